@@ -0,0 +1,80 @@
+// Counting of heap allocations, replacing those of the C library.
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+
+#include "alloc_check.h"
+
+// Implementations of glibc, which the functions below forward to. The
+// C library and libstdc++ call the replacements.
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+}
+
+// Number of live AllocationCounters, and allocations made while there
+// was at least one.
+static std::atomic<int> num_counters{0};
+static std::atomic<size_t> num_allocations{0};
+
+static void CountAllocation() {
+  if (num_counters.load(std::memory_order_relaxed) > 0) {
+    num_allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+extern "C" {
+void* malloc(size_t size) noexcept {
+  CountAllocation();
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) noexcept {
+  CountAllocation();
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) noexcept {
+  CountAllocation();
+  return __libc_realloc(ptr, size);
+}
+
+void* memalign(size_t alignment, size_t size) noexcept {
+  CountAllocation();
+  return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) noexcept {
+  CountAllocation();
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size) noexcept {
+  if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) {
+    return EINVAL;
+  }
+  CountAllocation();
+  void* data = __libc_memalign(alignment, size);
+  if (data == nullptr) {
+    return ENOMEM;
+  }
+  *ptr = data;
+  return 0;
+}
+}
+
+AllocationCounter::AllocationCounter() {
+  num_counters.fetch_add(1, std::memory_order_seq_cst);
+  start_ = num_allocations.load(std::memory_order_seq_cst);
+}
+
+AllocationCounter::~AllocationCounter() {
+  num_counters.fetch_sub(1, std::memory_order_seq_cst);
+}
+
+size_t AllocationCounter::count() const {
+  return num_allocations.load(std::memory_order_seq_cst) - start_;
+}
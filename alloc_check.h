@@ -0,0 +1,27 @@
+#ifndef _ALLOC_CHECK_H
+#define _ALLOC_CHECK_H
+// Counting of heap allocations, to check that processing events doesn't
+// allocate once a graph is finalized. Only available in programs linked
+// with alloc_check.cc (dag_test and dag_bench), which replaces malloc()
+// and its variants: allocations from C++, Lua and C libraries are all
+// counted.
+
+#include <cstddef>
+
+// Counts allocations made by all threads from construction to
+// destruction. Counters can be nested.
+class AllocationCounter {
+public:
+  AllocationCounter();
+  ~AllocationCounter();
+  AllocationCounter(const AllocationCounter&) = delete;
+  AllocationCounter& operator=(const AllocationCounter&) = delete;
+
+  // Number of allocations so far, including reallocations.
+  size_t count() const;
+
+private:
+  size_t start_;
+};
+
+#endif
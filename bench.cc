@@ -0,0 +1,304 @@
+/* Offline benchmark of the processing graph.
+
+   Representative graphs are loaded from Lua config files and fed with
+   synthetic event streams, without any sequencer: outputs only count
+   events. Results are printed on stdout, one JSON object per line and
+   per (graph, stream, batch size), for example:
+
+   {"graph":"fanout","stream":"cc_flood","batch_size":64,"events":200000,
+    "events_per_sec":...,"ns_per_event":...,"batch_p50_ns":...,
+    "batch_p99_ns":...,"batch_p999_ns":...,"batch_max_ns":...,
+    "allocations":0}
+
+   Latency percentiles are for processing a whole batch, which is the
+   latency of a single event with a batch size of 1.
+
+   Allocations are the number of heap allocations made while processing
+   events, warm-up included, which should be 0: with -a, dag_bench fails
+   if there are any.
+
+   Must be run from the top directory, for configs and mflib.lua to be
+   found. Usage: dag_bench [-a] [-n <number of events>] [graph names...]
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h>
+#include <iostream>
+#include <random>
+#include <span>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include <alsa/asoundlib.h>
+#include <lua5.3/lua.h>
+
+#include "alloc_check.h"
+#include "dag.h"
+#include "event_processors.h"
+#include "lua_config.h"
+#include "port_registry.h"
+#include "stats.h"
+
+// A graph to benchmark, loaded from a Lua config file.
+struct BenchGraph {
+  const char* name;
+  const char* config_filename;
+};
+
+const BenchGraph kGraphs[] = {
+  {"nanokontrol2_split", "configs/nanokontrol2_split.lua"},
+  {"fanout", "configs/bench/fanout.lua"},
+  {"deep_chain", "configs/bench/deep_chain.lua"},
+  {"many_inputs", "configs/bench/many_inputs.lua"},
+  {"wide", "configs/bench/wide.lua"},
+};
+
+const size_t kBatchSizes[] = {1, 64};
+
+// Synthetic event streams. Each generator appends 'count' events to
+// 'events', sent to ports picked from 'ports'.
+typedef void (*StreamGenerator)(const std::vector<int>& ports, size_t count,
+                                std::mt19937* rng,
+                                std::vector<snd_seq_event_t>* events);
+
+snd_seq_event_t MakeEvent(snd_seq_event_type_t type, int port,
+                          unsigned char channel) {
+  snd_seq_event_t ev;
+  snd_seq_ev_clear(&ev);
+  ev.type = type;
+  ev.dest.port = port;
+  ev.data.note.channel = channel;
+  return ev;
+}
+
+// Chords of 1 to 8 notes, pressed then released.
+void NoteBursts(const std::vector<int>& ports, size_t count, std::mt19937* rng,
+                std::vector<snd_seq_event_t>* events) {
+  std::uniform_int_distribution<int> note(0, 127);
+  std::uniform_int_distribution<int> chord_size(1, 8);
+  std::uniform_int_distribution<int> channel(0, 3);
+  size_t generated = 0;
+  while (generated < count) {
+    const int port = ports[(*rng)() % ports.size()];
+    const unsigned char chord_channel = channel(*rng);
+    const size_t size = std::min<size_t>(chord_size(*rng), (count - generated + 1) / 2);
+    std::vector<unsigned char> notes;
+    for (size_t i = 0; i < size; i++) {
+      notes.push_back(note(*rng));
+    }
+    for (snd_seq_event_type_t type : {SND_SEQ_EVENT_NOTEON, SND_SEQ_EVENT_NOTEOFF}) {
+      for (const unsigned char n : notes) {
+        if (generated == count) {
+          return;
+        }
+        snd_seq_event_t ev = MakeEvent(type, port, chord_channel);
+        ev.data.note.note = n;
+        ev.data.note.velocity = type == SND_SEQ_EVENT_NOTEON ? 100 : 0;
+        events->push_back(ev);
+        generated++;
+      }
+    }
+  }
+}
+
+// Faders and knobs of a nanoKontrol2 moved all at once.
+void ControllerFlood(const std::vector<int>& ports, size_t count, std::mt19937* rng,
+                     std::vector<snd_seq_event_t>* events) {
+  const unsigned char controllers[] = {0, 1, 2, 3, 4, 5, 6, 7,
+                                       16, 17, 18, 19, 20, 21, 22, 23};
+  for (size_t i = 0; i < count; i++) {
+    snd_seq_event_t ev = MakeEvent(SND_SEQ_EVENT_CONTROLLER,
+                                   ports[i % ports.size()], 0);
+    ev.data.control.param = controllers[i % 16];
+    ev.data.control.value = (i / 16) % 128;
+    events->push_back(ev);
+  }
+}
+
+// Pitch bend wheel going up and down.
+void PitchBendSweep(const std::vector<int>& ports, size_t count, std::mt19937* rng,
+                    std::vector<snd_seq_event_t>* events) {
+  for (size_t i = 0; i < count; i++) {
+    snd_seq_event_t ev = MakeEvent(SND_SEQ_EVENT_PITCHBEND,
+                                   ports[(i / 256) % ports.size()], 0);
+    const int position = i % 512;
+    ev.data.control.value = (position < 256 ? position : 511 - position) * 64 - 8192;
+    events->push_back(ev);
+  }
+}
+
+// Notes, controllers, pitch bend and clock from all inputs.
+void MixedTraffic(const std::vector<int>& ports, size_t count, std::mt19937* rng,
+                  std::vector<snd_seq_event_t>* events) {
+  std::uniform_int_distribution<int> kind(0, 9);
+  std::uniform_int_distribution<int> data(0, 127);
+  for (size_t i = 0; i < count; i++) {
+    const int port = ports[(*rng)() % ports.size()];
+    const unsigned char channel = data(*rng) % 16;
+    const int k = kind(*rng);
+    snd_seq_event_t ev;
+    if (k < 4) {
+      ev = MakeEvent(SND_SEQ_EVENT_CONTROLLER, port, channel);
+      ev.data.control.param = data(*rng);
+      ev.data.control.value = data(*rng);
+    } else if (k < 7) {
+      ev = MakeEvent(k % 2 ? SND_SEQ_EVENT_NOTEON : SND_SEQ_EVENT_NOTEOFF,
+                     port, channel);
+      ev.data.note.note = data(*rng);
+      ev.data.note.velocity = data(*rng);
+    } else if (k < 9) {
+      ev = MakeEvent(SND_SEQ_EVENT_PITCHBEND, port, channel);
+      ev.data.control.value = data(*rng) * 128 - 8192;
+    } else {
+      ev = MakeEvent(SND_SEQ_EVENT_CLOCK, port, 0);
+    }
+    events->push_back(ev);
+  }
+}
+
+struct BenchStream {
+  const char* name;
+  StreamGenerator generator;
+};
+
+const BenchStream kStreams[] = {
+  {"note_bursts", NoteBursts},
+  {"cc_flood", ControllerFlood},
+  {"pitchbend_sweep", PitchBendSweep},
+  {"mixed", MixedTraffic},
+};
+
+// Reads a config file, with anything the config prints on stdout
+// discarded to keep the output machine-readable.
+bool LoadGraph(const std::string& config_filename, lua_State **L,
+               ProcessorDAG *dag, PortRegistry* ports) {
+  fflush(stdout);
+  const int saved_stdout = dup(STDOUT_FILENO);
+  const int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, STDOUT_FILENO);
+  close(null_fd);
+  bool ok = ReadConfigFile(config_filename, L);
+  fflush(stdout);
+  dup2(saved_stdout, STDOUT_FILENO);
+  close(saved_stdout);
+  if (!ok) {
+    return false;
+  }
+  if (!GetProcessingGraph(*L, nullptr, dag, ports)) {
+    lua_close(*L);
+    return false;
+  }
+  return true;
+}
+
+// Returns the number of allocations made.
+size_t RunBenchmark(const char* graph_name, ProcessorDAG& dag,
+                    const BenchStream& stream, size_t batch_size,
+                    const std::vector<snd_seq_event_t>& events) {
+  AllocationCounter allocations;
+  // Warm up caches.
+  const size_t warmup_size = std::min<size_t>(events.size(), 10000);
+  for (size_t i = 0; i < warmup_size; i += batch_size) {
+    dag.ProcessBatch(std::span<const snd_seq_event_t>(
+        events.data() + i, std::min(batch_size, warmup_size - i)));
+  }
+
+  LatencyHistogram latency;
+  uint64_t total_ns = 0;
+  for (size_t i = 0; i < events.size(); i += batch_size) {
+    std::span<const snd_seq_event_t> batch(events.data() + i,
+                                           std::min(batch_size, events.size() - i));
+    auto start = std::chrono::steady_clock::now();
+    dag.ProcessBatch(batch);
+    auto end = std::chrono::steady_clock::now();
+    const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        end - start).count();
+    latency.Record(ns);
+    total_ns += ns;
+  }
+
+  // Before printing, which allocates.
+  const size_t num_allocations = allocations.count();
+  const double seconds = total_ns * 1e-9;
+  std::cout << "{\"graph\":\"" << graph_name << "\""
+            << ",\"stream\":\"" << stream.name << "\""
+            << ",\"batch_size\":" << batch_size
+            << ",\"events\":" << events.size()
+            << ",\"events_per_sec\":" << static_cast<uint64_t>(events.size() / seconds)
+            << ",\"ns_per_event\":" << static_cast<double>(total_ns) / events.size()
+            << ",\"batch_p50_ns\":" << latency.Percentile(0.5)
+            << ",\"batch_p99_ns\":" << latency.Percentile(0.99)
+            << ",\"batch_p999_ns\":" << latency.Percentile(0.999)
+            << ",\"batch_max_ns\":" << latency.Max()
+            << ",\"allocations\":" << num_allocations
+            << "}" << std::endl;
+  return num_allocations;
+}
+
+int main(int argc, char *argv[]) {
+  size_t num_events = 200000;
+  bool check_allocations = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "an:")) != -1) {
+    switch (opt) {
+    case 'a':
+      check_allocations = true;
+      break;
+    case 'n':
+      num_events = std::stoul(optarg);
+      break;
+    default:
+      std::cerr << "Usage: dag_bench [-a] [-n <number of events>] [graph names...]\n";
+      return 1;
+    }
+  }
+  std::vector<std::string> selected_graphs(argv + optind, argv + argc);
+
+  for (const BenchGraph& graph : kGraphs) {
+    if (!selected_graphs.empty()
+        && std::find(selected_graphs.begin(), selected_graphs.end(),
+                     graph.name) == selected_graphs.end()) {
+      continue;
+    }
+
+    lua_State *L;
+    // Numbers the inputs of the graph, so that events can be sent to
+    // each of them.
+    PortRegistry registry(nullptr);
+    ProcessorDAG dag;
+    if (!LoadGraph(graph.config_filename, &L, &dag, &registry)) {
+      std::cerr << "Error loading " << graph.config_filename << "\n";
+      return 1;
+    }
+
+    std::vector<int> ports;
+    for (size_t i = 0; i < dag.NumProcessors(); i++) {
+      auto input = dynamic_cast<MidiInput*>(dag.GetProcessor(i));
+      if (input != nullptr) {
+        ports.push_back(input->port_num());
+      }
+    }
+
+    for (const BenchStream& stream : kStreams) {
+      // Same events for all graphs and batch sizes.
+      std::mt19937 rng(42);
+      std::vector<snd_seq_event_t> events;
+      events.reserve(num_events);
+      stream.generator(ports, num_events, &rng, &events);
+      for (const size_t batch_size : kBatchSizes) {
+        if (RunBenchmark(graph.name, dag, stream, batch_size, events) > 0
+            && check_allocations) {
+          std::cerr << graph.name << " allocated memory while processing "
+                    << stream.name << " events\n";
+          lua_close(L);
+          return 1;
+        }
+      }
+    }
+    lua_close(L);
+  }
+  return 0;
+}
@@ -0,0 +1,224 @@
+// Capture and replay of incoming events.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <limits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "capture.h"
+#include "timer_wheel.h"
+
+// The file grows by its current size, within these bounds.
+const size_t kMinCaptureGrowth = 1 << 20;
+const size_t kMaxCaptureGrowth = 64 << 20;
+
+CaptureWriter::~CaptureWriter() {
+  Close();
+}
+
+bool CaptureWriter::Open(const std::string& filename) {
+  Close();
+  fd_ = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    std::cerr << "Cannot open capture file " << filename << ": "
+              << strerror(errno) << "\n";
+    return false;
+  }
+  mapped_size_ = kMinCaptureGrowth;
+  void* data = MAP_FAILED;
+  if (ftruncate(fd_, mapped_size_) == 0) {
+    data = mmap(nullptr, mapped_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  }
+  if (data == MAP_FAILED) {
+    std::cerr << "Cannot map capture file " << filename << ": "
+              << strerror(errno) << "\n";
+    close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  header_ = static_cast<CaptureHeader*>(data);
+  memcpy(header_->magic, kCaptureMagic, sizeof(kCaptureMagic));
+  header_->record_size = sizeof(CaptureRecord);
+  header_->unused = 0;
+  header_->num_records = 0;
+  records_ = reinterpret_cast<CaptureRecord*>(header_ + 1);
+  capacity_ = (mapped_size_ - sizeof(CaptureHeader)) / sizeof(CaptureRecord);
+  dropped_events_ = 0;
+  return true;
+}
+
+void CaptureWriter::Close() {
+  if (header_ == nullptr) {
+    return;
+  }
+  const size_t size = sizeof(CaptureHeader) + header_->num_records * sizeof(CaptureRecord);
+  munmap(header_, mapped_size_);
+  if (ftruncate(fd_, size) != 0) {
+    std::cerr << "Cannot truncate capture file: " << strerror(errno) << "\n";
+  }
+  close(fd_);
+  fd_ = -1;
+  header_ = nullptr;
+  records_ = nullptr;
+  mapped_size_ = 0;
+  capacity_ = 0;
+}
+
+bool CaptureWriter::Grow(size_t count) {
+  const size_t needed = sizeof(CaptureHeader)
+      + (header_->num_records + count) * sizeof(CaptureRecord);
+  size_t new_size = mapped_size_;
+  while (new_size < needed) {
+    new_size += std::clamp(new_size, kMinCaptureGrowth, kMaxCaptureGrowth);
+  }
+  if (ftruncate(fd_, new_size) != 0) {
+    return false;
+  }
+  void* data = mremap(header_, mapped_size_, new_size, MREMAP_MAYMOVE);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  header_ = static_cast<CaptureHeader*>(data);
+  records_ = reinterpret_cast<CaptureRecord*>(header_ + 1);
+  mapped_size_ = new_size;
+  capacity_ = (mapped_size_ - sizeof(CaptureHeader)) / sizeof(CaptureRecord);
+  return true;
+}
+
+bool CaptureWriter::Append(const MidiEvent* events, size_t count, uint64_t time_ns) {
+  if (header_ == nullptr) {
+    return false;
+  }
+  const uint64_t num_records = header_->num_records;
+  if (num_records + count > capacity_ && !Grow(count)) {
+    dropped_events_ += count;
+    return false;
+  }
+  for (size_t i = 0; i < count; i++) {
+    CaptureRecord& record = records_[num_records + i];
+    record.time_ns = time_ns;
+    record.event = events[i];
+  }
+  // Records are complete before they are counted.
+  header_->num_records = num_records + count;
+  return true;
+}
+
+bool CaptureWriter::Append(const snd_seq_event_t& ev, uint64_t time_ns) {
+  const size_t count = NumMidiEvents(ev);
+  if (count == 0) {
+    return true;
+  }
+  FromSeqEvent(ev, converted_);
+  return Append(converted_, count, time_ns);
+}
+
+void CaptureWriter::PrintStats(std::ostream& out) {
+  out << "Capture: " << num_records() << " events, "
+      << dropped_events_ << " dropped\n";
+}
+
+CaptureReader::~CaptureReader() {
+  if (data_ != nullptr) {
+    munmap(data_, mapped_size_);
+  }
+}
+
+bool CaptureReader::Open(const std::string& filename) {
+  const int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    std::cerr << "Cannot open capture file " << filename << ": "
+              << strerror(errno) << "\n";
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(CaptureHeader)) {
+    std::cerr << filename << " is not a capture file\n";
+    close(fd);
+    return false;
+  }
+  void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    std::cerr << "Cannot map capture file " << filename << ": "
+              << strerror(errno) << "\n";
+    return false;
+  }
+  data_ = data;
+  mapped_size_ = st.st_size;
+
+  const CaptureHeader* header = static_cast<const CaptureHeader*>(data);
+  const size_t max_records = (mapped_size_ - sizeof(CaptureHeader)) / sizeof(CaptureRecord);
+  if (memcmp(header->magic, kCaptureMagic, sizeof(kCaptureMagic)) != 0
+      || header->record_size != sizeof(CaptureRecord)
+      || header->num_records > max_records) {
+    std::cerr << filename << " is not a capture file, or is corrupted\n";
+    return false;
+  }
+  records_ = reinterpret_cast<const CaptureRecord*>(header + 1);
+  num_records_ = header->num_records;
+  return true;
+}
+
+static void SleepUntilNs(uint64_t time_ns) {
+  struct timespec until;
+  until.tv_sec = time_ns / 1000000000;
+  until.tv_nsec = time_ns % 1000000000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, nullptr) == EINTR) {
+  }
+}
+
+bool ReplayCapture(const CaptureReader& capture, ProcessorDAG* dag,
+                   bool real_time, const std::function<void()>& after_batch) {
+  if (capture.size() == 0) {
+    return true;
+  }
+  // Capture time 'first_ns' is replayed at 'start_ns'.
+  const uint64_t first_ns = capture.record(0).time_ns;
+  const uint64_t start_ns = MonotonicNs();
+  auto wait_until = [&](uint64_t capture_ns) {
+    if (real_time && capture_ns > first_ns) {
+      SleepUntilNs(start_ns + (capture_ns - first_ns));
+    }
+  };
+
+  std::vector<MidiEvent> batch;
+  size_t next = 0;
+  while (true) {
+    const uint64_t batch_ms = next < capture.size()
+        ? capture.record(next).time_ns / 1000000
+        : std::numeric_limits<uint64_t>::max();
+    const uint64_t timer_ms = dag->NextTimer();
+    if (batch_ms == std::numeric_limits<uint64_t>::max()
+        && timer_ms == std::numeric_limits<uint64_t>::max()) {
+      return true;
+    }
+    if (timer_ms < batch_ms) {
+      wait_until(timer_ms * 1000000);
+      if (!dag->ProcessTimers(timer_ms)) {
+        return false;
+      }
+    } else {
+      const uint64_t time_ns = capture.record(next).time_ns;
+      batch.clear();
+      while (next < capture.size() && capture.record(next).time_ns == time_ns) {
+        batch.push_back(capture.record(next).event);
+        next++;
+      }
+      wait_until(time_ns);
+      if (!dag->ProcessTimers(batch_ms) || !dag->ProcessBatch(batch)) {
+        return false;
+      }
+    }
+    if (after_batch) {
+      after_batch();
+    }
+  }
+}
@@ -0,0 +1,120 @@
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+// Capture of incoming events to a file, and replay of such files through
+// a processing graph, to reproduce problems seen live and to profile
+// with real traffic.
+//
+// A capture file starts with a CaptureHeader, followed by fixed-size
+// CaptureRecords in the order events were received. Events are stored
+// converted to MidiEvent, sysex messages taking several records.
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <alsa/asoundlib.h>
+
+#include "dag.h"
+#include "midi_event.h"
+
+const char kCaptureMagic[8] = {'M', 'F', 'C', 'A', 'P', 'T', '1', '\0'};
+
+struct CaptureHeader {
+  char magic[8];
+  // sizeof(CaptureRecord), for files written by another version.
+  uint32_t record_size;
+  uint32_t unused;
+  // Number of records following the header. Updated after each record,
+  // so that a capture is readable even if midiflume didn't exit cleanly.
+  uint64_t num_records;
+};
+static_assert(sizeof(CaptureHeader) == 24, "CaptureHeader must not change");
+
+struct CaptureRecord {
+  // CLOCK_MONOTONIC time the event was read at, in nanoseconds. Events
+  // read together have the same time, and are replayed together.
+  uint64_t time_ns;
+  MidiEvent event;
+};
+static_assert(sizeof(CaptureRecord) == 24, "CaptureRecord must not change");
+
+// Appends events to a capture file, mapped in memory. Appending an event
+// is a copy, except when the file has to grow, which is done in chunks
+// of increasing size.
+class CaptureWriter {
+public:
+  CaptureWriter() {}
+  ~CaptureWriter();
+  CaptureWriter(const CaptureWriter&) = delete;
+  CaptureWriter& operator=(const CaptureWriter&) = delete;
+
+  // Creates or truncates 'filename'. Returns false on error.
+  bool Open(const std::string& filename);
+  // Truncates the file to its records, and closes it.
+  void Close();
+  bool IsOpen() const { return header_ != nullptr; }
+
+  // Appends 'count' events, read at 'time_ns'. Returns false, and counts
+  // the events as dropped, if the file can't grow.
+  bool Append(const MidiEvent* events, size_t count, uint64_t time_ns);
+  // Same as above for a sequencer event, converted first. Events which
+  // can't be converted are ignored.
+  bool Append(const snd_seq_event_t& ev, uint64_t time_ns);
+
+  uint64_t num_records() const { return header_ == nullptr ? 0 : header_->num_records; }
+  uint64_t dropped_events() const { return dropped_events_; }
+  // Prints the number of events captured and dropped.
+  void PrintStats(std::ostream& out);
+
+private:
+  // Makes room for at least 'count' more records.
+  bool Grow(size_t count);
+
+  int fd_ = -1;
+  CaptureHeader* header_ = nullptr;
+  CaptureRecord* records_ = nullptr;
+  // Size of the file and of the mapping, in bytes.
+  size_t mapped_size_ = 0;
+  // Records which fit in the mapping.
+  size_t capacity_ = 0;
+  uint64_t dropped_events_ = 0;
+  // Conversion of sequencer events.
+  MidiEvent converted_[kMaxSysexChunks];
+};
+
+// Read-only access to a capture file, mapped in memory.
+class CaptureReader {
+public:
+  CaptureReader() {}
+  ~CaptureReader();
+  CaptureReader(const CaptureReader&) = delete;
+  CaptureReader& operator=(const CaptureReader&) = delete;
+
+  // Returns false if the file can't be read or isn't a capture.
+  bool Open(const std::string& filename);
+
+  size_t size() const { return num_records_; }
+  const CaptureRecord& record(size_t i) const { return records_[i]; }
+
+private:
+  void* data_ = nullptr;
+  size_t mapped_size_ = 0;
+  const CaptureRecord* records_ = nullptr;
+  size_t num_records_ = 0;
+};
+
+// Sends the events of 'capture' through 'dag', in batches of events read
+// together. The graph clock (ProcessorDAG::ProcessTimers) follows the
+// capture timestamps rather than the current time, so that a given
+// capture always gives the same output whatever the replay speed.
+// With 'real_time', waits between batches as long as when they were
+// captured; otherwise replays as fast as possible. 'after_batch', if
+// set, is called after each call to ProcessBatch or ProcessTimers, e.g.
+// to drain an output buffer. Events still scheduled at the end are
+// processed before returning.
+bool ReplayCapture(const CaptureReader& capture, ProcessorDAG* dag,
+                   bool real_time,
+                   const std::function<void()>& after_batch = nullptr);
+
+#endif
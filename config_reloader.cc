@@ -0,0 +1,198 @@
+// Hot reload of the Lua config.
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+#include "config_reloader.h"
+#include "lua_config.h"
+
+// Time without changes to the config file before reloading it.
+const int kQuietPeriodMs = 100;
+
+ConfigReloader::ConfigReloader(const std::string& config_filename,
+                               snd_seq_t *seq_handle, PortRegistry* ports,
+                               GraphSlot* graphs, const Callbacks& callbacks):
+  config_filename_(config_filename), seq_handle_(seq_handle), ports_(ports),
+  graphs_(graphs), callbacks_(callbacks) {
+  const size_t slash = config_filename.rfind('/');
+  if (slash == std::string::npos) {
+    config_dir_ = ".";
+    config_name_ = config_filename;
+  } else {
+    config_dir_ = config_filename.substr(0, slash + 1);
+    config_name_ = config_filename.substr(slash + 1);
+  }
+}
+
+ConfigReloader::~ConfigReloader() {
+  Stop();
+  for (const int fd : {inotify_fd_, signal_fd_, stop_fd_}) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  // The graph may use the Lua state.
+  dag_.reset();
+  if (L_ != nullptr) {
+    lua_close(L_);
+  }
+}
+
+bool ConfigReloader::BlockReloadSignal() {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGHUP);
+  const int error = pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+  if (error != 0) {
+    std::cerr << "Cannot block SIGHUP: " << strerror(error) << "\n";
+    return false;
+  }
+  return true;
+}
+
+bool ConfigReloader::Start(std::unique_ptr<ProcessorDAG> dag, lua_State *L) {
+  dag_ = std::move(dag);
+  L_ = L;
+
+  stop_fd_ = eventfd(0, EFD_CLOEXEC);
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGHUP);
+  signal_fd_ = signalfd(-1, &signals, SFD_CLOEXEC | SFD_NONBLOCK);
+  if (stop_fd_ < 0 || signal_fd_ < 0) {
+    std::cerr << "Cannot create reload descriptors: " << strerror(errno) << "\n";
+    return false;
+  }
+
+  inotify_fd_ = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+  if (inotify_fd_ < 0
+      || inotify_add_watch(inotify_fd_, config_dir_.c_str(),
+                           IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    std::cerr << "Cannot watch " << config_filename_ << ": " << strerror(errno)
+              << ", reload with SIGHUP\n";
+    if (inotify_fd_ >= 0) {
+      close(inotify_fd_);
+      inotify_fd_ = -1;
+    }
+  }
+
+  stopping_ = false;
+  thread_ = std::thread([this]() { ReloadThread(); });
+  return true;
+}
+
+void ConfigReloader::Stop() {
+  if (thread_.joinable()) {
+    stopping_ = true;
+    const uint64_t one = 1;
+    if (write(stop_fd_, &one, sizeof(one)) != sizeof(one)) {
+      std::cerr << "Cannot stop reload thread: " << strerror(errno) << "\n";
+    }
+    thread_.join();
+  }
+}
+
+void ConfigReloader::ReloadThread() {
+  struct pollfd pfds[3];
+  pfds[0] = {stop_fd_, POLLIN, 0};
+  pfds[1] = {signal_fd_, POLLIN, 0};
+  // Ignored by poll() when negative.
+  pfds[2] = {inotify_fd_, POLLIN, 0};
+
+  while (!stopping_) {
+    if (poll(pfds, 3, -1) <= 0) {
+      continue;
+    }
+    bool reload = false;
+    if (pfds[1].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      while (read(signal_fd_, &info, sizeof(info)) == sizeof(info)) {
+        reload = true;
+      }
+    }
+    if (pfds[2].revents & POLLIN) {
+      reload = ReadConfigChanges() || reload;
+    }
+    if (reload && !stopping_) {
+      WaitForQuietConfig();
+      Reload();
+    }
+  }
+}
+
+bool ConfigReloader::ReadConfigChanges() {
+  alignas(struct inotify_event) char buffer[4096];
+  bool changed = false;
+  ssize_t length;
+  while ((length = read(inotify_fd_, buffer, sizeof(buffer))) > 0) {
+    for (char* p = buffer; p < buffer + length; ) {
+      const struct inotify_event* event = reinterpret_cast<struct inotify_event*>(p);
+      if (event->len > 0 && config_name_ == event->name) {
+        changed = true;
+      }
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+  return changed;
+}
+
+void ConfigReloader::WaitForQuietConfig() {
+  if (inotify_fd_ < 0) {
+    return;
+  }
+  struct pollfd pfd = {inotify_fd_, POLLIN, 0};
+  while (poll(&pfd, 1, kQuietPeriodMs) > 0 && !stopping_) {
+    ReadConfigChanges();
+  }
+}
+
+bool ConfigReloader::Reload() {
+  std::cerr << "Reloading " << config_filename_ << "\n";
+  lua_State *L;
+  if (!ReadConfigFile(config_filename_, &L)) {
+    std::cerr << "Keeping the current config.\n";
+    return false;
+  }
+
+  auto dag = std::make_unique<ProcessorDAG>();
+  ports_->BeginGeneration();
+  if (!GetProcessingGraph(L, seq_handle_, dag.get(), ports_)
+      || (callbacks_.prepare && !callbacks_.prepare(dag.get()))) {
+    std::cerr << "Error getting processing graph, keeping the current config.\n";
+    dag.reset();
+    ports_->AbortGeneration();
+    lua_close(L);
+    return false;
+  }
+
+  // From here on, batches use the new graph. Those which started before
+  // finish with the previous one. Events the previous graph scheduled
+  // (note-offs, echoes) are still sent by the new one, on time, so it's
+  // kept with its Lua state and ports until they are all sent.
+  dag->RunTimersOf(graphs_->current());
+  ProcessorDAG* previous = graphs_->Publish(dag.get());
+  while (graphs_->InUse(previous) || !dag->PreviousTimersDone()) {
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+
+  ports_->CommitGeneration();
+  if (callbacks_.published) {
+    callbacks_.published(dag.get());
+  }
+  dag_ = std::move(dag);
+  if (L_ != nullptr) {
+    lua_close(L_);
+  }
+  L_ = L;
+  std::cerr << "Reloaded " << config_filename_ << "\n";
+  return true;
+}
@@ -0,0 +1,89 @@
+#ifndef _CONFIG_RELOADER_H
+#define _CONFIG_RELOADER_H
+// Hot reload of the Lua config: the processing graph is rebuilt on a
+// separate thread when the config file changes or on SIGHUP, then swapped
+// with the one in use without interrupting processing.
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <lua5.3/lua.h>
+#include <alsa/asoundlib.h>
+
+#include "dag.h"
+#include "graph_slot.h"
+#include "port_registry.h"
+
+class ConfigReloader {
+public:
+  struct Callbacks {
+    // Called on the reload thread with a new finalized graph, before it
+    // is published. Returning false abandons the reload.
+    std::function<bool(ProcessorDAG*)> prepare;
+    // Called on the reload thread once the previous graph is not used
+    // anymore, with the new current graph.
+    std::function<void(ProcessorDAG*)> published;
+  };
+
+  // 'ports' must be the registry the graph in 'graphs' was built with.
+  // The reloader becomes the only writer of 'graphs'.
+  ConfigReloader(const std::string& config_filename, snd_seq_t *seq_handle,
+                 PortRegistry* ports, GraphSlot* graphs,
+                 const Callbacks& callbacks);
+  ~ConfigReloader();
+  ConfigReloader(const ConfigReloader&) = delete;
+  ConfigReloader& operator=(const ConfigReloader&) = delete;
+
+  // Takes ownership of the current graph and the Lua state it was built
+  // from, and starts watching the config file. SIGHUP must be blocked in
+  // all threads (see BlockReloadSignal()). Returns false if the thread
+  // can't be started; a missing inotify only prints a warning.
+  bool Start(std::unique_ptr<ProcessorDAG> dag, lua_State *L);
+  void Stop();
+
+  // Builds a graph from the config file and swaps it with the current
+  // one. Returns false, keeping the current graph, if the config is
+  // invalid. Called by the reload thread, or directly when it isn't
+  // running.
+  bool Reload();
+
+  // Blocks SIGHUP in the calling thread, and in threads it creates
+  // afterwards, so that it's only received by the reload thread. Call
+  // before starting any thread.
+  static bool BlockReloadSignal();
+
+private:
+  void ReloadThread();
+  // Waits for further changes to the config file for a short time, so
+  // that an editor writing the file in several steps causes a single
+  // reload.
+  void WaitForQuietConfig();
+  // Reads pending inotify events. Returns true if the config file was
+  // written or replaced.
+  bool ReadConfigChanges();
+
+  const std::string config_filename_;
+  // Directory and name of the config file, as inotify needs to watch the
+  // directory to notice the file being replaced.
+  std::string config_dir_;
+  std::string config_name_;
+  snd_seq_t *seq_handle_;
+  PortRegistry* ports_;
+  GraphSlot* graphs_;
+  const Callbacks callbacks_;
+
+  // Current graph and its Lua state.
+  std::unique_ptr<ProcessorDAG> dag_;
+  lua_State *L_ = nullptr;
+
+  int inotify_fd_ = -1;
+  int signal_fd_ = -1;
+  // Wakes up the reload thread when stopping.
+  int stop_fd_ = -1;
+  std::thread thread_;
+  std::atomic<bool> stopping_{false};
+};
+
+#endif
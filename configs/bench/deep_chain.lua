@@ -0,0 +1,30 @@
+-- Benchmark graph: long chains of processors between an input and an
+-- output, with a branch every few processors so that they are not all
+-- fused into a single node by the optimizer.
+
+local mflib = require 'mflib'
+
+config = mflib.make_empty_config()
+input = mflib.add_input(config, "input")
+output = mflib.add_output(config, "output")
+branch_output = mflib.add_output(config, "branch_output")
+
+local previous = input
+for i = 1, 64 do
+   local processor
+   if i % 2 == 0 then
+      processor = mflib.add_note_selector(config, "notes_" .. i,
+                                          {lowest_note=i % 16,
+                                           highest_note=127 - i % 16})
+   else
+      processor = mflib.add_controller_selector(config, "controllers_" .. i,
+                                                {lowest_controller=0,
+                                                 highest_controller=127 - i})
+   end
+   mflib.connect(config, previous, processor)
+   if i % 8 == 0 then
+      mflib.connect(config, processor, branch_output)
+   end
+   previous = processor
+end
+mflib.connect(config, previous, output)
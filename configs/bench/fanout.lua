@@ -0,0 +1,24 @@
+-- Benchmark graph: one input fanned out to many outputs.
+-- Each output gets one channel, through a note selector for notes and a
+-- controller selector followed by a mapping for controllers.
+
+local mflib = require 'mflib'
+
+config = mflib.make_empty_config()
+input = mflib.add_input(config, "input")
+
+for channel = 0, 15 do
+   local output = mflib.add_output(config, "output_" .. channel)
+   local notes = mflib.add_note_selector(config, "notes_" .. channel,
+                                         {channels={channel}})
+   local controllers = mflib.add_controller_selector(
+      config, "controllers_" .. channel,
+      {lowest_controller=0, highest_controller=31, channels={channel}})
+   local mapping = mflib.add_controller_mapping(
+      config, "mapping_" .. channel, {mapping={[7]=11, [10]=74}})
+   mflib.connect(config, input, notes)
+   mflib.connect(config, input, controllers)
+   mflib.connect(config, notes, output)
+   mflib.connect(config, controllers, mapping)
+   mflib.connect(config, mapping, output)
+end
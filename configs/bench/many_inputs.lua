@@ -0,0 +1,25 @@
+-- Benchmark graph: many inputs, each split in two halves of the keyboard
+-- sent to outputs shared by all inputs.
+
+local mflib = require 'mflib'
+
+config = mflib.make_empty_config()
+low_output = mflib.add_output(config, "low")
+high_output = mflib.add_output(config, "high")
+controller_output = mflib.add_output(config, "controllers")
+
+for i = 1, 16 do
+   local input = mflib.add_input(config, "input_" .. i)
+   local low = mflib.add_note_selector(config, "low_" .. i,
+                                       {lowest_note=0, highest_note=59})
+   local high = mflib.add_note_selector(config, "high_" .. i,
+                                        {lowest_note=60, highest_note=127})
+   local controllers = mflib.add_controller_selector(
+      config, "controllers_" .. i, {lowest_controller=0, highest_controller=63})
+   mflib.connect(config, input, low)
+   mflib.connect(config, input, high)
+   mflib.connect(config, input, controllers)
+   mflib.connect(config, low, low_output)
+   mflib.connect(config, high, high_output)
+   mflib.connect(config, controllers, controller_output)
+end
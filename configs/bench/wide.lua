@@ -0,0 +1,26 @@
+-- Benchmark graph: several hundred processors. Each input is split by
+-- channel, and each channel goes to an output shared by all inputs.
+
+local mflib = require 'mflib'
+
+config = mflib.make_empty_config()
+outputs = {}
+for channel = 0, 15 do
+   outputs[channel] = mflib.add_output(config, "output_" .. channel)
+end
+
+for i = 1, 8 do
+   local input = mflib.add_input(config, "input_" .. i)
+   for channel = 0, 15 do
+      local notes = mflib.add_note_selector(
+         config, "notes_" .. i .. "_" .. channel,
+         {lowest_note=i * 8, highest_note=127, channels={channel}})
+      local controllers = mflib.add_controller_selector(
+         config, "controllers_" .. i .. "_" .. channel,
+         {lowest_controller=0, highest_controller=63, channels={channel}})
+      mflib.connect(config, input, notes)
+      mflib.connect(config, input, controllers)
+      mflib.connect(config, notes, outputs[channel])
+      mflib.connect(config, controllers, outputs[channel])
+   end
+end
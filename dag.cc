@@ -1,9 +1,10 @@
 #include <algorithm>
+#include <chrono>
+#include <map>
 #include <memory>
 #include <iostream>
-#include <queue>
-#include <set>
-//#include <chrono>
+#include <limits>
+#include <numeric>
 
 #include <alsa/asoundlib.h>
 
@@ -11,8 +12,6 @@
 #include "event_processors.h"
 
 
-//using namespace std::chrono;
-
 size_t ProcessorDAG::AddProcessor(std::unique_ptr<EventProcessor> processor) {
   size_t index = processors_.size();
   processor->init();
@@ -22,9 +21,10 @@ size_t ProcessorDAG::AddProcessor(std::unique_ptr<EventProcessor> processor) {
   processors_.push_back(std::move(processor));
   parents_.emplace_back();
   children_.emplace_back();
-  processed_events_.emplace_back();
-  // Pre-allocate enough memory to cover most cases.
-  processed_events_.back().reserve(5);
+  // Last in topological order: it has no connections yet, and positions
+  // stay below the number of processors.
+  topo_position_.push_back(index);
+  visited_.push_back(0);
   return index;
 }
 
@@ -35,24 +35,43 @@ size_t ProcessorDAG::AddProcessor(std::unique_ptr<EventProcessor> processor,
   return index;
 }
 
+EventProcessor* ProcessorDAG::GetProcessor(size_t processor_id) {
+  if (processor_id >= processors_.size()) {
+    return nullptr;
+  }
+  return processors_[processor_id].get();
+}
+
+EventProcessor* ProcessorDAG::GetProcessor(const std::string& processor_name) {
+  auto position = name_to_index_.find(processor_name);
+  if (position == name_to_index_.end()) {
+    return nullptr;
+  }
+  return GetProcessor(position->second);
+}
+
 // Returns false if failure, true for success.
 bool ProcessorDAG::AddConnection(size_t input, size_t output) {
+  if (finalized) {
+    std::cerr << "Cannot change a finalized graph\n";
+    return false;
+  }
   if (input == output) {
     std::cerr << "Cannot connect processor to itself\n";
     return false;
   }
   
-  if (input >= processors_.size() || output >= processors_.size()) {
-    return false;
-  }
-  if (input >= children_.size()) {
+  if (input >= processors_.size() || processors_[input] == nullptr) {
     std::cerr << "Invalid input index " << input << "\n";
     return false;
   }
-  if (output >= parents_.size()) {
+  if (output >= processors_.size() || processors_[output] == nullptr) {
     std::cerr << "Invalid output index " << output << "\n";
     return false;
   }
+  if (!UpdateTopologicalOrder(input, output)) {
+    return false;
+  }
 
   parents_[output].push_back(input);
   children_[input].push_back(output);
@@ -61,68 +80,376 @@ bool ProcessorDAG::AddConnection(size_t input, size_t output) {
 
 bool ProcessorDAG::AddConnection(const std::string& input,
                                  const std::string& output) {
-  size_t input_index = name_to_index_[input];
-  size_t output_index = name_to_index_[output];
-  return AddConnection(input_index, output_index);
+  const auto input_index = name_to_index_.find(input);
+  if (input_index == name_to_index_.end()) {
+    std::cerr << "Unknown processor: " << input << "\n";
+    return false;
+  }
+  const auto output_index = name_to_index_.find(output);
+  if (output_index == name_to_index_.end()) {
+    std::cerr << "Unknown processor: " << output << "\n";
+    return false;
+  }
+  return AddConnection(input_index->second, output_index->second);
 }
 
-void ProcessorDAG::ComputeEvaluationOrder(const std::vector<size_t>& outputs) {
-  // Scan nodes from the inputs, compute maximum distance from the input.
-  std::set<size_t> input_connected;
-  std::vector<size_t> distance(processors_.size(), 0);
-  {
-    std::queue<size_t> to_explore;
-    for (const size_t i: inputs_) {
-      to_explore.push(i);
-      distance[i] = 0;
-      input_connected.insert(i);
+bool ProcessorDAG::UpdateTopologicalOrder(size_t input, size_t output) {
+  const size_t lower = topo_position_[output];
+  const size_t upper = topo_position_[input];
+  if (lower > upper) {
+    return true;  // Already in order.
+  }
+  visit_epoch_++;
+
+  // Processors reached from 'output' up to the position of 'input'. If
+  // 'input' is one of them, the connection closes a cycle.
+  std::vector<size_t> forward;
+  std::unordered_map<size_t, size_t> reached_from;
+  std::vector<size_t> stack = {output};
+  visited_[output] = visit_epoch_;
+  while (!stack.empty()) {
+    const size_t current = stack.back();
+    stack.pop_back();
+    forward.push_back(current);
+    for (const size_t child : children_[current]) {
+      if (child == input) {
+        const std::vector<std::string> names = GetStatsNames();
+        std::vector<size_t> path = {current};
+        while (path.back() != output) {
+          path.push_back(reached_from[path.back()]);
+        }
+        std::cerr << "Connection from " << names[input] << " to " << names[output]
+                  << " would create a cycle: " << names[input];
+        for (auto it = path.rbegin(); it != path.rend(); ++it) {
+          std::cerr << " -> " << names[*it];
+        }
+        std::cerr << " -> " << names[input] << "\n";
+        return false;
+      }
+      // Descendants of later processors are all after 'input'.
+      if (visited_[child] != visit_epoch_ && topo_position_[child] < upper) {
+        visited_[child] = visit_epoch_;
+        reached_from[child] = current;
+        stack.push_back(child);
+      }
     }
-    
-    while (!to_explore.empty()) {
-      size_t current = to_explore.front();
-      to_explore.pop();
-      size_t d = distance[current];
-      for (const size_t c: children_[current]) {
-        to_explore.push(c);
-        distance[c] = std::max(d+1, distance[c]);
-        input_connected.insert(c);
+  }
+
+  // Processors leading to 'input' from the position of 'output'. No
+  // processor can be in both sets without a cycle.
+  std::vector<size_t> backward;
+  stack = {input};
+  visited_[input] = visit_epoch_;
+  while (!stack.empty()) {
+    const size_t current = stack.back();
+    stack.pop_back();
+    backward.push_back(current);
+    for (const size_t parent : parents_[current]) {
+      if (visited_[parent] != visit_epoch_ && topo_position_[parent] > lower) {
+        visited_[parent] = visit_epoch_;
+        stack.push_back(parent);
       }
     }
   }
 
-  // Scan nodes from the outputs
-  std::set<size_t> output_connected;
-  {
-    std::queue<size_t> to_explore;
-    for (const size_t i: outputs) {
-      to_explore.push(i);
-      output_connected.insert(i);
+  // Both sets take the positions they had, 'backward' first, each in
+  // its previous order.
+  auto by_position = [this](size_t a, size_t b) {
+    return topo_position_[a] < topo_position_[b];
+  };
+  std::sort(forward.begin(), forward.end(), by_position);
+  std::sort(backward.begin(), backward.end(), by_position);
+  std::vector<size_t> positions;
+  positions.reserve(forward.size() + backward.size());
+  for (const size_t processor_id : backward) {
+    positions.push_back(topo_position_[processor_id]);
+  }
+  for (const size_t processor_id : forward) {
+    positions.push_back(topo_position_[processor_id]);
+  }
+  std::sort(positions.begin(), positions.end());
+  size_t next = 0;
+  for (const size_t processor_id : backward) {
+    topo_position_[processor_id] = positions[next++];
+  }
+  for (const size_t processor_id : forward) {
+    topo_position_[processor_id] = positions[next++];
+  }
+  return true;
+}
+
+bool ProcessorDAG::RemoveConnection(size_t input, size_t output) {
+  if (finalized) {
+    std::cerr << "Cannot change a finalized graph\n";
+    return false;
+  }
+  if (input >= processors_.size() || output >= processors_.size()) {
+    return false;
+  }
+  auto& children = children_[input];
+  const auto child = std::find(children.begin(), children.end(), output);
+  if (child == children.end()) {
+    return false;
+  }
+  children.erase(child);
+  auto& parents = parents_[output];
+  parents.erase(std::find(parents.begin(), parents.end(), input));
+  // Removing connections keeps the topological order valid.
+  return true;
+}
+
+bool ProcessorDAG::RemoveProcessor(size_t processor_id) {
+  if (finalized) {
+    std::cerr << "Cannot change a finalized graph\n";
+    return false;
+  }
+  if (processor_id >= processors_.size() || processors_[processor_id] == nullptr) {
+    return false;
+  }
+  ReplaceProcessor(processor_id, {});
+  processors_[processor_id].reset();
+  for (auto it = name_to_index_.begin(); it != name_to_index_.end();) {
+    if (it->second == processor_id) {
+      it = name_to_index_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  return true;
+}
+
+bool ProcessorDAG::ComputeEvaluationOrder(const std::vector<size_t>& outputs) {
+  const size_t num_processors = processors_.size();
+  // Processors reached from the inputs.
+  std::vector<bool> input_connected(num_processors, false);
+  std::vector<size_t> stack;
+  for (const size_t i: inputs_) {
+    input_connected[i] = true;
+    stack.push_back(i);
+  }
+  size_t num_input_connected = stack.size();
+  while (!stack.empty()) {
+    const size_t current = stack.back();
+    stack.pop_back();
+    for (const size_t c: children_[current]) {
+      if (!input_connected[c]) {
+        input_connected[c] = true;
+        num_input_connected++;
+        stack.push_back(c);
+      }
     }
+  }
 
-    while (!to_explore.empty()) {
-      size_t current = to_explore.front();
-      to_explore.pop();
-      for (const size_t c: parents_[current]) {
-        to_explore.push(c);
-        output_connected.insert(c);
+  // Processors reaching an output.
+  std::vector<bool> output_connected(num_processors, false);
+  for (const size_t i: outputs) {
+    output_connected[i] = true;
+    stack.push_back(i);
+  }
+  while (!stack.empty()) {
+    const size_t current = stack.back();
+    stack.pop_back();
+    for (const size_t p: parents_[current]) {
+      if (!output_connected[p]) {
+        output_connected[p] = true;
+        stack.push_back(p);
       }
     }
   }
 
-  // Keep only nodes that appear in both sets.
+  // Kahn's algorithm over processors reached from the inputs: a processor
+  // is visited once all its parents have been, which gives its maximum
+  // distance from an input.
+  std::vector<size_t> pending_parents(num_processors, 0);
+  for (size_t i = 0; i < num_processors; i++) {
+    if (input_connected[i]) {
+      for (const size_t c: children_[i]) {
+        pending_parents[c]++;
+      }
+    }
+  }
+  std::vector<size_t> distance(num_processors, 0);
+  for (size_t i = 0; i < num_processors; i++) {
+    if (input_connected[i] && pending_parents[i] == 0) {
+      stack.push_back(i);
+    }
+  }
+  size_t num_visited = 0;
   evaluation_order_.clear();
-  std::set_intersection(input_connected.begin(),input_connected.end(),
-                        output_connected.begin(),output_connected.end(),
-                        std::inserter(evaluation_order_, evaluation_order_.begin()));
+  while (!stack.empty()) {
+    const size_t current = stack.back();
+    stack.pop_back();
+    num_visited++;
+    // Keep only processors connected to both an input and an output.
+    if (output_connected[current]) {
+      evaluation_order_.push_back(current);
+    }
+    for (const size_t c: children_[current]) {
+      distance[c] = std::max(distance[current] + 1, distance[c]);
+      if (--pending_parents[c] == 0) {
+        stack.push_back(c);
+      }
+    }
+  }
+  if (num_visited < num_input_connected) {
+    const std::vector<std::string> names = GetStatsNames();
+    std::cerr << "The graph has a cycle through:";
+    for (size_t i = 0; i < num_processors; i++) {
+      if (input_connected[i] && pending_parents[i] > 0) {
+        std::cerr << " " << names[i];
+      }
+    }
+    std::cerr << "\n";
+    evaluation_order_.clear();
+    return false;
+  }
 
-  // Sort nodes by distance to an input.
+  // Sort nodes by distance to an input, then by index.
   std::sort(evaluation_order_.begin(), evaluation_order_.end(),
-            [&distance](size_t i, size_t j){ return distance[i] < distance[j];});
+            [&distance](size_t i, size_t j) {
+              return distance[i] != distance[j] ? distance[i] < distance[j] : i < j;
+            });
+  return true;
 }
 
 
+bool ProcessorDAG::IsOptimizable(size_t processor_id) {
+  const auto& processor = processors_[processor_id];
+  return processor != nullptr && processor->HasInputs()
+    && processor->HasOutputs() && processor->IsStateless();
+}
+
+void ProcessorDAG::ReplaceProcessor(size_t processor_id,
+                                    const std::vector<size_t>& replacement) {
+  for (const size_t parent_id : parents_[processor_id]) {
+    auto& children = children_[parent_id];
+    children.erase(std::find(children.begin(), children.end(), processor_id));
+  }
+  for (const size_t child_id : children_[processor_id]) {
+    // Keep the position in the list of parents, it defines the order in
+    // which events are merged.
+    auto& parents = parents_[child_id];
+    auto position = std::find(parents.begin(), parents.end(), processor_id);
+    position = parents.erase(position);
+    parents.insert(position, replacement.begin(), replacement.end());
+    for (const size_t new_parent_id : replacement) {
+      children_[new_parent_id].push_back(child_id);
+    }
+  }
+  parents_[processor_id].clear();
+  children_[processor_id].clear();
+}
+
+void ProcessorDAG::DropPassThroughProcessors() {
+  for (size_t i = 0; i < processors_.size(); i++) {
+    if (IsOptimizable(i) && !parents_[i].empty()
+        && processors_[i]->PassesEverything()) {
+      // Copy: parents_[i] is cleared by ReplaceProcessor.
+      const std::vector<size_t> parents = parents_[i];
+      ReplaceProcessor(i, parents);
+      optimizer_report_.dropped_processors++;
+    }
+  }
+}
+
+void ProcessorDAG::MergeEquivalentProcessors() {
+  // Merging processors can make their children candidates for merging
+  // too, so iterate until nothing changes.
+  bool merged = true;
+  while (merged) {
+    merged = false;
+    // Group candidates by parents, only processors in the same group can
+    // be merged.
+    std::map<std::vector<size_t>, std::vector<size_t>> groups;
+    for (size_t i = 0; i < processors_.size(); i++) {
+      if (IsOptimizable(i) && !parents_[i].empty()) {
+        groups[parents_[i]].push_back(i);
+      }
+    }
+
+    for (const auto& group : groups) {
+      const std::vector<size_t>& candidates = group.second;
+      for (size_t i = 0; i < candidates.size(); i++) {
+        if (parents_[candidates[i]].empty()) {
+          continue;  // Already merged.
+        }
+        for (size_t j = i + 1; j < candidates.size(); j++) {
+          if (!parents_[candidates[j]].empty()
+              && processors_[candidates[i]]->IsEquivalent(*processors_[candidates[j]])) {
+            ReplaceProcessor(candidates[j], {candidates[i]});
+            optimizer_report_.merged_processors++;
+            merged = true;
+          }
+        }
+      }
+    }
+  }
+}
+
+void ProcessorDAG::FuseChains() {
+  // Returns true if 'child' can be fused with its only parent 'parent'.
+  auto can_fuse = [this](size_t parent, size_t child) {
+    return IsOptimizable(parent) && IsOptimizable(child)
+      && children_[parent].size() == 1 && parents_[child].size() == 1;
+  };
+
+  for (size_t head = 0; head < processors_.size(); head++) {
+    if (!IsOptimizable(head) || parents_[head].empty()) {
+      continue;
+    }
+    // Only start from the first processor of a chain.
+    if (parents_[head].size() == 1 && can_fuse(parents_[head][0], head)) {
+      continue;
+    }
+
+    std::vector<size_t> chain = {head};
+    while (children_[chain.back()].size() == 1
+           && can_fuse(chain.back(), children_[chain.back()][0])
+           && chain.size() <= processors_.size()) {
+      chain.push_back(children_[chain.back()][0]);
+    }
+    if (chain.size() < 2) {
+      continue;
+    }
+
+    // The head of the chain is replaced by the fused processor, which gets
+    // the children of the last processor.
+    std::vector<std::unique_ptr<EventProcessor>> processors;
+    for (const size_t processor_id : chain) {
+      processors.push_back(std::move(processors_[processor_id]));
+    }
+    for (size_t i = 1; i + 1 < chain.size(); i++) {
+      ReplaceProcessor(chain[i], {});
+    }
+    ReplaceProcessor(chain.back(), {head});
+    processors_[head] = std::make_unique<ProcessorChain>(std::move(processors));
+    processors_[head]->init();
+
+    optimizer_report_.fused_chains++;
+    optimizer_report_.fused_processors += chain.size();
+  }
+}
+
+void ProcessorDAG::Optimize() {
+  optimizer_report_ = OptimizerReport();
+  DropPassThroughProcessors();
+  MergeEquivalentProcessors();
+  FuseChains();
+
+  if (optimizer_report_.dropped_processors > 0
+      || optimizer_report_.merged_processors > 0
+      || optimizer_report_.fused_chains > 0) {
+    std::cerr << "Graph optimizer: dropped "
+              << optimizer_report_.dropped_processors << " pass-through processors, merged "
+              << optimizer_report_.merged_processors << " duplicate processors, fused "
+              << optimizer_report_.fused_processors << " processors into "
+              << optimizer_report_.fused_chains << " chains\n";
+  }
+}
+
 /* Postprocesses the processing graph.
-   Mainly drops disconnected processors and computes evaluation order.
+   Mainly drops disconnected processors, optimizes the graph and computes
+   evaluation order.
  */
 bool ProcessorDAG::Finalize() {
   // DAG start and end nodes.
@@ -130,6 +457,9 @@ bool ProcessorDAG::Finalize() {
   std::vector<size_t> outputs;
   
   for (size_t i=0; i<processors_.size(); i++) {
+    if (processors_[i] == nullptr) {
+      continue;  // Fused by the optimizer.
+    }
     if (processors_[i]->HasInputs() && parents_[i].empty()) {
       std::cerr << "processor " << i << " disconnected (no inputs)\n";
     }
@@ -146,52 +476,797 @@ bool ProcessorDAG::Finalize() {
     }
   }
 
+  if (optimizer_enabled_) {
+    Optimize();
+  }
+
   // Topological sort of connected nodes, so that all nodes at a given
   // distance from the input are next to each other.
   // The result is stored in evaluation_order_.
-  ComputeEvaluationOrder(outputs);
+  if (!ComputeEvaluationOrder(outputs)) {
+    return false;
+  }
+  ComputeUsefulTypes();
+  BuildPlan();
+  BuildPropagationIndex();
+  processor_stats_ = std::make_unique<ProcessorStats[]>(processors_.size());
+  Reserve(max_batch_size_);
   finalized = true;
   return true;
 }
 
-bool ProcessorDAG::ProcessEvent(const snd_seq_event_t& ev) {
-  if (!finalized) {
-    std::cerr << "ProcessEvent called on a non-finalized graph.\n";
-    return false;
+void ProcessorDAG::ComputeUsefulTypes() {
+  useful_types_.assign(processors_.size(), EventTypeSet());
+  input_types_.reset();
+  // Children come after their parents in evaluation order.
+  for (auto it = evaluation_order_.rbegin(); it != evaluation_order_.rend(); ++it) {
+    const size_t processor_id = *it;
+    EventProcessor& processor = *processors_[processor_id];
+    // Types which have an effect when generated by this processor.
+    EventTypeSet wanted_types;
+    if (!processor.HasOutputs()) {
+      wanted_types.set();
+    }
+    for (const size_t child : children_[processor_id]) {
+      wanted_types |= useful_types_[child];
+    }
+    EventTypeSet& useful_types = useful_types_[processor_id];
+    for (size_t type = 0; wanted_types.any() && type < useful_types.size(); type++) {
+      EventTypeSet input_type;
+      input_type.set(type);
+      useful_types[type] = (processor.OutputTypes(input_type) & wanted_types).any();
+    }
+    if (parents_[processor_id].empty()) {
+      input_types_ |= useful_types;
+    }
   }
-  
-  // high_resolution_clock::time_point start_point = high_resolution_clock::now();
+}
+
+// Returns true if 'events' has at least one event with a type in 'types'.
+static bool HasEventOfType(const EventBuffer& events, const EventTypeSet& types) {
+  for (const MidiEvent& ev : events) {
+    if (types[ev.type]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void ProcessorDAG::BuildPlan() {
+  // Union-find over processors with outputs, joined by connections and
+  // by shared state. Outputs are only connected to their parents: they
+  // all go to the outputs partition, run on the calling thread, which
+  // serializes those sharing a device or ring without SharedState().
+  std::vector<size_t> roots(processors_.size());
+  std::iota(roots.begin(), roots.end(), 0);
+  auto find_root = [&roots](size_t processor_id) {
+    while (roots[processor_id] != processor_id) {
+      roots[processor_id] = roots[roots[processor_id]];
+      processor_id = roots[processor_id];
+    }
+    return processor_id;
+  };
+  std::map<const void*, size_t> state_owners;
   for (const size_t processor_id : evaluation_order_) {
-    processed_events_[processor_id].clear();
+    EventProcessor& processor = *processors_[processor_id];
+    if (!processor.HasOutputs()) {
+      continue;
+    }
+    for (const size_t parent : parents_[processor_id]) {
+      roots[find_root(parent)] = find_root(processor_id);
+    }
+    const void* state = processor.SharedState();
+    if (state != nullptr) {
+      auto owner = state_owners.emplace(state, processor_id).first;
+      roots[find_root(owner->second)] = find_root(processor_id);
+    }
+  }
 
-    // No parents for the processor: use the input event.
-    if (parents_[processor_id].empty()) {
-      auto events = processors_[processor_id]->ProcessEvent(ev);
-      if (events->size() > 0) {
-        processed_events_[processor_id].insert(
-            processed_events_[processor_id].end(),
-            events->begin(),
-            events->end());
+  // Partitions are numbered in the evaluation order of their first
+  // processor, and outputs come last.
+  const size_t kUnassigned = processors_.size();
+  std::vector<size_t> root_partitions(processors_.size(), kUnassigned);
+  std::vector<size_t> partition_of(processors_.size(), kUnassigned);
+  size_t num_partitions = 0;
+  for (const size_t processor_id : evaluation_order_) {
+    if (processors_[processor_id]->HasOutputs()) {
+      size_t& partition = root_partitions[find_root(processor_id)];
+      if (partition == kUnassigned) {
+        partition = num_partitions++;
       }
+      partition_of[processor_id] = partition;
+    }
+  }
+  for (const size_t processor_id : evaluation_order_) {
+    if (partition_of[processor_id] == kUnassigned) {
+      partition_of[processor_id] = num_partitions;
+    }
+  }
+
+  // Processors of a partition are next to each other in the plan, in
+  // evaluation order. Parents always come before their children.
+  std::vector<std::vector<size_t>> partition_order(num_partitions + 1);
+  for (const size_t processor_id : evaluation_order_) {
+    partition_order[partition_of[processor_id]].push_back(processor_id);
+  }
+  const uint32_t kNotInPlan = std::numeric_limits<uint32_t>::max();
+  std::vector<uint32_t> plan_index(processors_.size(), kNotInPlan);
+  plan_.clear();
+  plan_.resize(evaluation_order_.size());
+  partitions_.clear();
+  partitions_.resize(num_partitions + 1);
+  uint32_t node_index = 0;
+  for (size_t i = 0; i < partition_order.size(); i++) {
+    Partition& partition = partitions_[i];
+    partition.plan_begin = node_index;
+    for (const size_t processor_id : partition_order[i]) {
+      PlanNode& node = plan_[node_index];
+      node.processor = processors_[processor_id].get();
+      node.kind = GetProcessorKind(node.processor);
+      node.processor_id = processor_id;
+      node.partition = i;
+      node.position = node_index - partition.plan_begin;
+      node.useful_types = useful_types_[processor_id];
+      node.output.SetTimers(&partition.timers, node_index);
+      plan_index[processor_id] = node_index;
+      node_index++;
+    }
+    partition.plan_end = node_index;
+    partition.scheduled.assign((partition.plan_end - partition.plan_begin + 63) / 64, 0);
+  }
+
+  // Connections to processors outside of the plan are never used.
+  plan_parents_.clear();
+  plan_children_.clear();
+  for (PlanNode& node : plan_) {
+    node.parents_begin = plan_parents_.size();
+    for (const size_t parent : parents_[node.processor_id]) {
+      if (plan_index[parent] != kNotInPlan) {
+        plan_parents_.push_back(plan_index[parent]);
+      }
+    }
+    node.parents_end = plan_parents_.size();
+    node.children_begin = plan_children_.size();
+    for (const size_t child : children_[node.processor_id]) {
+      if (plan_index[child] != kNotInPlan) {
+        plan_children_.push_back(plan_index[child]);
+      }
+    }
+    node.children_end = plan_children_.size();
+  }
+  active_partitions_.reserve(num_partitions);
+}
+
+void ProcessorDAG::BuildPropagationIndex() {
+  for (auto& inputs : port_inputs_) {
+    inputs.clear();
+  }
+  other_roots_.clear();
+  for (uint32_t i = 0; i < plan_.size(); i++) {
+    PlanNode& node = plan_[i];
+    node.last_run = 0;
+    if (node.parents_begin != node.parents_end) {
       continue;
     }
+    auto input = dynamic_cast<MidiInput*>(node.processor);
+    auto raw_input = dynamic_cast<RawMidiInput*>(node.processor);
+    auto shm_input = dynamic_cast<ShmInput*>(node.processor);
+    if (input != nullptr) {
+      port_inputs_[input->port_num() % 256].push_back(i);
+    } else if (raw_input != nullptr) {
+      port_inputs_[raw_input->port_num() % 256].push_back(i);
+    } else if (shm_input != nullptr) {
+      port_inputs_[shm_input->port_num() % 256].push_back(i);
+    } else {
+      other_roots_.push_back(i);
+    }
+  }
+  run_number_ = 0;
+}
+
+bool ProcessorDAG::ProcessEvent(const snd_seq_event_t& ev) {
+  return ProcessBatch(std::span<const snd_seq_event_t>(&ev, 1));
+}
+
+void ProcessorDAG::Reserve(size_t max_batch_size) {
+  max_batch_size_ = max_batch_size;
+  // The last event of a batch can be a sysex message split into chunks.
+  const size_t input_capacity = max_batch_size + kMaxSysexChunks;
+  // Bounds memory used by graphs merging many paths. Events that don't
+  // fit are dropped and counted.
+  const size_t max_capacity = 16 * input_capacity;
+
+  // Number of events each processor can generate, in plan order.
+  std::vector<size_t> capacities(plan_.size(), 0);
+  // Largest merged input, number of parents and pending events, by
+  // partition.
+  std::vector<size_t> merged_capacities(partitions_.size(), 0);
+  std::vector<size_t> max_parents(partitions_.size(), 0);
+  std::vector<size_t> pending_events(partitions_.size(), 0);
+  size_t num_timer_owners = 0;
+  // Parents come before their children in the plan.
+  for (size_t i = 0; i < plan_.size(); i++) {
+    const PlanNode& node = plan_[i];
+    const size_t num_parents = node.parents_end - node.parents_begin;
+    size_t input_size = num_parents == 0 ? input_capacity : 0;
+    for (uint32_t parent = node.parents_begin; parent < node.parents_end; parent++) {
+      input_size += capacities[plan_parents_[parent]];
+    }
+    input_size = std::min(input_size, max_capacity);
+    const size_t partition = node.partition;
+    if (num_parents > 1) {
+      merged_capacities[partition] = std::max(merged_capacities[partition], input_size);
+    }
+    max_parents[partition] = std::max(max_parents[partition], num_parents);
+
+    EventProcessor* processor = node.processor;
+    processor->Reserve(input_size);
+    capacities[i] = std::min(input_size * processor->MaxEventsPerInput(), max_capacity);
+    if (processor->MaxPendingEvents() > 0) {
+      // Room for events coming due, see ProcessTimers().
+      capacities[i] = std::max(capacities[i], input_capacity);
+      pending_events[partition] += processor->MaxPendingEvents();
+      num_timer_owners++;
+    }
+  }
 
-    // When we have parents we call the processor on all events generated
-    // by all parents.
-    for(const size_t parent_id : parents_[processor_id]) {
-      for(const snd_seq_event_t& event : processed_events_[parent_id]) {
-        auto events = processors_[processor_id]->ProcessEvent(event);
-        if (events->size() > 0) {
-          processed_events_[processor_id].insert(processed_events_[processor_id].end(),
-                                                 events->begin(),
-                                                 events->end());
+  // Outputs of processors are only read by their children, so once
+  // these have run the space of a buffer can be used by the next
+  // processors of the partition. Buffers read by outputs, which run
+  // once all partitions are done, and buffers receiving timer events,
+  // which are all written before any processor runs, keep their own
+  // space. Partitions run in parallel, they don't share anything.
+  const size_t kNoSlot = std::numeric_limits<size_t>::max();
+  std::vector<size_t> slots(plan_.size(), kNoSlot);
+  std::vector<size_t> slot_capacities;
+  for (const Partition& partition : partitions_) {
+    const size_t first_slot = slot_capacities.size();
+    // Last position at which each slot of the partition is read.
+    std::vector<uint32_t> slot_last_use;
+    for (uint32_t i = partition.plan_begin; i < partition.plan_end; i++) {
+      const PlanNode& node = plan_[i];
+      if (capacities[i] == 0) {
+        continue;
+      }
+      uint32_t last_use = i;
+      if (node.processor->MaxPendingEvents() > 0) {
+        last_use = partition.plan_end;
+      }
+      for (uint32_t child = node.children_begin; child < node.children_end; child++) {
+        const uint32_t child_index = plan_children_[child];
+        last_use = std::max(last_use, plan_[child_index].partition == node.partition
+                                      ? child_index : partition.plan_end);
+      }
+      // Takes the smallest free slot large enough, or grows the largest
+      // one, so that total size stays close to the widest point.
+      size_t slot = kNoSlot;
+      for (size_t j = first_slot; j < slot_capacities.size(); j++) {
+        if (slot_last_use[j - first_slot] >= i) {
+          continue;
         }
+        const bool fits = slot_capacities[j] >= capacities[i];
+        if (slot == kNoSlot
+            || (fits && (slot_capacities[slot] < capacities[i]
+                         || slot_capacities[j] < slot_capacities[slot]))
+            || (!fits && slot_capacities[j] > slot_capacities[slot])) {
+          slot = j;
+        }
+      }
+      if (slot == kNoSlot) {
+        slot = slot_capacities.size();
+        slot_capacities.push_back(0);
+        slot_last_use.push_back(0);
       }
+      slot_capacities[slot] = std::max(slot_capacities[slot], capacities[i]);
+      slot_last_use[slot - first_slot] = last_use;
+      slots[i] = slot;
     }
   }
-  // high_resolution_clock::time_point end_point = high_resolution_clock::now();
-  // duration<double> time_span = duration_cast<duration<double>>(end_point - start_point);
-  // std::cerr << "processing time: " << 1000*time_span.count() << " ms\n";
-  
+
+  // All event buffers share a single allocation. Slots are laid out in
+  // order of first use, so that processors run one after the other use
+  // neighbouring memory.
+  size_t arena_size = EventArena::BufferSize(input_capacity);
+  for (const size_t capacity : slot_capacities) {
+    arena_size += EventArena::BufferSize(capacity);
+  }
+  for (const size_t capacity : merged_capacities) {
+    arena_size += EventArena::BufferSize(capacity);
+  }
+  events_arena_.Reset(arena_size);
+  // Always fits.
+  input_batch_.Reserve(input_capacity, &events_arena_);
+  std::vector<void*> slot_storage(slot_capacities.size());
+  for (size_t i = 0; i < slot_capacities.size(); i++) {
+    slot_storage[i] = events_arena_.Allocate(EventArena::BufferSize(slot_capacities[i]));
+  }
+  for (size_t i = 0; i < partitions_.size(); i++) {
+    Partition& partition = partitions_[i];
+    for (uint32_t node = partition.plan_begin; node < partition.plan_end; node++) {
+      if (slots[node] == kNoSlot) {
+        plan_[node].output.Reserve(0, &events_arena_);
+      } else {
+        plan_[node].output.UseStorage(capacities[node], slot_storage[slots[node]]);
+      }
+    }
+    partition.merged_events.Reserve(merged_capacities[i], &events_arena_);
+    partition.timers.Reserve(pending_events[i]);
+    partition.merge_positions.reserve(max_parents[i]);
+    partition.active_parents.reserve(max_parents[i]);
+  }
+  timer_owners_.reserve(num_timer_owners);
+}
+
+void ProcessorDAG::MergeParentEvents(const std::vector<uint32_t>& parents,
+                                     Partition& partition) {
+  EventBuffer* merged = &partition.merged_events;
+  std::vector<size_t>& merge_positions = partition.merge_positions;
+  merged->clear();
+  merge_positions.assign(parents.size(), 0);
+
+  // Events from a given parent are ordered by origin. For a given origin,
+  // all events from the first parent come first, then the second parent,
+  // etc. This is the order obtained when processing events one at a time.
+  while (true) {
+    size_t next_parent = parents.size();
+    uint32_t next_origin = 0;
+    for (size_t i = 0; i < parents.size(); i++) {
+      const EventBuffer& events = plan_[parents[i]].output;
+      if (merge_positions[i] < events.size()
+          && (next_parent == parents.size()
+              || events.origin(merge_positions[i]) < next_origin)) {
+        next_parent = i;
+        next_origin = events.origin(merge_positions[i]);
+      }
+    }
+    if (next_parent == parents.size()) {
+      return;
+    }
+
+    const EventBuffer& events = plan_[parents[next_parent]].output;
+    size_t& position = merge_positions[next_parent];
+    while (position < events.size() && events.origin(position) == next_origin) {
+      merged->push_back(events.event(position), next_origin);
+      position++;
+    }
+  }
+}
+
+bool ProcessorDAG::ProcessBatch(std::span<const snd_seq_event_t> events) {
+  if (!finalized) {
+    std::cerr << "ProcessBatch called on a non-finalized graph.\n";
+    return false;
+  }
+
+  input_batch_.clear();
+  uint32_t origin = 0;
+  for (const snd_seq_event_t& ev : events) {
+    const size_t count = NumMidiEvents(ev);
+    if (count == 0) {
+      // Not a midi message, see MidiEvent.
+      IncrementCounter(&graph_stats_.dropped_events, 1);
+      continue;
+    }
+    // A sysex message can take up to kMaxSysexChunks events.
+    if (origin == max_batch_size_
+        || (origin > 0 && input_batch_.size() + count > input_batch_.capacity())) {
+      RunGraph(origin);
+      input_batch_.clear();
+      origin = 0;
+    }
+    MidiEvent* out = input_batch_.Append(count, origin);
+    if (out == nullptr) {
+      // Larger than the whole buffer, dropped and counted by Append().
+      continue;
+    }
+    FromSeqEvent(ev, out);
+    origin++;
+  }
+  if (origin > 0) {
+    RunGraph(origin);
+  }
+  return true;
+}
+
+bool ProcessorDAG::ProcessBatch(std::span<const MidiEvent> events) {
+  if (!finalized) {
+    std::cerr << "ProcessBatch called on a non-finalized graph.\n";
+    return false;
+  }
+
+  input_batch_.clear();
+  uint32_t origin = 0;
+  for (const MidiEvent& ev : events) {
+    // All chunks of a sysex message derive from the same incoming event.
+    if (!IsSysexContinuation(ev) || input_batch_.empty()) {
+      if (origin == max_batch_size_) {
+        RunGraph(origin);
+        input_batch_.clear();
+        origin = 0;
+      }
+      origin++;
+    }
+    input_batch_.push_back(ev, origin - 1);
+  }
+  if (origin > 0) {
+    RunGraph(origin);
+  }
   return true;
-} 
+}
+
+void ProcessorDAG::RunGraph(size_t num_events) {
+  // Events that didn't fit in a buffer.
+  size_t dropped_events = input_batch_.dropped();
+  const bool stats_enabled = stats_enabled_;
+  std::chrono::steady_clock::time_point batch_start;
+  PerfValues perf_start;
+  if (stats_enabled) {
+    if (perf_counters_enabled_) {
+      perf_counters_.Read(&perf_start);
+    }
+    batch_start = std::chrono::steady_clock::now();
+  }
+
+  // Only inputs receiving events are run first, then processors whose
+  // parents generated events, in evaluation order. In both cases, at
+  // least one of the events must have a type that can affect an output
+  // (see ComputeUsefulTypes). Buffers of processors
+  // which are not run are left as is: their content is only valid if
+  // their last_run matches run_number_.
+  run_number_++;
+  ScheduleInputs();
+  dropped_events += RunScheduled(stats_enabled);
+
+  if (dropped_events > 0) {
+    IncrementCounter(&graph_stats_.dropped_events, dropped_events);
+  }
+
+  if (stats_enabled) {
+    auto batch_end = std::chrono::steady_clock::now();
+    graph_stats_.latency.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        batch_end - batch_start).count());
+    IncrementCounter(&graph_stats_.batches, 1);
+    IncrementCounter(&graph_stats_.events, num_events);
+    PerfValues perf_end;
+    if (perf_counters_enabled_ && perf_counters_.Read(&perf_end)) {
+      IncrementCounter(&graph_stats_.cycles, perf_end.cycles - perf_start.cycles);
+      IncrementCounter(&graph_stats_.instructions,
+                       perf_end.instructions - perf_start.instructions);
+      IncrementCounter(&graph_stats_.cache_misses,
+                       perf_end.cache_misses - perf_start.cache_misses);
+    }
+  }
+}
+
+size_t ProcessorDAG::RunScheduled(bool stats_enabled) {
+  size_t dropped_events = 0;
+  // Partitions reached by events are independent until the outputs.
+  const size_t outputs = partitions_.size() - 1;
+  active_partitions_.clear();
+  for (size_t i = 0; i < outputs; i++) {
+    const std::vector<uint64_t>& scheduled = partitions_[i].scheduled;
+    if (std::any_of(scheduled.begin(), scheduled.end(),
+                    [](uint64_t word) { return word != 0; })) {
+      active_partitions_.push_back(i);
+    }
+  }
+  PartitionRun run = {this, stats_enabled};
+  if (worker_pool_ != nullptr) {
+    worker_pool_->Run(active_partitions_.size(), &RunActivePartition, &run);
+  } else {
+    for (size_t i = 0; i < active_partitions_.size(); i++) {
+      RunActivePartition(&run, i);
+    }
+  }
+  ScheduleOutputs();
+  RunPartition(outputs, stats_enabled);
+  for (Partition& partition : partitions_) {
+    dropped_events += partition.dropped_events;
+    partition.dropped_events = 0;
+  }
+  return dropped_events;
+}
+
+void ProcessorDAG::RunActivePartition(void* context, size_t i) {
+  const PartitionRun* run = static_cast<PartitionRun*>(context);
+  run->dag->RunPartition(run->dag->active_partitions_[i], run->stats_enabled);
+}
+
+void ProcessorDAG::RunPartition(size_t partition_index, bool stats_enabled) {
+  Partition& partition = partitions_[partition_index];
+  std::vector<uint64_t>& scheduled = partition.scheduled;
+  for (size_t word = 0; word < scheduled.size(); word++) {
+    // Children are always after their parents in evaluation order, so
+    // they are scheduled in this word or a later one.
+    while (scheduled[word] != 0) {
+      const uint32_t node_index = partition.plan_begin + word * 64
+          + __builtin_ctzll(scheduled[word]);
+      scheduled[word] &= scheduled[word] - 1;
+      partition.dropped_events += RunProcessor(node_index, partition, stats_enabled);
+      ScheduleChildren(node_index);
+    }
+  }
+}
+
+void ProcessorDAG::ScheduleChildren(uint32_t node_index) {
+  const PlanNode& node = plan_[node_index];
+  if (node.output.empty()) {
+    return;
+  }
+  // Outputs are scheduled once all partitions are done.
+  for (uint32_t i = node.children_begin; i < node.children_end; i++) {
+    const PlanNode& child = plan_[plan_children_[i]];
+    if (child.partition == node.partition && !IsScheduled(child)
+        && HasEventOfType(node.output, child.useful_types)) {
+      Schedule(child);
+    }
+  }
+}
+
+bool ProcessorDAG::ProcessTimers(uint64_t now_ms) {
+  if (!finalized) {
+    std::cerr << "ProcessTimers called on a non-finalized graph.\n";
+    return false;
+  }
+  // Announced before reading previous_, see PreviousTimersDone().
+  running_previous_.store(true);
+  ProcessorDAG* previous = previous_.load();
+  if (previous != nullptr) {
+    previous->ProcessTimers(now_ms);
+  }
+  running_previous_.store(false, std::memory_order_release);
+
+  const bool stats_enabled = stats_enabled_;
+  size_t dropped_events = 0;
+  // One run per millisecond with events coming due, and per
+  // max_batch_size_ events. Timers of all partitions advance together so
+  // that events are processed in time order.
+  while (true) {
+    const uint64_t tick = NextTimer();
+    if (tick > now_ms) {
+      break;
+    }
+    run_number_++;
+    timer_owners_.clear();
+    size_t fired = 0;
+    for (Partition& partition : partitions_) {
+      partition.timers.Advance(tick, max_batch_size_ - fired,
+                               [this, &fired](uint32_t owner, const MidiEvent& ev) {
+        PlanNode& node = plan_[owner];
+        if (node.last_run != run_number_) {
+          node.output.clear();
+          node.last_run = run_number_;
+          timer_owners_.push_back(owner);
+        }
+        // All events due at the same time share an origin.
+        node.output.SetOrigin(0);
+        node.processor->ProcessTimer(ev, &node.output);
+        fired++;
+      });
+    }
+    for (const uint32_t owner : timer_owners_) {
+      dropped_events += plan_[owner].output.dropped();
+      ScheduleChildren(owner);
+    }
+    dropped_events += RunScheduled(stats_enabled);
+    if (stats_enabled) {
+      IncrementCounter(&graph_stats_.timer_events, fired);
+    }
+  }
+  for (Partition& partition : partitions_) {
+    partition.timers.Advance(now_ms, 0, [](uint32_t, const MidiEvent&) {});
+  }
+  if (dropped_events > 0) {
+    IncrementCounter(&graph_stats_.dropped_events, dropped_events);
+  }
+  return true;
+}
+
+uint64_t ProcessorDAG::NextTimer() {
+  uint64_t next = std::numeric_limits<uint64_t>::max();
+  for (const Partition& partition : partitions_) {
+    next = std::min(next, partition.timers.NextTick());
+  }
+  running_previous_.store(true);
+  ProcessorDAG* previous = previous_.load();
+  if (previous != nullptr) {
+    next = std::min(next, previous->NextTimer());
+  }
+  running_previous_.store(false, std::memory_order_release);
+  return next;
+}
+
+void ProcessorDAG::RunTimersOf(ProcessorDAG* previous) {
+  previous_.store(previous);
+}
+
+bool ProcessorDAG::PreviousTimersDone() {
+  ProcessorDAG* previous = previous_.exchange(nullptr);
+  if (previous == nullptr) {
+    return true;
+  }
+  // Either ProcessTimers() or NextTimer() got the previous graph before
+  // the exchange and is still using it, or they won't see it until it's
+  // put back.
+  while (running_previous_.load()) {
+  }
+  if (previous->NextTimer() == std::numeric_limits<uint64_t>::max()) {
+    return true;
+  }
+  previous_.store(previous);
+  return false;
+}
+
+void ProcessorDAG::ScheduleOutputs() {
+  const Partition& outputs = partitions_.back();
+  for (uint32_t i = outputs.plan_begin; i < outputs.plan_end; i++) {
+    const PlanNode& output = plan_[i];
+    for (uint32_t parent = output.parents_begin; parent < output.parents_end; parent++) {
+      const PlanNode& parent_node = plan_[plan_parents_[parent]];
+      if (parent_node.last_run == run_number_
+          && HasEventOfType(parent_node.output, output.useful_types)) {
+        Schedule(output);
+        break;
+      }
+    }
+  }
+}
+
+void ProcessorDAG::ScheduleInputs() {
+  for (const MidiEvent& ev : input_batch_) {
+    for (const uint32_t input : port_inputs_[ev.port]) {
+      if (plan_[input].useful_types[ev.type]) {
+        Schedule(plan_[input]);
+      }
+    }
+  }
+  for (const uint32_t root : other_roots_) {
+    if (HasEventOfType(input_batch_, plan_[root].useful_types)) {
+      Schedule(plan_[root]);
+    }
+  }
+}
+
+size_t ProcessorDAG::RunProcessor(uint32_t node_index, Partition& partition,
+                                  bool stats_enabled) {
+  size_t dropped_events = 0;
+  PlanNode& node = plan_[node_index];
+  EventBuffer& output = node.output;
+  // Keeps events which came due in this run, see ProcessTimers().
+  if (node.last_run != run_number_) {
+    output.clear();
+    node.last_run = run_number_;
+  }
+
+  const EventBuffer* input;
+  if (node.parents_begin == node.parents_end) {
+    // No parents for the processor: use the input events.
+    input = &input_batch_;
+  } else {
+    // Only parents which generated events during this run are used, and
+    // there is at least one.
+    std::vector<uint32_t>& active_parents = partition.active_parents;
+    active_parents.clear();
+    for (uint32_t i = node.parents_begin; i < node.parents_end; i++) {
+      const PlanNode& parent = plan_[plan_parents_[i]];
+      if (parent.last_run == run_number_ && !parent.output.empty()) {
+        active_parents.push_back(plan_parents_[i]);
+      }
+    }
+    if (active_parents.size() == 1) {
+      input = &plan_[active_parents[0]].output;
+    } else {
+      // When we have several parents we call the processor on all events
+      // generated by all parents, in the order they would have been
+      // generated by processing input events one at a time.
+      MergeParentEvents(active_parents, partition);
+      input = &partition.merged_events;
+      dropped_events += partition.merged_events.dropped();
+    }
+  }
+
+  if (!stats_enabled) {
+    DispatchBatch(node.kind, node.processor, *input, &output);
+  } else {
+    auto start = std::chrono::steady_clock::now();
+    DispatchBatch(node.kind, node.processor, *input, &output);
+    auto end = std::chrono::steady_clock::now();
+    ProcessorStats& stats = processor_stats_[node.processor_id];
+    stats.latency.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        end - start).count());
+    IncrementCounter(&stats.events_in, input->size());
+    IncrementCounter(&stats.events_out, output.size());
+    IncrementCounter(&stats.dropped_events, output.dropped());
+  }
+  return dropped_events + output.dropped();
+}
+
+bool ProcessorDAG::EnablePerfCounters() {
+  // Counters are attached to the calling thread, which must be the one
+  // calling ProcessBatch.
+  perf_counters_enabled_ = perf_counters_.Open();
+  return perf_counters_enabled_;
+}
+
+std::vector<std::string> ProcessorDAG::GetStatsNames() {
+  std::vector<std::string> names(processors_.size());
+  for (const auto& name_index : name_to_index_) {
+    names[name_index.second] = name_index.first;
+  }
+  for (size_t processor_id = 0; processor_id < names.size(); processor_id++) {
+    names[processor_id] = "processor " + std::to_string(processor_id)
+        + (names[processor_id].empty() ? "" : " (" + names[processor_id] + ")");
+  }
+  return names;
+}
+
+void ProcessorDAG::PrintStats(std::ostream& out) {
+  if (!finalized) {
+    return;
+  }
+  const std::vector<std::string> names = GetStatsNames();
+
+  const uint64_t events = graph_stats_.events.load(std::memory_order_relaxed);
+  out << "graph: batches=" << graph_stats_.batches.load(std::memory_order_relaxed)
+      << " events=" << events
+      << " dropped=" << graph_stats_.dropped_events.load(std::memory_order_relaxed)
+      << " timer_events=" << graph_stats_.timer_events.load(std::memory_order_relaxed)
+      << " latency: ";
+  PrintHistogram(graph_stats_.latency, out);
+  out << "\n";
+  if (perf_counters_enabled_ && events > 0) {
+    out << "graph: cycles/event="
+        << graph_stats_.cycles.load(std::memory_order_relaxed) / events
+        << " instructions/event="
+        << graph_stats_.instructions.load(std::memory_order_relaxed) / events
+        << " cache-misses/event="
+        << static_cast<double>(graph_stats_.cache_misses.load(std::memory_order_relaxed)) / events
+        << "\n";
+  }
+
+  for (const size_t processor_id : evaluation_order_) {
+    const ProcessorStats& stats = processor_stats_[processor_id];
+    out << names[processor_id]
+        << ": in=" << stats.events_in.load(std::memory_order_relaxed)
+        << " out=" << stats.events_out.load(std::memory_order_relaxed)
+        << " dropped=" << stats.dropped_events.load(std::memory_order_relaxed)
+        << " latency: ";
+    PrintHistogram(stats.latency, out);
+    processors_[processor_id]->PrintStats(out);
+    out << "\n";
+  }
+}
+
+void ProcessorDAG::PublishMetrics(MetricsSegment* segment) {
+  if (!finalized) {
+    return;
+  }
+  GraphMetrics& graph = segment->graph;
+  SetMetric(&graph.batches, graph_stats_.batches.load(std::memory_order_relaxed));
+  SetMetric(&graph.events, graph_stats_.events.load(std::memory_order_relaxed));
+  SetMetric(&graph.dropped_events,
+            graph_stats_.dropped_events.load(std::memory_order_relaxed));
+  SetMetric(&graph.timer_events, graph_stats_.timer_events.load(std::memory_order_relaxed));
+  SetMetric(&graph.max_latency_ns, graph_stats_.latency.Max());
+  uint64_t dropped_output_events = 0;
+  for (const auto& processor : processors_) {
+    if (auto output = dynamic_cast<const MidiOutput*>(processor.get())) {
+      dropped_output_events += output->dropped_events();
+    }
+  }
+  SetMetric(&graph.dropped_output_events, dropped_output_events);
+
+  const std::vector<std::string> names = GetStatsNames();
+  const size_t num_processors = std::min(evaluation_order_.size(), kMaxMetricsProcessors);
+  SetMetric(&segment->header.num_processors, num_processors);
+  for (size_t i = 0; i < num_processors; i++) {
+    const size_t processor_id = evaluation_order_[i];
+    const ProcessorStats& stats = processor_stats_[processor_id];
+    ProcessorMetrics& metrics = segment->processors[i];
+    SetMetricName(&metrics, names[processor_id]);
+    SetMetric(&metrics.events_in, stats.events_in.load(std::memory_order_relaxed));
+    SetMetric(&metrics.events_out, stats.events_out.load(std::memory_order_relaxed));
+    SetMetric(&metrics.dropped_events, stats.dropped_events.load(std::memory_order_relaxed));
+    SetMetric(&metrics.max_latency_ns, stats.latency.Max());
+  }
+}
@@ -1,10 +1,34 @@
 #ifndef _DAG_H_
 #define _DAG_H_
 
+#include <array>
+#include <atomic>
 #include <memory>
+#include <span>
 #include <unordered_map> 
 #include <alsa/asoundlib.h>
 #include "event_processors.h"
+#include "metrics.h"
+#include "midi_event.h"
+#include "stats.h"
+#include "timer_wheel.h"
+#include "worker_pool.h"
+
+// What the graph optimizer did during ProcessorDAG::Finalize().
+struct OptimizerReport {
+  // Processors dropped because they let all events through.
+  size_t dropped_processors = 0;
+  // Processors merged into an equivalent one with the same parents.
+  size_t merged_processors = 0;
+  // Number of chains of processors fused into a single node, and total
+  // number of processors in these chains.
+  size_t fused_chains = 0;
+  size_t fused_processors = 0;
+};
+
+// Default maximum number of events processed at once, see
+// ProcessorDAG::Reserve().
+const size_t kDefaultMaxBatchSize = 256;
 
 /* Class used to store the DAG of processors */
 class ProcessorDAG {
@@ -20,47 +44,332 @@ class ProcessorDAG {
 
   // Adds a connection between two processors.
   // Use indices returned by AddProcessor() as input.
+  // Returns false, leaving the graph unchanged, if the connection would
+  // create a cycle. A topological order of the processors is kept up to
+  // date as connections are added (Pearce-Kelly), so that this check
+  // only visits the processors between 'output' and 'input' in that
+  // order, rather than the whole graph.
   bool AddConnection(size_t input, size_t output);
   // Adds a connection between two processors referred to by names.
   // Only names provided through AddProcessor can be used here:
   bool AddConnection(const std::string& input,
                      const std::string& output);
+  // Removes a connection added by AddConnection(). Returns false if
+  // there is none.
+  bool RemoveConnection(size_t input, size_t output);
+  // Removes a processor and its connections. Its index isn't reused.
+  bool RemoveProcessor(size_t processor_id);
+  // The graph can only be changed until Finalize(): a finalized graph
+  // is replaced by a new one instead (see ConfigReloader).
 
   // Call this when all processors and connections have been added.
   // It does all the precomputation and optimization to speed up
   // evaluation.
+  // Unless disabled with EnableOptimizer(false), the graph is simplified
+  // at that point: processors letting all events through are dropped,
+  // equivalent processors with the same parents are merged and chains of
+  // stateless processors are fused into a single node. Indices and names
+  // of processors removed that way should not be used anymore.
+  // Finalize() also works out, from the OutputTypes() of processors, which
+  // event types can affect an output from each processor. Processors are
+  // then only run on batches holding events of such types.
+  // Last, the graph is split into partitions which are only connected
+  // through outputs (processors without outputs, such as MidiOutput), see
+  // SetWorkerPool(), and compiled into a flat execution plan where the
+  // processors of each partition are stored next to each other.
   bool Finalize();
   bool IsFinalized() { return finalized; }
 
+  void EnableOptimizer(bool enable) { optimizer_enabled_ = enable; }
+  // Types of incoming events which can affect an output, only valid after
+  // Finalize(). Other events can be filtered out by the sequencer.
+  const EventTypeSet& InputEventTypes() { return input_types_; }
+  const OptimizerReport& GetOptimizerReport() { return optimizer_report_; }
+
   // Sends a incoming event through the processing graph. Output is
   // performed by the graph itself.
   bool ProcessEvent(const snd_seq_event_t& ev);
+
+  // Sends a batch of incoming events through the processing graph. Each
+  // processor is run over the whole batch before the next one in the
+  // evaluation order. Events reach the outputs in the same order as with
+  // a call to ProcessEvent() for each event.
+  // Events are converted to MidiEvent first; those that can't be are
+  // dropped. Large batches are split, see Reserve().
+  bool ProcessBatch(std::span<const snd_seq_event_t> events);
+  // Same as above, for events already converted with FromSeqEvent().
+  bool ProcessBatch(std::span<const MidiEvent> events);
+
+  // Moves the clock of the graph to 'now_ms', as given by MonotonicMs(),
+  // and passes events scheduled by processors up to that time (see
+  // EventBuffer::Schedule), through their EventProcessor::ProcessTimer(),
+  // to their children, in order. Events due on the
+  // same millisecond are processed together, as if they derived from a
+  // single incoming event. Delays are counted from the last call, so this
+  // must be called before ProcessBatch() as well as at NextTimer().
+  bool ProcessTimers(uint64_t now_ms);
+  // Time at which ProcessTimers() must be called next, or the maximum
+  // value if no events are scheduled.
+  uint64_t NextTimer();
+
+  // Makes ProcessTimers() run the timers of 'previous', the graph this
+  // one replaces, until none are pending, so that the note-offs and
+  // echoes it scheduled are still sent on time. Called before publishing
+  // this graph. 'previous' must be kept until PreviousTimersDone().
+  void RunTimersOf(ProcessorDAG* previous);
+  // Returns true once the graph given to RunTimersOf() has no pending
+  // events, after which this graph doesn't use it anymore. Called by the
+  // thread publishing graphs, once the previous one isn't in use.
+  bool PreviousTimersDone();
+
+  // Sizes all buffers for batches of up to 'max_batch_size' incoming
+  // events, from the maximum number of events each processor generates.
+  // Larger batches are processed in several steps, so that processing
+  // never allocates memory. Processors whose outputs are never needed at
+  // the same time share buffers, so that memory grows with the width of
+  // the graph rather than its size. Called by Finalize() with
+  // kDefaultMaxBatchSize.
+  void Reserve(size_t max_batch_size);
+  // Bytes taken by event buffers, as sized by Reserve().
+  size_t EventMemorySize() const { return events_arena_.capacity(); }
+
+  // Runs partitions of the graph reached by a batch in parallel on 'pool',
+  // which must outlive the graph or be unset first. Null, the default,
+  // runs everything on the thread calling ProcessBatch().
+  // Processors returning the same EventProcessor::SharedState() are kept
+  // in the same partition. Outputs are run on the calling thread once all
+  // partitions are done, in evaluation order, so that they receive the
+  // same events in the same order as without a pool: events from a given
+  // input keep their order, and events from inputs in different
+  // partitions are ordered by their position in the batch.
+  void SetWorkerPool(WorkerPool* pool) { worker_pool_ = pool; }
+  // Number of partitions, outputs excluded. Only valid after Finalize().
+  size_t NumPartitions() { return partitions_.empty() ? 0 : partitions_.size() - 1; }
   
+  // Instrumentation. When enabled, ProcessBatch records the time spent in
+  // each processor and in the whole graph, as well as event counts.
+  // Statistics can be read from any thread while events are processed.
+  // Enabled by default when compiled with -DMIDIFLUME_STATS.
+  void EnableStats(bool enable) { stats_enabled_ = enable; }
+  // Also reads hardware counters for each batch. This costs a couple of
+  // system calls per batch. Returns false if counters are not available.
+  bool EnablePerfCounters();
+  // Statistics for processor 'processor_id'. Only valid after Finalize().
+  const ProcessorStats& GetProcessorStats(size_t processor_id) {
+    return processor_stats_[processor_id];
+  }
+  const GraphStats& GetGraphStats() { return graph_stats_; }
+  // Prints all statistics in a human-readable form.
+  void PrintStats(std::ostream& out);
+  // Copies statistics to 'segment', between MetricsWriter::BeginUpdate()
+  // and EndUpdate(). Like PrintStats(), can be called from any thread.
+  void PublishMetrics(MetricsSegment* segment);
+
+  // Access to processors, by index or by name. Returns nullptr for unknown
+  // processors and processors removed by the optimizer.
+  size_t NumProcessors() { return processors_.size(); }
+  EventProcessor* GetProcessor(size_t processor_id);
+  EventProcessor* GetProcessor(const std::string& processor_name);
+
   // Returns the order in which processors will be run. For testing purposes.
   const std::vector<size_t>& GetEvaluationOrder() {
     return evaluation_order_;
   }
   
  private:
-  void ComputeEvaluationOrder(const std::vector<size_t>& outputs);
+  // Returns false if the graph has a cycle.
+  bool ComputeEvaluationOrder(const std::vector<size_t>& outputs);
+  // Moves processors in topo_position_ so that 'input' comes before
+  // 'output', see AddConnection(). Returns false if 'output' leads to
+  // 'input'.
+  bool UpdateTopologicalOrder(size_t input, size_t output);
+  // Processor names used in statistics, by processor index.
+  std::vector<std::string> GetStatsNames();
+
+  // Graph optimizer, see Finalize().
+  void Optimize();
+  // Returns true if the processor can be removed, merged or fused.
+  bool IsOptimizable(size_t processor_id);
+  void DropPassThroughProcessors();
+  void MergeEquivalentProcessors();
+  void FuseChains();
+  // Runs all processors on the events in input_batch_, which derive from
+  // 'num_events' incoming events.
+  void RunGraph(size_t num_events);
+  // Runs scheduled processors, then outputs. Returns the number of events
+  // dropped.
+  size_t RunScheduled(bool stats_enabled);
+  // A processor in the execution plan, with everything needed to run it.
+  struct PlanNode {
+    EventProcessor* processor = nullptr;
+    // Kind of the processor, to call built-in ones directly.
+    ProcessorKind kind = ProcessorKind::kOther;
+    // Index in processors_.
+    uint32_t processor_id = 0;
+    // Partition of the processor, and position in it.
+    uint32_t partition = 0;
+    uint32_t position = 0;
+    // Parents and children, as ranges of plan_parents_ and plan_children_.
+    uint32_t parents_begin = 0;
+    uint32_t parents_end = 0;
+    uint32_t children_begin = 0;
+    uint32_t children_end = 0;
+    // Value of run_number_ when 'output' was last written. Its events are
+    // only valid if this is the current run.
+    uint64_t last_run = 0;
+    // Types of the events which can have an effect on an output when
+    // given to the processor.
+    EventTypeSet useful_types;
+    // Events generated during the last run, stored in events_arena_,
+    // possibly in the same space as other processors, see Reserve().
+    EventBuffer output;
+  };
+  // Processors run by a single thread, see SetWorkerPool().
+  struct alignas(64) Partition {
+    // Processors of the partition, in evaluation order, as a range of
+    // plan_.
+    uint32_t plan_begin = 0;
+    uint32_t plan_end = 0;
+    // Bitmap of processors to run, indexed by position in the range.
+    std::vector<uint64_t> scheduled;
+    // Input for processors with several parents.
+    EventBuffer merged_events;
+    // Read position in each parent's events, used by MergeParentEvents.
+    std::vector<size_t> merge_positions;
+    // Parents which generated events, used by RunProcessor.
+    std::vector<uint32_t> active_parents;
+    // Events dropped during the current run.
+    size_t dropped_events = 0;
+    // Events scheduled by processors of the partition.
+    TimerWheel timers;
+  };
+  // Splits processors in evaluation order into partitions_, and lays
+  // them out in plan_.
+  void BuildPlan();
+  // Runs the scheduled processors of partitions_[partition_index].
+  void RunPartition(size_t partition_index, bool stats_enabled);
+  // Task given to WorkerPool::Run(), runs the i-th active partition.
+  struct PartitionRun {
+    ProcessorDAG* dag;
+    bool stats_enabled;
+  };
+  static void RunActivePartition(void* context, size_t i);
+  // Computes useful_types_ and input_types_ from the OutputTypes() of
+  // processors, going back from the outputs.
+  void ComputeUsefulTypes();
+  // Builds port_inputs_ and the other structures used to only run
+  // processors reached by events.
+  void BuildPropagationIndex();
+  // Schedules inputs for the ports events in input_batch_ were received
+  // on, and inputs which are not MidiInput.
+  void ScheduleInputs();
+  // Schedules outputs with a parent which generated useful events.
+  void ScheduleOutputs();
+  // Schedules children of plan_[node_index] in its partition for which
+  // it generated useful events.
+  void ScheduleChildren(uint32_t node_index);
+  bool IsScheduled(const PlanNode& node) const {
+    return partitions_[node.partition].scheduled[node.position / 64]
+        & (uint64_t{1} << (node.position % 64));
+  }
+  void Schedule(const PlanNode& node) {
+    partitions_[node.partition].scheduled[node.position / 64]
+        |= uint64_t{1} << (node.position % 64);
+  }
+  // Runs scheduled processor plan_[node_index] of 'partition', returns
+  // the number of events dropped.
+  size_t RunProcessor(uint32_t node_index, Partition& partition,
+                      bool stats_enabled);
+  // Removes processor 'processor_id' from the graph, connecting its
+  // children to 'replacement' instead.
+  void ReplaceProcessor(size_t processor_id, const std::vector<size_t>& replacement);
+  // Merges events generated by all 'parents', positions in plan_, into
+  // the merged_events of 'partition', in the order given by their origin.
+  void MergeParentEvents(const std::vector<uint32_t>& parents,
+                         Partition& partition);
   
   bool finalized = false;
+  bool optimizer_enabled_ = true;
+#ifdef MIDIFLUME_STATS
+  bool stats_enabled_ = true;
+#else
+  bool stats_enabled_ = false;
+#endif
+  bool perf_counters_enabled_ = false;
+  OptimizerReport optimizer_report_;
   std::vector<std::unique_ptr<EventProcessor>> processors_;
   
-  // The DAG structure.
+  // The DAG structure, as built by AddConnection() and the optimizer.
+  // Processing only uses plan_.
   std::vector<size_t> inputs_;  // TODO: Get rid of this
   std::vector<std::vector<size_t>> children_;
   std::vector<std::vector<size_t>> parents_; 
+  // Position of each processor in a topological order of the graph, kept
+  // up to date by AddConnection(). Positions are unique, but not
+  // necessarily contiguous.
+  std::vector<size_t> topo_position_;
+  // Processors visited by the searches of UpdateTopologicalOrder() are
+  // marked with the current visit_epoch_.
+  std::vector<uint64_t> visited_;
+  uint64_t visit_epoch_ = 0;
   
   // Order in which processors must be called.
   // Elements in here that have no parents are the inputs.
   std::vector<size_t> evaluation_order_;
 
-  // List of events generated during a single call to
-  // ProcessorDAG::ProcessEvent for each processor.
-  std::vector<std::vector<snd_seq_event_t>> processed_events_;
+  // See Reserve().
+  size_t max_batch_size_ = kDefaultMaxBatchSize;
+  // Storage of all event buffers below, allocated by Reserve().
+  EventArena events_arena_;
+  // Events given to ProcessBatch, used as input for processors without
+  // parents.
+  EventBuffer input_batch_;
+
+  // Types of the events which can have an effect on an output when given
+  // to each processor.
+  std::vector<EventTypeSet> useful_types_;
+  // Union of useful_types_ for processors without parents.
+  EventTypeSet input_types_;
+
+  // Execution plan: processors reached from an input and reaching an
+  // output, partition after partition, each in evaluation order.
+  std::vector<PlanNode> plan_;
+  // Parents and children of the processors of plan_, as positions in
+  // plan_.
+  std::vector<uint32_t> plan_parents_;
+  std::vector<uint32_t> plan_children_;
+
+  // Sparse propagation: only inputs for ports which received events are
+  // run, then processors with at least one parent which generated events.
+  // MidiInput, RawMidiInput and ShmInput processors by port number, as
+  // positions in plan_.
+  std::array<std::vector<uint32_t>, 256> port_inputs_;
+  // Processors without parents which are not inputs, always run.
+  std::vector<uint32_t> other_roots_;
+  // Incremented by RunGraph, see PlanNode::last_run.
+  uint64_t run_number_ = 0;
+
+  // Partitions of the graph, with outputs in the last one, run after all
+  // others. Processors are only connected to processors of their own
+  // partition, or to outputs.
+  std::vector<Partition> partitions_;
+  // Partitions with scheduled processors during the current run.
+  std::vector<size_t> active_partitions_;
+  // Processors whose scheduled events came due, as positions in plan_,
+  // see ProcessTimers().
+  std::vector<uint32_t> timer_owners_;
+  // See RunTimersOf(). 'running_previous_' is set by ProcessTimers() and
+  // NextTimer() while they use 'previous_'.
+  std::atomic<ProcessorDAG*> previous_{nullptr};
+  std::atomic<bool> running_previous_{false};
+  WorkerPool* worker_pool_ = nullptr;
 
   // Mapping from processor name to index.
   std::unordered_map<std::string, size_t> name_to_index_;
+
+  // Instrumentation, see EnableStats().
+  std::unique_ptr<ProcessorStats[]> processor_stats_;
+  GraphStats graph_stats_;
+  PerfCounters perf_counters_;
 };
 #endif
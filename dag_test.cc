@@ -1,8 +1,24 @@
 #define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
 #include "third_party/catch.hpp"
+#include <sstream>
+#include <sys/stat.h>
+#include <lua5.3/lualib.h>
 
 #include "event_processors.h"
+#include "alloc_check.h"
+#include "capture.h"
 #include "dag.h"
+#include "graph_slot.h"
+#include "lua_processor.h"
+#include "metrics.h"
+#include "offline.h"
+#include "port_registry.h"
+#include "raw_midi.h"
+#include "shm_ring.h"
+#include "smf.h"
+#include "snapshot.h"
+#include "timer_wheel.h"
+#include "worker_pool.h"
 
 TEST_CASE("Empty") {
   ProcessorDAG dag;
@@ -75,3 +91,2012 @@ TEST_CASE("No self connection") {
   REQUIRE(!dag.AddConnection(filter1_index, filter1_index));
 }
 
+
+TEST_CASE("No cycles") {
+  ProcessorDAG dag;
+
+  std::vector<size_t> filters;
+  for (int i = 0; i < 4; i++) {
+    filters.push_back(dag.AddProcessor(std::make_unique<NoteSelector>(0,64,0,127)));
+  }
+  // Added against the initial order, which must be updated.
+  REQUIRE(dag.AddConnection(filters[3], filters[2]));
+  REQUIRE(dag.AddConnection(filters[2], filters[1]));
+  REQUIRE(dag.AddConnection(filters[1], filters[0]));
+  REQUIRE(!dag.AddConnection(filters[0], filters[3]));
+  REQUIRE(!dag.AddConnection(filters[1], filters[2]));
+  REQUIRE(dag.AddConnection(filters[3], filters[0]));
+
+  // The cycle is only closed once a connection is removed.
+  REQUIRE(dag.RemoveConnection(filters[2], filters[1]));
+  REQUIRE(!dag.RemoveConnection(filters[2], filters[1]));
+  REQUIRE(dag.AddConnection(filters[1], filters[2]));
+  REQUIRE(!dag.AddConnection(filters[2], filters[3]));
+}
+
+TEST_CASE("Connections by name") {
+  ProcessorDAG dag;
+
+  dag.AddProcessor(std::make_unique<MidiInput>("in", nullptr), "in");
+  dag.AddProcessor(std::make_unique<MidiOutput>("out", nullptr), "out");
+  REQUIRE(!dag.AddConnection("in", "typo"));
+  REQUIRE(!dag.AddConnection("typo", "out"));
+  REQUIRE(dag.AddConnection("in", "out"));
+  REQUIRE(dag.Finalize());
+  // Finalized graphs can't change.
+  REQUIRE(!dag.AddConnection("out", "in"));
+}
+
+TEST_CASE("Graph editing") {
+  ProcessorDAG dag;
+
+  size_t input_index = dag.AddProcessor(std::make_unique<MidiInput>("in", nullptr));
+  size_t filter1_index = dag.AddProcessor(std::make_unique<NoteSelector>(0,64,0,127),
+                                          "filter1");
+  size_t filter2_index = dag.AddProcessor(std::make_unique<NoteSelector>(65,127,0,127));
+  size_t output_index = dag.AddProcessor(std::make_unique<MidiOutput>("out", nullptr));
+  REQUIRE(dag.AddConnection(input_index, filter1_index));
+  REQUIRE(dag.AddConnection(filter1_index, output_index));
+  REQUIRE(dag.AddConnection(input_index, filter2_index));
+  REQUIRE(dag.AddConnection(filter2_index, output_index));
+
+  REQUIRE(dag.RemoveProcessor(filter1_index));
+  REQUIRE(!dag.RemoveProcessor(filter1_index));
+  REQUIRE(dag.GetProcessor(filter1_index) == nullptr);
+  REQUIRE(dag.GetProcessor("filter1") == nullptr);
+  REQUIRE(!dag.AddConnection(input_index, filter1_index));
+  dag.EnableOptimizer(false);
+  REQUIRE(dag.Finalize());
+  REQUIRE_THAT(dag.GetEvaluationOrder(),
+               Catch::Equals(std::vector<size_t>({input_index, filter2_index,
+                                                  output_index})));
+}
+
+TEST_CASE("Large graphs") {
+  // Layers of selectors, each connected to all processors of the
+  // previous layer: the number of paths grows exponentially with the
+  // number of layers.
+  ProcessorDAG dag;
+  dag.EnableOptimizer(false);
+  const size_t kLayers = 200;
+  const size_t kWidth = 10;
+  std::vector<size_t> previous = {
+    dag.AddProcessor(std::make_unique<MidiInput>("in", nullptr))};
+  bool connected = true;
+  for (size_t layer = 0; layer < kLayers; layer++) {
+    std::vector<size_t> current;
+    for (size_t i = 0; i < kWidth; i++) {
+      current.push_back(dag.AddProcessor(std::make_unique<NoteSelector>(0,127,0,127)));
+      for (const size_t parent : previous) {
+        connected &= dag.AddConnection(parent, current.back());
+      }
+    }
+    previous = current;
+  }
+  size_t output_index = dag.AddProcessor(std::make_unique<MidiOutput>("out", nullptr));
+  for (const size_t parent : previous) {
+    connected &= dag.AddConnection(parent, output_index);
+  }
+  REQUIRE(connected);
+  REQUIRE(dag.Finalize());
+  REQUIRE(dag.GetEvaluationOrder().size() == kLayers * kWidth + 2);
+  REQUIRE(dag.GetEvaluationOrder().back() == output_index);
+}
+
+// Output processor keeping all the events it receives.
+class EventRecorder: public EventProcessor {
+public:
+  virtual bool HasInputs() override { return true; }
+  virtual bool HasOutputs() override { return false; }
+
+  virtual void ProcessEvent(const MidiEvent& ev, EventBuffer* output) override {
+    received.push_back(ev);
+  }
+  virtual size_t MaxEventsPerInput() override { return 0; }
+
+  std::vector<MidiEvent> received;
+};
+
+snd_seq_event_t MakeNoteEvent(snd_seq_event_type_t type, unsigned char note) {
+  snd_seq_event_t ev;
+  snd_seq_ev_clear(&ev);
+  ev.type = type;
+  ev.data.note.note = note;
+  ev.data.note.velocity = 100;
+  return ev;
+}
+
+std::vector<int> GetNotes(const std::vector<MidiEvent>& events) {
+  std::vector<int> notes;
+  for (const auto& ev: events) {
+    notes.push_back(ev.data.note.note);
+  }
+  return notes;
+}
+
+// Sets the destination of all events to the port of input 'input_index'.
+std::vector<snd_seq_event_t> SendTo(ProcessorDAG& dag, size_t input_index,
+                                    std::vector<snd_seq_event_t> events) {
+  const int port = static_cast<MidiInput*>(dag.GetProcessor(input_index))->port_num();
+  for (auto& ev: events) {
+    ev.dest.port = port;
+  }
+  return events;
+}
+
+TEST_CASE("Batch keeps event order through merges") {
+  ProcessorDAG dag;
+
+  auto recorder = std::make_unique<EventRecorder>();
+  EventRecorder* recorder_ptr = recorder.get();
+  size_t output_index = dag.AddProcessor(std::move(recorder));
+  size_t input_index = dag.AddProcessor(std::make_unique<MidiInput>("blah", nullptr));
+  size_t low_index = dag.AddProcessor(std::make_unique<NoteSelector>(0,64,0,127));
+  size_t high_index = dag.AddProcessor(std::make_unique<NoteSelector>(65,127,0,127));
+
+  REQUIRE(dag.AddConnection(input_index, low_index));
+  REQUIRE(dag.AddConnection(input_index, high_index));
+  REQUIRE(dag.AddConnection(low_index, output_index));
+  REQUIRE(dag.AddConnection(high_index, output_index));
+  REQUIRE(dag.Finalize());
+
+  const std::vector<snd_seq_event_t> events = {
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 70),
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 10),
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEOFF, 70),
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEOFF, 10)};
+
+  REQUIRE(dag.ProcessBatch(events));
+  REQUIRE_THAT(GetNotes(recorder_ptr->received),
+               Catch::Equals(std::vector<int>({70, 10, 70, 10})));
+  REQUIRE(recorder_ptr->received[2].type == SND_SEQ_EVENT_NOTEOFF);
+
+  // Same result when events are sent one at a time.
+  recorder_ptr->received.clear();
+  for (const auto& ev: events) {
+    REQUIRE(dag.ProcessEvent(ev));
+  }
+  REQUIRE_THAT(GetNotes(recorder_ptr->received),
+               Catch::Equals(std::vector<int>({70, 10, 70, 10})));
+}
+
+TEST_CASE("Batch duplicates events on parallel paths") {
+  ProcessorDAG dag;
+
+  auto recorder = std::make_unique<EventRecorder>();
+  EventRecorder* recorder_ptr = recorder.get();
+  size_t input_index = dag.AddProcessor(std::make_unique<MidiInput>("blah", nullptr));
+  size_t all_index = dag.AddProcessor(std::make_unique<NoteSelector>(0,127,0,127));
+  size_t low_index = dag.AddProcessor(std::make_unique<NoteSelector>(0,64,0,127));
+  size_t output_index = dag.AddProcessor(std::move(recorder));
+
+  REQUIRE(dag.AddConnection(input_index, all_index));
+  REQUIRE(dag.AddConnection(input_index, low_index));
+  REQUIRE(dag.AddConnection(all_index, output_index));
+  REQUIRE(dag.AddConnection(low_index, output_index));
+  REQUIRE(dag.Finalize());
+
+  const std::vector<snd_seq_event_t> events = {
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 10),
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 70),
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 20)};
+  REQUIRE(dag.ProcessBatch(events));
+  REQUIRE_THAT(GetNotes(recorder_ptr->received),
+               Catch::Equals(std::vector<int>({10, 10, 70, 20, 20})));
+}
+
+snd_seq_event_t MakeControllerEvent(unsigned char channel, unsigned int param) {
+  snd_seq_event_t ev;
+  snd_seq_ev_clear(&ev);
+  ev.type = SND_SEQ_EVENT_CONTROLLER;
+  ev.data.control.channel = channel;
+  ev.data.control.param = param;
+  ev.data.control.value = 64;
+  return ev;
+}
+
+// Number of events generated by 'processor' for 'ev'.
+size_t NumOutputs(EventProcessor& processor, const snd_seq_event_t& ev) {
+  MidiEvent event;
+  FromSeqEvent(ev, &event);
+  EventBuffer output;
+  output.Reserve(4);
+  processor.ProcessEvent(event, &output);
+  return output.size();
+}
+
+TEST_CASE("Note selector") {
+  NoteSelector selector(10, 20, 5, 100);
+  selector.channels = {1, 3};
+  selector.types = {SND_SEQ_EVENT_NOTEON};
+  REQUIRE(selector.init());
+
+  snd_seq_event_t ev = MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 15);
+  ev.data.note.channel = 3;
+  REQUIRE(NumOutputs(selector, ev) == 1);
+
+  // Wrong channel.
+  ev.data.note.channel = 2;
+  REQUIRE(NumOutputs(selector, ev) == 0);
+  ev.data.note.channel = 1;
+
+  // Notes and velocities outside the ranges.
+  ev.data.note.note = 21;
+  REQUIRE(NumOutputs(selector, ev) == 0);
+  ev.data.note.note = 10;
+  REQUIRE(NumOutputs(selector, ev) == 1);
+  ev.data.note.velocity = 101;
+  REQUIRE(NumOutputs(selector, ev) == 0);
+  ev.data.note.velocity = 5;
+  REQUIRE(NumOutputs(selector, ev) == 1);
+
+  // Note event not in types.
+  ev.type = SND_SEQ_EVENT_NOTEOFF;
+  REQUIRE(NumOutputs(selector, ev) == 0);
+
+  // Non-note events go through.
+  REQUIRE(NumOutputs(selector, MakeControllerEvent(2, 7)) == 1);
+}
+
+TEST_CASE("Controller selector and mapping") {
+  ProcessorDAG dag;
+
+  auto selector = std::make_unique<ControllerSelector>();
+  selector->channels_ = {0, 9};
+  auto mapping = std::make_unique<ControllerMapping>();
+  mapping->channels_ = {9};
+  mapping->SetMapping(7, 20);
+  auto recorder = std::make_unique<EventRecorder>();
+  EventRecorder* recorder_ptr = recorder.get();
+
+  size_t input_index = dag.AddProcessor(std::make_unique<MidiInput>("blah", nullptr));
+  size_t selector_index = dag.AddProcessor(std::move(selector));
+  size_t mapping_index = dag.AddProcessor(std::move(mapping));
+  size_t output_index = dag.AddProcessor(std::move(recorder));
+  REQUIRE(dag.AddConnection(input_index, selector_index));
+  REQUIRE(dag.AddConnection(selector_index, mapping_index));
+  REQUIRE(dag.AddConnection(mapping_index, output_index));
+  REQUIRE(dag.Finalize());
+
+  const std::vector<snd_seq_event_t> events = {
+    MakeControllerEvent(0, 7),
+    MakeControllerEvent(1, 7),
+    MakeControllerEvent(9, 300),
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 10),
+    MakeControllerEvent(9, 7)};
+  REQUIRE(dag.ProcessBatch(events));
+  REQUIRE(recorder_ptr->received.size() == 2);
+  REQUIRE(recorder_ptr->received[0].channel == 0);
+  REQUIRE(recorder_ptr->received[0].data.control.param == 7);
+  REQUIRE(recorder_ptr->received[1].channel == 9);
+  REQUIRE(recorder_ptr->received[1].data.control.param == 20);
+}
+
+TEST_CASE("Optimizer") {
+  ProcessorDAG dag;
+
+  auto recorder1 = std::make_unique<EventRecorder>();
+  EventRecorder* recorder1_ptr = recorder1.get();
+  auto recorder2 = std::make_unique<EventRecorder>();
+  EventRecorder* recorder2_ptr = recorder2.get();
+  auto mapping = std::make_unique<ControllerMapping>();
+  mapping->SetMapping(7, 20);
+
+  size_t input_index = dag.AddProcessor(std::make_unique<MidiInput>("blah", nullptr));
+  // Lets everything through.
+  size_t all_index = dag.AddProcessor(std::make_unique<ControllerSelector>());
+  // Equivalent selectors with the same parent.
+  size_t low1_index = dag.AddProcessor(std::make_unique<NoteSelector>(0,64,0,127));
+  size_t low2_index = dag.AddProcessor(std::make_unique<NoteSelector>(0,64,0,127));
+  size_t mapping_index = dag.AddProcessor(std::move(mapping));
+  size_t output1_index = dag.AddProcessor(std::move(recorder1));
+  size_t output2_index = dag.AddProcessor(std::move(recorder2));
+
+  REQUIRE(dag.AddConnection(input_index, all_index));
+  REQUIRE(dag.AddConnection(all_index, low1_index));
+  REQUIRE(dag.AddConnection(all_index, low2_index));
+  REQUIRE(dag.AddConnection(low1_index, output1_index));
+  REQUIRE(dag.AddConnection(low2_index, mapping_index));
+  REQUIRE(dag.AddConnection(mapping_index, output2_index));
+  REQUIRE(dag.Finalize());
+
+  const OptimizerReport& report = dag.GetOptimizerReport();
+  REQUIRE(report.dropped_processors == 1);
+  REQUIRE(report.merged_processors == 1);
+  REQUIRE(report.fused_chains == 0);
+  REQUIRE_THAT(dag.GetEvaluationOrder(),
+               Catch::Equals(std::vector<size_t>({input_index, low1_index,
+                                                  mapping_index, output1_index,
+                                                  output2_index})));
+
+  const std::vector<snd_seq_event_t> events = {
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 10),
+    MakeControllerEvent(0, 7),
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 70)};
+  REQUIRE(dag.ProcessBatch(events));
+  REQUIRE(recorder1_ptr->received.size() == 2);
+  REQUIRE(recorder2_ptr->received.size() == 1);
+  REQUIRE(recorder2_ptr->received[0].data.control.param == 20);
+}
+
+TEST_CASE("Optimizer fuses chains") {
+  ProcessorDAG dag;
+
+  auto recorder = std::make_unique<EventRecorder>();
+  EventRecorder* recorder_ptr = recorder.get();
+  auto mapping = std::make_unique<ControllerMapping>();
+  mapping->SetMapping(7, 20);
+  auto selector = std::make_unique<ControllerSelector>();
+  selector->channels_ = {0};
+
+  size_t input_index = dag.AddProcessor(std::make_unique<MidiInput>("blah", nullptr));
+  size_t notes_index = dag.AddProcessor(std::make_unique<NoteSelector>(0,64,0,127));
+  size_t selector_index = dag.AddProcessor(std::move(selector));
+  size_t mapping_index = dag.AddProcessor(std::move(mapping));
+  size_t output_index = dag.AddProcessor(std::move(recorder));
+
+  REQUIRE(dag.AddConnection(input_index, notes_index));
+  REQUIRE(dag.AddConnection(notes_index, selector_index));
+  REQUIRE(dag.AddConnection(selector_index, mapping_index));
+  REQUIRE(dag.AddConnection(mapping_index, output_index));
+  REQUIRE(dag.Finalize());
+
+  REQUIRE(dag.GetOptimizerReport().fused_chains == 1);
+  REQUIRE(dag.GetOptimizerReport().fused_processors == 3);
+  REQUIRE_THAT(dag.GetEvaluationOrder(),
+               Catch::Equals(std::vector<size_t>({input_index, notes_index,
+                                                  output_index})));
+
+  const std::vector<snd_seq_event_t> events = {
+    MakeControllerEvent(0, 7),
+    MakeControllerEvent(1, 7),
+    MakeControllerEvent(0, 8)};
+  REQUIRE(dag.ProcessBatch(events));
+  REQUIRE(recorder_ptr->received.size() == 2);
+  REQUIRE(recorder_ptr->received[0].data.control.param == 20);
+  REQUIRE(recorder_ptr->received[1].data.control.param == 8);
+  recorder_ptr->received.clear();
+  REQUIRE(dag.ProcessEvent(MakeControllerEvent(0, 7)));
+  REQUIRE(recorder_ptr->received.size() == 1);
+}
+
+TEST_CASE("Latency histogram") {
+  for (uint64_t value : {0ull, 1ull, 15ull, 16ull, 17ull, 1000ull, 123456789ull,
+                         ~0ull}) {
+    size_t index = LatencyHistogram::BucketIndex(value);
+    REQUIRE(index < LatencyHistogram::kNumBuckets);
+    REQUIRE(LatencyHistogram::BucketUpperBound(index) >= value);
+    // Relative error is less than 1/16th.
+    REQUIRE(LatencyHistogram::BucketUpperBound(index) - value <= value / 16);
+  }
+
+  LatencyHistogram histogram;
+  for (uint64_t value = 1; value <= 1000; value++) {
+    histogram.Record(value);
+  }
+  REQUIRE(histogram.Count() == 1000);
+  REQUIRE(histogram.Max() == 1000);
+  REQUIRE(histogram.Percentile(0.5) >= 500);
+  REQUIRE(histogram.Percentile(0.5) <= 500 + 500 / 16);
+  REQUIRE(histogram.Percentile(0.999) >= 999);
+  REQUIRE(histogram.Percentile(1.0) == 1000);
+}
+
+TEST_CASE("Processor statistics") {
+  ProcessorDAG dag;
+  dag.EnableStats(true);
+
+  size_t input_index = dag.AddProcessor(std::make_unique<MidiInput>("blah", nullptr));
+  size_t low_index = dag.AddProcessor(std::make_unique<NoteSelector>(0,64,0,127));
+  size_t output_index = dag.AddProcessor(std::make_unique<EventRecorder>());
+  REQUIRE(dag.AddConnection(input_index, low_index));
+  REQUIRE(dag.AddConnection(low_index, output_index));
+  REQUIRE(dag.Finalize());
+
+  const std::vector<snd_seq_event_t> events = {
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 10),
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 70)};
+  REQUIRE(dag.ProcessBatch(events));
+  REQUIRE(dag.ProcessBatch(events));
+
+  REQUIRE(dag.GetGraphStats().batches == 2);
+  REQUIRE(dag.GetGraphStats().events == 4);
+  REQUIRE(dag.GetGraphStats().latency.Count() == 2);
+  REQUIRE(dag.GetProcessorStats(low_index).events_in == 4);
+  REQUIRE(dag.GetProcessorStats(low_index).events_out == 2);
+  REQUIRE(dag.GetProcessorStats(output_index).events_in == 2);
+  REQUIRE(dag.GetProcessorStats(low_index).latency.Count() == 2);
+}
+
+TEST_CASE("Output queue") {
+  SpscRing<MidiEvent> queue(3);
+  REQUIRE(queue.capacity() == 4);
+
+  ProcessorDAG dag;
+  size_t input_index = dag.AddProcessor(std::make_unique<MidiInput>("blah", nullptr));
+  size_t output_index = dag.AddProcessor(std::make_unique<MidiOutput>("blah", nullptr));
+  REQUIRE(dag.AddConnection(input_index, output_index));
+  REQUIRE(dag.Finalize());
+  auto output = static_cast<MidiOutput*>(dag.GetProcessor(output_index));
+  output->SetOutputQueue(&queue);
+
+  std::vector<snd_seq_event_t> events;
+  for (int note = 0; note < 6; note++) {
+    events.push_back(MakeNoteEvent(SND_SEQ_EVENT_NOTEON, note));
+  }
+  REQUIRE(dag.ProcessBatch(SendTo(dag, input_index, events)));
+  REQUIRE(queue.Size() == 4);
+  REQUIRE(output->dropped_events() == 2);
+
+  MidiEvent ev;
+  std::vector<MidiEvent> sent;
+  while (queue.TryPop(&ev)) {
+    REQUIRE(ev.port == output->port_num());
+    sent.push_back(ev);
+  }
+  REQUIRE(GetNotes(sent) == std::vector<int>({0, 1, 2, 3}));
+
+  // The ring wraps around.
+  REQUIRE(dag.ProcessBatch(SendTo(dag, input_index, {events[4], events[5]})));
+  sent.clear();
+  while (queue.TryPop(&ev)) {
+    sent.push_back(ev);
+  }
+  REQUIRE(GetNotes(sent) == std::vector<int>({4, 5}));
+}
+
+TEST_CASE("MidiEvent conversion") {
+  SeqEventEncoder encoder;
+  snd_seq_event_t encoded;
+
+  snd_seq_event_t ev = MakeControllerEvent(9, 300);
+  ev.data.control.value = -8000;
+  ev.dest.port = 3;
+  REQUIRE(NumMidiEvents(ev) == 1);
+  MidiEvent event;
+  FromSeqEvent(ev, &event);
+  REQUIRE(event.port == 3);
+  REQUIRE(event.channel == 9);
+  REQUIRE(encoder.Encode(event, &encoded));
+  REQUIRE(encoded.type == SND_SEQ_EVENT_CONTROLLER);
+  REQUIRE(encoded.data.control.channel == 9);
+  REQUIRE(encoded.data.control.param == 300);
+  REQUIRE(encoded.data.control.value == -8000);
+
+  // Sequencer events which are not midi messages.
+  snd_seq_ev_clear(&ev);
+  ev.type = SND_SEQ_EVENT_ECHO;
+  REQUIRE(NumMidiEvents(ev) == 0);
+
+  // Sysex messages are split into chunks.
+  std::vector<unsigned char> sysex = {0xf0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 0xf7};
+  snd_seq_ev_clear(&ev);
+  snd_seq_ev_set_sysex(&ev, sysex.size(), sysex.data());
+  REQUIRE(NumMidiEvents(ev) == 2);
+  MidiEvent chunks[2];
+  FromSeqEvent(ev, chunks);
+  REQUIRE(IsSysexContinuation(chunks[1]));
+  REQUIRE(!encoder.Encode(chunks[0], &encoded));
+  REQUIRE(encoder.Encode(chunks[1], &encoded));
+  REQUIRE(encoded.type == SND_SEQ_EVENT_SYSEX);
+  REQUIRE(encoded.data.ext.len == sysex.size());
+  const unsigned char* data = static_cast<const unsigned char*>(encoded.data.ext.ptr);
+  REQUIRE(std::vector<unsigned char>(data, data + sysex.size()) == sysex);
+
+  // Chunks without the start of their message are dropped.
+  REQUIRE(!encoder.Encode(chunks[1], &encoded));
+}
+
+TEST_CASE("Large batches are split") {
+  ProcessorDAG dag;
+
+  auto recorder = std::make_unique<EventRecorder>();
+  EventRecorder* recorder_ptr = recorder.get();
+  size_t input_index = dag.AddProcessor(std::make_unique<MidiInput>("blah", nullptr));
+  size_t low_index = dag.AddProcessor(std::make_unique<NoteSelector>(0,64,0,127));
+  size_t high_index = dag.AddProcessor(std::make_unique<NoteSelector>(65,127,0,127));
+  size_t output_index = dag.AddProcessor(std::move(recorder));
+  REQUIRE(dag.AddConnection(input_index, low_index));
+  REQUIRE(dag.AddConnection(input_index, high_index));
+  REQUIRE(dag.AddConnection(low_index, output_index));
+  REQUIRE(dag.AddConnection(high_index, output_index));
+  REQUIRE(dag.Finalize());
+  dag.Reserve(16);
+
+  std::vector<snd_seq_event_t> events;
+  std::vector<int> expected;
+  for (int i = 0; i < 100; i++) {
+    events.push_back(MakeNoteEvent(SND_SEQ_EVENT_NOTEON, (i * 37) % 128));
+    expected.push_back((i * 37) % 128);
+  }
+  REQUIRE(dag.ProcessBatch(SendTo(dag, input_index, events)));
+  REQUIRE(GetNotes(recorder_ptr->received) == expected);
+  REQUIRE(dag.GetGraphStats().dropped_events == 0);
+}
+
+TEST_CASE("Large sysex messages in a batch") {
+  ProcessorDAG dag;
+  auto recorder = std::make_unique<EventRecorder>();
+  EventRecorder* recorder_ptr = recorder.get();
+  size_t input_index = dag.AddProcessor(std::make_unique<MidiInput>("blah", nullptr));
+  size_t output_index = dag.AddProcessor(std::move(recorder));
+  REQUIRE(dag.AddConnection(input_index, output_index));
+  REQUIRE(dag.Finalize());
+
+  // Each message takes kMaxSysexChunks events, the input buffer has room
+  // for a batch and one of them.
+  std::vector<unsigned char> sysex(kMaxSysexSize, 0x55);
+  sysex.front() = 0xf0;
+  sysex.back() = 0xf7;
+  snd_seq_event_t sysex_ev;
+  snd_seq_ev_clear(&sysex_ev);
+  snd_seq_ev_set_sysex(&sysex_ev, sysex.size(), sysex.data());
+  std::vector<snd_seq_event_t> events;
+  for (int i = 0; i < 4; i++) {
+    events.push_back(MakeNoteEvent(SND_SEQ_EVENT_NOTEON, i));
+    events.push_back(sysex_ev);
+  }
+  REQUIRE(dag.ProcessBatch(events));
+
+  REQUIRE(recorder_ptr->received.size() == 4 * (1 + kMaxSysexChunks));
+  for (int i = 0; i < 4; i++) {
+    const MidiEvent* message = &recorder_ptr->received[i * (1 + kMaxSysexChunks)];
+    REQUIRE(message[0].type == SND_SEQ_EVENT_NOTEON);
+    REQUIRE(message[0].data.note.note == i);
+    REQUIRE(message[1].type == SND_SEQ_EVENT_SYSEX);
+    REQUIRE((message[1].flags & kSysexFirst) != 0);
+    REQUIRE((message[kMaxSysexChunks].flags & kSysexLast) != 0);
+  }
+  REQUIRE(dag.GetGraphStats().dropped_events == 0);
+}
+
+TEST_CASE("Only processors reached by events are run") {
+  // Numbers inputs, so that events can be sent to one of them.
+  PortRegistry ports(nullptr);
+  ProcessorDAG dag;
+  dag.EnableOptimizer(false);
+  dag.EnableStats(true);
+
+  auto recorder = std::make_unique<EventRecorder>();
+  EventRecorder* recorder_ptr = recorder.get();
+  size_t input1_index = dag.AddProcessor(std::make_unique<MidiInput>("in1", nullptr, &ports));
+  size_t input2_index = dag.AddProcessor(std::make_unique<MidiInput>("in2", nullptr, &ports));
+  size_t low_index = dag.AddProcessor(std::make_unique<NoteSelector>(0,64,0,127));
+  size_t high_index = dag.AddProcessor(std::make_unique<NoteSelector>(65,127,0,127));
+  size_t input2_notes_index = dag.AddProcessor(std::make_unique<NoteSelector>(0,127,0,127));
+  size_t output_index = dag.AddProcessor(std::move(recorder));
+  REQUIRE(dag.AddConnection(input1_index, low_index));
+  REQUIRE(dag.AddConnection(input1_index, high_index));
+  REQUIRE(dag.AddConnection(input2_index, input2_notes_index));
+  REQUIRE(dag.AddConnection(low_index, output_index));
+  REQUIRE(dag.AddConnection(high_index, output_index));
+  REQUIRE(dag.AddConnection(input2_notes_index, output_index));
+  REQUIRE(dag.Finalize());
+
+  REQUIRE(dag.ProcessBatch(SendTo(dag, input1_index, {
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 10),
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 20)})));
+  REQUIRE(GetNotes(recorder_ptr->received) == std::vector<int>({10, 20}));
+  // Nothing was received on the second input, and no high notes.
+  REQUIRE(dag.GetProcessorStats(input1_index).events_in == 2);
+  REQUIRE(dag.GetProcessorStats(input2_index).latency.Count() == 0);
+  REQUIRE(dag.GetProcessorStats(input2_notes_index).latency.Count() == 0);
+  REQUIRE(dag.GetProcessorStats(high_index).latency.Count() == 1);
+  REQUIRE(dag.GetProcessorStats(output_index).latency.Count() == 1);
+
+  // Events from the previous batch are not seen again by the output.
+  recorder_ptr->received.clear();
+  REQUIRE(dag.ProcessBatch(SendTo(dag, input2_index, {
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 30)})));
+  REQUIRE(GetNotes(recorder_ptr->received) == std::vector<int>({30}));
+  REQUIRE(dag.GetProcessorStats(low_index).latency.Count() == 1);
+  REQUIRE(dag.GetProcessorStats(input2_notes_index).events_in == 1);
+}
+
+TEST_CASE("Events which can't reach an output are skipped") {
+  ProcessorDAG dag;
+  dag.EnableOptimizer(false);
+  dag.EnableStats(true);
+
+  auto recorder = std::make_unique<EventRecorder>();
+  EventRecorder* recorder_ptr = recorder.get();
+  size_t input_index = dag.AddProcessor(std::make_unique<MidiInput>("blah", nullptr));
+  size_t mapping_index = dag.AddProcessor(std::make_unique<ControllerMapping>());
+  size_t output_index = dag.AddProcessor(std::move(recorder));
+  REQUIRE(dag.AddConnection(input_index, mapping_index));
+  REQUIRE(dag.AddConnection(mapping_index, output_index));
+  REQUIRE(dag.Finalize());
+
+  REQUIRE(dag.InputEventTypes().count() == 1);
+  REQUIRE(dag.InputEventTypes()[SND_SEQ_EVENT_CONTROLLER]);
+
+  snd_seq_event_t clock;
+  snd_seq_ev_clear(&clock);
+  clock.type = SND_SEQ_EVENT_CLOCK;
+  REQUIRE(dag.ProcessBatch(SendTo(dag, input_index, {
+    clock, MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 10)})));
+  REQUIRE(dag.GetProcessorStats(input_index).latency.Count() == 0);
+
+  REQUIRE(dag.ProcessBatch(SendTo(dag, input_index, {
+    clock, MakeControllerEvent(0, 7)})));
+  REQUIRE(dag.GetProcessorStats(mapping_index).events_in == 2);
+  REQUIRE(recorder_ptr->received.size() == 1);
+}
+
+TEST_CASE("Event types let through by processors") {
+  NoteSelector selector(0,127,0,127);
+  selector.types = {SND_SEQ_EVENT_NOTEON};
+  REQUIRE(selector.init());
+  EventTypeSet types;
+  types.set(SND_SEQ_EVENT_NOTEON);
+  types.set(SND_SEQ_EVENT_NOTEOFF);
+  types.set(SND_SEQ_EVENT_CLOCK);
+  EventTypeSet expected;
+  expected.set(SND_SEQ_EVENT_NOTEON);
+  expected.set(SND_SEQ_EVENT_CLOCK);
+  REQUIRE(selector.OutputTypes(types) == expected);
+
+  ControllerMapping mapping;
+  REQUIRE(mapping.init());
+  REQUIRE(mapping.OutputTypes(types).none());
+}
+
+TEST_CASE("Processor kinds") {
+  NoteSelector selector(0,127,0,127);
+  ControllerMapping mapping;
+  EventRecorder recorder;
+  REQUIRE(GetProcessorKind(&selector) == ProcessorKind::kNoteSelector);
+  REQUIRE(GetProcessorKind(&mapping) == ProcessorKind::kControllerMapping);
+  REQUIRE(GetProcessorKind(&recorder) == ProcessorKind::kOther);
+}
+
+TEST_CASE("Ports are kept across graphs") {
+  PortRegistry ports(nullptr);
+  ports.BeginGeneration();
+  MidiInput input("in", nullptr, &ports);
+  REQUIRE(input.init());
+  const int output_port = ports.Acquire("in", kOutputPortCaps);
+  const int other_port = ports.Acquire("other", kInputPortCaps);
+  REQUIRE(output_port != input.port_num());
+  REQUIRE(other_port != input.port_num());
+  ports.CommitGeneration();
+  REQUIRE(ports.NumPorts() == 3);
+
+  // A second port with the same name is a new one.
+  ports.BeginGeneration();
+  REQUIRE(ports.Acquire("in", kInputPortCaps) == input.port_num());
+  REQUIRE(ports.Acquire("in", kInputPortCaps) != input.port_num());
+  ports.AbortGeneration();
+  REQUIRE(ports.NumPorts() == 3);
+
+  // Ports not used anymore are deleted.
+  ports.BeginGeneration();
+  MidiInput new_input("in", nullptr, &ports);
+  REQUIRE(new_input.init());
+  REQUIRE(new_input.port_num() == input.port_num());
+  REQUIRE(ports.Acquire("in", kOutputPortCaps) == output_port);
+  ports.CommitGeneration();
+  REQUIRE(ports.NumPorts() == 2);
+}
+
+TEST_CASE("Graph slot") {
+  ProcessorDAG first;
+  ProcessorDAG second;
+  GraphSlot graphs(&first);
+
+  REQUIRE(graphs.Enter(GraphSlot::kProcessingReader) == &first);
+  REQUIRE(graphs.Publish(&second) == &first);
+  REQUIRE(graphs.current() == &second);
+  // The reader is still running a batch on the previous graph.
+  REQUIRE(graphs.InUse(&first));
+  graphs.Exit(GraphSlot::kProcessingReader);
+  REQUIRE(!graphs.InUse(&first));
+  REQUIRE(graphs.Enter(GraphSlot::kProcessingReader) == &second);
+  REQUIRE(graphs.InUse(&second));
+  graphs.Exit(GraphSlot::kProcessingReader);
+}
+
+// Thread which ran each task given to WorkerPool::Run().
+void RecordTaskThread(void* context, size_t i) {
+  (*static_cast<std::vector<std::thread::id>*>(context))[i] = std::this_thread::get_id();
+}
+
+TEST_CASE("Worker pool") {
+  std::vector<std::thread::id> threads(7);
+  WorkerPool pool;
+  // Without threads, all tasks run on the calling thread.
+  pool.Run(threads.size(), &RecordTaskThread, &threads);
+  REQUIRE(threads == std::vector<std::thread::id>(7, std::this_thread::get_id()));
+
+  REQUIRE(pool.Start(2, 0));
+  for (int run = 0; run < 10; run++) {
+    threads.assign(7, std::thread::id());
+    pool.Run(threads.size(), &RecordTaskThread, &threads);
+    for (size_t i = 0; i < threads.size(); i++) {
+      REQUIRE((threads[i] == std::this_thread::get_id()) == (i % 3 == 0));
+    }
+    REQUIRE(threads[1] == threads[4]);
+    REQUIRE(threads[2] == threads[5]);
+    REQUIRE(threads[1] != threads[2]);
+  }
+  pool.Stop();
+}
+
+TEST_CASE("Independent parts of the graph") {
+  PortRegistry ports(nullptr);
+  WorkerPool pool;
+  REQUIRE(pool.Start(1, 0));
+  ProcessorDAG dag;
+  dag.EnableOptimizer(false);
+  dag.SetWorkerPool(&pool);
+
+  auto recorder = std::make_unique<EventRecorder>();
+  EventRecorder* recorder_ptr = recorder.get();
+  size_t input1_index = dag.AddProcessor(std::make_unique<MidiInput>("in1", nullptr, &ports));
+  size_t input2_index = dag.AddProcessor(std::make_unique<MidiInput>("in2", nullptr, &ports));
+  size_t notes1_index = dag.AddProcessor(std::make_unique<NoteSelector>(0,127,0,127));
+  size_t notes2_index = dag.AddProcessor(std::make_unique<NoteSelector>(0,127,0,127));
+  size_t output_index = dag.AddProcessor(std::move(recorder));
+  REQUIRE(dag.AddConnection(input1_index, notes1_index));
+  REQUIRE(dag.AddConnection(input2_index, notes2_index));
+  REQUIRE(dag.AddConnection(notes1_index, output_index));
+  REQUIRE(dag.AddConnection(notes2_index, output_index));
+  REQUIRE(dag.Finalize());
+  // Both parts are only connected through the output.
+  REQUIRE(dag.NumPartitions() == 2);
+
+  std::vector<snd_seq_event_t> events;
+  for (unsigned char note = 10; note < 20; note++) {
+    events.push_back(SendTo(dag, note % 2 ? input2_index : input1_index, {
+      MakeNoteEvent(SND_SEQ_EVENT_NOTEON, note)})[0]);
+  }
+  for (int run = 0; run < 10; run++) {
+    recorder_ptr->received.clear();
+    REQUIRE(dag.ProcessBatch(events));
+    // Same order as when processing events one at a time.
+    REQUIRE(GetNotes(recorder_ptr->received)
+            == std::vector<int>({10, 11, 12, 13, 14, 15, 16, 17, 18, 19}));
+  }
+  dag.SetWorkerPool(nullptr);
+}
+
+TEST_CASE("Timer wheel") {
+  TimerWheel timers;
+  timers.Reserve(8);
+  std::vector<std::pair<uint64_t, uint32_t>> fired;
+  auto record = [&](uint32_t owner, const MidiEvent& ev) {
+    fired.emplace_back(timers.now(), owner);
+  };
+  MidiEvent ev = {};
+  REQUIRE(timers.Advance(1000, 100, record));
+  // Due times spread over several levels, with two events due together.
+  REQUIRE(timers.Add(300000, 1, ev));
+  REQUIRE(timers.Add(5000, 2, ev));
+  REQUIRE(timers.Add(70, 3, ev));
+  REQUIRE(timers.Add(5, 4, ev));
+  REQUIRE(timers.Add(0, 5, ev));
+  REQUIRE(timers.Add(70, 6, ev));
+  REQUIRE(timers.size() == 6);
+  REQUIRE(timers.NextTick() == 1001);
+
+  REQUIRE(timers.Advance(1069, 100, record));
+  REQUIRE(fired == std::vector<std::pair<uint64_t, uint32_t>>({{1001, 5}, {1005, 4}}));
+  fired.clear();
+  // Stops after one event, the other one due at the same time comes next.
+  REQUIRE(!timers.Advance(2000, 1, record));
+  REQUIRE(timers.Advance(2000, 100, record));
+  REQUIRE(fired == std::vector<std::pair<uint64_t, uint32_t>>({{1070, 3}, {1070, 6}}));
+  fired.clear();
+  REQUIRE(timers.Add(4000, 7, ev));
+  REQUIRE(timers.Advance(1000000, 100, record));
+  REQUIRE(fired == std::vector<std::pair<uint64_t, uint32_t>>(
+      {{6000, 2}, {6000, 7}, {301000, 1}}));
+  REQUIRE(timers.size() == 0);
+  REQUIRE(timers.NextTick() == std::numeric_limits<uint64_t>::max());
+
+  for (uint32_t i = 0; i < 8; i++) {
+    REQUIRE(timers.Add(i, i, ev));
+  }
+  REQUIRE(!timers.Add(1, 8, ev));
+
+  // Events added on each tick, due across slot boundaries of all levels.
+  TimerWheel ticks;
+  ticks.Reserve(16);
+  size_t late_events = 0;
+  size_t fired_events = 0;
+  for (uint32_t tick = 4000; tick < 5000; tick++) {
+    ticks.Advance(tick, 100, [&](uint32_t due, const MidiEvent& ev) {
+      late_events += ticks.now() != due;
+      fired_events++;
+    });
+    ticks.Add(3, tick + 3, ev);
+  }
+  REQUIRE(late_events == 0);
+  REQUIRE(fired_events == 997);
+}
+
+// Builds input -> 'processor' -> recorder, returns the input index.
+size_t MakeTimedGraph(ProcessorDAG& dag, std::unique_ptr<EventProcessor> processor,
+                      std::unique_ptr<EventProcessor> recorder) {
+  size_t input_index = dag.AddProcessor(std::make_unique<MidiInput>("in", nullptr));
+  size_t processor_index = dag.AddProcessor(std::move(processor));
+  size_t output_index = dag.AddProcessor(std::move(recorder));
+  REQUIRE(dag.AddConnection(input_index, processor_index));
+  REQUIRE(dag.AddConnection(processor_index, output_index));
+  REQUIRE(dag.Finalize());
+  return input_index;
+}
+
+std::vector<int> GetVelocities(const std::vector<MidiEvent>& events) {
+  std::vector<int> velocities;
+  for (const auto& ev: events) {
+    velocities.push_back(ev.data.note.velocity);
+  }
+  return velocities;
+}
+
+TEST_CASE("Delay") {
+  ProcessorDAG dag;
+  auto recorder = std::make_unique<EventRecorder>();
+  EventRecorder* recorder_ptr = recorder.get();
+  size_t input_index = MakeTimedGraph(dag, std::make_unique<Delay>(100), std::move(recorder));
+  REQUIRE(dag.NextTimer() == std::numeric_limits<uint64_t>::max());
+
+  REQUIRE(dag.ProcessTimers(1000));
+  REQUIRE(dag.ProcessBatch(SendTo(dag, input_index, {
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 60)})));
+  REQUIRE(recorder_ptr->received.empty());
+  // Start of the wheel slot holding the event, at most its due time.
+  REQUIRE(dag.NextTimer() > 1000);
+  REQUIRE(dag.NextTimer() <= 1100);
+  REQUIRE(dag.ProcessTimers(1099));
+  REQUIRE(recorder_ptr->received.empty());
+  REQUIRE(dag.ProcessTimers(1100));
+  REQUIRE(GetNotes(recorder_ptr->received) == std::vector<int>({60}));
+}
+
+TEST_CASE("Echo") {
+  ProcessorDAG dag;
+  auto recorder = std::make_unique<EventRecorder>();
+  EventRecorder* recorder_ptr = recorder.get();
+  auto echo = std::make_unique<Delay>(50);
+  echo->dry = true;
+  echo->repeats = 1;
+  echo->decay_percent = 50;
+  size_t input_index = MakeTimedGraph(dag, std::move(echo), std::move(recorder));
+
+  REQUIRE(dag.ProcessTimers(1000));
+  REQUIRE(dag.ProcessBatch(SendTo(dag, input_index, {
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 60)})));
+  REQUIRE(GetVelocities(recorder_ptr->received) == std::vector<int>({100}));
+  // Late call: both repeats are due.
+  REQUIRE(dag.ProcessTimers(1200));
+  REQUIRE(GetVelocities(recorder_ptr->received) == std::vector<int>({100, 50, 25}));
+}
+
+TEST_CASE("Note length") {
+  ProcessorDAG dag;
+  auto recorder = std::make_unique<EventRecorder>();
+  EventRecorder* recorder_ptr = recorder.get();
+  size_t input_index = MakeTimedGraph(dag, std::make_unique<NoteLength>(30),
+                                      std::move(recorder));
+
+  REQUIRE(dag.ProcessTimers(1000));
+  REQUIRE(dag.ProcessBatch(SendTo(dag, input_index, {
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 60),
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEOFF, 60)})));
+  REQUIRE(recorder_ptr->received.size() == 1);
+  REQUIRE(dag.ProcessTimers(1030));
+  REQUIRE(recorder_ptr->received.size() == 2);
+  REQUIRE(recorder_ptr->received[1].type == SND_SEQ_EVENT_NOTEOFF);
+  REQUIRE(recorder_ptr->received[1].data.note.note == 60);
+}
+
+TEST_CASE("Note length across a reload") {
+  auto first = std::make_unique<ProcessorDAG>();
+  auto first_recorder = std::make_unique<EventRecorder>();
+  EventRecorder* first_recorder_ptr = first_recorder.get();
+  size_t input_index = MakeTimedGraph(*first, std::make_unique<NoteLength>(30),
+                                      std::move(first_recorder));
+  GraphSlot graphs(first.get());
+  REQUIRE(first->ProcessTimers(1000));
+  REQUIRE(first->ProcessBatch(SendTo(*first, input_index, {
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 60)})));
+
+  // Reloaded while the note-off is pending, as ConfigReloader::Reload()
+  // does.
+  ProcessorDAG second;
+  auto second_recorder = std::make_unique<EventRecorder>();
+  EventRecorder* second_recorder_ptr = second_recorder.get();
+  input_index = MakeTimedGraph(second, std::make_unique<NoteLength>(10),
+                               std::move(second_recorder));
+  second.RunTimersOf(graphs.current());
+  REQUIRE(graphs.Publish(&second) == first.get());
+  REQUIRE(!graphs.InUse(first.get()));
+  REQUIRE(!second.PreviousTimersDone());
+
+  ProcessorDAG* dag = graphs.Enter(GraphSlot::kProcessingReader);
+  REQUIRE(dag == &second);
+  REQUIRE(dag->NextTimer() <= 1030);
+  REQUIRE(dag->ProcessTimers(1010));
+  REQUIRE(dag->ProcessBatch(SendTo(*dag, input_index, {
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 62)})));
+  REQUIRE(dag->ProcessTimers(1029));
+  REQUIRE(first_recorder_ptr->received.size() == 1);
+  REQUIRE(GetNotes(second_recorder_ptr->received) == std::vector<int>({62, 62}));
+  graphs.Exit(GraphSlot::kProcessingReader);
+  REQUIRE(!second.PreviousTimersDone());
+
+  // The note-off is sent on time by the previous graph.
+  dag = graphs.Enter(GraphSlot::kProcessingReader);
+  REQUIRE(dag->ProcessTimers(1030));
+  graphs.Exit(GraphSlot::kProcessingReader);
+  REQUIRE(first_recorder_ptr->received.size() == 2);
+  REQUIRE(first_recorder_ptr->received[1].type == SND_SEQ_EVENT_NOTEOFF);
+  REQUIRE(first_recorder_ptr->received[1].data.note.note == 60);
+  REQUIRE(second.PreviousTimersDone());
+  REQUIRE(second.NextTimer() == std::numeric_limits<uint64_t>::max());
+  first.reset();
+  REQUIRE(second.ProcessTimers(1100));
+}
+
+std::vector<int> GetControllerValues(const std::vector<MidiEvent>& events) {
+  std::vector<int> values;
+  for (const auto& ev: events) {
+    values.push_back(ev.data.control.value);
+  }
+  return values;
+}
+
+snd_seq_event_t MakeControllerValue(unsigned int param, int value) {
+  snd_seq_event_t ev = MakeControllerEvent(0, param);
+  ev.data.control.value = value;
+  return ev;
+}
+
+TEST_CASE("Controller filter") {
+  ProcessorDAG dag;
+  auto recorder = std::make_unique<EventRecorder>();
+  EventRecorder* recorder_ptr = recorder.get();
+  auto filter = std::make_unique<ControllerFilter>();
+  filter->threshold = 3;
+  size_t input_index = MakeTimedGraph(dag, std::move(filter), std::move(recorder));
+
+  REQUIRE(dag.ProcessBatch(SendTo(dag, input_index, {
+    MakeControllerValue(7, 64), MakeControllerValue(7, 64),
+    MakeControllerValue(7, 65), MakeControllerValue(7, 67),
+    // Other controllers have their own last value.
+    MakeControllerValue(8, 65),
+    // Extremes are always sent.
+    MakeControllerValue(7, 125), MakeControllerValue(7, 126), MakeControllerValue(7, 127),
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 60), MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 60)})));
+  REQUIRE(recorder_ptr->received.size() == 7);
+  REQUIRE(GetControllerValues(std::vector<MidiEvent>(
+      recorder_ptr->received.begin(), recorder_ptr->received.begin() + 5))
+          == std::vector<int>({64, 67, 65, 125, 127}));
+}
+
+TEST_CASE("Controller rate limit") {
+  ProcessorDAG dag;
+  auto recorder = std::make_unique<EventRecorder>();
+  EventRecorder* recorder_ptr = recorder.get();
+  auto filter = std::make_unique<ControllerFilter>();
+  filter->max_events = 2;
+  filter->interval_ms = 10;
+  size_t input_index = MakeTimedGraph(dag, std::move(filter), std::move(recorder));
+
+  REQUIRE(dag.ProcessTimers(1000));
+  REQUIRE(dag.ProcessBatch(SendTo(dag, input_index, {
+    MakeControllerValue(7, 1), MakeControllerValue(7, 2),
+    MakeControllerValue(7, 3), MakeControllerValue(7, 4),
+    MakeControllerValue(8, 5)})));
+  REQUIRE(GetControllerValues(recorder_ptr->received) == std::vector<int>({1, 2, 5}));
+  REQUIRE(dag.ProcessTimers(1005));
+  REQUIRE(dag.ProcessBatch(SendTo(dag, input_index, {MakeControllerValue(7, 6)})));
+  REQUIRE(recorder_ptr->received.size() == 3);
+  // The last value is sent at the end of the interval, and starts a new
+  // one.
+  REQUIRE(dag.ProcessTimers(1010));
+  REQUIRE(GetControllerValues(recorder_ptr->received) == std::vector<int>({1, 2, 5, 6}));
+  REQUIRE(dag.ProcessBatch(SendTo(dag, input_index, {
+    MakeControllerValue(7, 7), MakeControllerValue(7, 8)})));
+  REQUIRE(GetControllerValues(recorder_ptr->received) == std::vector<int>({1, 2, 5, 6, 7}));
+  // Back to the value sent before the end of the interval: nothing to send.
+  REQUIRE(dag.ProcessBatch(SendTo(dag, input_index, {MakeControllerValue(7, 7)})));
+  REQUIRE(dag.ProcessTimers(1020));
+  REQUIRE(recorder_ptr->received.size() == 5);
+}
+
+std::vector<int> GetTypes(const std::vector<MidiEvent>& events) {
+  std::vector<int> types;
+  for (const auto& ev: events) {
+    types.push_back(ev.type);
+  }
+  return types;
+}
+
+// Lua processor defined by 'table', the source of its Lua table, in a
+// state owned by the caller.
+std::unique_ptr<LuaProcessor> MakeLuaProcessor(lua_State *L, const std::string& table,
+                                               size_t max_input_events) {
+  REQUIRE(luaL_loadstring(L, ("return " + table).c_str()) == LUA_OK);
+  REQUIRE(lua_pcall(L, 0, 1, 0) == LUA_OK);
+  auto processor = std::make_unique<LuaProcessor>(L);
+  REQUIRE(processor->InitFromLua(L, -1));
+  lua_pop(L, 1);
+  processor->Reserve(max_input_events);
+  return processor;
+}
+
+// Runs 'processor' on 'events' as a single batch.
+std::vector<MidiEvent> ProcessWith(EventProcessor& processor,
+                                   const std::vector<snd_seq_event_t>& events) {
+  size_t size = 0;
+  for (const auto& ev: events) {
+    size += NumMidiEvents(ev);
+  }
+  EventBuffer input;
+  input.Reserve(size);
+  for (size_t i = 0; i < events.size(); i++) {
+    FromSeqEvent(events[i], input.Append(NumMidiEvents(events[i]), i));
+  }
+  EventBuffer output;
+  output.Reserve(size);
+  processor.ProcessBatch(input, &output);
+  return std::vector<MidiEvent>(output.begin(), output.end());
+}
+
+std::string GetStats(EventProcessor& processor) {
+  std::ostringstream stats;
+  processor.PrintStats(stats);
+  return stats.str();
+}
+
+TEST_CASE("Lua processor") {
+  std::unique_ptr<lua_State, decltype(&lua_close)> state(luaL_newstate(), lua_close);
+  lua_State *L = state.get();
+  luaL_openlibs(L);
+  auto processor = MakeLuaProcessor(L, R"({process = function(ev)
+    if ev.note == 60 then return false end
+    if ev.note == 61 then ev.drop = true end
+    ev.note = ev.note + 12
+    ev.velocity = 1
+    ev.channel = 3
+  end})", 16);
+
+  std::vector<unsigned char> sysex = {0xf0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 0xf7};
+  snd_seq_event_t sysex_ev;
+  snd_seq_ev_clear(&sysex_ev);
+  snd_seq_ev_set_sysex(&sysex_ev, sysex.size(), sysex.data());
+  const std::vector<MidiEvent> output = ProcessWith(*processor, {
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 59), MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 60),
+    sysex_ev, MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 61),
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEOFF, 62)});
+  REQUIRE(GetTypes(output) == std::vector<int>({SND_SEQ_EVENT_NOTEON, SND_SEQ_EVENT_SYSEX,
+                                                SND_SEQ_EVENT_SYSEX, SND_SEQ_EVENT_NOTEOFF}));
+  REQUIRE(output[0].data.note.note == 71);
+  REQUIRE(output[0].data.note.velocity == 1);
+  REQUIRE(output[0].channel == 3);
+  // Sysex chunks are not given to the function.
+  REQUIRE(output[1].flags == (kSysexChunkSize | kSysexFirst));
+  REQUIRE(memcmp(output[1].data.sysex, sysex.data(), kSysexChunkSize) == 0);
+  REQUIRE(output[2].flags == (3 | kSysexLast));
+  REQUIRE(memcmp(output[2].data.sysex, sysex.data() + kSysexChunkSize, 3) == 0);
+  REQUIRE(output[3].data.note.note == 74);
+  REQUIRE(GetStats(*processor).find("calls=4 overruns=0 errors=0") != std::string::npos);
+}
+
+TEST_CASE("Lua processor field checks") {
+  std::unique_ptr<lua_State, decltype(&lua_close)> state(luaL_newstate(), lua_close);
+  lua_State *L = state.get();
+  luaL_openlibs(L);
+  // Event n sets a field to a value, as given by the n-th element of
+  // 'sets'.
+  auto processor = MakeLuaProcessor(L, R"({process = function(ev)
+    local sets = {
+      {"type", 7}, {"type", 0}, {"type", 255}, {"type", 130},
+      {"channel", 15}, {"channel", 16}, {"channel", -1},
+      {"port", 1},
+      {"note", 127}, {"note", 128}, {"note", 300},
+      {"velocity", 0}, {"velocity", 200}, {"off_velocity", -1},
+      {"param", 16383}, {"param", 16384},
+    }
+    local set = sets[ev.note]
+    ev[set[1]] = set[2]
+  end})", 16);
+
+  std::vector<snd_seq_event_t> events;
+  for (int i = 1; i <= 16; i++) {
+    events.push_back(MakeNoteEvent(SND_SEQ_EVENT_NOTEON, i));
+  }
+  // Events setting invalid values are dropped: types which aren't event
+  // types, or sysex which is made of several events, channels, notes and
+  // velocities out of MIDI ranges, and the port.
+  const std::vector<MidiEvent> output = ProcessWith(*processor, events);
+  REQUIRE(output.size() == 5);
+  REQUIRE(output[0].type == SND_SEQ_EVENT_NOTEOFF);
+  REQUIRE(output[1].channel == 15);
+  REQUIRE(output[2].data.note.note == 127);
+  REQUIRE(output[3].data.note.velocity == 0);
+  REQUIRE(output[4].data.control.param == 16383);
+  REQUIRE(GetStats(*processor).find("calls=16 overruns=0 errors=11") != std::string::npos);
+}
+
+TEST_CASE("Lua processor batches") {
+  std::unique_ptr<lua_State, decltype(&lua_close)> state(luaL_newstate(), lua_close);
+  lua_State *L = state.get();
+  luaL_openlibs(L);
+  // Numbers events in each call, drops every other one.
+  auto processor = MakeLuaProcessor(L, R"({process_batch = function(batch)
+    for i = 1, #batch do
+      batch[i].value = i
+      batch[i].drop = i % 2 == 0
+    end
+    assert(batch[#batch + 1] == nil)
+  end})", 3);
+
+  std::vector<unsigned char> sysex = {0xf0, 1, 0xf7};
+  snd_seq_event_t sysex_ev;
+  snd_seq_ev_clear(&sysex_ev);
+  snd_seq_ev_set_sysex(&sysex_ev, sysex.size(), sysex.data());
+  std::vector<snd_seq_event_t> events(7, MakeControllerValue(7, 0));
+  events.insert(events.begin() + 1, sysex_ev);
+  // Split in batches of 3.
+  const std::vector<MidiEvent> output = ProcessWith(*processor, events);
+  REQUIRE(GetTypes(output) == std::vector<int>({
+    SND_SEQ_EVENT_CONTROLLER, SND_SEQ_EVENT_SYSEX, SND_SEQ_EVENT_CONTROLLER,
+    SND_SEQ_EVENT_CONTROLLER, SND_SEQ_EVENT_CONTROLLER, SND_SEQ_EVENT_CONTROLLER}));
+  REQUIRE(GetControllerValues({output[0], output[2], output[3], output[4], output[5]})
+          == std::vector<int>({1, 3, 1, 3, 1}));
+  REQUIRE(GetStats(*processor).find("calls=3 overruns=0 errors=0") != std::string::npos);
+}
+
+TEST_CASE("Lua processor budget") {
+  std::unique_ptr<lua_State, decltype(&lua_close)> state(luaL_newstate(), lua_close);
+  lua_State *L = state.get();
+  luaL_openlibs(L);
+  const std::vector<snd_seq_event_t> events = {
+    MakeControllerValue(7, 1), MakeControllerValue(7, 2), MakeControllerValue(7, 3)};
+  const std::string loop = "= function(ev) ev.value = 0 while ev.value >= 0 do end end";
+
+  auto drop = MakeLuaProcessor(L, "{budget = 100, on_error = \"drop\", process" + loop + "}", 4);
+  REQUIRE(ProcessWith(*drop, events).empty());
+  REQUIRE(GetStats(*drop).find("calls=3 overruns=3 errors=0") != std::string::npos);
+
+  // Events are passed as they were before the call.
+  auto pass = MakeLuaProcessor(L, "{budget = 100, on_error = \"pass\", process" + loop + "}", 4);
+  REQUIRE(GetControllerValues(ProcessWith(*pass, events)) == std::vector<int>({1, 2, 3}));
+  REQUIRE(GetStats(*pass).find("calls=3 overruns=3 errors=0") != std::string::npos);
+
+  auto batch = MakeLuaProcessor(
+      L, "{budget = 100, on_error = \"pass\", process_batch"
+         "= function(batch) batch[1].value = 0 while true do end end}", 4);
+  REQUIRE(GetControllerValues(ProcessWith(*batch, events)) == std::vector<int>({1, 2, 3}));
+  REQUIRE(GetStats(*batch).find("calls=1 overruns=1 errors=0") != std::string::npos);
+}
+
+TEST_CASE("Event arena") {
+  EventArena arena;
+  arena.Reset(EventArena::BufferSize(10) + EventArena::BufferSize(3));
+  EventBuffer first;
+  EventBuffer second;
+  REQUIRE(first.Reserve(10, &arena));
+  REQUIRE(second.Reserve(3, &arena));
+  REQUIRE(arena.size() == arena.capacity());
+  // Each buffer starts on its own cache line, right after the previous one.
+  REQUIRE(reinterpret_cast<uintptr_t>(first.begin()) % 64 == 0);
+  REQUIRE(reinterpret_cast<const char*>(second.begin())
+          == reinterpret_cast<const char*>(first.begin()) + EventArena::BufferSize(10));
+
+  MidiEvent ev = {};
+  for (int i = 0; i < 11; i++) {
+    ev.port = i;
+    first.push_back(ev, i);
+  }
+  ev.port = 100;
+  second.push_back(ev, 7);
+  REQUIRE(first.size() == 10);
+  REQUIRE(first.dropped() == 1);
+  REQUIRE(first.event(9).port == 9);
+  REQUIRE(first.origin(9) == 9);
+  REQUIRE(second.event(0).port == 100);
+  REQUIRE(second.origin(0) == 7);
+
+  EventBuffer third;
+  REQUIRE(!third.Reserve(1, &arena));
+  REQUIRE(third.capacity() == 0);
+  REQUIRE(third.Reserve(0, &arena));
+}
+
+TEST_CASE("Event buffers are shared") {
+  ProcessorDAG dag;
+  dag.EnableOptimizer(false);
+  auto recorder = std::make_unique<EventRecorder>();
+  EventRecorder* recorder_ptr = recorder.get();
+  size_t input_index = dag.AddProcessor(std::make_unique<MidiInput>("in", nullptr));
+  size_t low_index = dag.AddProcessor(std::make_unique<NoteSelector>(0,64,0,127));
+  size_t high_index = dag.AddProcessor(std::make_unique<NoteSelector>(65,127,0,127));
+  REQUIRE(dag.AddConnection(input_index, low_index));
+  REQUIRE(dag.AddConnection(input_index, high_index));
+  // Chain after the merge, each processor only needing its parent's
+  // buffer.
+  size_t previous_index = dag.AddProcessor(std::make_unique<NoteSelector>(0,127,0,127));
+  REQUIRE(dag.AddConnection(low_index, previous_index));
+  REQUIRE(dag.AddConnection(high_index, previous_index));
+  for (int i = 0; i < 10; i++) {
+    size_t index = dag.AddProcessor(std::make_unique<NoteSelector>(0,127,0,127));
+    REQUIRE(dag.AddConnection(previous_index, index));
+    previous_index = index;
+  }
+  size_t output_index = dag.AddProcessor(std::move(recorder));
+  REQUIRE(dag.AddConnection(previous_index, output_index));
+  REQUIRE(dag.Finalize());
+
+  // Input batch, merged events (twice the size) and the buffers of the
+  // widest point: both selectors, and the merge input, which is taken
+  // over by the chain. The last processor keeps its buffer for the
+  // output. With a buffer per processor, that would be 25.
+  const size_t batch_size = EventArena::BufferSize(kDefaultMaxBatchSize + kMaxSysexChunks);
+  REQUIRE(dag.EventMemorySize() <= 10 * batch_size);
+
+  const std::vector<snd_seq_event_t> events = SendTo(dag, input_index, {
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 70),
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 10),
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEOFF, 70),
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEOFF, 10)});
+  for (int run = 0; run < 3; run++) {
+    recorder_ptr->received.clear();
+    REQUIRE(dag.ProcessBatch(events));
+    REQUIRE(GetNotes(recorder_ptr->received) == std::vector<int>({70, 10, 70, 10}));
+  }
+}
+
+TEST_CASE("Processing doesn't allocate") {
+  PortRegistry ports(nullptr);
+  WorkerPool pool;
+  REQUIRE(pool.Start(1, 0));
+  ProcessorDAG dag;
+  dag.SetWorkerPool(&pool);
+  auto recorder = std::make_unique<EventRecorder>();
+  EventRecorder* recorder_ptr = recorder.get();
+  recorder_ptr->received.reserve(10000);
+  size_t input1_index = dag.AddProcessor(std::make_unique<MidiInput>("in1", nullptr, &ports));
+  size_t input2_index = dag.AddProcessor(std::make_unique<MidiInput>("in2", nullptr, &ports));
+  size_t low_index = dag.AddProcessor(std::make_unique<NoteSelector>(0,64,0,127));
+  size_t high_index = dag.AddProcessor(std::make_unique<NoteSelector>(65,127,0,127));
+  auto echo = std::make_unique<Delay>(10);
+  echo->dry = true;
+  echo->repeats = 2;
+  size_t echo_index = dag.AddProcessor(std::move(echo));
+  size_t output_index = dag.AddProcessor(std::move(recorder));
+  REQUIRE(dag.AddConnection(input1_index, low_index));
+  REQUIRE(dag.AddConnection(input1_index, high_index));
+  REQUIRE(dag.AddConnection(low_index, echo_index));
+  REQUIRE(dag.AddConnection(high_index, echo_index));
+  REQUIRE(dag.AddConnection(input2_index, output_index));
+  REQUIRE(dag.AddConnection(echo_index, output_index));
+  REQUIRE(dag.Finalize());
+
+  std::vector<snd_seq_event_t> events;
+  for (unsigned char note = 0; note < 100; note++) {
+    events.push_back(SendTo(dag, note % 3 ? input1_index : input2_index, {
+      MakeNoteEvent(SND_SEQ_EVENT_NOTEON, note)})[0]);
+  }
+  std::vector<MidiEvent> converted(events.size());
+  for (size_t i = 0; i < events.size(); i++) {
+    FromSeqEvent(events[i], &converted[i]);
+  }
+
+  // Nothing is allocated from the first batch on, including for merges,
+  // timers and batches larger than the buffers.
+  bool processed = true;
+  size_t allocations;
+  {
+    AllocationCounter counter;
+    for (uint64_t now_ms = 1000; now_ms < 1100; now_ms += 5) {
+      processed &= dag.ProcessTimers(now_ms);
+      processed &= dag.ProcessBatch(std::span<const snd_seq_event_t>(events).first(now_ms % 7));
+      processed &= dag.ProcessBatch(std::span<const MidiEvent>(converted).first(now_ms % 11));
+    }
+    processed &= dag.ProcessBatch(std::span<const snd_seq_event_t>(events));
+    processed &= dag.ProcessTimers(1200);
+    allocations = counter.count();
+  }
+  REQUIRE(processed);
+  REQUIRE(allocations == 0);
+  REQUIRE(recorder_ptr->received.size() > 100);
+
+  // Sizing buffers does allocate.
+  size_t reserve_allocations;
+  {
+    AllocationCounter counter;
+    dag.Reserve(16);
+    reserve_allocations = counter.count();
+    processed &= dag.ProcessBatch(std::span<const snd_seq_event_t>(events));
+    processed &= dag.ProcessTimers(1300);
+    allocations = counter.count() - reserve_allocations;
+  }
+  REQUIRE(processed);
+  REQUIRE(reserve_allocations > 0);
+  REQUIRE(allocations == 0);
+  dag.SetWorkerPool(nullptr);
+}
+
+// Input of the graph getting all events, whatever their port.
+class EventSource: public EventProcessor {
+public:
+  virtual bool HasInputs() override { return false; }
+  virtual bool HasOutputs() override { return true; }
+
+  virtual void ProcessEvent(const MidiEvent& ev, EventBuffer* output) override {
+    output->Emit(ev);
+  }
+};
+
+// Runs 'capture' through source -> echo -> recorder, fast or not.
+std::vector<MidiEvent> ReplayThroughEcho(const CaptureReader& capture, bool real_time) {
+  ProcessorDAG dag;
+  auto recorder = std::make_unique<EventRecorder>();
+  EventRecorder* recorder_ptr = recorder.get();
+  auto echo = std::make_unique<Delay>(3);
+  echo->dry = true;
+  echo->repeats = 1;
+  echo->decay_percent = 50;
+  size_t source_index = dag.AddProcessor(std::make_unique<EventSource>());
+  size_t echo_index = dag.AddProcessor(std::move(echo));
+  size_t output_index = dag.AddProcessor(std::move(recorder));
+  REQUIRE(dag.AddConnection(source_index, echo_index));
+  REQUIRE(dag.AddConnection(echo_index, output_index));
+  REQUIRE(dag.Finalize());
+  size_t batches = 0;
+  REQUIRE(ReplayCapture(capture, &dag, real_time, [&batches]() { batches++; }));
+  REQUIRE(batches > 0);
+  return recorder_ptr->received;
+}
+
+// Bit-for-bit comparison of events.
+bool SameEvents(const std::vector<MidiEvent>& a, const std::vector<MidiEvent>& b) {
+  return a.size() == b.size()
+      && (a.empty() || memcmp(a.data(), b.data(), a.size() * sizeof(MidiEvent)) == 0);
+}
+
+// Writes 'num_events' alternating note-ons and note-offs to a new capture
+// file, read in pairs 100us apart. Returns the file name.
+std::string WriteTestCapture(size_t num_events) {
+  char filename[] = "/tmp/midiflume_capture_XXXXXX";
+  const int fd = mkstemp(filename);
+  REQUIRE(fd >= 0);
+  close(fd);
+  CaptureWriter writer;
+  REQUIRE(writer.Open(filename));
+  bool ok = true;
+  for (size_t i = 0; i < num_events; i++) {
+    snd_seq_event_t ev = MakeNoteEvent(i % 2 ? SND_SEQ_EVENT_NOTEOFF : SND_SEQ_EVENT_NOTEON,
+                                       i % 128);
+    ok = writer.Append(ev, 5000000000 + i / 2 * 100000) && ok;
+  }
+  REQUIRE(ok);
+  REQUIRE(writer.num_records() == num_events);
+  REQUIRE(writer.dropped_events() == 0);
+  return filename;
+}
+
+TEST_CASE("Capture and replay") {
+  // Enough records for the file to grow.
+  const size_t num_events = 100000;
+  const std::string filename = WriteTestCapture(num_events);
+  CaptureReader reader;
+  REQUIRE(reader.Open(filename));
+  REQUIRE(reader.size() == num_events);
+  REQUIRE(reader.record(3).time_ns == 5000000000 + 100000);
+  REQUIRE(reader.record(3).event.type == SND_SEQ_EVENT_NOTEOFF);
+  REQUIRE(reader.record(3).event.data.note.note == 3);
+
+  std::vector<MidiEvent> replayed = ReplayThroughEcho(reader, false);
+  REQUIRE(replayed.size() == 3 * num_events);
+  REQUIRE(SameEvents(replayed, ReplayThroughEcho(reader, false)));
+  unlink(filename.c_str());
+
+  // Same output in real time, here for 20ms.
+  const std::string short_filename = WriteTestCapture(400);
+  CaptureReader short_reader;
+  REQUIRE(short_reader.Open(short_filename));
+  REQUIRE(SameEvents(ReplayThroughEcho(short_reader, true),
+                     ReplayThroughEcho(short_reader, false)));
+  unlink(short_filename.c_str());
+
+  CaptureReader invalid;
+  REQUIRE(!invalid.Open("dag_test.cc"));
+}
+
+// Returns the name of a new empty file in /tmp.
+std::string MakeTestFile() {
+  char filename[] = "/tmp/midiflume_test_XXXXXX";
+  const int fd = mkstemp(filename);
+  REQUIRE(fd >= 0);
+  close(fd);
+  return filename;
+}
+
+TEST_CASE("Standard MIDI Files") {
+  const std::string filename = MakeTestFile();
+  SmfWriter writer(96);
+  const size_t meta_track = writer.AddTrack("");
+  const size_t track = writer.AddTrack("notes");
+  const uint8_t tempo[] = {0x07, 0xa1, 0x20};
+  writer.AddMeta(meta_track, 0, kSmfMetaTempo, tempo, sizeof(tempo));
+  const uint8_t note_on[] = {0x90, 60, 100};
+  const uint8_t second_note_on[] = {0x90, 64, 90};
+  const uint8_t sysex[] = {0x7e, 0x01, 0xf7};
+  writer.AddMessage(track, 0, note_on, sizeof(note_on));
+  // Written with running status.
+  writer.AddMessage(track, 96, second_note_on, sizeof(second_note_on));
+  writer.AddSysex(track, 200, 0xf0, sysex, sizeof(sysex));
+  snd_seq_event_t bend;
+  snd_seq_ev_clear(&bend);
+  bend.type = SND_SEQ_EVENT_PITCHBEND;
+  bend.data.control.channel = 2;
+  bend.data.control.value = -8192;
+  REQUIRE(writer.AddSeqEvent(track, 300, bend));
+  REQUIRE(writer.Save(filename));
+
+  SmfReader reader;
+  REQUIRE(reader.Open(filename));
+  REQUIRE(reader.format() == 1);
+  REQUIRE(reader.num_tracks() == 2);
+  REQUIRE(reader.division() == 96);
+  std::vector<SmfEvent> events;
+  SmfEvent ev;
+  while (reader.Next(&ev)) {
+    events.push_back(ev);
+  }
+  REQUIRE(!reader.error());
+  // Tempo, track name, then the events of the second track.
+  REQUIRE(events.size() == 6);
+  REQUIRE(events[0].track == 0);
+  REQUIRE(events[0].meta_type == kSmfMetaTempo);
+  REQUIRE(events[1].meta_type == kSmfMetaTrackName);
+  REQUIRE(std::string(reinterpret_cast<const char*>(events[1].data), events[1].size) == "notes");
+  REQUIRE(events[3].tick == 96);
+  REQUIRE(events[3].status == 0x90);
+  REQUIRE(events[3].data[0] == 64);
+
+  SmfEventDecoder decoder;
+  snd_seq_event_t seq_ev;
+  REQUIRE(!decoder.Decode(events[0], &seq_ev));
+  REQUIRE(decoder.Decode(events[2], &seq_ev));
+  REQUIRE(seq_ev.type == SND_SEQ_EVENT_NOTEON);
+  REQUIRE(seq_ev.data.note.velocity == 100);
+  REQUIRE(decoder.Decode(events[4], &seq_ev));
+  REQUIRE(seq_ev.type == SND_SEQ_EVENT_SYSEX);
+  REQUIRE(seq_ev.data.ext.len == 4);
+  REQUIRE(decoder.Decode(events[5], &seq_ev));
+  REQUIRE(seq_ev.type == SND_SEQ_EVENT_PITCHBEND);
+  REQUIRE(seq_ev.data.control.channel == 2);
+  REQUIRE(seq_ev.data.control.value == -8192);
+  unlink(filename.c_str());
+
+  SmfClock clock(96);
+  REQUIRE(clock.TickToUs(96) == 500000);
+  clock.SetTempo(96, 1000000);
+  REQUIRE(clock.TickToUs(192) == 1500000);
+  REQUIRE(clock.UsToTick(1500000) == 192);
+
+  SmfReader invalid;
+  REQUIRE(!invalid.Open("dag_test.cc"));
+}
+
+TEST_CASE("Offline processing") {
+  // 100 ticks per quarter note at one quarter note per second: 10ms per
+  // tick.
+  const std::string input_filename = MakeTestFile();
+  SmfWriter writer(100);
+  writer.AddTrack("");
+  const size_t track = writer.AddTrack("");
+  const uint8_t tempo[] = {0x0f, 0x42, 0x40};
+  writer.AddMeta(0, 0, kSmfMetaTempo, tempo, sizeof(tempo));
+  const uint8_t note_on[] = {0x90, 60, 100};
+  const uint8_t note_off[] = {0x80, 60, 0};
+  writer.AddMessage(track, 10, note_on, sizeof(note_on));
+  writer.AddMessage(track, 20, note_off, sizeof(note_off));
+  REQUIRE(writer.Save(input_filename));
+
+  ProcessorDAG dag;
+  size_t input_index = dag.AddProcessor(std::make_unique<MidiInput>("in", nullptr));
+  size_t delay_index = dag.AddProcessor(std::make_unique<Delay>(50));
+  size_t output_index = dag.AddProcessor(std::make_unique<MidiOutput>("out", nullptr));
+  REQUIRE(dag.AddConnection(input_index, delay_index));
+  REQUIRE(dag.AddConnection(delay_index, output_index));
+  REQUIRE(dag.Finalize());
+
+  const std::string output_filename = MakeTestFile();
+  OfflineStats stats;
+  REQUIRE(ProcessMidiFile(input_filename, output_filename, &dag, OfflineOptions(), &stats));
+  REQUIRE(stats.input_events == 2);
+  REQUIRE(stats.output_events == 2);
+
+  // Tempo map, then the delayed notes on the track of the output.
+  SmfReader reader;
+  REQUIRE(reader.Open(output_filename));
+  REQUIRE(reader.num_tracks() == 2);
+  SmfEvent ev;
+  REQUIRE(reader.Next(&ev));
+  REQUIRE(ev.meta_type == kSmfMetaTempo);
+  REQUIRE(reader.Next(&ev));
+  REQUIRE(ev.meta_type == kSmfMetaTrackName);
+  REQUIRE(reader.Next(&ev));
+  REQUIRE(ev.tick == 15);
+  REQUIRE(ev.status == 0x90);
+  REQUIRE(reader.Next(&ev));
+  REQUIRE(ev.tick == 25);
+  REQUIRE(ev.status == 0x80);
+  REQUIRE(!reader.Next(&ev));
+  REQUIRE(!reader.error());
+  unlink(input_filename.c_str());
+  unlink(output_filename.c_str());
+}
+
+TEST_CASE("Offline inputs in config order") {
+  // Declared in the reverse of the order of their names.
+  const std::string config_filename = MakeTestFile();
+  FILE* config = fopen(config_filename.c_str(), "w");
+  REQUIRE(config != nullptr);
+  fputs("local mflib = require 'mflib'\n"
+        "config = mflib.make_empty_config()\n"
+        "mflib.add_input(config, 'second')\n"
+        "mflib.add_input(config, 'first')\n"
+        "mflib.add_output(config, 'out_second')\n"
+        "mflib.add_output(config, 'out_first')\n"
+        "mflib.connect(config, 'second', 'out_second')\n"
+        "mflib.connect(config, 'first', 'out_first')\n", config);
+  fclose(config);
+
+  const std::string input_filename = MakeTestFile();
+  SmfWriter writer(100);
+  writer.AddTrack("");
+  for (const uint8_t note : {60, 62}) {
+    const size_t track = writer.AddTrack("");
+    const uint8_t note_on[] = {0x90, note, 100};
+    writer.AddMessage(track, 10, note_on, sizeof(note_on));
+  }
+  REQUIRE(writer.Save(input_filename));
+
+  const std::string output_filename = MakeTestFile();
+  REQUIRE(ProcessMidiFiles(config_filename, {{input_filename, output_filename}}, 1,
+                           OfflineOptions()));
+
+  // The first track goes to the first input declared, and the output
+  // has a track per output, in the same order.
+  SmfReader reader;
+  REQUIRE(reader.Open(output_filename));
+  REQUIRE(reader.num_tracks() == 3);
+  std::vector<std::string> track_names(reader.num_tracks());
+  std::vector<int> track_notes(reader.num_tracks(), -1);
+  SmfEvent ev;
+  while (reader.Next(&ev)) {
+    if (ev.meta_type == kSmfMetaTrackName) {
+      track_names[ev.track].assign(reinterpret_cast<const char*>(ev.data), ev.size);
+    } else if (ev.status == 0x90) {
+      track_notes[ev.track] = ev.data[0];
+    }
+  }
+  REQUIRE(!reader.error());
+  REQUIRE(track_names == std::vector<std::string>({"", "out_second", "out_first"}));
+  REQUIRE(track_notes == std::vector<int>({-1, 60, 62}));
+  unlink(config_filename.c_str());
+  unlink(input_filename.c_str());
+  unlink(output_filename.c_str());
+}
+
+TEST_CASE("Metrics segment") {
+  ProcessorDAG dag;
+  dag.EnableStats(true);
+  size_t input_index = dag.AddProcessor(std::make_unique<MidiInput>("in", nullptr));
+  size_t low_index = dag.AddProcessor(std::make_unique<NoteSelector>(0, 64, 0, 127),
+                                      "low");
+  size_t output_index = dag.AddProcessor(std::make_unique<MidiOutput>("out", nullptr));
+  REQUIRE(dag.AddConnection(input_index, low_index));
+  REQUIRE(dag.AddConnection(low_index, output_index));
+  REQUIRE(dag.Finalize());
+  REQUIRE(dag.ProcessBatch(SendTo(dag, input_index, {
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 60),
+    MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 70)})));
+
+  const std::string name = MetricsSegmentName("test-" + std::to_string(getpid()));
+  MetricsWriter writer;
+  REQUIRE(writer.Open(name));
+  dag.PublishMetrics(writer.BeginUpdate());
+  writer.EndUpdate();
+
+  MetricsReader reader;
+  REQUIRE(reader.Open(name));
+  auto snapshot = std::make_unique<MetricsSnapshot>();
+  REQUIRE(reader.Read(snapshot.get()));
+  REQUIRE(snapshot->pid == static_cast<uint64_t>(getpid()));
+  REQUIRE(snapshot->graph.batches == 1);
+  REQUIRE(snapshot->graph.events == 2);
+  REQUIRE(snapshot->num_processors == 3);
+  // Processors in evaluation order.
+  REQUIRE(std::string(snapshot->processors[1].name)
+          == "processor " + std::to_string(low_index) + " (low)");
+  REQUIRE(snapshot->processors[1].events_in == 2);
+  REQUIRE(snapshot->processors[1].events_out == 1);
+
+  MetricsReader missing;
+  REQUIRE(!missing.Open(MetricsSegmentName("no-such-client")));
+}
+
+TEST_CASE("Graph snapshots") {
+  const std::string config_filename = MakeTestFile();
+  FILE* config = fopen(config_filename.c_str(), "w");
+  REQUIRE(config != nullptr);
+  fputs("config = {}\n", config);
+  fclose(config);
+
+  GraphSnapshot snapshot;
+  MidiInput input("in", nullptr);
+  NoteSelector low(0, 64, 0, 127);
+  low.channels = {1, 2};
+  Delay delay(20);
+  delay.repeats = 3;
+  MidiOutput output("out", nullptr);
+  REQUIRE(snapshot.AddProcessor(&input, "in"));
+  REQUIRE(snapshot.AddProcessor(&low, "low"));
+  REQUIRE(snapshot.AddProcessor(&delay, "delay"));
+  REQUIRE(snapshot.AddProcessor(&output, "out"));
+  REQUIRE(snapshot.AddConnection("in", "low"));
+  REQUIRE(snapshot.AddConnection("low", "delay"));
+  REQUIRE(snapshot.AddConnection("delay", "out"));
+  snapshot.SetClientName("snapshot");
+  snapshot.SetConfigFiles({config_filename});
+  const std::string snapshot_filename = MakeTestFile();
+  REQUIRE(snapshot.Save(snapshot_filename));
+
+  GraphSnapshot loaded;
+  REQUIRE(loaded.Load(snapshot_filename, config_filename));
+  REQUIRE(loaded.client_name() == "snapshot");
+  ProcessorDAG dag;
+  dag.EnableOptimizer(false);
+  REQUIRE(loaded.BuildGraph(nullptr, &dag));
+  REQUIRE(dag.GetEvaluationOrder().size() == 4);
+  NoteSelector* loaded_low = dynamic_cast<NoteSelector*>(dag.GetProcessor("low"));
+  REQUIRE(loaded_low != nullptr);
+  low.init();
+  REQUIRE(loaded_low->IsEquivalent(low));
+  Delay* loaded_delay = dynamic_cast<Delay*>(dag.GetProcessor("delay"));
+  REQUIRE(loaded_delay != nullptr);
+  REQUIRE(loaded_delay->delay_ms == 20);
+  REQUIRE(loaded_delay->repeats == 3);
+
+  // Not saved when part of the graph is missing.
+  GraphSnapshot incomplete;
+  REQUIRE(incomplete.AddProcessor(&input, "in"));
+  REQUIRE(!incomplete.AddConnection("in", "missing"));
+  incomplete.SetConfigFiles({config_filename});
+  REQUIRE(!incomplete.Save(snapshot_filename + ".incomplete"));
+
+  GraphSnapshot other_config;
+  REQUIRE(!other_config.Load(snapshot_filename, "other.lua"));
+
+  // Out of date once the config changes.
+  config = fopen(config_filename.c_str(), "a");
+  REQUIRE(config != nullptr);
+  fputs("-- changed\n", config);
+  fclose(config);
+  GraphSnapshot stale;
+  REQUIRE(!stale.Load(snapshot_filename, config_filename));
+
+  GraphSnapshot invalid;
+  REQUIRE(!invalid.Load("dag_test.cc", config_filename));
+  unlink(config_filename.c_str());
+  unlink(snapshot_filename.c_str());
+}
+
+std::vector<MidiEvent> ParseBytes(MidiByteParser& parser, std::vector<uint8_t> bytes) {
+  std::vector<MidiEvent> events;
+  parser.Parse(bytes.data(), bytes.size(), [&](const MidiEvent& ev) {
+    events.push_back(ev);
+  });
+  return events;
+}
+
+TEST_CASE("Raw MIDI parser") {
+  MidiByteParser parser(7);
+  // Running status, with a clock between the data bytes.
+  auto events = ParseBytes(parser, {0x91, 0x3c, 0x64, 0x3e, 0xf8, 0x00});
+  REQUIRE_THAT(GetTypes(events), Catch::Equals(std::vector<int>(
+      {SND_SEQ_EVENT_NOTEON, SND_SEQ_EVENT_CLOCK, SND_SEQ_EVENT_NOTEON})));
+  REQUIRE_THAT(GetNotes(events), Catch::Equals(std::vector<int>({60, 0, 62})));
+  REQUIRE_THAT(GetVelocities(events), Catch::Equals(std::vector<int>({100, 0, 0})));
+  REQUIRE(events[0].channel == 1);
+  REQUIRE(events[0].port == 7);
+
+  // Messages split across reads.
+  REQUIRE(ParseBytes(parser, {0xe0}).empty());
+  REQUIRE(ParseBytes(parser, {0x7f}).empty());
+  events = ParseBytes(parser, {0x7f, 0x00, 0x00, 0xb2, 0x07, 0x50});
+  REQUIRE_THAT(GetTypes(events), Catch::Equals(std::vector<int>(
+      {SND_SEQ_EVENT_PITCHBEND, SND_SEQ_EVENT_PITCHBEND, SND_SEQ_EVENT_CONTROLLER})));
+  REQUIRE_THAT(GetControllerValues(events), Catch::Equals(std::vector<int>({8191, -8192, 80})));
+  REQUIRE(events[2].data.control.param == 7);
+
+  // System common messages cancel the running status.
+  events = ParseBytes(parser, {0xf3, 0x05, 0x10, 0x20});
+  REQUIRE_THAT(GetTypes(events), Catch::Equals(std::vector<int>({SND_SEQ_EVENT_SONGSEL})));
+  REQUIRE(events[0].data.control.value == 5);
+
+  // Sysex in chunks, with a real-time byte in the middle.
+  events = ParseBytes(parser, {0xf0, 1, 2, 3, 4, 5, 6, 0xfa, 7, 8, 9, 0xf7});
+  REQUIRE_THAT(GetTypes(events), Catch::Equals(std::vector<int>(
+      {SND_SEQ_EVENT_START, SND_SEQ_EVENT_SYSEX, SND_SEQ_EVENT_SYSEX})));
+  REQUIRE(events[1].flags == (8 | kSysexFirst));
+  REQUIRE(events[1].data.sysex[0] == 0xf0);
+  REQUIRE(events[2].flags == (3 | kSysexLast));
+  REQUIRE(events[2].data.sysex[2] == 0xf7);
+
+  // A status byte ends an unterminated sysex.
+  events = ParseBytes(parser, {0xf0, 0x7e, 0x80, 0x40, 0x00});
+  REQUIRE_THAT(GetTypes(events), Catch::Equals(std::vector<int>(
+      {SND_SEQ_EVENT_SYSEX, SND_SEQ_EVENT_NOTEOFF})));
+  REQUIRE(events[0].flags == (3 | kSysexFirst | kSysexLast));
+
+  // Data bytes without status and undefined status bytes are dropped.
+  parser.Reset();
+  REQUIRE(ParseBytes(parser, {0x40, 0x40, 0xf4, 0x10, 0xfd}).empty());
+}
+
+TEST_CASE("Raw MIDI encoder") {
+  MidiByteParser parser;
+  const auto events = ParseBytes(parser, {
+      0x90, 0x3c, 0x64, 0xf8, 0x3e, 0x00, 0xc3, 0x05, 0xe0, 0x00, 0x40,
+      0xf2, 0x10, 0x02, 0xf0, 1, 2, 3, 4, 5, 6, 7, 8, 0xf7, 0x90, 0x40, 0x7f});
+  REQUIRE(events.size() == 9);
+
+  MidiByteEncoder encoder;
+  std::vector<uint8_t> bytes;
+  for (const auto& ev: events) {
+    uint8_t out[MidiByteEncoder::kMaxEventBytes];
+    const size_t size = encoder.Encode(ev, out);
+    bytes.insert(bytes.end(), out, out + size);
+  }
+  REQUIRE_THAT(bytes, Catch::Equals(std::vector<uint8_t>({
+      0x90, 0x3c, 0x64, 0xf8, 0x3e, 0x00, 0xc3, 0x05, 0xe0, 0x00, 0x40,
+      0xf2, 0x10, 0x02, 0xf0, 1, 2, 3, 4, 5, 6, 7, 8, 0xf7, 0x90, 0x40, 0x7f})));
+
+  // Controllers standing for 14-bit values and NRPNs.
+  MidiEvent ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.type = SND_SEQ_EVENT_CONTROL14;
+  ev.channel = 2;
+  ev.data.control.param = 1;
+  ev.data.control.value = 0x1234;
+  uint8_t out[MidiByteEncoder::kMaxEventBytes];
+  encoder.use_running_status = false;
+  REQUIRE(encoder.Encode(ev, out) == 6);
+  REQUIRE_THAT(std::vector<uint8_t>(out, out + 6), Catch::Equals(std::vector<uint8_t>(
+      {0xb2, 0x01, 0x24, 0xb2, 0x21, 0x34})));
+  ev.type = SND_SEQ_EVENT_NONREGPARAM;
+  encoder.use_running_status = true;
+  encoder.Reset();
+  REQUIRE(encoder.Encode(ev, out) == 9);
+  REQUIRE_THAT(std::vector<uint8_t>(out, out + 9), Catch::Equals(std::vector<uint8_t>(
+      {0xb2, 0x63, 0x00, 0x62, 0x01, 0x06, 0x24, 0x26, 0x34})));
+  ev.type = SND_SEQ_EVENT_TIMESIGN;
+  REQUIRE(encoder.Encode(ev, out) == 0);
+}
+
+// Creates a FIFO with a unique name.
+std::string MakeTestFifo() {
+  const std::string filename = MakeTestFile();
+  unlink(filename.c_str());
+  REQUIRE(mkfifo(filename.c_str(), 0600) == 0);
+  return filename;
+}
+
+// Reads all events available from 'device'.
+std::vector<MidiEvent> ReadDevice(RawMidiDevice* device) {
+  std::vector<MidiEvent> events;
+  REQUIRE(device->Read([&](const MidiEvent& ev) { events.push_back(ev); }));
+  return events;
+}
+
+TEST_CASE("Raw MIDI devices") {
+  const std::string fifo = MakeTestFifo();
+  REQUIRE(RawMidiDevice::Open(fifo + ".missing", false, 0) == nullptr);
+  const std::string regular_file = MakeTestFile();
+  REQUIRE(RawMidiDevice::Open(regular_file, false, 0) == nullptr);
+  unlink(regular_file.c_str());
+
+  PortRegistry ports(nullptr);
+  ports.BeginGeneration();
+  RawMidiInput input(fifo, &ports);
+  RawMidiOutput output(fifo, &ports);
+  REQUIRE(input.init());
+  REQUIRE(output.init());
+  REQUIRE(input.port_num() == 255);
+  REQUIRE(ports.polled_inputs_version() == 0);
+  ports.CommitGeneration();
+  REQUIRE(ports.NumEndpoints() == 2);
+  std::vector<std::shared_ptr<PolledInput>> inputs;
+  REQUIRE(ports.GetPolledInputs(&inputs) == 1);
+  REQUIRE(inputs.size() == 1);
+  REQUIRE(inputs[0].get() == input.device());
+
+  // What the output writes to the FIFO is read back by the input.
+  EventBuffer batch;
+  batch.Reserve(4);
+  snd_seq_event_t seq_ev = MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 60);
+  MidiEvent ev;
+  FromSeqEvent(seq_ev, &ev);
+  batch.Emit(ev);
+  ev.data.note.note = 62;
+  batch.Emit(ev);
+  output.ProcessBatch(batch, nullptr);
+  auto events = ReadDevice(input.device());
+  REQUIRE_THAT(GetNotes(events), Catch::Equals(std::vector<int>({60, 62})));
+  REQUIRE(events[0].port == input.port_num());
+  REQUIRE(ReadDevice(input.device()).empty());
+
+  // Input events go through the graph like sequencer events.
+  ProcessorDAG dag;
+  dag.EnableOptimizer(false);
+  size_t input_index = dag.AddProcessor(std::make_unique<RawMidiInput>(fifo, nullptr));
+  auto recorder = std::make_unique<EventRecorder>();
+  EventRecorder* received = recorder.get();
+  size_t recorder_index = dag.AddProcessor(std::move(recorder));
+  REQUIRE(dag.AddConnection(input_index, recorder_index));
+  REQUIRE(dag.Finalize());
+  const int port = static_cast<RawMidiInput*>(dag.GetProcessor(input_index))->port_num();
+  for (auto& received_ev: events) {
+    received_ev.port = port;
+  }
+  events[1].port = port + 1;
+  REQUIRE(dag.ProcessBatch(std::span<const MidiEvent>(events)));
+  REQUIRE_THAT(GetNotes(received->received), Catch::Equals(std::vector<int>({60})));
+
+  // Devices are kept by the next graph, and closed once unused.
+  ports.BeginGeneration();
+  REQUIRE(ports.AcquireRawDevice(fifo, false).get() == input.device());
+  REQUIRE(ports.AcquireRawDevice(fifo + ".missing", true) == nullptr);
+  ports.CommitGeneration();
+  REQUIRE(ports.NumEndpoints() == 1);
+  REQUIRE(ports.polled_inputs_version() == 1);
+  ports.BeginGeneration();
+  ports.CommitGeneration();
+  REQUIRE(ports.NumEndpoints() == 0);
+  REQUIRE(ports.GetPolledInputs(&inputs) == 2);
+  REQUIRE(inputs.empty());
+  unlink(fifo.c_str());
+}
+
+// Pops all events from 'ring'.
+std::vector<MidiEvent> PopAll(ShmRing* ring) {
+  std::vector<MidiEvent> events;
+  MidiEvent ev;
+  while (ring->TryPop(&ev)) {
+    events.push_back(ev);
+  }
+  return events;
+}
+
+bool IsReadable(int fd) {
+  struct pollfd pfd = {fd, POLLIN, 0};
+  return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+TEST_CASE("Shared memory rings") {
+  const std::string name = "/midiflume_test_" + std::to_string(getpid());
+  REQUIRE(ShmRing::Attach(name) == nullptr);
+  auto consumer = ShmRing::Create(name, 5, 9);
+  REQUIRE(consumer != nullptr);
+  REQUIRE(consumer->capacity() == 8);
+  REQUIRE(ShmRing::Create(name, 5) == nullptr);
+  auto producer = ShmRing::Attach(name);
+  REQUIRE(producer != nullptr);
+  REQUIRE(producer->capacity() == 8);
+
+  // Events which don't fit are dropped.
+  MidiEvent ev;
+  FromSeqEvent(MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 0), &ev);
+  for (int note = 0; note < 9; note++) {
+    ev.data.note.note = note;
+    REQUIRE(producer->TryPush(ev) == (note < 8));
+  }
+  REQUIRE(consumer->Size() == 8);
+  REQUIRE(consumer->dropped_events() == 1);
+  REQUIRE_THAT(GetNotes(PopAll(consumer.get())),
+               Catch::Equals(std::vector<int>({0, 1, 2, 3, 4, 5, 6, 7})));
+
+  // The eventfd is only written when the consumer waits.
+  producer->TryPush(ev);
+  producer->Wake();
+  REQUIRE(!IsReadable(consumer->wakeup_fd()));
+  REQUIRE(!consumer->PrepareWait());
+  REQUIRE(PopAll(consumer.get()).size() == 1);
+  REQUIRE(consumer->PrepareWait());
+  producer->TryPush(ev);
+  producer->TryPush(ev);
+  producer->Wake();
+  producer->Wake();
+  REQUIRE(IsReadable(consumer->wakeup_fd()));
+  std::vector<MidiEvent> events;
+  REQUIRE(consumer->ReadEvents([](void* context, const MidiEvent& ev) {
+    static_cast<std::vector<MidiEvent>*>(context)->push_back(ev);
+  }, &events));
+  REQUIRE(events.size() == 2);
+  REQUIRE(events[0].port == 9);
+  REQUIRE(!IsReadable(consumer->wakeup_fd()));
+
+  // A wakeup written after the consumer read the eventfd, as when the
+  // producer clears the flag and the consumer ends its wait before the
+  // write lands, only wakes up the next wait.
+  REQUIRE(consumer->PrepareWait());
+  producer->TryPush(ev);
+  producer->Wake();
+  consumer->EndWait();
+  REQUIRE(PopAll(consumer.get()).size() == 1);
+  const uint64_t one = 1;
+  REQUIRE(write(consumer->wakeup_fd(), &one, sizeof(one)) == sizeof(one));
+  REQUIRE(consumer->PrepareWait());
+  REQUIRE(IsReadable(consumer->wakeup_fd()));
+  consumer->EndWait();
+  REQUIRE(consumer->PrepareWait());
+  REQUIRE(!IsReadable(consumer->wakeup_fd()));
+  consumer->EndWait();
+
+  // Removed with the end which created it.
+  producer.reset();
+  consumer.reset();
+  REQUIRE(ShmRing::Attach(name) == nullptr);
+}
+
+TEST_CASE("Shared memory inputs and outputs") {
+  const std::string input_name = "/midiflume_test_in_" + std::to_string(getpid());
+  const std::string output_name = "/midiflume_test_out_" + std::to_string(getpid());
+  PortRegistry ports(nullptr);
+  ports.BeginGeneration();
+  ShmInput input(input_name, 64, &ports);
+  ShmOutput output(output_name, 64, &ports);
+  REQUIRE(input.init());
+  REQUIRE(output.init());
+  REQUIRE(input.port_num() == 255);
+  ports.CommitGeneration();
+  REQUIRE(ports.NumEndpoints() == 2);
+  std::vector<std::shared_ptr<PolledInput>> inputs;
+  REQUIRE(ports.GetPolledInputs(&inputs) == 1);
+  REQUIRE(inputs.size() == 1);
+  REQUIRE(inputs[0].get() == input.ring());
+
+  // Events pushed by another process go through the graph, and come out
+  // of the output ring.
+  ProcessorDAG dag;
+  dag.EnableOptimizer(false);
+  ports.BeginGeneration();
+  size_t input_index = dag.AddProcessor(std::make_unique<ShmInput>(input_name, 64, &ports));
+  size_t output_index = dag.AddProcessor(std::make_unique<ShmOutput>(output_name, 64, &ports));
+  REQUIRE(dag.AddConnection(input_index, output_index));
+  REQUIRE(dag.Finalize());
+  ports.CommitGeneration();
+  REQUIRE(ports.NumEndpoints() == 2);
+  REQUIRE(ports.polled_inputs_version() == 1);
+
+  auto producer = ShmRing::Attach(input_name);
+  auto consumer = ShmRing::Attach(output_name);
+  REQUIRE(producer != nullptr);
+  REQUIRE(consumer != nullptr);
+  MidiEvent ev;
+  FromSeqEvent(MakeNoteEvent(SND_SEQ_EVENT_NOTEON, 60), &ev);
+  REQUIRE(producer->TryPush(ev));
+  ev.data.note.note = 62;
+  REQUIRE(producer->TryPush(ev));
+  producer->Wake();
+  std::vector<MidiEvent> events;
+  inputs[0]->ReadEvents([](void* context, const MidiEvent& ev) {
+    static_cast<std::vector<MidiEvent>*>(context)->push_back(ev);
+  }, &events);
+  REQUIRE(consumer->PrepareWait());
+  REQUIRE(dag.ProcessBatch(std::span<const MidiEvent>(events)));
+  REQUIRE(IsReadable(consumer->wakeup_fd()));
+  consumer->EndWait();
+  REQUIRE_THAT(GetNotes(PopAll(consumer.get())), Catch::Equals(std::vector<int>({60, 62})));
+}
@@ -1,5 +1,8 @@
 // Code that actually does the midi event processing.
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
 #include <memory>
 #include <iostream>
 #include <vector>
@@ -9,20 +12,46 @@
 #include <lua5.3/lualib.h>
 
 #include "lua_util.h"
+#include "lua_processor.h"
 #include "event_processors.h"
+#include "raw_midi.h"
+#include "shm_ring.h"
+#include "snapshot.h"
 
 // EventProcessor
 EventProcessor::EventProcessor() {}
 bool EventProcessor::init() {
-  // Most processors will return either one or zero elements, so use that
-  // as the default.
-  events_.reserve(1);  
   return true;
 }
 
+EventTypeSet EventProcessor::OutputTypes(const EventTypeSet& input_types) {
+  return input_types.any() ? EventTypeSet().set() : EventTypeSet();
+}
+
+void EventProcessor::ProcessBatch(const EventBuffer& input, EventBuffer* output) {
+  for (size_t i = 0; i < input.size(); i++) {
+    output->SetOrigin(input.origin(i));
+    ProcessEvent(input.event(i), output);
+  }
+}
+
 // MidiInput
+bool MidiInput::SaveSettings(SnapshotWriter* out) {
+  // The port is named after the processor.
+  out->WriteString("midi_input");
+  return true;
+}
+
 bool MidiInput::init() {
-  events_.reserve(1);
+  if (ports_ != nullptr) {
+    // Keeps the port of the previous graph, if any.
+    if ((port_num_ = ports_->Acquire(name_, kInputPortCaps)) < 0) {
+      std::cerr << "Error creating sequencer input port " << name_ << "\n";
+      return false;
+    }
+    std::cerr << "Using input " << port_num_ << " (" << name_ << ")\n";
+    return true;
+  }
   if (seq_handle_ == nullptr) {
     std::cerr << "MidiInput: Null seq_handle, ignoring init. "
               << "This is intended for testing only\n";
@@ -30,8 +59,7 @@ bool MidiInput::init() {
   }
   
   if ((port_num_ = snd_seq_create_simple_port(
-           seq_handle_, name_.c_str(),
-           SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE,
+           seq_handle_, name_.c_str(), kInputPortCaps,
            SND_SEQ_PORT_TYPE_APPLICATION)) < 0) {
     std::cerr << "Error creating sequencer input port " << name_ << "\n";
     return false;
@@ -40,19 +68,92 @@ bool MidiInput::init() {
   return true;
 }
 
-std::vector<snd_seq_event_t>*
-MidiInput::ProcessEvent(const snd_seq_event_t& ev) {
-  events_.clear();
-  if (ev.dest.port != port_num_) {
-    return &events_;
+void MidiInput::ProcessEvent(const MidiEvent& ev, EventBuffer* output) {
+  if (ev.port == port_num_) {
+    output->Emit(ev);
   }
-  events_.push_back(ev);
-  return &events_;
+}
+
+void MidiInput::ProcessBatch(const EventBuffer& input, EventBuffer* output) {
+  for (size_t i = 0; i < input.size(); i++) {
+    if (input.event(i).port == port_num_) {
+      output->push_back(input.event(i), input.origin(i));
+    }
+  }
+}
+
+// OutputBuffer
+bool OutputBuffer::Resize(size_t num_events) {
+  if (snd_seq_set_output_buffer_size(seq_handle_,
+                                     num_events * sizeof(snd_seq_event_t)) < 0) {
+    std::cerr << "Error setting output buffer size to " << num_events
+              << " events\n";
+    return false;
+  }
+  return true;
+}
+
+void OutputBuffer::Output(snd_seq_event_t* ev) {
+  // Unlike snd_seq_event_output(), snd_seq_event_output_buffer() doesn't
+  // drain the buffer by itself when it's full, so that it can be counted.
+  int result = snd_seq_event_output_buffer(seq_handle_, ev);
+  if (result == -EAGAIN || result == -EINVAL) {
+    overflows_++;
+    Drain();
+    result = snd_seq_event_output_buffer(seq_handle_, ev);
+  }
+  if (result == -EAGAIN || result == -EINVAL) {
+    // Larger than the whole buffer, such as a long sysex message: sent
+    // on its own, after the events drained above.
+    if (snd_seq_event_output_direct(seq_handle_, ev) < 0) {
+      errors_++;
+      return;
+    }
+    events_++;
+    direct_events_++;
+    return;
+  }
+  if (result < 0) {
+    errors_++;
+    return;
+  }
+  events_++;
+  pending_events_++;
+}
+
+void OutputBuffer::Drain() {
+  if (pending_events_ == 0) {
+    return;
+  }
+  drains_++;
+  pending_events_ = 0;
+  if (snd_seq_drain_output(seq_handle_) < 0) {
+    errors_++;
+  }
+}
+
+void OutputBuffer::PrintStats(std::ostream& out) {
+  out << "Output buffer: " << events_ << " events, " << drains_ << " drains, "
+      << overflows_ << " overflows, " << direct_events_ << " sent directly, "
+      << errors_ << " errors\n";
 }
 
 // MidiOutput
+bool MidiOutput::SaveSettings(SnapshotWriter* out) {
+  out->WriteString("midi_output");
+  return true;
+}
+
 bool MidiOutput::init() {
-  // Not reserving any memory in events_ because we don't need it.
+  if (ports_ != nullptr) {
+    // Keeps the port of the previous graph, if any.
+    if ((port_num_ = ports_->Acquire(name_, kOutputPortCaps)) < 0) {
+      std::cerr << "Error creating sequencer output port " << name_ << "\n";
+      return false;
+    }
+    std::cerr << "Using output " << port_num_ << " (" << name_ << ")\n";
+    return true;
+  }
   if (seq_handle_ == nullptr) {
     std::cerr << "MidiOutput: Null seq_handle, ignoring init. "
               << "This is intended for testing only\n";
@@ -60,8 +161,7 @@ bool MidiOutput::init() {
   }
 
   if ((port_num_ = snd_seq_create_simple_port(
-           seq_handle_, name_.c_str(),
-           SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ,
+           seq_handle_, name_.c_str(), kOutputPortCaps,
            SND_SEQ_PORT_TYPE_APPLICATION)) < 0) {
     std::cerr << "Error creating sequencer output port " << name_ << "\n";
     return false;
@@ -70,16 +170,233 @@ bool MidiOutput::init() {
   return true;
 }
 
-std::vector<snd_seq_event_t>*
-MidiOutput::ProcessEvent(const snd_seq_event_t& ev) {
-  snd_seq_event_t event = ev;
+void MidiOutput::Send(const MidiEvent& ev) {
+  if (output_queue_ != nullptr) {
+    MidiEvent queued = ev;
+    queued.port = port_num_;
+    if (!output_queue_->TryPush(queued)) {
+      // Only written by the thread running the graph.
+      dropped_events_.store(dropped_events_.load(std::memory_order_relaxed) + 1,
+                            std::memory_order_relaxed);
+    }
+    return;
+  }
+  if (seq_handle_ == nullptr) {
+    // Testing mode, see init().
+    return;
+  }
+  snd_seq_event_t event;
+  if (!encoder_.Encode(ev, &event)) {
+    return;  // Part of a sysex message.
+  }
   snd_seq_ev_set_subs(&event);
   snd_seq_ev_set_direct(&event);
   snd_seq_ev_set_source(&event, port_num_);
+  if (output_buffer_ != nullptr) {
+    output_buffer_->Output(&event);
+    return;
+  }
   snd_seq_event_output_direct(seq_handle_, &event);
-  // We want to return an empty vector.
-  events_.clear();
-  return &events_;
+}
+
+void MidiOutput::ProcessEvent(const MidiEvent& ev, EventBuffer* output) {
+  Send(ev);
+}
+
+void MidiOutput::ProcessBatch(const EventBuffer& input, EventBuffer* output) {
+  for (const MidiEvent& ev : input) {
+    Send(ev);
+  }
+}
+
+// RawMidiInput
+bool RawMidiInput::SaveSettings(SnapshotWriter* out) {
+  out->WriteString("raw_input");
+  out->WriteString(path_);
+  return true;
+}
+
+bool RawMidiInput::init() {
+  if (ports_ != nullptr) {
+    device_ = ports_->AcquireRawDevice(path_, false);
+  } else {
+    // Nothing polls the device then, this is intended for testing only.
+    device_ = RawMidiDevice::Open(path_, false, 0);
+  }
+  if (device_ == nullptr) {
+    std::cerr << "Error opening raw MIDI input " << path_ << "\n";
+    return false;
+  }
+  port_num_ = device_->port();
+  std::cerr << "Using raw input " << port_num_ << " (" << path_ << ")\n";
+  return true;
+}
+
+void RawMidiInput::ProcessEvent(const MidiEvent& ev, EventBuffer* output) {
+  if (ev.port == port_num_) {
+    output->Emit(ev);
+  }
+}
+
+void RawMidiInput::ProcessBatch(const EventBuffer& input, EventBuffer* output) {
+  for (size_t i = 0; i < input.size(); i++) {
+    if (input.event(i).port == port_num_) {
+      output->push_back(input.event(i), input.origin(i));
+    }
+  }
+}
+
+// RawMidiOutput
+bool RawMidiOutput::SaveSettings(SnapshotWriter* out) {
+  out->WriteString("raw_output");
+  out->WriteString(path_);
+  return true;
+}
+
+bool RawMidiOutput::init() {
+  if (ports_ != nullptr) {
+    device_ = ports_->AcquireRawDevice(path_, true);
+  } else {
+    device_ = RawMidiDevice::Open(path_, true, 0);
+  }
+  if (device_ == nullptr) {
+    std::cerr << "Error opening raw MIDI output " << path_ << "\n";
+    return false;
+  }
+  std::cerr << "Using raw output " << path_ << "\n";
+  return true;
+}
+
+void RawMidiOutput::ProcessEvent(const MidiEvent& ev, EventBuffer* output) {
+  device_->Write(ev);
+  device_->Flush();
+}
+
+void RawMidiOutput::ProcessBatch(const EventBuffer& input, EventBuffer* output) {
+  for (const MidiEvent& ev : input) {
+    device_->Write(ev);
+  }
+  device_->Flush();
+}
+
+void RawMidiOutput::PrintStats(std::ostream& out) {
+  out << " raw: dropped_bytes=" << device_->dropped_bytes();
+}
+
+// ShmInput
+bool ShmInput::SaveSettings(SnapshotWriter* out) {
+  out->WriteString("shm_input");
+  out->WriteString(ring_name_);
+  out->WriteU64(capacity_);
+  return true;
+}
+
+bool ShmInput::init() {
+  if (ports_ != nullptr) {
+    ring_ = ports_->AcquireShmRing(ring_name_, false, capacity_);
+  } else {
+    // Nothing polls the ring then, this is intended for testing only.
+    ring_ = ShmRing::Create(ring_name_, capacity_, 0);
+  }
+  if (ring_ == nullptr) {
+    std::cerr << "Error creating shared memory input " << ring_name_ << "\n";
+    return false;
+  }
+  port_num_ = ring_->port();
+  std::cerr << "Using shared memory input " << port_num_ << " (" << ring_name_ << ")\n";
+  return true;
+}
+
+void ShmInput::ProcessEvent(const MidiEvent& ev, EventBuffer* output) {
+  if (ev.port == port_num_) {
+    output->Emit(ev);
+  }
+}
+
+void ShmInput::ProcessBatch(const EventBuffer& input, EventBuffer* output) {
+  for (size_t i = 0; i < input.size(); i++) {
+    if (input.event(i).port == port_num_) {
+      output->push_back(input.event(i), input.origin(i));
+    }
+  }
+}
+
+// ShmOutput
+bool ShmOutput::SaveSettings(SnapshotWriter* out) {
+  out->WriteString("shm_output");
+  out->WriteString(ring_name_);
+  out->WriteU64(capacity_);
+  return true;
+}
+
+bool ShmOutput::init() {
+  if (ports_ != nullptr) {
+    ring_ = ports_->AcquireShmRing(ring_name_, true, capacity_);
+  } else {
+    ring_ = ShmRing::Create(ring_name_, capacity_);
+  }
+  if (ring_ == nullptr) {
+    std::cerr << "Error creating shared memory output " << ring_name_ << "\n";
+    return false;
+  }
+  std::cerr << "Using shared memory output " << ring_name_ << "\n";
+  return true;
+}
+
+void ShmOutput::ProcessEvent(const MidiEvent& ev, EventBuffer* output) {
+  ring_->TryPush(ev);
+  ring_->Wake();
+}
+
+void ShmOutput::ProcessBatch(const EventBuffer& input, EventBuffer* output) {
+  for (const MidiEvent& ev : input) {
+    ring_->TryPush(ev);
+  }
+  ring_->Wake();
+}
+
+void ShmOutput::PrintStats(std::ostream& out) {
+  out << " shm: dropped=" << ring_->dropped_events();
+}
+
+// Reads the optional "channels" field of the table at position 'index'.
+// Returns false if the field is present but invalid.
+bool GetChannelsFromLua(lua_State *L, int index,
+                        std::vector<unsigned char>* channels) {
+  lua_getfield(L, index, "channels");
+  bool missing = lua_isnil(L, -1);
+  lua_pop(L, 1);
+  if (missing) {
+    return true;
+  }
+
+  std::vector<int> values;
+  if (!GetIntegerListField(L, index, "channels", &values)) {
+    return false;
+  }
+  channels->clear();
+  for (const int value: values) {
+    if (value < 0 || value >= static_cast<int>(NUM_CHANNELS)) {
+      std::cerr << "Channel number outside [0,15]: " << value << "\n";
+      return false;
+    }
+    channels->push_back(static_cast<unsigned char>(value));
+  }
+  return true;
+}
+
+// Returns true if 'channel' is in 'channels', or if 'channels' is empty.
+bool HasChannel(const std::vector<unsigned char>& channels,
+                unsigned char channel) {
+  if (channels.empty()) {
+    return true;
+  }
+  for (const auto c: channels) {
+    if (c == channel) {
+      return true;
+    }
+  }
+  return false;
 }
 
 // NoteSelector
@@ -97,52 +414,148 @@ bool NoteSelector::InitFromLua(lua_State *L, int index) {
   if (GetIntegerField(L, index, "highest_velocity", &value)) {
     highest_velocity = static_cast<unsigned char>(value);
   }
+  RETURN_IF_FALSE(GetChannelsFromLua(L, index, &channels));
+
+  std::vector<std::string> type_names;
+  if (GetStringListField(L, index, "types", &type_names, false)) {
+    types.clear();
+    for (const auto& type_name: type_names) {
+      if (type_name == "note") {
+        types.push_back(SND_SEQ_EVENT_NOTE);
+      } else if (type_name == "noteon") {
+        types.push_back(SND_SEQ_EVENT_NOTEON);
+      } else if (type_name == "noteoff") {
+        types.push_back(SND_SEQ_EVENT_NOTEOFF);
+      } else if (type_name == "keypress") {
+        types.push_back(SND_SEQ_EVENT_KEYPRESS);
+      } else {
+        std::cerr << "Unknown note event type: " << type_name << "\n";
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool NoteSelector::SaveSettings(SnapshotWriter* out) {
+  out->WriteString("note_selector");
+  out->WriteU8(lowest_note);
+  out->WriteU8(highest_note);
+  out->WriteU8(lowest_velocity);
+  out->WriteU8(highest_velocity);
+  out->WriteBytes(channels);
+  out->WriteU32(types.size());
+  for (const auto type: types) {
+    out->WriteU8(type);
+  }
+  return true;
+}
+
+bool NoteSelector::LoadSettings(SnapshotReader* in) {
+  RETURN_IF_FALSE(in->ReadU8(&lowest_note));
+  RETURN_IF_FALSE(in->ReadU8(&highest_note));
+  RETURN_IF_FALSE(in->ReadU8(&lowest_velocity));
+  RETURN_IF_FALSE(in->ReadU8(&highest_velocity));
+  RETURN_IF_FALSE(in->ReadBytes(&channels));
+  uint32_t num_types;
+  RETURN_IF_FALSE(in->ReadU32(&num_types));
+  types.clear();
+  for (uint32_t i = 0; i < num_types; i++) {
+    uint8_t type;
+    RETURN_IF_FALSE(in->ReadU8(&type));
+    types.push_back(static_cast<snd_seq_event_type_t>(type));
+  }
   return true;
 }
 
-std::vector<snd_seq_event_t>*
-NoteSelector::ProcessEvent(const snd_seq_event_t& ev) {
-  events_.clear();
+bool NoteSelector::init() {
+  EventProcessor::init();
+
+  // Events other than notes are let through. Note events whose type is
+  // not in 'types' are dropped.
+  type_action_.fill(kPass);
   for (const snd_seq_event_type_t ev_type : NOTE_EVENTS) {
-    if (ev.type == ev_type) {
-      bool keep = true;
-
-      if (!channels.empty()) {
-        keep = false;
-        for (const auto channel: channels) {
-          if (ev.data.note.channel == channel) {
-            keep = true;
-            break;
-          }
-        }
-      }
-        
-      if (keep && !types.empty()) {
-        keep = false;
-        for (const auto type: types) {
-          if (ev.type == type) {
-            keep = true;
-            break;
-          }
-        }
-      }
-        
-      if (keep && ((ev.data.note.note > highest_note)
-                   || (ev.data.note.note < lowest_note))) {
-        keep = false;
-      }
-      if (keep && ((ev.data.note.velocity > highest_velocity)
-                   || (ev.data.note.velocity < lowest_velocity))) {
-        keep = false;
-      }
+    type_action_[ev_type] = types.empty() ? kCheck : kDrop;
+  }
+  for (const auto type: types) {
+    if (type_action_[type] == kDrop) {
+      type_action_[type] = kCheck;
+    }
+  }
+
+  for (size_t channel = 0; channel < NUM_CHANNELS; channel++) {
+    note_table_[channel].reset();
+    if (!HasChannel(channels, channel)) {
+      continue;
+    }
+    for (size_t note = lowest_note; note <= highest_note; note++) {
+      note_table_[channel].set(note);
+    }
+  }
+
+  velocity_table_.reset();
+  for (size_t velocity = lowest_velocity; velocity <= highest_velocity; velocity++) {
+    velocity_table_.set(velocity);
+  }
+  return true;
+}
+
+void NoteSelector::ProcessEvent(const MidiEvent& ev, EventBuffer* output) {
+  if (Keep(ev)) {
+    output->Emit(ev);
+  }
+}
 
-      if (!keep) {
-        return &events_;
+void NoteSelector::ProcessBatch(const EventBuffer& input, EventBuffer* output) {
+  for (size_t i = 0; i < input.size(); i++) {
+    if (Keep(input.event(i))) {
+      output->push_back(input.event(i), input.origin(i));
+    }
+  }
+}
+
+bool NoteSelector::PassesEverything() {
+  for (const snd_seq_event_type_t ev_type : NOTE_EVENTS) {
+    if (type_action_[ev_type] == kDrop) {
+      return false;
+    }
+  }
+  for (size_t value = 0; value < 128; value++) {
+    if (!velocity_table_[value]) {
+      return false;
+    }
+    for (size_t channel = 0; channel < NUM_CHANNELS; channel++) {
+      if (!note_table_[channel][value]) {
+        return false;
       }
     }
   }
-  events_.push_back(ev);
-  return &events_;
+  return true;
+}
+
+bool NoteSelector::IsEquivalent(EventProcessor& other) {
+  auto other_selector = dynamic_cast<NoteSelector*>(&other);
+  return other_selector != nullptr
+    && type_action_ == other_selector->type_action_
+    && note_table_ == other_selector->note_table_
+    && velocity_table_ == other_selector->velocity_table_;
+}
+
+EventTypeSet NoteSelector::OutputTypes(const EventTypeSet& input_types) {
+  bool any_note = velocity_table_.any();
+  if (any_note) {
+    any_note = false;
+    for (const auto& notes : note_table_) {
+      any_note = any_note || notes.any();
+    }
+  }
+  EventTypeSet output_types = input_types;
+  for (size_t type = 0; type < type_action_.size(); type++) {
+    if (type_action_[type] == kDrop || (type_action_[type] == kCheck && !any_note)) {
+      output_types.reset(type);
+    }
+  }
+  return output_types;
 }
 
 // ControllerSelector
@@ -154,36 +567,77 @@ bool ControllerSelector::InitFromLua(lua_State *L, int index) {
   if (GetIntegerField(L, index, "highest_controller", &value)) {
     highest_controller_ = static_cast<unsigned char>(value);
   }
+  return GetChannelsFromLua(L, index, &channels_);
+}
+
+bool ControllerSelector::SaveSettings(SnapshotWriter* out) {
+  out->WriteString("controller_selector");
+  out->WriteU8(lowest_controller_);
+  out->WriteU8(highest_controller_);
+  out->WriteBytes(channels_);
   return true;
 }
 
-std::vector<snd_seq_event_t>*
-ControllerSelector::ProcessEvent(const snd_seq_event_t& ev) {
-  events_.clear();
-  if (ev.type == SND_SEQ_EVENT_CONTROLLER) {
-    bool keep = true;
-    
-    if (!channels_.empty()) {
-      keep = false;
-      for (const auto channel: channels_) {
-        if (ev.data.note.channel == channel) {
-          keep = true;
-          break;
-        }
-      }
+bool ControllerSelector::LoadSettings(SnapshotReader* in) {
+  RETURN_IF_FALSE(in->ReadU8(&lowest_controller_));
+  RETURN_IF_FALSE(in->ReadU8(&highest_controller_));
+  return in->ReadBytes(&channels_);
+}
+
+bool ControllerSelector::init() {
+  EventProcessor::init();
+  for (size_t channel = 0; channel < NUM_CHANNELS; channel++) {
+    controller_table_[channel].reset();
+    if (!HasChannel(channels_, channel)) {
+      continue;
     }
-    
-    if (keep && ((ev.data.control.param > highest_controller_)
-                 || (ev.data.control.param < lowest_controller_))) {
-      keep = false;
+    for (size_t controller = lowest_controller_;
+         controller <= highest_controller_ && controller < 128; controller++) {
+      controller_table_[channel].set(controller);
     }
-    
-    if (!keep) {
-      return &events_;
+  }
+  return true;
+}
+
+void ControllerSelector::ProcessEvent(const MidiEvent& ev, EventBuffer* output) {
+  if (Keep(ev)) {
+    output->Emit(ev);
+  }
+}
+
+void ControllerSelector::ProcessBatch(const EventBuffer& input, EventBuffer* output) {
+  for (size_t i = 0; i < input.size(); i++) {
+    if (Keep(input.event(i))) {
+      output->push_back(input.event(i), input.origin(i));
     }
   }
-  events_.push_back(ev);
-  return &events_;
+}
+
+bool ControllerSelector::PassesEverything() {
+  for (const auto& controllers: controller_table_) {
+    if (!controllers.all()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ControllerSelector::IsEquivalent(EventProcessor& other) {
+  auto other_selector = dynamic_cast<ControllerSelector*>(&other);
+  return other_selector != nullptr
+    && controller_table_ == other_selector->controller_table_;
+}
+
+EventTypeSet ControllerSelector::OutputTypes(const EventTypeSet& input_types) {
+  EventTypeSet output_types = input_types;
+  bool any_controller = false;
+  for (const auto& controllers : controller_table_) {
+    any_controller = any_controller || controllers.any();
+  }
+  if (!any_controller) {
+    output_types.reset(SND_SEQ_EVENT_CONTROLLER);
+  }
+  return output_types;
 }
 
 // ControllerMapping
@@ -211,45 +665,540 @@ bool ControllerMapping::InitFromLua(lua_State *L, int index) {
     lua_pop(L, 1);
   }
   lua_pop(L, 1);
+  return GetChannelsFromLua(L, index, &channels_);
+}
+
+bool ControllerMapping::SaveSettings(SnapshotWriter* out) {
+  out->WriteString("controller_mapping");
+  out->WriteBytes(controller_mapping_);
+  out->WriteBytes(channels_);
   return true;
 }
 
-std::vector<snd_seq_event_t>*
-ControllerMapping::ProcessEvent(const snd_seq_event_t& ev) {
-  events_.clear();
+bool ControllerMapping::LoadSettings(SnapshotReader* in) {
+  RETURN_IF_FALSE(in->ReadBytes(&controller_mapping_));
+  if (controller_mapping_.size() != 128) {
+    std::cerr << "Invalid controller mapping size: "
+              << controller_mapping_.size() << "\n";
+    return false;
+  }
+  return in->ReadBytes(&channels_);
+}
+
+bool ControllerMapping::init() {
+  EventProcessor::init();
+  for (size_t channel = 0; channel < NUM_CHANNELS; channel++) {
+    const bool mapped = HasChannel(channels_, channel);
+    for (size_t controller = 0; controller < 128; controller++) {
+      remap_table_[channel][controller] =
+        mapped ? controller_mapping_[controller] : controller;
+    }
+  }
+  return true;
+}
+
+void ControllerMapping::ProcessEvent(const MidiEvent& ev, EventBuffer* output) {
   if (ev.type == SND_SEQ_EVENT_CONTROLLER) {
-    events_.emplace_back(ev);
-    events_.back().data.control.param =
-      controller_mapping_[ev.data.control.param];
+    MidiEvent mapped = ev;
+    mapped.data.control.param = Map(ev);
+    output->Emit(mapped);
+  }
+}
+
+void ControllerMapping::ProcessBatch(const EventBuffer& input, EventBuffer* output) {
+  for (size_t i = 0; i < input.size(); i++) {
+    const MidiEvent& ev = input.event(i);
+    if (ev.type == SND_SEQ_EVENT_CONTROLLER) {
+      MidiEvent mapped = ev;
+      mapped.data.control.param = Map(ev);
+      output->push_back(mapped, input.origin(i));
+    }
+  }
+}
+
+bool ControllerMapping::IsEquivalent(EventProcessor& other) {
+  auto other_mapping = dynamic_cast<ControllerMapping*>(&other);
+  return other_mapping != nullptr
+    && remap_table_ == other_mapping->remap_table_;
+}
+
+// ProcessorChain
+bool ProcessorChain::init() {
+  EventProcessor::init();
+  kinds_.clear();
+  for (const auto& processor : processors_) {
+    kinds_.push_back(GetProcessorKind(processor.get()));
+  }
+  single_input_.Reserve(1);
+  Reserve(1);
+  return true;
+}
+
+size_t ProcessorChain::MaxEventsPerInput() {
+  size_t max_events = 1;
+  for (const auto& processor : processors_) {
+    max_events *= processor->MaxEventsPerInput();
+  }
+  return max_events;
+}
+
+EventTypeSet ProcessorChain::OutputTypes(const EventTypeSet& input_types) {
+  EventTypeSet types = input_types;
+  for (const auto& processor : processors_) {
+    types = processor->OutputTypes(types);
+  }
+  return types;
+}
+
+void ProcessorChain::Reserve(size_t max_input_events) {
+  // Both intermediate buffers get the size of the largest one.
+  size_t max_events = max_input_events;
+  size_t capacity = 0;
+  for (size_t i = 0; i + 1 < processors_.size(); i++) {
+    processors_[i]->Reserve(max_events);
+    max_events *= processors_[i]->MaxEventsPerInput();
+    capacity = std::max(capacity, max_events);
+  }
+  processors_.back()->Reserve(max_events);
+  intermediate_[0].Reserve(capacity);
+  intermediate_[1].Reserve(capacity);
+}
+
+void ProcessorChain::ProcessEvent(const MidiEvent& ev, EventBuffer* output) {
+  single_input_.clear();
+  single_input_.push_back(ev, output->current_origin());
+  ProcessBatch(single_input_, output);
+}
+
+void ProcessorChain::ProcessBatch(const EventBuffer& input, EventBuffer* output) {
+  // Each processor writes into the buffer its predecessor did not use.
+  const EventBuffer* current = &input;
+  for (size_t i = 0; i + 1 < processors_.size(); i++) {
+    EventBuffer* next = &intermediate_[i % 2];
+    next->clear();
+    DispatchBatch(kinds_[i], processors_[i].get(), *current, next);
+    if (next->empty()) {
+      return;
+    }
+    current = next;
+  }
+  DispatchBatch(kinds_.back(), processors_.back().get(), *current, output);
+}
+
+// Dispatch
+ProcessorKind GetProcessorKind(EventProcessor* processor) {
+  if (dynamic_cast<MidiInput*>(processor) != nullptr) {
+    return ProcessorKind::kMidiInput;
+  } else if (dynamic_cast<MidiOutput*>(processor) != nullptr) {
+    return ProcessorKind::kMidiOutput;
+  } else if (dynamic_cast<NoteSelector*>(processor) != nullptr) {
+    return ProcessorKind::kNoteSelector;
+  } else if (dynamic_cast<ControllerSelector*>(processor) != nullptr) {
+    return ProcessorKind::kControllerSelector;
+  } else if (dynamic_cast<ControllerMapping*>(processor) != nullptr) {
+    return ProcessorKind::kControllerMapping;
+  } else if (dynamic_cast<ProcessorChain*>(processor) != nullptr) {
+    return ProcessorKind::kProcessorChain;
+  }
+  return ProcessorKind::kOther;
+}
+
+void DispatchBatch(ProcessorKind kind, EventProcessor* processor,
+                   const EventBuffer& input, EventBuffer* output) {
+  switch (kind) {
+  case ProcessorKind::kMidiInput:
+    static_cast<MidiInput*>(processor)->ProcessBatch(input, output);
+    break;
+  case ProcessorKind::kMidiOutput:
+    static_cast<MidiOutput*>(processor)->ProcessBatch(input, output);
+    break;
+  case ProcessorKind::kNoteSelector:
+    static_cast<NoteSelector*>(processor)->ProcessBatch(input, output);
+    break;
+  case ProcessorKind::kControllerSelector:
+    static_cast<ControllerSelector*>(processor)->ProcessBatch(input, output);
+    break;
+  case ProcessorKind::kControllerMapping:
+    static_cast<ControllerMapping*>(processor)->ProcessBatch(input, output);
+    break;
+  case ProcessorKind::kProcessorChain:
+    static_cast<ProcessorChain*>(processor)->ProcessBatch(input, output);
+    break;
+  default:
+    processor->ProcessBatch(input, output);
+    break;
+  }
+}
+
+// Delay
+bool Delay::InitFromLua(lua_State *L, int index) {
+  int value;
+  RETURN_IF_FALSE(GetIntegerField(L, index, "delay", &value));
+  if (value < 0) {
+    std::cerr << "Negative delay: " << value << "\n";
+    return false;
+  }
+  delay_ms = value;
+  if (GetIntegerField(L, index, "repeats", &value, false)) {
+    if (value < 0) {
+      std::cerr << "Negative number of repeats: " << value << "\n";
+      return false;
+    }
+    repeats = value;
+  }
+  if (GetIntegerField(L, index, "decay", &value, false)) {
+    if (value < 0 || value > 100) {
+      std::cerr << "Decay outside [0,100]: " << value << "\n";
+      return false;
+    }
+    decay_percent = value;
+  }
+  if (GetIntegerField(L, index, "grid", &value, false)) {
+    if (value < 0) {
+      std::cerr << "Negative grid: " << value << "\n";
+      return false;
+    }
+    grid_ms = value;
+  }
+  if (GetIntegerField(L, index, "max_pending", &value, false)) {
+    if (value <= 0) {
+      std::cerr << "max_pending must be positive: " << value << "\n";
+      return false;
+    }
+    max_pending = value;
+  }
+  return true;
+}
+
+bool Delay::SaveSettings(SnapshotWriter* out) {
+  out->WriteString("delay");
+  out->WriteU32(delay_ms);
+  out->WriteU32(repeats);
+  out->WriteU32(decay_percent);
+  out->WriteU32(grid_ms);
+  out->WriteU8(dry);
+  out->WriteU64(max_pending);
+  return true;
+}
+
+bool Delay::LoadSettings(SnapshotReader* in) {
+  uint8_t dry_value;
+  uint64_t max_pending_value;
+  RETURN_IF_FALSE(in->ReadU32(&delay_ms));
+  RETURN_IF_FALSE(in->ReadU32(&repeats));
+  RETURN_IF_FALSE(in->ReadU32(&decay_percent));
+  RETURN_IF_FALSE(in->ReadU32(&grid_ms));
+  RETURN_IF_FALSE(in->ReadU8(&dry_value));
+  RETURN_IF_FALSE(in->ReadU64(&max_pending_value));
+  dry = dry_value != 0;
+  max_pending = max_pending_value;
+  return true;
+}
+
+void Delay::ProcessEvent(const MidiEvent& ev, EventBuffer* output) {
+  if (dry || ev.type == SND_SEQ_EVENT_SYSEX) {
+    output->Emit(ev);
+    if (ev.type == SND_SEQ_EVENT_SYSEX) {
+      return;
+    }
+  }
+  uint32_t delay = delay_ms;
+  if (grid_ms > 0) {
+    delay += (grid_ms - (output->now_ms() + delay) % grid_ms) % grid_ms;
+  }
+  const bool note_on = ev.type == SND_SEQ_EVENT_NOTEON && ev.data.note.velocity > 0;
+  MidiEvent copy = ev;
+  for (uint32_t i = 0; i <= repeats; i++) {
+    if (note_on && (dry || i > 0)) {
+      // Stays a note-on.
+      copy.data.note.velocity = std::max(1u, copy.data.note.velocity * decay_percent / 100);
+    }
+    output->Schedule(copy, delay + i * delay_ms);
+  }
+}
+
+// NoteLength
+bool NoteLength::InitFromLua(lua_State *L, int index) {
+  int value;
+  RETURN_IF_FALSE(GetIntegerField(L, index, "length", &value));
+  if (value < 0) {
+    std::cerr << "Negative note length: " << value << "\n";
+    return false;
+  }
+  length_ms = value;
+  if (GetIntegerField(L, index, "max_pending", &value, false)) {
+    if (value <= 0) {
+      std::cerr << "max_pending must be positive: " << value << "\n";
+      return false;
+    }
+    max_pending = value;
+  }
+  return true;
+}
+
+bool NoteLength::SaveSettings(SnapshotWriter* out) {
+  out->WriteString("note_length");
+  out->WriteU32(length_ms);
+  out->WriteU64(max_pending);
+  return true;
+}
+
+bool NoteLength::LoadSettings(SnapshotReader* in) {
+  uint64_t max_pending_value;
+  RETURN_IF_FALSE(in->ReadU32(&length_ms));
+  RETURN_IF_FALSE(in->ReadU64(&max_pending_value));
+  max_pending = max_pending_value;
+  return true;
+}
+
+void NoteLength::ProcessEvent(const MidiEvent& ev, EventBuffer* output) {
+  if (ev.type == SND_SEQ_EVENT_NOTEOFF
+      || (ev.type == SND_SEQ_EVENT_NOTEON && ev.data.note.velocity == 0)) {
+    return;
+  }
+  output->Emit(ev);
+  if (ev.type == SND_SEQ_EVENT_NOTEON) {
+    MidiEvent note_off = ev;
+    note_off.type = SND_SEQ_EVENT_NOTEOFF;
+    note_off.data.note.velocity = 0;
+    output->Schedule(note_off, length_ms);
+  }
+}
+
+// ControllerFilter
+bool ControllerFilter::InitFromLua(lua_State *L, int index) {
+  int value;
+  if (GetIntegerField(L, index, "threshold", &value, false)) {
+    if (value <= 0) {
+      std::cerr << "threshold must be positive: " << value << "\n";
+      return false;
+    }
+    threshold = value;
+  }
+  if (GetIntegerField(L, index, "max_events", &value, false)) {
+    if (value < 0) {
+      std::cerr << "Negative max_events: " << value << "\n";
+      return false;
+    }
+    max_events = value;
+  }
+  if (GetIntegerField(L, index, "interval", &value, false)) {
+    if (value < 0) {
+      std::cerr << "Negative interval: " << value << "\n";
+      return false;
+    }
+    interval_ms = value;
+  }
+  if ((max_events > 0) != (interval_ms > 0)) {
+    std::cerr << "max_events and interval must be given together\n";
+    return false;
+  }
+  return true;
+}
+
+bool ControllerFilter::SaveSettings(SnapshotWriter* out) {
+  out->WriteString("controller_filter");
+  out->WriteU32(threshold);
+  out->WriteU32(max_events);
+  out->WriteU32(interval_ms);
+  return true;
+}
+
+bool ControllerFilter::LoadSettings(SnapshotReader* in) {
+  RETURN_IF_FALSE(in->ReadU32(&threshold));
+  RETURN_IF_FALSE(in->ReadU32(&max_events));
+  return in->ReadU32(&interval_ms);
+}
+
+bool ControllerFilter::init() {
+  EventProcessor::init();
+  slots_.assign(NUM_CHANNELS * kSlotsPerChannel, Slot());
+  return true;
+}
+
+size_t ControllerFilter::MaxPendingEvents() {
+  // At most one pending value per slot.
+  return rate_limited() ? NUM_CHANNELS * kSlotsPerChannel : 0;
+}
+
+ControllerFilter::Slot* ControllerFilter::GetSlot(const MidiEvent& ev) {
+  size_t slot;
+  switch (ev.type) {
+  case SND_SEQ_EVENT_CONTROLLER:
+    if (ev.data.control.param >= 128) {
+      return nullptr;
+    }
+    slot = ev.data.control.param;
+    break;
+  case SND_SEQ_EVENT_PITCHBEND:
+    slot = kPitchBendSlot;
+    break;
+  case SND_SEQ_EVENT_CHANPRESS:
+    slot = kChannelPressureSlot;
+    break;
+  default:
+    return nullptr;
+  }
+  return &slots_[(ev.channel % NUM_CHANNELS) * kSlotsPerChannel + slot];
+}
+
+bool ControllerFilter::Changed(const Slot& slot, const MidiEvent& ev) const {
+  const int32_t value = ev.data.control.value;
+  if (!slot.sent) {
+    return true;
+  }
+  if (value == slot.last_value) {
+    return false;
+  }
+  const bool pitch_bend = ev.type == SND_SEQ_EVENT_PITCHBEND;
+  if (value <= (pitch_bend ? -8192 : 0) || value >= (pitch_bend ? 8191 : 127)) {
+    return true;
+  }
+  return std::abs(static_cast<int64_t>(value) - slot.last_value) >= threshold;
+}
+
+void ControllerFilter::Send(Slot* slot, const MidiEvent& ev, uint64_t now_ms,
+                            EventBuffer* output) {
+  output->Emit(ev);
+  slot->last_value = ev.data.control.value;
+  slot->sent = true;
+  if (now_ms >= slot->interval_start_ms + interval_ms) {
+    slot->interval_start_ms = now_ms;
+    slot->sent_in_interval = 0;
+  }
+  slot->sent_in_interval++;
+}
+
+void ControllerFilter::ProcessEvent(const MidiEvent& ev, EventBuffer* output) {
+  Slot* slot = GetSlot(ev);
+  if (slot == nullptr) {
+    output->Emit(ev);
+    return;
+  }
+  const uint64_t now_ms = output->now_ms();
+  if (slot->flush_scheduled && now_ms >= slot->flush_ms) {
+    // Timers due by now have fired: this one didn't fit in the wheel.
+    ProcessTimer(ev, output);
+  }
+  if (!Changed(*slot, ev)) {
+    // Back within the threshold of the value sent: the pending one is
+    // obsolete.
+    slot->has_pending = false;
+    return;
+  }
+  if (!rate_limited()) {
+    Send(slot, ev, now_ms, output);
+    return;
+  }
+  // Pending values go first, so nothing is sent before the flush.
+  if (!slot->flush_scheduled
+      && (now_ms >= slot->interval_start_ms + interval_ms
+          || slot->sent_in_interval < max_events)) {
+    Send(slot, ev, now_ms, output);
+    return;
+  }
+  slot->pending = ev;
+  slot->has_pending = true;
+  if (!slot->flush_scheduled) {
+    slot->flush_ms = slot->interval_start_ms + interval_ms;
+    slot->flush_scheduled = true;
+    // Only identifies the slot, the value sent is the latest pending one.
+    output->Schedule(ev, slot->flush_ms - now_ms);
+  }
+}
+
+void ControllerFilter::ProcessTimer(const MidiEvent& ev, EventBuffer* output) {
+  Slot* slot = GetSlot(ev);
+  if (slot == nullptr || !slot->flush_scheduled) {
+    return;
+  }
+  slot->flush_scheduled = false;
+  if (slot->has_pending) {
+    slot->has_pending = false;
+    Send(slot, slot->pending, output->now_ms(), output);
   }
-  return &events_;
 }
 
 // Factory for all processors from a Lua object.
 // Expects a 'processor' table at index 'index'.
 std::unique_ptr<EventProcessor> MakeProcessorFromLua(lua_State *L, int index,
                                                      const std::string& name,
-                                                     snd_seq_t *seq_handle) {
+                                                     snd_seq_t *seq_handle,
+                                                     PortRegistry* ports) {
   std::string type;
   if (!GetStringField(L, -1, "processor_type", &type)) {
     return nullptr;
   }
 
   if (type == "midi_input") {
-    return std::make_unique<MidiInput>(name, seq_handle);
+    return std::make_unique<MidiInput>(name, seq_handle, ports);
   } else if (type == "midi_output") {
-    return std::make_unique<MidiOutput>(name, seq_handle);    
+    return std::make_unique<MidiOutput>(name, seq_handle, ports);
+  } else if (type == "raw_input" || type == "raw_output") {
+    std::string device;
+    if (!GetStringField(L, index, "device", &device)) {
+      return nullptr;
+    }
+    if (type == "raw_input") {
+      return std::make_unique<RawMidiInput>(device, ports);
+    }
+    return std::make_unique<RawMidiOutput>(device, ports);
+  } else if (type == "shm_input" || type == "shm_output") {
+    std::string ring;
+    if (!GetStringField(L, index, "ring", &ring)) {
+      return nullptr;
+    }
+    int capacity = kDefaultShmRingCapacity;
+    if (GetIntegerField(L, index, "size", &capacity, false) && capacity <= 0) {
+      std::cerr << "size must be positive: " << capacity << "\n";
+      return nullptr;
+    }
+    if (type == "shm_input") {
+      return std::make_unique<ShmInput>(ring, capacity, ports);
+    }
+    return std::make_unique<ShmOutput>(ring, capacity, ports);
   } else if (type == "note_selector") {
     auto processor = std::make_unique<NoteSelector>();
-    processor->InitFromLua(L, index);
+    if (!processor->InitFromLua(L, index)) {
+      return nullptr;
+    }
     return processor;
   } else if (type == "controller_selector") {
     auto processor = std::make_unique<ControllerSelector>();
-    processor->InitFromLua(L, index);
+    if (!processor->InitFromLua(L, index)) {
+      return nullptr;
+    }
     return processor;
   } else if (type == "controller_mapping") {
     auto processor = std::make_unique<ControllerMapping>();
-    processor->InitFromLua(L, index);
+    if (!processor->InitFromLua(L, index)) {
+      return nullptr;
+    }
+    return processor;
+  } else if (type == "delay" || type == "echo") {
+    auto processor = std::make_unique<Delay>();
+    processor->dry = type == "echo";
+    if (!processor->InitFromLua(L, index)) {
+      return nullptr;
+    }
+    return processor;
+  } else if (type == "note_length") {
+    auto processor = std::make_unique<NoteLength>();
+    if (!processor->InitFromLua(L, index)) {
+      return nullptr;
+    }
+    return processor;
+  } else if (type == "controller_filter") {
+    auto processor = std::make_unique<ControllerFilter>();
+    if (!processor->InitFromLua(L, index)) {
+      return nullptr;
+    }
+    return processor;
+  } else if (type == "lua_processor") {
+    auto processor = std::make_unique<LuaProcessor>(L);
+    if (!processor->InitFromLua(L, index)) {
+      return nullptr;
+    }
     return processor;
   }
 
@@ -257,4 +1206,72 @@ std::unique_ptr<EventProcessor> MakeProcessorFromLua(lua_State *L, int index,
   return nullptr;
 }
 
+// Factory for the processors which can be saved in snapshots.
+std::unique_ptr<EventProcessor> MakeProcessorFromSnapshot(SnapshotReader* in,
+                                                          const std::string& name,
+                                                          snd_seq_t *seq_handle,
+                                                          PortRegistry* ports) {
+  std::string type;
+  if (!in->ReadString(&type)) {
+    return nullptr;
+  }
 
+  std::unique_ptr<EventProcessor> processor;
+  bool ok = false;
+  if (type == "midi_input") {
+    processor = std::make_unique<MidiInput>(name, seq_handle, ports);
+    ok = true;
+  } else if (type == "midi_output") {
+    processor = std::make_unique<MidiOutput>(name, seq_handle, ports);
+    ok = true;
+  } else if (type == "raw_input" || type == "raw_output") {
+    std::string device;
+    ok = in->ReadString(&device);
+    if (type == "raw_input") {
+      processor = std::make_unique<RawMidiInput>(device, ports);
+    } else {
+      processor = std::make_unique<RawMidiOutput>(device, ports);
+    }
+  } else if (type == "shm_input" || type == "shm_output") {
+    std::string ring;
+    uint64_t capacity = 0;
+    ok = in->ReadString(&ring) && in->ReadU64(&capacity) && capacity > 0;
+    if (type == "shm_input") {
+      processor = std::make_unique<ShmInput>(ring, capacity, ports);
+    } else {
+      processor = std::make_unique<ShmOutput>(ring, capacity, ports);
+    }
+  } else if (type == "note_selector") {
+    auto note_selector = std::make_unique<NoteSelector>();
+    ok = note_selector->LoadSettings(in);
+    processor = std::move(note_selector);
+  } else if (type == "controller_selector") {
+    auto controller_selector = std::make_unique<ControllerSelector>();
+    ok = controller_selector->LoadSettings(in);
+    processor = std::move(controller_selector);
+  } else if (type == "controller_mapping") {
+    auto controller_mapping = std::make_unique<ControllerMapping>();
+    ok = controller_mapping->LoadSettings(in);
+    processor = std::move(controller_mapping);
+  } else if (type == "delay") {
+    auto delay = std::make_unique<Delay>();
+    ok = delay->LoadSettings(in);
+    processor = std::move(delay);
+  } else if (type == "note_length") {
+    auto note_length = std::make_unique<NoteLength>();
+    ok = note_length->LoadSettings(in);
+    processor = std::move(note_length);
+  } else if (type == "controller_filter") {
+    auto controller_filter = std::make_unique<ControllerFilter>();
+    ok = controller_filter->LoadSettings(in);
+    processor = std::move(controller_filter);
+  } else {
+    std::cerr << "Unknown processor type in snapshot: " << type << "\n";
+    return nullptr;
+  }
+  if (!ok) {
+    std::cerr << "Invalid settings in snapshot for processor " << name << "\n";
+    return nullptr;
+  }
+  return processor;
+}
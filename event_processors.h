@@ -2,6 +2,10 @@
 #define _EVENT_PROCESSORS_H
 // Code that actually does the midi event processing.
 
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <cstdint>
 #include <memory>
 #include <iostream>
 #include <vector>
@@ -10,6 +14,13 @@
 #include <lua5.3/lauxlib.h>
 #include <lua5.3/lualib.h>
 
+#include "midi_event.h"
+#include "port_registry.h"
+#include "spsc_ring.h"
+
+class SnapshotReader;
+class SnapshotWriter;
+
 /* All possible note events. */
 const snd_seq_event_type_t NOTE_EVENTS[] = {SND_SEQ_EVENT_NOTEON,
                                             SND_SEQ_EVENT_NOTEOFF,
@@ -45,52 +56,328 @@ public:
   // not allocate memory.
   virtual bool init();
 
-  // Does the actual processing. A given processor can return an arbitrary
-  // number of events, they usually return either one or zero (use that for
-  // filtering).
-  // This method should avoid allocating memory as much as possible.
-  virtual std::vector<snd_seq_event_t>* ProcessEvent(const snd_seq_event_t& ev) = 0;
-  
-protected:
-  // Processed events, preallocated by init().
-  std::vector<snd_seq_event_t> events_;
+  // Does the actual processing: adds the events generated from 'ev' to
+  // 'output' with output->Emit(). A given processor can emit an arbitrary
+  // number of events (up to MaxEventsPerInput()), they usually emit
+  // either one or zero (use that for filtering).
+  // This method must not allocate memory.
+  virtual void ProcessEvent(const MidiEvent& ev, EventBuffer* output) = 0;
+
+  // Processes all events in 'input' and appends the generated events to
+  // 'output', with the origin of the event they were generated from.
+  // Events must be appended in the order of their origin.
+  // The default implementation calls ProcessEvent() on each event, override
+  // it when a processor can do better on a whole batch.
+  virtual void ProcessBatch(const EventBuffer& input, EventBuffer* output);
+
+  // Maximum number of events generated from a single event, used by
+  // ProcessorDAG to size buffers.
+  virtual size_t MaxEventsPerInput() { return 1; }
+  // Preallocates internal buffers, if any, for batches of up to
+  // 'max_input_events' events. Called by ProcessorDAG.
+  virtual void Reserve(size_t max_input_events) {}
+  // Maximum number of events the processor keeps scheduled at once with
+  // EventBuffer::Schedule(), used to size the timer wheel. Events
+  // scheduled beyond that are dropped.
+  virtual size_t MaxPendingEvents() { return 0; }
+  // Called with an event scheduled with EventBuffer::Schedule() when it
+  // is due. The default emits it; processors can emit something else
+  // instead, such as the latest state. Must not schedule events.
+  virtual void ProcessTimer(const MidiEvent& ev, EventBuffer* output) {
+    output->Emit(ev);
+  }
+
+  // Properties used by the graph optimizer (see ProcessorDAG::Finalize).
+  // Returns true if the output only depends on the event being processed.
+  virtual bool IsStateless() { return false; }
+  // Returns true if all valid midi events are let through unchanged.
+  virtual bool PassesEverything() { return false; }
+  // Returns true if 'other' always gives the same output as this processor.
+  virtual bool IsEquivalent(EventProcessor& other) { return false; }
+
+  // Prints counters specific to the processor, if any, on the line of
+  // its statistics (see ProcessorDAG::PrintStats).
+  virtual void PrintStats(std::ostream& out) {}
+
+  // Used by ProcessorDAG to skip processors which can't affect any output
+  // for the events they would get (see ProcessorDAG::Finalize).
+  // Returns the types of the events that may be generated from events of
+  // 'input_types', immediately or later if the processor keeps state.
+  // For output processors, returns the types which have an effect. The
+  // default assumes that any event can generate events of any type.
+  virtual EventTypeSet OutputTypes(const EventTypeSet& input_types);
+
+  // Processors returning the same non-null value use common state, such
+  // as a Lua state, and are never run concurrently (see
+  // ProcessorDAG::SetWorkerPool). Not needed for output processors, which
+  // all run on the same thread.
+  virtual const void* SharedState() { return nullptr; }
+
+  // Writes the type of the processor, as in the Lua config, and its
+  // settings, to be read back by MakeProcessorFromSnapshot() (see
+  // snapshot.h). Returns false for processors which can't be saved.
+  virtual bool SaveSettings(SnapshotWriter* out) { return false; }
 };
 
-class MidiInput: public EventProcessor {
+class MidiInput final: public EventProcessor {
 public:
-  MidiInput(const std::string& name, snd_seq_t *seq_handle):
-    name_(name), seq_handle_(seq_handle) {}
+  // If 'ports' isn't null, the port is acquired from it rather than
+  // created by init().
+  MidiInput(const std::string& name, snd_seq_t *seq_handle,
+            PortRegistry* ports = nullptr):
+    name_(name), seq_handle_(seq_handle), ports_(ports) {}
   virtual bool init() override;
   
   virtual bool HasInputs() override { return false; }
   virtual bool HasOutputs() override { return true; }
 
-  virtual std::vector<snd_seq_event_t>* ProcessEvent(const snd_seq_event_t& ev) override;
+  // Keeps events received on the input port.
+  virtual void ProcessEvent(const MidiEvent& ev, EventBuffer* output) override;
+  virtual void ProcessBatch(const EventBuffer& input, EventBuffer* output) override;
+  virtual EventTypeSet OutputTypes(const EventTypeSet& input_types) override {
+    return input_types;
+  }
+  virtual bool SaveSettings(SnapshotWriter* out) override;
+
+  const std::string& name() const { return name_; }
+  // Port events must be sent to. Only valid after init().
+  int port_num() const { return port_num_; }
   
 private:
   const std::string name_;
   snd_seq_t *seq_handle_;
-  int port_num_;
+  PortRegistry* ports_;
+  int port_num_ = 0;
 };
 
-class MidiOutput: public EventProcessor {
+// Buffered output to the sequencer: events are queued in the client
+// output buffer and sent with a single write when Drain() is called,
+// typically once per batch. Events sent to several outputs or arriving
+// in bursts then cost one system call instead of one each.
+class OutputBuffer {
 public:
-  MidiOutput(const std::string& name, snd_seq_t *seq_handle):
-    name_(name), seq_handle_(seq_handle) {}
+  explicit OutputBuffer(snd_seq_t *seq_handle): seq_handle_(seq_handle) {}
+
+  // Sizes the client output buffer to hold 'num_events' events without
+  // variable-length data. Call before any output.
+  bool Resize(size_t num_events);
+  // Adds an event to the buffer. If the buffer is full, it is drained
+  // first and the overflow is counted. Events larger than the whole
+  // buffer, such as long sysex messages, are then sent directly.
+  void Output(snd_seq_event_t* ev);
+  // Sends all buffered events.
+  void Drain();
+
+  // Prints counters in a human-readable form.
+  void PrintStats(std::ostream& out);
+
+private:
+  snd_seq_t *seq_handle_;
+  // Number of events buffered since the last drain.
+  size_t pending_events_ = 0;
+  // Counters, only accessed by the thread using the buffer.
+  uint64_t events_ = 0;
+  uint64_t drains_ = 0;
+  uint64_t overflows_ = 0;
+  uint64_t direct_events_ = 0;
+  uint64_t errors_ = 0;
+};
+
+class MidiOutput final: public EventProcessor {
+public:
+  // If 'ports' isn't null, the port is acquired from it rather than
+  // created by init().
+  MidiOutput(const std::string& name, snd_seq_t *seq_handle,
+            PortRegistry* ports = nullptr):
+    name_(name), seq_handle_(seq_handle), ports_(ports) {}
   virtual bool init() override;
 
   virtual bool HasInputs() override { return true; }
   virtual bool HasOutputs() override { return false; }
 
-  virtual std::vector<snd_seq_event_t>* ProcessEvent(const snd_seq_event_t& ev) override;
+  // Converts events back to sequencer events and sends them.
+  virtual void ProcessEvent(const MidiEvent& ev, EventBuffer* output) override;
+  virtual void ProcessBatch(const EventBuffer& input, EventBuffer* output) override;
+  virtual size_t MaxEventsPerInput() override { return 0; }
+  virtual EventTypeSet OutputTypes(const EventTypeSet& input_types) override {
+    return input_types & MidiEventTypes();
+  }
+  virtual bool SaveSettings(SnapshotWriter* out) override;
+
+  const std::string& name() const { return name_; }
+  // Port events are sent from. Only valid after init().
+  int port_num() const { return port_num_; }
+
+  // Buffered mode: events are added to 'buffer' instead of being sent
+  // right away. Whoever calls ProcessorDAG::ProcessBatch must then call
+  // buffer->Drain(). Null to go back to direct output.
+  void SetOutputBuffer(OutputBuffer* buffer) { output_buffer_ = buffer; }
+
+  // Queued mode, used when the graph runs on a separate thread: instead
+  // of being sent, events are pushed to 'queue' with 'port' set to the
+  // output port, to be converted and passed to the sequencer by the
+  // thread owning it. Takes precedence over the buffered mode. Events
+  // that don't fit are dropped. Null to go back to direct output.
+  void SetOutputQueue(SpscRing<MidiEvent>* queue) { output_queue_ = queue; }
+  // Number of events dropped because the output queue was full.
+  uint64_t dropped_events() const {
+    return dropped_events_.load(std::memory_order_relaxed);
+  }
 
 private:
+  // Sends one event to the subscribers of the output port.
+  void Send(const MidiEvent& ev);
+
   const std::string name_;
   snd_seq_t *seq_handle_;
-  int port_num_;
+  PortRegistry* ports_;
+  int port_num_ = 0;
+  SeqEventEncoder encoder_;
+  OutputBuffer* output_buffer_ = nullptr;
+  SpscRing<MidiEvent>* output_queue_ = nullptr;
+  std::atomic<uint64_t> dropped_events_{0};
+};
+
+// Input from a raw MIDI device or FIFO (see RawMidiDevice), such as
+// /dev/snd/midiC1D0. Events are read by the thread polling inputs and
+// given to the graph with the port number of the device.
+class RawMidiInput final: public EventProcessor {
+public:
+  // If 'ports' isn't null, the device is acquired from it rather than
+  // opened by init(), and read by the poll loop.
+  RawMidiInput(const std::string& path, PortRegistry* ports = nullptr):
+    path_(path), ports_(ports) {}
+  virtual bool init() override;
+
+  virtual bool HasInputs() override { return false; }
+  virtual bool HasOutputs() override { return true; }
+
+  // Keeps events read from the device.
+  virtual void ProcessEvent(const MidiEvent& ev, EventBuffer* output) override;
+  virtual void ProcessBatch(const EventBuffer& input, EventBuffer* output) override;
+  virtual EventTypeSet OutputTypes(const EventTypeSet& input_types) override {
+    return input_types;
+  }
+  virtual bool SaveSettings(SnapshotWriter* out) override;
+
+  const std::string& path() const { return path_; }
+  // Port of the events read from the device. Only valid after init().
+  int port_num() const { return port_num_; }
+  RawMidiDevice* device() const { return device_.get(); }
+
+private:
+  const std::string path_;
+  PortRegistry* ports_;
+  std::shared_ptr<RawMidiDevice> device_;
+  int port_num_ = 0;
 };
 
-class NoteSelector: public EventProcessor {
+// Output to a raw MIDI device or FIFO. Events are encoded as MIDI 1.0
+// bytes, with running status, and written with a single non-blocking
+// write per batch. Bytes the device can't take are dropped.
+class RawMidiOutput final: public EventProcessor {
+public:
+  // If 'ports' isn't null, the device is acquired from it rather than
+  // opened by init().
+  RawMidiOutput(const std::string& path, PortRegistry* ports = nullptr):
+    path_(path), ports_(ports) {}
+  virtual bool init() override;
+
+  virtual bool HasInputs() override { return true; }
+  virtual bool HasOutputs() override { return false; }
+
+  virtual void ProcessEvent(const MidiEvent& ev, EventBuffer* output) override;
+  virtual void ProcessBatch(const EventBuffer& input, EventBuffer* output) override;
+  virtual size_t MaxEventsPerInput() override { return 0; }
+  virtual EventTypeSet OutputTypes(const EventTypeSet& input_types) override {
+    return input_types & MidiEventTypes();
+  }
+  virtual void PrintStats(std::ostream& out) override;
+  virtual bool SaveSettings(SnapshotWriter* out) override;
+
+  const std::string& path() const { return path_; }
+  RawMidiDevice* device() const { return device_.get(); }
+
+private:
+  const std::string path_;
+  PortRegistry* ports_;
+  std::shared_ptr<RawMidiDevice> device_;
+};
+
+// Input from a shared memory ring (see ShmRing) created by midiflume and
+// fed by another process on the same host. Events are popped by the
+// thread polling inputs and given to the graph with the port number of
+// the ring.
+class ShmInput final: public EventProcessor {
+public:
+  // If 'ports' isn't null, the ring is acquired from it rather than
+  // created by init(), and read by the poll loop.
+  ShmInput(const std::string& ring_name, size_t capacity, PortRegistry* ports = nullptr):
+    ring_name_(ring_name), capacity_(capacity), ports_(ports) {}
+  virtual bool init() override;
+
+  virtual bool HasInputs() override { return false; }
+  virtual bool HasOutputs() override { return true; }
+
+  // Keeps events popped from the ring.
+  virtual void ProcessEvent(const MidiEvent& ev, EventBuffer* output) override;
+  virtual void ProcessBatch(const EventBuffer& input, EventBuffer* output) override;
+  virtual EventTypeSet OutputTypes(const EventTypeSet& input_types) override {
+    return input_types;
+  }
+  virtual bool SaveSettings(SnapshotWriter* out) override;
+
+  const std::string& ring_name() const { return ring_name_; }
+  // Port of the events popped from the ring. Only valid after init().
+  int port_num() const { return port_num_; }
+  ShmRing* ring() const { return ring_.get(); }
+
+private:
+  const std::string ring_name_;
+  const size_t capacity_;
+  PortRegistry* ports_;
+  std::shared_ptr<ShmRing> ring_;
+  int port_num_ = 0;
+};
+
+// Output to a shared memory ring created by midiflume and consumed by
+// another process. Events are pushed without system calls, the consumer
+// is woken up once per batch if it waits. Events which don't fit are
+// dropped.
+class ShmOutput final: public EventProcessor {
+public:
+  // If 'ports' isn't null, the ring is acquired from it rather than
+  // created by init().
+  ShmOutput(const std::string& ring_name, size_t capacity, PortRegistry* ports = nullptr):
+    ring_name_(ring_name), capacity_(capacity), ports_(ports) {}
+  virtual bool init() override;
+
+  virtual bool HasInputs() override { return true; }
+  virtual bool HasOutputs() override { return false; }
+
+  virtual void ProcessEvent(const MidiEvent& ev, EventBuffer* output) override;
+  virtual void ProcessBatch(const EventBuffer& input, EventBuffer* output) override;
+  virtual size_t MaxEventsPerInput() override { return 0; }
+  virtual EventTypeSet OutputTypes(const EventTypeSet& input_types) override {
+    return input_types & MidiEventTypes();
+  }
+  virtual void PrintStats(std::ostream& out) override;
+  virtual bool SaveSettings(SnapshotWriter* out) override;
+
+  const std::string& ring_name() const { return ring_name_; }
+  ShmRing* ring() const { return ring_.get(); }
+
+private:
+  const std::string ring_name_;
+  const size_t capacity_;
+  PortRegistry* ports_;
+  std::shared_ptr<ShmRing> ring_;
+};
+
+// Number of midi channels, used to size per-channel lookup tables.
+const size_t NUM_CHANNELS = 16;
+
+class NoteSelector final: public EventProcessor {
 public:
 
   virtual bool HasInputs() override { return true; }
@@ -105,8 +392,20 @@ public:
 
   NoteSelector() {};
   bool InitFromLua(lua_State *L, int index);
+  // Reads settings written by SaveSettings(), after the type.
+  bool LoadSettings(SnapshotReader* in);
+
+  // Computes the lookup tables from the settings.
+  virtual bool init() override;
   
-  virtual std::vector<snd_seq_event_t>* ProcessEvent(const snd_seq_event_t& ev) override;
+  virtual void ProcessEvent(const MidiEvent& ev, EventBuffer* output) override;
+  virtual void ProcessBatch(const EventBuffer& input, EventBuffer* output) override;
+
+  virtual bool IsStateless() override { return true; }
+  virtual bool PassesEverything() override;
+  virtual bool IsEquivalent(EventProcessor& other) override;
+  virtual EventTypeSet OutputTypes(const EventTypeSet& input_types) override;
+  virtual bool SaveSettings(SnapshotWriter* out) override;
 
   /* Which notes events we want. Empty means all. */
   std::vector<snd_seq_event_type_t> types;
@@ -114,6 +413,22 @@ public:
   std::vector<unsigned char> channels;
 
  private:
+  // What to do with an event, depending on its type.
+  enum TypeAction : unsigned char { kPass, kCheck, kDrop };
+
+  // Returns true if the event must be kept.
+  bool Keep(const MidiEvent& ev) const {
+    switch (type_action_[ev.type]) {
+    case kPass:
+      return true;
+    case kDrop:
+      return false;
+    default:
+      return note_table_[ev.channel % NUM_CHANNELS][ev.data.note.note]
+        && velocity_table_[ev.data.note.velocity];
+    }
+  }
+
   // TODO: add trailing underscore
   /* Lowest note to keep */
   unsigned char lowest_note = 0;
@@ -124,9 +439,17 @@ public:
   unsigned char lowest_velocity = 0;
   /* Highest velocity to keep */
   unsigned char highest_velocity = 127;  
+
+  // Lookup tables computed by init(), all the above settings are
+  // folded into them.
+  std::array<TypeAction, 256> type_action_;
+  // Notes to keep on each channel.
+  std::array<std::bitset<256>, NUM_CHANNELS> note_table_;
+  // Velocities to keep.
+  std::bitset<256> velocity_table_;
 };
 
-class ControllerSelector: public EventProcessor {
+class ControllerSelector final: public EventProcessor {
 public:
   virtual bool HasInputs() override { return true; }
   virtual bool HasOutputs() override { return true; }
@@ -134,21 +457,44 @@ public:
   // Constructs the processor from a lua object.
   ControllerSelector() {};
   bool InitFromLua(lua_State *L, int index);
+  bool LoadSettings(SnapshotReader* in);
+
+  // Computes the lookup table from the settings.
+  virtual bool init() override;
   
-  virtual std::vector<snd_seq_event_t>* ProcessEvent(const snd_seq_event_t& ev) override;
+  virtual void ProcessEvent(const MidiEvent& ev, EventBuffer* output) override;
+  virtual void ProcessBatch(const EventBuffer& input, EventBuffer* output) override;
+
+  virtual bool IsStateless() override { return true; }
+  virtual bool PassesEverything() override;
+  virtual bool IsEquivalent(EventProcessor& other) override;
+  virtual EventTypeSet OutputTypes(const EventTypeSet& input_types) override;
+  virtual bool SaveSettings(SnapshotWriter* out) override;
 
   /* Which channels to keep. Empty means all. */
   std::vector<unsigned char> channels_;
 
  private:
+  // Returns true if the event must be kept.
+  bool Keep(const MidiEvent& ev) const {
+    if (ev.type != SND_SEQ_EVENT_CONTROLLER) {
+      return true;
+    }
+    return ev.data.control.param < 128
+      && controller_table_[ev.channel % NUM_CHANNELS][ev.data.control.param];
+  }
+
   /* Lowest note to keep */
   unsigned char lowest_controller_ = 0;
   /* Highest note to keep */
   unsigned char highest_controller_ = 127;
+
+  // Controllers to keep on each channel, computed by init().
+  std::array<std::bitset<128>, NUM_CHANNELS> controller_table_;
 };
 
 // Maps controller numbers to other ones.
-class ControllerMapping: public EventProcessor {
+class ControllerMapping final: public EventProcessor {
 public:
   virtual bool HasInputs() override { return true; }
   virtual bool HasOutputs() override { return true; }
@@ -161,21 +507,237 @@ public:
     }
   }
   bool InitFromLua(lua_State *L, int index);
+  bool LoadSettings(SnapshotReader* in);
+  // Maps controller 'in_controller' to 'out_controller'. Must be called
+  // before init().
+  void SetMapping(unsigned char in_controller, unsigned char out_controller) {
+    controller_mapping_[in_controller % 128] = out_controller;
+  }
+
+  // Computes the lookup table from the settings.
+  virtual bool init() override;
   
-  virtual std::vector<snd_seq_event_t>* ProcessEvent(const snd_seq_event_t& ev) override;
+  virtual void ProcessEvent(const MidiEvent& ev, EventBuffer* output) override;
+  virtual void ProcessBatch(const EventBuffer& input, EventBuffer* output) override;
 
-  /* Which channels to keep. Empty means all. */
+  virtual bool IsStateless() override { return true; }
+  virtual bool IsEquivalent(EventProcessor& other) override;
+  // Only controller events are kept.
+  virtual EventTypeSet OutputTypes(const EventTypeSet& input_types) override {
+    EventTypeSet output_types;
+    output_types[SND_SEQ_EVENT_CONTROLLER] = input_types[SND_SEQ_EVENT_CONTROLLER];
+    return output_types;
+  }
+  virtual bool SaveSettings(SnapshotWriter* out) override;
+
+  /* Channels the mapping applies to. Empty means all. */
   std::vector<unsigned char> channels_;
 
 private:
+  // Returns the new controller number for a controller event.
+  uint32_t Map(const MidiEvent& ev) const {
+    if (ev.data.control.param >= 128) {
+      return ev.data.control.param;
+    }
+    return remap_table_[ev.channel % NUM_CHANNELS][ev.data.control.param];
+  }
+
   std::vector<unsigned char> controller_mapping_;
+  // New controller number for each channel and controller, computed by
+  // init().
+  std::array<std::array<unsigned char, 128>, NUM_CHANNELS> remap_table_;
+};
+
+// Emits events again later, using the timer wheel of the graph (see
+// EventBuffer::Schedule): 'delay_ms' after they are received, then
+// 'repeats' more times every 'delay_ms', each time with the velocity of
+// note-on events scaled by 'decay_percent' (echo). With 'dry', events
+// are also let through right away and the first delayed copy is already
+// scaled. With 'grid_ms', the first copy is further delayed to the next
+// multiple of 'grid_ms' milliseconds (quantize). Sysex messages are let
+// through right away.
+class Delay final: public EventProcessor {
+public:
+  Delay() {}
+  explicit Delay(uint32_t delay_ms): delay_ms(delay_ms) {}
+  bool InitFromLua(lua_State *L, int index);
+  bool LoadSettings(SnapshotReader* in);
+
+  virtual bool HasInputs() override { return true; }
+  virtual bool HasOutputs() override { return true; }
+
+  virtual void ProcessEvent(const MidiEvent& ev, EventBuffer* output) override;
+  virtual size_t MaxPendingEvents() override { return max_pending; }
+  virtual EventTypeSet OutputTypes(const EventTypeSet& input_types) override {
+    return input_types;
+  }
+  virtual bool SaveSettings(SnapshotWriter* out) override;
+
+  uint32_t delay_ms = 0;
+  uint32_t repeats = 0;
+  uint32_t decay_percent = 100;
+  uint32_t grid_ms = 0;
+  bool dry = false;
+  // Events scheduled beyond that are dropped.
+  size_t max_pending = 4096;
+};
+
+// Gives all notes the same length: note-off events are dropped, and one
+// is emitted 'length_ms' after each note-on.
+class NoteLength final: public EventProcessor {
+public:
+  NoteLength() {}
+  explicit NoteLength(uint32_t length_ms): length_ms(length_ms) {}
+  bool InitFromLua(lua_State *L, int index);
+  bool LoadSettings(SnapshotReader* in);
+
+  virtual bool HasInputs() override { return true; }
+  virtual bool HasOutputs() override { return true; }
+
+  virtual void ProcessEvent(const MidiEvent& ev, EventBuffer* output) override;
+  virtual size_t MaxPendingEvents() override { return max_pending; }
+  virtual EventTypeSet OutputTypes(const EventTypeSet& input_types) override {
+    EventTypeSet output_types = input_types;
+    output_types[SND_SEQ_EVENT_NOTEOFF] = input_types[SND_SEQ_EVENT_NOTEON];
+    return output_types;
+  }
+  virtual bool SaveSettings(SnapshotWriter* out) override;
+
+  uint32_t length_ms = 100;
+  // Notes ending beyond that are dropped.
+  size_t max_pending = 1024;
+};
+
+// Reduces the traffic of controller, pitch bend and channel pressure
+// streams, keeping the last value sent for each controller of each
+// channel: values which differ by less than 'threshold' from it are
+// dropped (1 only drops repeated values), except the extremes of the
+// range so that faders can still reach them. With 'max_events' and
+// 'interval_ms', at most 'max_events' values are sent for a controller
+// every 'interval_ms' milliseconds; later ones are coalesced, and the
+// last of them is sent at the end of the interval. Other events are let
+// through.
+class ControllerFilter final: public EventProcessor {
+public:
+  ControllerFilter() {}
+  bool InitFromLua(lua_State *L, int index);
+  bool LoadSettings(SnapshotReader* in);
+
+  virtual bool HasInputs() override { return true; }
+  virtual bool HasOutputs() override { return true; }
+
+  // Allocates the table of last values.
+  virtual bool init() override;
+
+  virtual void ProcessEvent(const MidiEvent& ev, EventBuffer* output) override;
+  virtual void ProcessTimer(const MidiEvent& ev, EventBuffer* output) override;
+  virtual size_t MaxPendingEvents() override;
+  virtual EventTypeSet OutputTypes(const EventTypeSet& input_types) override {
+    return input_types;
+  }
+  virtual bool SaveSettings(SnapshotWriter* out) override;
+
+  uint32_t threshold = 1;
+  uint32_t max_events = 0;
+  uint32_t interval_ms = 0;
+
+private:
+  // Controllers 0-127, then pitch bend and channel pressure.
+  static const size_t kPitchBendSlot = 128;
+  static const size_t kChannelPressureSlot = 129;
+  static const size_t kSlotsPerChannel = 130;
+
+  struct Slot {
+    // Latest value received while the rate was exceeded, sent at the end
+    // of the interval.
+    MidiEvent pending;
+    // Start of the current interval, and time the pending value is due.
+    uint64_t interval_start_ms = 0;
+    uint64_t flush_ms = 0;
+    int32_t last_value = 0;
+    // Values sent during the current interval.
+    uint32_t sent_in_interval = 0;
+    bool sent = false;
+    bool has_pending = false;
+    bool flush_scheduled = false;
+  };
+
+  // Returns the slot of 'ev', or nullptr for events which are let
+  // through.
+  Slot* GetSlot(const MidiEvent& ev);
+  // Returns true if 'value' must be sent given what 'slot' last sent.
+  bool Changed(const Slot& slot, const MidiEvent& ev) const;
+  void Send(Slot* slot, const MidiEvent& ev, uint64_t now_ms, EventBuffer* output);
+
+  bool rate_limited() const { return max_events > 0 && interval_ms > 0; }
+
+  std::vector<Slot> slots_;
+};
+
+// Built-in processors, which ProcessorDAG and ProcessorChain call without
+// going through virtual functions, see DispatchBatch().
+enum class ProcessorKind : unsigned char {
+  kOther, kMidiInput, kMidiOutput, kNoteSelector, kControllerSelector,
+  kControllerMapping, kProcessorChain
+};
+ProcessorKind GetProcessorKind(EventProcessor* processor);
+// Same as processor->ProcessBatch(input, output), with 'kind' given by
+// GetProcessorKind(processor). Built-in processors are final, so that
+// their ProcessBatch() is called directly and inlined here; other
+// processors go through the virtual call.
+void DispatchBatch(ProcessorKind kind, EventProcessor* processor,
+                   const EventBuffer& input, EventBuffer* output);
+
+// Runs several processors one after the other, as if they were connected
+// in a chain. Created by the graph optimizer to fuse chains of stateless
+// processors into a single node.
+class ProcessorChain final: public EventProcessor {
+public:
+  explicit ProcessorChain(std::vector<std::unique_ptr<EventProcessor>> processors):
+    processors_(std::move(processors)) {}
+
+  virtual bool HasInputs() override { return true; }
+  virtual bool HasOutputs() override { return true; }
+
+  // Processors in the chain must already be initialized.
+  virtual bool init() override;
+
+  virtual void ProcessEvent(const MidiEvent& ev, EventBuffer* output) override;
+  virtual void ProcessBatch(const EventBuffer& input, EventBuffer* output) override;
+  virtual size_t MaxEventsPerInput() override;
+  virtual void Reserve(size_t max_input_events) override;
+
+  virtual bool IsStateless() override { return true; }
+  virtual EventTypeSet OutputTypes(const EventTypeSet& input_types) override;
+
+  const std::vector<std::unique_ptr<EventProcessor>>& processors() {
+    return processors_;
+  }
+
+private:
+  std::vector<std::unique_ptr<EventProcessor>> processors_;
+  // Kind of each processor, see DispatchBatch().
+  std::vector<ProcessorKind> kinds_;
+  // Events passed between processors in the chain.
+  EventBuffer intermediate_[2];
+  // Input of ProcessEvent().
+  EventBuffer single_input_;
 };
 
 // Factory function for EventProcessor. Reads the config from
-// a 'processor' Lua object.
+// a 'processor' Lua object. Inputs and outputs get their ports from
+// 'ports' if not null.
 std::unique_ptr<EventProcessor> MakeProcessorFromLua(lua_State *L, int index,
                                                      const std::string& name,
-                                                     snd_seq_t *seq_handle);
+                                                     snd_seq_t *seq_handle,
+                                                     PortRegistry* ports = nullptr);
+
+// Same as above, from the type and settings written by
+// EventProcessor::SaveSettings().
+std::unique_ptr<EventProcessor> MakeProcessorFromSnapshot(SnapshotReader* in,
+                                                          const std::string& name,
+                                                          snd_seq_t *seq_handle,
+                                                          PortRegistry* ports = nullptr);
 
 #endif
 
@@ -0,0 +1,75 @@
+#ifndef _GRAPH_SLOT_H
+#define _GRAPH_SLOT_H
+// Publication of the processing graph to the threads running it, so that
+// it can be replaced while events are processed.
+
+#include <atomic>
+#include <cstddef>
+
+#include "dag.h"
+
+// Holds the current graph. Readers bracket each use of the graph with
+// Enter() and Exit(), which neither lock nor allocate. The writer
+// publishes a new graph with Publish(), then waits until InUse() returns
+// false before deleting the previous one: a reader that entered before
+// the switch finishes its batch on the previous graph, and gets the new
+// one on its next Enter().
+// Each reader has its own slot, so there can be up to kMaxReaders threads
+// reading concurrently, and a single writer.
+class GraphSlot {
+public:
+  static const size_t kMaxReaders = 3;
+  // Reader slots used by midiflume.
+  static const size_t kProcessingReader = 0;
+  static const size_t kStatsReader = 1;
+  static const size_t kMetricsReader = 2;
+
+  explicit GraphSlot(ProcessorDAG* dag): current_(dag) {}
+  GraphSlot(const GraphSlot&) = delete;
+  GraphSlot& operator=(const GraphSlot&) = delete;
+
+  // Returns the current graph, valid until Exit() is called by the same
+  // reader.
+  ProcessorDAG* Enter(size_t reader) {
+    std::atomic<ProcessorDAG*>& hazard = readers_[reader].dag;
+    ProcessorDAG* dag = current_.load();
+    while (true) {
+      hazard.store(dag);
+      // If the graph didn't change after the store, the writer will see
+      // it in InUse().
+      ProcessorDAG* again = current_.load();
+      if (again == dag) {
+        return dag;
+      }
+      dag = again;
+    }
+  }
+  void Exit(size_t reader) {
+    readers_[reader].dag.store(nullptr, std::memory_order_release);
+  }
+
+  // Writer side. Makes 'dag' the current graph, returns the previous one.
+  ProcessorDAG* Publish(ProcessorDAG* dag) {
+    return current_.exchange(dag);
+  }
+  // Returns true while a reader may still use 'dag'.
+  bool InUse(const ProcessorDAG* dag) const {
+    for (const Reader& reader : readers_) {
+      if (reader.dag.load() == dag) {
+        return true;
+      }
+    }
+    return false;
+  }
+  // The current graph, for the writer or when there is no writer.
+  ProcessorDAG* current() const { return current_.load(std::memory_order_acquire); }
+
+private:
+  std::atomic<ProcessorDAG*> current_;
+  struct Reader {
+    alignas(64) std::atomic<ProcessorDAG*> dag{nullptr};
+  };
+  Reader readers_[kMaxReaders];
+};
+
+#endif
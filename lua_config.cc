@@ -1,7 +1,11 @@
 /* Functions related to the lua configuration file. */
 
+#include <algorithm>
 #include <iostream>
 #include <memory>
+#include <unordered_map>
+#include <utility>
+#include <unistd.h>
 #include <alsa/asoundlib.h>
 #include <lua5.3/lua.h>
 #include <lua5.3/lauxlib.h>
@@ -25,35 +29,62 @@ bool CheckFieldIsTable(lua_State *L, int index,  const char* k) {
 }
 
 // Creates processors based on the info from the table at position 'index'.
-bool AddProcessors(lua_State *L, int index, ProcessorDAG *dag, snd_seq_t *seq_handle) {
-  std::string name;
+// Processors are added in the order of 'order', the names of the
+// processors in the order they were declared, then by name, so that the
+// graph doesn't depend on the iteration order of the table.
+bool AddProcessors(lua_State *L, int index, const std::vector<std::string>& order,
+                   ProcessorDAG *dag, snd_seq_t *seq_handle,
+                   PortRegistry* ports, GraphSnapshot* snapshot) {
+  index = lua_absindex(L, index);
+  std::vector<std::string> names;
   
   // Iterate over processors.
   lua_pushnil(L);  /* first key */
-  while (lua_next(L, index-1) != 0) {
+  while (lua_next(L, index) != 0) {
     /* uses 'key' (at index -2) and 'value' (at index -1) */
     if (lua_isstring(L, -2)) {
-      name = lua_tolstring(L, index-1, nullptr);
-      std::cerr << "Adding processor: " << name << "\n";
-
-      auto processor = MakeProcessorFromLua(L, -1, name, seq_handle);
-
-      if (processor == nullptr) {
-        lua_pop(L, 1);
-        return false;
-      }
-      dag->AddProcessor(std::move(processor), name);
+      // Converting a number key in place would confuse lua_next().
+      lua_pushvalue(L, -2);
+      names.push_back(lua_tostring(L, -1));
+      lua_pop(L, 1);
     }
 
     /* removes 'value'; keeps 'key' for next iteration */
     lua_pop(L, 1);
   }
+
+  std::unordered_map<std::string, size_t> ranks;
+  for (size_t i = 0; i < order.size(); i++) {
+    ranks.emplace(order[i], i);
+  }
+  const auto rank = [&](const std::string& name) {
+    const auto position = ranks.find(name);
+    return position == ranks.end() ? order.size() : position->second;
+  };
+  std::sort(names.begin(), names.end(), [&](const std::string& a, const std::string& b) {
+    return std::make_pair(rank(a), a) < std::make_pair(rank(b), b);
+  });
+
+  for (const std::string& name : names) {
+    std::cerr << "Adding processor: " << name << "\n";
+    lua_getfield(L, index, name.c_str());
+    auto processor = MakeProcessorFromLua(L, -1, name, seq_handle, ports);
+    lua_pop(L, 1);
+    if (processor == nullptr) {
+      return false;
+    }
+    if (snapshot != nullptr) {
+      snapshot->AddProcessor(processor.get(), name);
+    }
+    dag->AddProcessor(std::move(processor), name);
+  }
   return true;
 }
 
 // Creates connections between processor based on the info from the table
 // at position 'index'
-bool AddConnections(lua_State *L, int index, ProcessorDAG *dag) {
+bool AddConnections(lua_State *L, int index, ProcessorDAG *dag,
+                    GraphSnapshot* snapshot) {
   // Iterate over connections.
   lua_pushnil(L);  /* first key */
   while (lua_next(L, index-1) != 0) {
@@ -66,6 +97,9 @@ bool AddConnections(lua_State *L, int index, ProcessorDAG *dag) {
       std::cerr << "Adding connection: " << input_name
                 << " -> " << output_name << "\n";
       RETURN_IF_FALSE(dag->AddConnection(input_name, output_name));
+      if (snapshot != nullptr) {
+        snapshot->AddConnection(input_name, output_name);
+      }
     } else {
       std::cerr << "Unexpected non-table value for connection information.\n";
       PrintStackTypes(L, 1);
@@ -79,7 +113,9 @@ bool AddConnections(lua_State *L, int index, ProcessorDAG *dag) {
 
 bool GetProcessingGraph(lua_State *L,
                         snd_seq_t *seq_handle,
-                        ProcessorDAG *dag) {
+                        ProcessorDAG *dag,
+                        PortRegistry* ports,
+                        GraphSnapshot* snapshot) {
 
   // Load the config object and do some basic checks.
   lua_getglobal(L, "config");
@@ -95,12 +131,18 @@ bool GetProcessingGraph(lua_State *L,
   
   // Now we know that config.connections and config.processors are tables.
   //  PrintStackTypes(L, 4);
+  // Declaration order, recorded by mflib. Processors of other configs are
+  // added by name.
+  std::vector<std::string> order;
+  if (!GetStringListField(L, -1, "processor_order", &order, false)) {
+    order.clear();
+  }
   lua_getfield(L, -1, "processors");  
-  RETURN_IF_FALSE(AddProcessors(L, -1, dag, seq_handle));
+  RETURN_IF_FALSE(AddProcessors(L, -1, order, dag, seq_handle, ports, snapshot));
   lua_pop(L, 1);
 
   lua_getfield(L, -1, "connections");  
-  RETURN_IF_FALSE(AddConnections(L, -1, dag));
+  RETURN_IF_FALSE(AddConnections(L, -1, dag, snapshot));
   lua_pop(L, 1);
 
   return dag->Finalize();
@@ -148,3 +190,56 @@ bool GetClientName(lua_State *L, std::string *client_name) {
   lua_pop(L, 1);
   return true;
 }
+
+std::vector<std::string> GetConfigFiles(lua_State *L, const std::string& lua_filename) {
+  std::vector<std::string> filenames = {lua_filename};
+  lua_getglobal(L, "package");
+  if (!lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    return filenames;
+  }
+  std::string path;
+  GetStringField(L, -1, "path", &path, false);
+  lua_getfield(L, -1, "loaded");
+  if (!lua_istable(L, -1)) {
+    lua_pop(L, 2);
+    return filenames;
+  }
+  // Finds the file of each loaded module the way require() does, see
+  // package.searchpath. Built-in libraries have none.
+  lua_pushnil(L);  /* first key */
+  while (lua_next(L, -2) != 0) {
+    if (lua_type(L, -2) == LUA_TSTRING) {
+      std::string module = lua_tolstring(L, -2, nullptr);
+      for (auto& c: module) {
+        if (c == '.') {
+          c = '/';
+        }
+      }
+      size_t start = 0;
+      while (start <= path.size()) {
+        size_t end = path.find(';', start);
+        if (end == std::string::npos) {
+          end = path.size();
+        }
+        std::string filename;
+        for (size_t i = start; i < end; i++) {
+          if (path[i] == '?') {
+            filename += module;
+          } else {
+            filename += path[i];
+          }
+        }
+        if (!filename.empty() && access(filename.c_str(), R_OK) == 0) {
+          filenames.push_back(filename);
+          break;
+        }
+        start = end + 1;
+      }
+    }
+    /* removes 'value'; keeps 'key' for next iteration */
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 2);
+  return filenames;
+}
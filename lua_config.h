@@ -2,10 +2,24 @@
 #define _LUA_CONFIG_H
 
 #include <alsa/asoundlib.h>
+#include <string>
+#include <vector>
 #include "dag.h"
+#include "port_registry.h"
+#include "snapshot.h"
 
+// Builds and finalizes the graph described by the 'config' table. Ports
+// of inputs and outputs are acquired from 'ports' if not null. The graph
+// is also recorded in 'snapshot' if not null. Processors are added in the
+// order they were declared with mflib (see 'processor_order'), or by name,
+// so that inputs and outputs are always numbered in the same order.
 bool GetProcessingGraph(lua_State *L, snd_seq_t *seq_handle,
-                        ProcessorDAG *dag);
+                        ProcessorDAG *dag, PortRegistry* ports = nullptr,
+                        GraphSnapshot* snapshot = nullptr);
+
+// Returns the files a config was read from: 'lua_filename', then the
+// files of the Lua modules it loaded, such as mflib.lua.
+std::vector<std::string> GetConfigFiles(lua_State *L, const std::string& lua_filename);
 
 bool ReadConfigFile(const std::string& lua_filename, lua_State **L);
 bool GetClientName(lua_State *L, std::string *client_name);
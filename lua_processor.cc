@@ -0,0 +1,356 @@
+// Processor running a Lua function from the config.
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <lua5.3/lua.h>
+#include <lua5.3/lauxlib.h>
+
+#include "lua_processor.h"
+#include "lua_util.h"
+
+const char kEventMetatable[] = "midiflume.event";
+const char kBatchMetatable[] = "midiflume.batch";
+
+// Error object raised when a call runs out of budget.
+static char budget_exceeded;
+
+static void BudgetHook(lua_State *L, lua_Debug *ar) {
+  lua_pushlightuserdata(L, &budget_exceeded);
+  lua_error(L);
+}
+
+// Event fields accessible from Lua.
+enum class EventField {
+  kUnknown, kType, kChannel, kPort, kTime, kNote, kVelocity, kOffVelocity,
+  kDuration, kParam, kValue, kDrop
+};
+
+static EventField GetEventField(lua_State *L, int index) {
+  if (lua_type(L, index) != LUA_TSTRING) {
+    return EventField::kUnknown;
+  }
+  const char* name = lua_tostring(L, index);
+  static const struct {
+    const char* name;
+    EventField field;
+  } kFields[] = {
+    {"type", EventField::kType}, {"channel", EventField::kChannel},
+    {"port", EventField::kPort}, {"time", EventField::kTime},
+    {"note", EventField::kNote}, {"velocity", EventField::kVelocity},
+    {"off_velocity", EventField::kOffVelocity},
+    {"duration", EventField::kDuration}, {"param", EventField::kParam},
+    {"value", EventField::kValue}, {"drop", EventField::kDrop},
+  };
+  for (const auto& field : kFields) {
+    if (strcmp(name, field.name) == 0) {
+      return field.field;
+    }
+  }
+  return EventField::kUnknown;
+}
+
+static LuaProcessor::Slot* CheckEvent(lua_State *L) {
+  return *static_cast<LuaProcessor::Slot**>(luaL_checkudata(L, 1, kEventMetatable));
+}
+
+// __index of events: event.field
+static int EventIndex(lua_State *L) {
+  const LuaProcessor::Slot* slot = CheckEvent(L);
+  const MidiEvent& ev = slot->event;
+  switch (GetEventField(L, 2)) {
+  case EventField::kType: lua_pushinteger(L, ev.type); break;
+  case EventField::kChannel: lua_pushinteger(L, ev.channel); break;
+  case EventField::kPort: lua_pushinteger(L, ev.port); break;
+  case EventField::kTime: lua_pushinteger(L, ev.time); break;
+  case EventField::kNote: lua_pushinteger(L, ev.data.note.note); break;
+  case EventField::kVelocity: lua_pushinteger(L, ev.data.note.velocity); break;
+  case EventField::kOffVelocity: lua_pushinteger(L, ev.data.note.off_velocity); break;
+  case EventField::kDuration: lua_pushinteger(L, ev.data.note.duration); break;
+  case EventField::kParam: lua_pushinteger(L, ev.data.control.param); break;
+  case EventField::kValue: lua_pushinteger(L, ev.data.control.value); break;
+  case EventField::kDrop: lua_pushboolean(L, slot->drop); break;
+  default: lua_pushnil(L); break;
+  }
+  return 1;
+}
+
+// Raises a Lua error unless 0 <= 'value' <= 'max'.
+static void CheckRange(lua_State *L, lua_Integer value, lua_Integer max,
+                       const char* field) {
+  if (value < 0 || value > max) {
+    luaL_error(L, "invalid %s %I", field, value);
+  }
+}
+
+// __newindex of events: event.field = value
+static int EventNewIndex(lua_State *L) {
+  LuaProcessor::Slot* slot = CheckEvent(L);
+  MidiEvent& ev = slot->event;
+  const EventField field = GetEventField(L, 2);
+  if (field == EventField::kDrop) {
+    slot->drop = lua_toboolean(L, 3);
+    return 0;
+  }
+  if (field == EventField::kUnknown || field == EventField::kPort
+      || field == EventField::kTime) {
+    return luaL_error(L, "cannot set event field '%s'",
+                      lua_type(L, 2) == LUA_TSTRING ? lua_tostring(L, 2) : "?");
+  }
+  const lua_Integer value = luaL_checkinteger(L, 3);
+  switch (field) {
+  case EventField::kType:
+    // Sysex events are made of several chunks.
+    if (value < 0 || value > 255 || value == SND_SEQ_EVENT_SYSEX
+        || !MidiEventTypes()[value]) {
+      return luaL_error(L, "invalid event type %d", static_cast<int>(value));
+    }
+    ev.type = value;
+    break;
+  case EventField::kChannel:
+    CheckRange(L, value, 15, "channel");
+    ev.channel = value;
+    break;
+  case EventField::kNote:
+    CheckRange(L, value, 127, "note");
+    ev.data.note.note = value;
+    break;
+  case EventField::kVelocity:
+    CheckRange(L, value, 127, "velocity");
+    ev.data.note.velocity = value;
+    break;
+  case EventField::kOffVelocity:
+    CheckRange(L, value, 127, "off_velocity");
+    ev.data.note.off_velocity = value;
+    break;
+  case EventField::kDuration: ev.data.note.duration = value; break;
+  case EventField::kParam:
+    // Up to 14 bits for (non-)registered parameters.
+    CheckRange(L, value, 16383, "param");
+    ev.data.control.param = value;
+    break;
+  case EventField::kValue: ev.data.control.value = value; break;
+  default: break;
+  }
+  return 0;
+}
+
+// __index of batches: batch[i], 1-based.
+static int BatchIndex(lua_State *L) {
+  const size_t size = *static_cast<size_t*>(luaL_checkudata(L, 1, kBatchMetatable));
+  int is_integer;
+  const lua_Integer i = lua_tointegerx(L, 2, &is_integer);
+  if (!is_integer || i < 1 || static_cast<size_t>(i) > size) {
+    lua_pushnil(L);
+    return 1;
+  }
+  // Events of the batch are kept in the user value.
+  lua_getuservalue(L, 1);
+  lua_rawgeti(L, -1, i);
+  return 1;
+}
+
+// __len of batches: #batch
+static int BatchLength(lua_State *L) {
+  lua_pushinteger(L, *static_cast<size_t*>(luaL_checkudata(L, 1, kBatchMetatable)));
+  return 1;
+}
+
+static void CreateMetatables(lua_State *L) {
+  if (luaL_newmetatable(L, kEventMetatable)) {
+    lua_pushcfunction(L, EventIndex);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, EventNewIndex);
+    lua_setfield(L, -2, "__newindex");
+  }
+  lua_pop(L, 1);
+  if (luaL_newmetatable(L, kBatchMetatable)) {
+    lua_pushcfunction(L, BatchIndex);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, BatchLength);
+    lua_setfield(L, -2, "__len");
+  }
+  lua_pop(L, 1);
+}
+
+// Pushes a new event object for 'slot'.
+static void PushEvent(lua_State *L, LuaProcessor::Slot* slot) {
+  auto event = static_cast<LuaProcessor::Slot**>(lua_newuserdata(L, sizeof(slot)));
+  *event = slot;
+  luaL_setmetatable(L, kEventMetatable);
+}
+
+bool LuaProcessor::InitFromLua(lua_State *L, int index) {
+  index = lua_absindex(L, index);
+  lua_getfield(L, index, "process");
+  if (!lua_isfunction(L, -1)) {
+    lua_pop(L, 1);
+    lua_getfield(L, index, "process_batch");
+    if (!lua_isfunction(L, -1)) {
+      std::cerr << "lua_processor needs a \"process\" or \"process_batch\" function\n";
+      lua_pop(L, 1);
+      return false;
+    }
+    per_batch_ = true;
+  }
+  function_ref_ = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  GetIntegerField(L, index, "budget", &budget_, false);
+  if (budget_ <= 0) {
+    std::cerr << "lua_processor budget must be positive\n";
+    return false;
+  }
+  std::string on_error;
+  if (GetStringField(L, index, "on_error", &on_error, false)) {
+    if (on_error != "drop" && on_error != "pass") {
+      std::cerr << "on_error must be \"drop\" or \"pass\", not " << on_error << "\n";
+      return false;
+    }
+    pass_on_error_ = on_error == "pass";
+  }
+  GetIntegerField(L, index, "gc_step_kb", &gc_step_kb_, false);
+
+  CreateMetatables(L);
+  PushEvent(L, &event_slot_);
+  event_ref_ = luaL_ref(L, LUA_REGISTRYINDEX);
+  if (per_batch_) {
+    auto size = static_cast<size_t*>(lua_newuserdata(L, sizeof(size_t)));
+    *size = 0;
+    luaL_setmetatable(L, kBatchMetatable);
+    batch_ref_ = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+
+  // Lua 5.3 only has an incremental collector. Rather than letting it
+  // run whenever a script allocates, it's stopped and advanced by a small
+  // step after each batch.
+  if (gc_step_kb_ > 0) {
+    lua_gc(L, LUA_GCSTOP, 0);
+  }
+  return true;
+}
+
+void LuaProcessor::Reserve(size_t max_input_events) {
+  if (!per_batch_) {
+    return;
+  }
+  batch_capacity_ = std::max<size_t>(max_input_events, 1);
+  batch_slots_ = std::make_unique<Slot[]>(batch_capacity_);
+  lua_rawgeti(L_, LUA_REGISTRYINDEX, batch_ref_);
+  lua_createtable(L_, batch_capacity_, 0);
+  for (size_t i = 0; i < batch_capacity_; i++) {
+    PushEvent(L_, &batch_slots_[i]);
+    lua_rawseti(L_, -2, i + 1);
+  }
+  lua_setuservalue(L_, -2);
+  lua_pop(L_, 1);
+}
+
+bool LuaProcessor::Call(int num_args, int budget) {
+  const auto start = std::chrono::steady_clock::now();
+  // Setting the hook also resets its instruction count.
+  lua_sethook(L_, BudgetHook, LUA_MASKCOUNT, budget);
+  const int status = lua_pcall(L_, num_args, 1, 0);
+  lua_sethook(L_, nullptr, 0, 0);
+  const auto end = std::chrono::steady_clock::now();
+  call_latency_.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+      end - start).count());
+  IncrementCounter(&calls_, 1);
+  if (status != LUA_OK) {
+    IncrementCounter(lua_touserdata(L_, -1) == &budget_exceeded ? &overruns_ : &errors_, 1);
+    lua_pop(L_, 1);
+    return false;
+  }
+  return true;
+}
+
+void LuaProcessor::ProcessOne(const MidiEvent& ev, uint32_t origin, EventBuffer* output) {
+  if (ev.type == SND_SEQ_EVENT_SYSEX) {
+    output->push_back(ev, origin);
+    return;
+  }
+  event_slot_.event = ev;
+  event_slot_.drop = false;
+  lua_rawgeti(L_, LUA_REGISTRYINDEX, function_ref_);
+  lua_rawgeti(L_, LUA_REGISTRYINDEX, event_ref_);
+  if (!Call(1, budget_)) {
+    if (pass_on_error_) {
+      output->push_back(ev, origin);
+    }
+    return;
+  }
+  const bool returned_false = lua_isboolean(L_, -1) && !lua_toboolean(L_, -1);
+  lua_pop(L_, 1);
+  if (!returned_false && !event_slot_.drop) {
+    output->push_back(event_slot_.event, origin);
+  }
+}
+
+void LuaProcessor::ProcessEvent(const MidiEvent& ev, EventBuffer* output) {
+  ProcessOne(ev, output->current_origin(), output);
+  CollectGarbage();
+}
+
+void LuaProcessor::ProcessBatch(const EventBuffer& input, EventBuffer* output) {
+  if (!per_batch_) {
+    for (size_t i = 0; i < input.size(); i++) {
+      ProcessOne(input.event(i), input.origin(i), output);
+    }
+    CollectGarbage();
+    return;
+  }
+
+  // Batches larger than what Reserve() allowed are split.
+  size_t begin = 0;
+  while (begin < input.size()) {
+    size_t end = begin;
+    size_t size = 0;
+    for (; end < input.size() && size < batch_capacity_; end++) {
+      if (input.event(end).type != SND_SEQ_EVENT_SYSEX) {
+        batch_slots_[size].event = input.event(end);
+        batch_slots_[size].drop = false;
+        size++;
+      }
+    }
+    bool ok = true;
+    if (size > 0) {
+      lua_rawgeti(L_, LUA_REGISTRYINDEX, function_ref_);
+      lua_rawgeti(L_, LUA_REGISTRYINDEX, batch_ref_);
+      *static_cast<size_t*>(lua_touserdata(L_, -1)) = size;
+      ok = Call(1, static_cast<int>(std::min<size_t>(budget_ * size, INT_MAX)));
+      if (ok) {
+        lua_pop(L_, 1);
+      }
+    }
+    size_t slot = 0;
+    for (size_t i = begin; i < end; i++) {
+      if (input.event(i).type == SND_SEQ_EVENT_SYSEX) {
+        output->push_back(input.event(i), input.origin(i));
+      } else if (!ok) {
+        if (pass_on_error_) {
+          output->push_back(input.event(i), input.origin(i));
+        }
+      } else if (!batch_slots_[slot++].drop) {
+        output->push_back(batch_slots_[slot - 1].event, input.origin(i));
+      }
+    }
+    begin = end;
+  }
+  CollectGarbage();
+}
+
+void LuaProcessor::CollectGarbage() {
+  if (gc_step_kb_ > 0) {
+    lua_gc(L_, LUA_GCSTEP, gc_step_kb_);
+  }
+}
+
+void LuaProcessor::PrintStats(std::ostream& out) {
+  out << " lua: calls=" << calls_.load(std::memory_order_relaxed)
+      << " overruns=" << overruns_.load(std::memory_order_relaxed)
+      << " errors=" << errors_.load(std::memory_order_relaxed)
+      << " call latency: ";
+  PrintHistogram(call_latency_, out);
+}
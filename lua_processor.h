@@ -0,0 +1,89 @@
+#ifndef _LUA_PROCESSOR_H
+#define _LUA_PROCESSOR_H
+// Processor running a Lua function from the config on each event or
+// batch of events.
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <lua5.3/lua.h>
+#include <lua5.3/lauxlib.h>
+
+#include "event_processors.h"
+#include "midi_event.h"
+#include "stats.h"
+
+// Calls a user-defined Lua function, in the Lua state the config was
+// read from, which must outlive the processor.
+// Events are passed as userdata objects allocated once, whose fields
+// (type, channel, port, time, note, velocity, off_velocity, duration,
+// param, value) read and write the event in place, so that a script
+// that doesn't build tables or strings generates no garbage. Setting
+// 'drop' to true removes the event.
+// With 'process', the function is called on each event, and the event is
+// also dropped if it returns false. With 'process_batch', it is called
+// once per batch with an object holding all events: batch[i] for i in
+// 1..#batch. Sysex events are not given to the function and pass through.
+// Each call is interrupted once it ran 'budget' Lua instructions (per
+// event for batches), as well as on errors; the events it was given are
+// then dropped, or passed unchanged with on_error = "pass".
+class LuaProcessor: public EventProcessor {
+public:
+  LuaProcessor(lua_State *L): L_(L) {}
+
+  virtual bool HasInputs() override { return true; }
+  virtual bool HasOutputs() override { return true; }
+
+  // Reads the function and settings from the processor table.
+  bool InitFromLua(lua_State *L, int index);
+
+  virtual void ProcessEvent(const MidiEvent& ev, EventBuffer* output) override;
+  virtual void ProcessBatch(const EventBuffer& input, EventBuffer* output) override;
+  virtual void Reserve(size_t max_input_events) override;
+  virtual void PrintStats(std::ostream& out) override;
+  // All Lua processors of a config use the same Lua state.
+  virtual const void* SharedState() override { return L_; }
+
+  // Event as seen by Lua.
+  struct Slot {
+    MidiEvent event;
+    bool drop;
+  };
+
+private:
+  // Calls the function with 'num_args' arguments already pushed after
+  // it, with a budget of 'budget' instructions. Leaves its result on the
+  // stack, or returns false if it didn't complete.
+  bool Call(int num_args, int budget);
+  // Runs the function on a single event.
+  void ProcessOne(const MidiEvent& ev, uint32_t origin, EventBuffer* output);
+  void CollectGarbage();
+
+  lua_State *L_;
+  // Registry references to the function, to the userdata for single
+  // events and to the batch userdata, whose events are in its user value.
+  int function_ref_ = LUA_NOREF;
+  int event_ref_ = LUA_NOREF;
+  int batch_ref_ = LUA_NOREF;
+  bool per_batch_ = false;
+  int budget_ = 10000;
+  bool pass_on_error_ = false;
+  // Size of the incremental garbage collection step done after each call,
+  // see InitFromLua().
+  int gc_step_kb_ = 1;
+
+  Slot event_slot_;
+  // Events of the current batch, allocated by Reserve().
+  std::unique_ptr<Slot[]> batch_slots_;
+  size_t batch_capacity_ = 0;
+
+  // Only written by the thread running the graph.
+  std::atomic<uint64_t> calls_{0};
+  std::atomic<uint64_t> overruns_{0};
+  std::atomic<uint64_t> errors_{0};
+  // Duration of each call, garbage collection included.
+  LatencyHistogram call_latency_;
+};
+
+#endif
@@ -38,6 +38,63 @@ bool GetIntegerField(lua_State *L, int index, const char* field_name, int* value
   return true;
 }
 
+bool GetIntegerListField(lua_State *L, int index, const char* field_name,
+                         std::vector<int>* values, bool missing_is_error) {
+  // Returns the list of integers obtained from field 'field_name' extracted
+  // from table at index 'index'.
+  lua_getfield(L, index, field_name);
+  if (!lua_istable(L, -1)) {
+    if (missing_is_error) {
+      std::cerr << "field \"" << field_name << "\" is not a table\n";
+    }
+    lua_pop(L, 1);
+    return false;
+  }
+  values->clear();
+  const lua_Integer length = lua_rawlen(L, -1);
+  for (lua_Integer i = 1; i <= length; i++) {
+    lua_rawgeti(L, -1, i);
+    if (!lua_isinteger(L, -1)) {
+      std::cerr << "field \"" << field_name << "\" is not a list of integers\n";
+      lua_pop(L, 2);
+      return false;
+    }
+    values->push_back(lua_tointeger(L, -1));
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  return true;
+}
+
+bool GetStringListField(lua_State *L, int index, const char* field_name,
+                        std::vector<std::string>* values,
+                        bool missing_is_error) {
+  // Returns the list of strings obtained from field 'field_name' extracted
+  // from table at index 'index'.
+  lua_getfield(L, index, field_name);
+  if (!lua_istable(L, -1)) {
+    if (missing_is_error) {
+      std::cerr << "field \"" << field_name << "\" is not a table\n";
+    }
+    lua_pop(L, 1);
+    return false;
+  }
+  values->clear();
+  const lua_Integer length = lua_rawlen(L, -1);
+  for (lua_Integer i = 1; i <= length; i++) {
+    lua_rawgeti(L, -1, i);
+    if (!lua_isstring(L, -1)) {
+      std::cerr << "field \"" << field_name << "\" is not a list of strings\n";
+      lua_pop(L, 2);
+      return false;
+    }
+    values->push_back(lua_tolstring(L, -1, nullptr));
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  return true;
+}
+
 void PrintStackTypes(lua_State *L, int num) {
   std::cerr << "= Lua stack types\n";
   for (int i = 1; i < num+1; i++) {
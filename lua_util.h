@@ -1,5 +1,7 @@
 #ifndef _LUA_UTIL_H
 #define _LUA_UTIL_H
+#include <string>
+#include <vector>
 #include <lua5.3/lua.h>
 
 #define RETURN_IF_FALSE(EXPR) if (!(EXPR)) { return false; }
@@ -7,5 +9,10 @@ bool GetStringField(lua_State *L, int index, const char* field_name, std::string
                     bool missing_is_error = true);
 bool GetIntegerField(lua_State *L, int index, const char* field_name, int* value,
                      bool missing_is_error = true);
+bool GetIntegerListField(lua_State *L, int index, const char* field_name,
+                         std::vector<int>* values, bool missing_is_error = true);
+bool GetStringListField(lua_State *L, int index, const char* field_name,
+                        std::vector<std::string>* values,
+                        bool missing_is_error = true);
 void PrintStackTypes(lua_State *L, int num);
 #endif
@@ -0,0 +1,172 @@
+// Metrics published in shared memory.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <new>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "timer_wheel.h"
+
+// Attempts at reading a consistent copy, which only fail if the writer
+// updates the segment at the same time.
+const int kMaxReadAttempts = 100;
+
+std::string MetricsSegmentName(const std::string& client_name) {
+  std::string name = "/midiflume-" + client_name;
+  // Shared memory object names can't hold other slashes.
+  for (size_t i = 1; i < name.size(); i++) {
+    if (name[i] == '/') {
+      name[i] = '_';
+    }
+  }
+  return name;
+}
+
+void SetMetricName(ProcessorMetrics* metrics, const std::string& name) {
+  const size_t size = std::min(name.size(), kMetricsNameSize - 1);
+  for (size_t i = 0; i < kMetricsNameSize; i++) {
+    metrics->name[i].store(i < size ? name[i] : '\0', std::memory_order_relaxed);
+  }
+}
+
+MetricsWriter::~MetricsWriter() {
+  if (segment_ != nullptr) {
+    munmap(segment_, sizeof(MetricsSegment));
+    shm_unlink(name_.c_str());
+  }
+}
+
+bool MetricsWriter::Open(const std::string& name) {
+  const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    std::cerr << "Cannot create shared memory " << name << ": "
+              << strerror(errno) << "\n";
+    return false;
+  }
+  void* data = MAP_FAILED;
+  if (ftruncate(fd, sizeof(MetricsSegment)) == 0) {
+    data = mmap(nullptr, sizeof(MetricsSegment), PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (data == MAP_FAILED) {
+    std::cerr << "Cannot map shared memory " << name << ": "
+              << strerror(errno) << "\n";
+    shm_unlink(name.c_str());
+    return false;
+  }
+  name_ = name;
+  segment_ = new (data) MetricsSegment();
+  MetricsHeader& header = segment_->header;
+  header.version = kMetricsVersion;
+  header.size = sizeof(MetricsSegment);
+  SetMetric(&header.pid, getpid());
+  // Readers check the magic first.
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(header.magic, kMetricsMagic, sizeof(kMetricsMagic));
+  return true;
+}
+
+MetricsSegment* MetricsWriter::BeginUpdate() {
+  std::atomic<uint64_t>& sequence = segment_->header.sequence;
+  sequence.store(sequence.load(std::memory_order_relaxed) + 1,
+                 std::memory_order_relaxed);
+  // Orders the odd sequence before the updates.
+  std::atomic_thread_fence(std::memory_order_release);
+  return segment_;
+}
+
+void MetricsWriter::EndUpdate() {
+  SetMetric(&segment_->header.update_time_ns, MonotonicNs());
+  std::atomic<uint64_t>& sequence = segment_->header.sequence;
+  sequence.store(sequence.load(std::memory_order_relaxed) + 1,
+                 std::memory_order_release);
+}
+
+MetricsReader::~MetricsReader() {
+  if (segment_ != nullptr) {
+    munmap(const_cast<MetricsSegment*>(segment_), sizeof(MetricsSegment));
+  }
+}
+
+bool MetricsReader::Open(const std::string& name) {
+  const int fd = shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+  if (fd < 0) {
+    std::cerr << "Cannot open shared memory " << name << ": "
+              << strerror(errno) << "\n";
+    return false;
+  }
+  struct stat st;
+  void* data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(MetricsHeader)) {
+    data = mmap(nullptr, sizeof(MetricsSegment), PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (data == MAP_FAILED) {
+    std::cerr << name << " is not a midiflume metrics segment\n";
+    return false;
+  }
+  const MetricsSegment* segment = static_cast<const MetricsSegment*>(data);
+  if (memcmp(segment->header.magic, kMetricsMagic, sizeof(kMetricsMagic)) != 0
+      || segment->header.version != kMetricsVersion
+      || segment->header.size != sizeof(MetricsSegment)
+      || static_cast<size_t>(st.st_size) < sizeof(MetricsSegment)) {
+    std::cerr << name << " is not a midiflume metrics segment of version "
+              << kMetricsVersion << "\n";
+    munmap(data, sizeof(MetricsSegment));
+    return false;
+  }
+  segment_ = segment;
+  return true;
+}
+
+static uint64_t Load(const std::atomic<uint64_t>& metric) {
+  return metric.load(std::memory_order_relaxed);
+}
+
+bool MetricsReader::Read(MetricsSnapshot* snapshot) const {
+  const std::atomic<uint64_t>& sequence = segment_->header.sequence;
+  for (int attempt = 0; attempt < kMaxReadAttempts; attempt++) {
+    const uint64_t before = sequence.load(std::memory_order_acquire);
+    if (before % 2 != 0) {
+      continue;  // Being updated.
+    }
+    const MetricsHeader& header = segment_->header;
+    snapshot->pid = Load(header.pid);
+    snapshot->update_time_ns = Load(header.update_time_ns);
+    snapshot->num_processors = std::min<uint64_t>(Load(header.num_processors),
+                                                  kMaxMetricsProcessors);
+    const GraphMetrics& graph = segment_->graph;
+    snapshot->graph = {Load(graph.batches), Load(graph.events),
+                       Load(graph.dropped_events), Load(graph.timer_events),
+                       Load(graph.max_latency_ns), Load(graph.dropped_output_events)};
+    const IoMetrics& io = segment_->io;
+    snapshot->io = {Load(io.input_overflows), Load(io.dropped_input_events),
+                    Load(io.input_queue_depth), Load(io.max_input_queue_depth),
+                    Load(io.output_queue_depth), Load(io.max_output_queue_depth)};
+    for (size_t i = 0; i < snapshot->num_processors; i++) {
+      const ProcessorMetrics& metrics = segment_->processors[i];
+      MetricsSnapshot::Processor& processor = snapshot->processors[i];
+      for (size_t j = 0; j < kMetricsNameSize; j++) {
+        processor.name[j] = metrics.name[j].load(std::memory_order_relaxed);
+      }
+      processor.name[kMetricsNameSize - 1] = '\0';
+      processor.events_in = Load(metrics.events_in);
+      processor.events_out = Load(metrics.events_out);
+      processor.dropped_events = Load(metrics.dropped_events);
+      processor.max_latency_ns = Load(metrics.max_latency_ns);
+    }
+    // Orders the copy before checking that the writer didn't change it.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (sequence.load(std::memory_order_relaxed) == before) {
+      return true;
+    }
+  }
+  return false;
+}
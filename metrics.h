@@ -0,0 +1,154 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+// Metrics published in shared memory, so that external tools (see
+// midiflume_stat.cc) can monitor a running midiflume without system
+// calls or locks on either side.
+//
+// The segment is a MetricsSegment, updated periodically by a single
+// writer. Readers take consistent snapshots with a seqlock: the writer
+// makes 'sequence' odd while it updates the segment, readers retry if
+// the sequence was odd or changed while they copied it. All fields are
+// relaxed atomics, padded to cache lines.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+const char kMetricsMagic[8] = {'M', 'F', 'S', 'T', 'A', 'T', '\0', '\0'};
+// Incremented whenever MetricsSegment changes.
+const uint32_t kMetricsVersion = 1;
+const size_t kMaxMetricsProcessors = 512;
+const size_t kMetricsNameSize = 40;
+
+struct alignas(64) MetricsHeader {
+  char magic[8];
+  uint32_t version;
+  // sizeof(MetricsSegment).
+  uint32_t size;
+  std::atomic<uint64_t> sequence;
+  std::atomic<uint64_t> pid;
+  // CLOCK_MONOTONIC time of the last update, in nanoseconds.
+  std::atomic<uint64_t> update_time_ns;
+  // Number of entries of MetricsSegment::processors in use.
+  std::atomic<uint64_t> num_processors;
+};
+
+// Counters of the current graph, see GraphStats.
+struct alignas(64) GraphMetrics {
+  std::atomic<uint64_t> batches;
+  std::atomic<uint64_t> events;
+  std::atomic<uint64_t> dropped_events;
+  std::atomic<uint64_t> timer_events;
+  std::atomic<uint64_t> max_latency_ns;
+  // Events dropped because the output queue was full, see
+  // MidiOutput::dropped_events().
+  std::atomic<uint64_t> dropped_output_events;
+};
+
+// Counters of the sequencer input and of the queues of the real-time
+// engine. Queue depths are 0 without it.
+struct alignas(64) IoMetrics {
+  // Times the sequencer input buffer overflowed, losing events.
+  std::atomic<uint64_t> input_overflows;
+  // Events dropped because the input queue was full.
+  std::atomic<uint64_t> dropped_input_events;
+  // Current and maximum number of events in the input and output queues.
+  std::atomic<uint64_t> input_queue_depth;
+  std::atomic<uint64_t> max_input_queue_depth;
+  std::atomic<uint64_t> output_queue_depth;
+  std::atomic<uint64_t> max_output_queue_depth;
+};
+
+// Counters of a processor, see ProcessorStats.
+struct alignas(64) ProcessorMetrics {
+  // Processor index and name, as printed by ProcessorDAG::PrintStats,
+  // null-terminated.
+  std::atomic<char> name[kMetricsNameSize];
+  std::atomic<uint64_t> events_in;
+  std::atomic<uint64_t> events_out;
+  std::atomic<uint64_t> dropped_events;
+  std::atomic<uint64_t> max_latency_ns;
+};
+
+struct MetricsSegment {
+  MetricsHeader header;
+  GraphMetrics graph;
+  IoMetrics io;
+  ProcessorMetrics processors[kMaxMetricsProcessors];
+};
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "Shared counters must be lock-free");
+
+// Plain copy of a MetricsSegment, taken by MetricsReader. Only the first
+// 'num_processors' processors are set.
+struct MetricsSnapshot {
+  uint64_t pid = 0;
+  uint64_t update_time_ns = 0;
+  uint64_t num_processors = 0;
+  struct {
+    uint64_t batches, events, dropped_events, timer_events, max_latency_ns,
+        dropped_output_events;
+  } graph = {};
+  struct {
+    uint64_t input_overflows, dropped_input_events, input_queue_depth,
+        max_input_queue_depth, output_queue_depth, max_output_queue_depth;
+  } io = {};
+  struct Processor {
+    char name[kMetricsNameSize];
+    uint64_t events_in, events_out, dropped_events, max_latency_ns;
+  } processors[kMaxMetricsProcessors];
+};
+
+// Name of the shared memory object for client 'client_name', e.g.
+// /midiflume-<client_name>.
+std::string MetricsSegmentName(const std::string& client_name);
+
+// Creates and updates the segment. Only one thread must use it.
+class MetricsWriter {
+public:
+  MetricsWriter() {}
+  ~MetricsWriter();
+  MetricsWriter(const MetricsWriter&) = delete;
+  MetricsWriter& operator=(const MetricsWriter&) = delete;
+
+  // Creates or replaces shared memory object 'name', removed by the
+  // destructor. Returns false on error.
+  bool Open(const std::string& name);
+
+  // Updates must be bracketed by BeginUpdate() and EndUpdate(), and
+  // only use relaxed stores.
+  MetricsSegment* BeginUpdate();
+  void EndUpdate();
+
+private:
+  std::string name_;
+  MetricsSegment* segment_ = nullptr;
+};
+
+// Read-only access to the segment of another process.
+class MetricsReader {
+public:
+  MetricsReader() {}
+  ~MetricsReader();
+  MetricsReader(const MetricsReader&) = delete;
+  MetricsReader& operator=(const MetricsReader&) = delete;
+
+  // Returns false if shared memory object 'name' doesn't exist, or isn't
+  // a segment of this version.
+  bool Open(const std::string& name);
+  // Copies the segment. Returns false if no consistent copy could be
+  // taken after a few attempts.
+  bool Read(MetricsSnapshot* snapshot) const;
+
+private:
+  const MetricsSegment* segment_ = nullptr;
+};
+
+// Helpers for writers.
+inline void SetMetric(std::atomic<uint64_t>* metric, uint64_t value) {
+  metric->store(value, std::memory_order_relaxed);
+}
+void SetMetricName(ProcessorMetrics* metrics, const std::string& name);
+
+#endif
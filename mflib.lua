@@ -55,10 +55,20 @@ end
 
 function mflib.make_empty_config()
    -- set all the default values here.
-   return {
+   local config = {
       processors = {},
       connections = {},
+      -- Names of the processors in the order they were added, which is
+      -- the order they are added to the graph in.
+      processor_order = {},
    }
+   setmetatable(config.processors, {
+      __newindex = function(processors, name, processor)
+         rawset(processors, name, processor)
+         table.insert(config.processor_order, name)
+      end
+   })
+   return config
 end
 
 function mflib.add_input(config, name)
@@ -79,6 +89,58 @@ function mflib.add_output(config, name)
    return name
 end
 
+-- Raw MIDI device or FIFO, e.g. "/dev/snd/midiC1D0".
+function mflib.add_raw_input(config, name, device)
+   check_name(config, name)
+   config.processors[name] = {
+      _obtype = "processor",
+      processor_type="raw_input",
+      device=device
+   }
+   return name
+end
+
+function mflib.add_raw_output(config, name, device)
+   check_name(config, name)
+   config.processors[name] = {
+      _obtype = "processor",
+      processor_type="raw_output",
+      device=device
+   }
+   return name
+end
+
+-- Shared memory ring, e.g. "/midiflume-in", created by midiflume for
+-- another process on the same host. options.size is its capacity in
+-- events.
+function mflib.add_shm_input(config, name, ring, options)
+   check_name(config, name)
+   options = options or {}
+   check_args(options, make_set{"size"})
+   config.processors[name] = merge_tables(
+      {
+         _obtype = "processor",
+         processor_type="shm_input",
+         ring=ring,
+      },
+      options)
+   return name
+end
+
+function mflib.add_shm_output(config, name, ring, options)
+   check_name(config, name)
+   options = options or {}
+   check_args(options, make_set{"size"})
+   config.processors[name] = merge_tables(
+      {
+         _obtype = "processor",
+         processor_type="shm_output",
+         ring=ring,
+      },
+      options)
+   return name
+end
+
 
 function mflib.add_note_selector(config, name, options)
    check_args(options, make_set{"lowest_note", "highest_note",
@@ -95,7 +157,8 @@ function mflib.add_note_selector(config, name, options)
 end
 
 function mflib.add_controller_selector(config, name, options)
-   check_args(options, make_set{"lowest_controller", "highest_controller"})
+   check_args(options, make_set{"lowest_controller", "highest_controller",
+                                "channels"})
 
    config.processors[name] = merge_tables(
       {
@@ -107,7 +170,7 @@ function mflib.add_controller_selector(config, name, options)
 end
 
 function mflib.add_controller_mapping(config, name, options)
-   check_args(options, make_set{"mapping"})
+   check_args(options, make_set{"mapping", "channels"})
 
    config.processors[name] = merge_tables(
       {
@@ -118,6 +181,148 @@ function mflib.add_controller_mapping(config, name, options)
    return name   
 end
 
+-- Emits events 'delay' milliseconds later, 'repeats' more times every
+-- 'delay' milliseconds, scaling note-on velocities by 'decay' percent
+-- each time. 'grid' further delays events to the next multiple of 'grid'
+-- milliseconds.
+function mflib.add_delay(config, name, options)
+   check_args(options, make_set{"delay", "repeats", "decay", "grid",
+                                "max_pending"})
+   check_name(config, name)
+
+   config.processors[name] = merge_tables(
+      {
+         _obtype = "processor",
+         processor_type="delay",
+      },
+      options)
+   return name
+end
+
+-- Same as add_delay, with events also let through right away.
+function mflib.add_echo(config, name, options)
+   check_args(options, make_set{"delay", "repeats", "decay", "max_pending"})
+   check_name(config, name)
+
+   config.processors[name] = merge_tables(
+      {
+         _obtype = "processor",
+         processor_type="echo",
+         repeats=2,
+         decay=70,
+      },
+      options)
+   return name
+end
+
+-- Delays events to the next multiple of 'grid' milliseconds.
+function mflib.add_quantize(config, name, options)
+   check_args(options, make_set{"grid", "max_pending"})
+   check_name(config, name)
+
+   config.processors[name] = merge_tables(
+      {
+         _obtype = "processor",
+         processor_type="delay",
+         delay=0,
+      },
+      options)
+   return name
+end
+
+-- Ends all notes 'length' milliseconds after they start.
+function mflib.add_note_length(config, name, options)
+   check_args(options, make_set{"length", "max_pending"})
+   check_name(config, name)
+
+   config.processors[name] = merge_tables(
+      {
+         _obtype = "processor",
+         processor_type="note_length",
+      },
+      options)
+   return name
+end
+
+-- Drops controller, pitch bend and channel pressure values equal to the
+-- last one sent for the same controller and channel.
+function mflib.add_dedup(config, name, options)
+   options = options or {}
+   check_args(options, make_set{})
+   check_name(config, name)
+
+   config.processors[name] = {
+      _obtype = "processor",
+      processor_type="controller_filter",
+   }
+   return name
+end
+
+-- Same as add_dedup, also dropping values which differ by less than
+-- 'threshold' from the last one sent, except the extremes of the range.
+function mflib.add_hysteresis(config, name, options)
+   check_args(options, make_set{"threshold"})
+   check_name(config, name)
+
+   config.processors[name] = merge_tables(
+      {
+         _obtype = "processor",
+         processor_type="controller_filter",
+      },
+      options)
+   return name
+end
+
+-- Same as add_dedup, with at most 'max_events' values sent per
+-- controller every 'interval' milliseconds. Values beyond that are
+-- coalesced: the last one is sent at the end of the interval.
+function mflib.add_rate_limit(config, name, options)
+   check_args(options, make_set{"max_events", "interval", "threshold"})
+   check_name(config, name)
+
+   config.processors[name] = merge_tables(
+      {
+         _obtype = "processor",
+         processor_type="controller_filter",
+         max_events=1,
+      },
+      options)
+   return name
+end
+
+-- Runs a Lua function on events. 'options' must have either 'process',
+-- called with each event, or 'process_batch', called with all events
+-- received at once (batch[1] .. batch[#batch]). Event fields can be read
+-- and modified in place, setting 'drop' to true (or returning false from
+-- 'process') removes the event. Calls running more than 'budget'
+-- instructions per event are interrupted, and their events dropped or
+-- passed unchanged depending on 'on_error' ("drop" or "pass").
+function mflib.add_lua_processor(config, name, options)
+   check_args(options, make_set{"process", "process_batch", "budget",
+                                "on_error", "gc_step_kb"})
+   check_name(config, name)
+
+   config.processors[name] = merge_tables(
+      {
+         _obtype = "processor",
+         processor_type="lua_processor",
+      },
+      options)
+   return name
+end
+
+-- Event types, for the 'type' field of events given to Lua processors.
+mflib.event_types = {
+   note = 5,
+   noteon = 6,
+   noteoff = 7,
+   keypress = 8,
+   controller = 10,
+   pgmchange = 11,
+   chanpress = 12,
+   pitchbend = 13,
+}
+
 function mflib.connect(config, input, output)
    table.insert(config.connections, {
       _objtype = "connection",
@@ -0,0 +1,225 @@
+// Compact midi events and conversion from and to sequencer events.
+
+#include <algorithm>
+#include <cstring>
+
+#include "midi_event.h"
+#include "timer_wheel.h"
+
+// How the data of a sequencer event is stored, depending on its type.
+enum class EventKind { kNone, kNote, kControl, kSysex, kNoData };
+
+EventKind GetEventKind(int type) {
+  switch (type) {
+  case SND_SEQ_EVENT_NOTE:
+  case SND_SEQ_EVENT_NOTEON:
+  case SND_SEQ_EVENT_NOTEOFF:
+  case SND_SEQ_EVENT_KEYPRESS:
+    return EventKind::kNote;
+  case SND_SEQ_EVENT_CONTROLLER:
+  case SND_SEQ_EVENT_PGMCHANGE:
+  case SND_SEQ_EVENT_CHANPRESS:
+  case SND_SEQ_EVENT_PITCHBEND:
+  case SND_SEQ_EVENT_CONTROL14:
+  case SND_SEQ_EVENT_NONREGPARAM:
+  case SND_SEQ_EVENT_REGPARAM:
+  case SND_SEQ_EVENT_SONGPOS:
+  case SND_SEQ_EVENT_SONGSEL:
+  case SND_SEQ_EVENT_QFRAME:
+  case SND_SEQ_EVENT_TIMESIGN:
+  case SND_SEQ_EVENT_KEYSIGN:
+    return EventKind::kControl;
+  case SND_SEQ_EVENT_SYSEX:
+    return EventKind::kSysex;
+  case SND_SEQ_EVENT_START:
+  case SND_SEQ_EVENT_CONTINUE:
+  case SND_SEQ_EVENT_STOP:
+  case SND_SEQ_EVENT_CLOCK:
+  case SND_SEQ_EVENT_TICK:
+  case SND_SEQ_EVENT_TUNE_REQUEST:
+  case SND_SEQ_EVENT_RESET:
+  case SND_SEQ_EVENT_SENSING:
+    return EventKind::kNoData;
+  default:
+    return EventKind::kNone;
+  }
+}
+
+const EventTypeSet& MidiEventTypes() {
+  static const EventTypeSet types = []() {
+    EventTypeSet types;
+    for (int type = 0; type < 256; type++) {
+      types[type] = GetEventKind(type) != EventKind::kNone;
+    }
+    return types;
+  }();
+  return types;
+}
+
+size_t NumMidiEvents(const snd_seq_event_t& ev) {
+  switch (GetEventKind(ev.type)) {
+  case EventKind::kNone:
+    return 0;
+  case EventKind::kSysex:
+    if (!snd_seq_ev_is_variable(&ev) || ev.data.ext.len == 0
+        || ev.data.ext.len > kMaxSysexSize) {
+      return 0;
+    }
+    return (ev.data.ext.len + kSysexChunkSize - 1) / kSysexChunkSize;
+  default:
+    return 1;
+  }
+}
+
+void FromSeqEvent(const snd_seq_event_t& ev, MidiEvent* out) {
+  MidiEvent event;
+  memset(&event, 0, sizeof(event));
+  event.type = ev.type;
+  event.port = ev.dest.port;
+  if (snd_seq_ev_is_real(&ev)) {
+    event.time = static_cast<uint32_t>(ev.time.time.tv_sec * 1000000ull
+                                       + ev.time.time.tv_nsec / 1000);
+  }
+
+  switch (GetEventKind(ev.type)) {
+  case EventKind::kNote:
+    event.channel = ev.data.note.channel;
+    event.data.note.note = ev.data.note.note;
+    event.data.note.velocity = ev.data.note.velocity;
+    event.data.note.off_velocity = ev.data.note.off_velocity;
+    event.data.note.duration = ev.data.note.duration;
+    break;
+  case EventKind::kControl:
+    event.channel = ev.data.control.channel;
+    event.data.control.param = ev.data.control.param;
+    event.data.control.value = ev.data.control.value;
+    break;
+  case EventKind::kSysex: {
+    const size_t num_chunks = NumMidiEvents(ev);
+    const uint8_t* data = static_cast<const uint8_t*>(ev.data.ext.ptr);
+    size_t remaining = ev.data.ext.len;
+    for (size_t i = 0; i < num_chunks; i++) {
+      const size_t length = std::min(remaining, kSysexChunkSize);
+      out[i] = event;
+      out[i].flags = length | (i == 0 ? kSysexFirst : 0)
+        | (i + 1 == num_chunks ? kSysexLast : 0);
+      memcpy(out[i].data.sysex, data, length);
+      data += length;
+      remaining -= length;
+    }
+    return;
+  }
+  default:
+    break;
+  }
+  *out = event;
+}
+
+bool SeqEventEncoder::Encode(const MidiEvent& ev, snd_seq_event_t* seq_ev) {
+  snd_seq_ev_clear(seq_ev);
+  seq_ev->type = ev.type;
+
+  switch (GetEventKind(ev.type)) {
+  case EventKind::kNote:
+    seq_ev->data.note.channel = ev.channel;
+    seq_ev->data.note.note = ev.data.note.note;
+    seq_ev->data.note.velocity = ev.data.note.velocity;
+    seq_ev->data.note.off_velocity = ev.data.note.off_velocity;
+    seq_ev->data.note.duration = ev.data.note.duration;
+    return true;
+  case EventKind::kControl:
+    seq_ev->data.control.channel = ev.channel;
+    seq_ev->data.control.param = ev.data.control.param;
+    seq_ev->data.control.value = ev.data.control.value;
+    return true;
+  case EventKind::kNoData:
+    return true;
+  case EventKind::kSysex: {
+    if (ev.flags & kSysexFirst) {
+      sysex_size_ = 0;
+      in_sysex_ = true;
+    }
+    const size_t length = ev.flags & kSysexLengthMask;
+    if (!in_sysex_ || length > kSysexChunkSize
+        || sysex_size_ + length > kMaxSysexSize) {
+      in_sysex_ = false;
+      return false;
+    }
+    memcpy(sysex_.data() + sysex_size_, ev.data.sysex, length);
+    sysex_size_ += length;
+    if (!(ev.flags & kSysexLast)) {
+      return false;
+    }
+    in_sysex_ = false;
+    snd_seq_ev_set_sysex(seq_ev, sysex_size_, sysex_.data());
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+size_t EventArena::BufferSize(size_t capacity) {
+  const size_t size = capacity * (sizeof(MidiEvent) + sizeof(uint32_t));
+  return (size + kLineSize - 1) / kLineSize * kLineSize;
+}
+
+void EventArena::Reset(size_t size) {
+  num_lines_ = (size + kLineSize - 1) / kLineSize;
+  lines_ = std::make_unique<Line[]>(num_lines_);
+  used_ = 0;
+}
+
+void* EventArena::Allocate(size_t size) {
+  const size_t num_lines = (size + kLineSize - 1) / kLineSize;
+  if (num_lines > num_lines_ - used_) {
+    return nullptr;
+  }
+  void* data = lines_.get() + used_;
+  used_ += num_lines;
+  return data;
+}
+
+void EventBuffer::Reserve(size_t capacity) {
+  storage_.Reset(EventArena::BufferSize(capacity));
+  Reserve(capacity, &storage_);
+}
+
+bool EventBuffer::Reserve(size_t capacity, EventArena* arena) {
+  void* data = arena->Allocate(EventArena::BufferSize(capacity));
+  UseStorage(data != nullptr ? capacity : 0, data);
+  return data != nullptr || capacity == 0;
+}
+
+void EventBuffer::UseStorage(size_t capacity, void* storage) {
+  // Events first, then their origins.
+  events_ = static_cast<MidiEvent*>(storage);
+  origins_ = reinterpret_cast<uint32_t*>(events_ + capacity);
+  capacity_ = capacity;
+  clear();
+}
+
+MidiEvent* EventBuffer::Append(size_t count, uint32_t origin) {
+  if (size_ + count > capacity_) {
+    dropped_ += count;
+    return nullptr;
+  }
+  MidiEvent* events = events_ + size_;
+  for (size_t i = 0; i < count; i++) {
+    origins_[size_ + i] = origin;
+  }
+  size_ += count;
+  return events;
+}
+
+void EventBuffer::Schedule(const MidiEvent& ev, uint32_t delay_ms) {
+  if (timers_ == nullptr) {
+    Emit(ev);
+  } else if (!timers_->Add(delay_ms, timer_owner_, ev)) {
+    dropped_++;
+  }
+}
+
+uint64_t EventBuffer::now_ms() const {
+  return timers_ == nullptr ? 0 : timers_->now();
+}
@@ -0,0 +1,213 @@
+#ifndef _MIDI_EVENT_H
+#define _MIDI_EVENT_H
+// Compact representation of midi events used inside the processing graph,
+// and conversion from and to ALSA sequencer events.
+
+#include <array>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <alsa/asoundlib.h>
+
+// A midi event in 16 bytes, against 28 for snd_seq_event_t. Sequencer
+// events are converted by ProcessorDAG when they enter the graph, and
+// back by MidiOutput. Only midi messages are represented: notes,
+// controllers (and other events using snd_seq_ev_ctrl_t), sysex and
+// system real-time messages. Other sequencer events (queue control,
+// user-defined, etc.) are not forwarded.
+struct MidiEvent {
+  // snd_seq_event_type_t value.
+  uint8_t type;
+  // Port the event was received on, or sent from once given to
+  // MidiOutput.
+  uint8_t port;
+  uint8_t channel;
+  // Sysex chunk description, see below. 0 for other events.
+  uint8_t flags;
+  // Reception time in microseconds when the sequencer timestamps events
+  // in real time, 0 otherwise. Wraps around every 71 minutes.
+  uint32_t time;
+  union {
+    struct {
+      uint8_t note;
+      uint8_t velocity;
+      uint8_t off_velocity;
+      uint8_t unused;
+      uint32_t duration;
+    } note;
+    struct {
+      uint32_t param;
+      int32_t value;
+    } control;
+    // Sysex messages are split into chunks of up to 8 bytes, carried by
+    // consecutive events.
+    uint8_t sysex[8];
+  } data;
+};
+static_assert(sizeof(MidiEvent) == 16, "MidiEvent must stay compact");
+
+// Sysex chunks: 'flags' holds the chunk length in its low bits, and
+// whether it is the first and last chunk of the message.
+const uint8_t kSysexLengthMask = 0x0f;
+const uint8_t kSysexFirst = 0x40;
+const uint8_t kSysexLast = 0x80;
+const size_t kSysexChunkSize = sizeof(MidiEvent::data.sysex);
+// Larger sysex messages are dropped.
+const size_t kMaxSysexSize = 4096;
+const size_t kMaxSysexChunks = kMaxSysexSize / kSysexChunkSize;
+
+// Set of snd_seq_event_type_t values.
+using EventTypeSet = std::bitset<256>;
+// Types of the sequencer events which can be converted to MidiEvent.
+const EventTypeSet& MidiEventTypes();
+
+// Returns true for sysex chunks other than the first one of a message.
+inline bool IsSysexContinuation(const MidiEvent& ev) {
+  return ev.type == SND_SEQ_EVENT_SYSEX && !(ev.flags & kSysexFirst);
+}
+
+// Returns the number of events 'ev' converts to: 1, several for sysex
+// messages, or 0 if it can't be converted.
+size_t NumMidiEvents(const snd_seq_event_t& ev);
+// Converts 'ev' into NumMidiEvents(ev) events, stored in 'out'.
+void FromSeqEvent(const snd_seq_event_t& ev, MidiEvent* out);
+
+// Converts events back into sequencer events, reassembling sysex
+// messages from their chunks. Source and destination are left unset.
+class SeqEventEncoder {
+public:
+  // Returns true if 'seq_ev' has been filled, false for sysex chunks
+  // other than the last one (or if chunks are missing). The data of a
+  // sysex event points into the encoder and is only valid until the next
+  // call.
+  bool Encode(const MidiEvent& ev, snd_seq_event_t* seq_ev);
+
+private:
+  std::array<uint8_t, kMaxSysexSize> sysex_;
+  size_t sysex_size_ = 0;
+  // False if the first chunk of the current message has been missed.
+  bool in_sysex_ = false;
+};
+
+class TimerWheel;
+
+// Single allocation holding the events of several EventBuffers, see
+// EventBuffer::Reserve(). Buffers are laid out in the order they are
+// allocated, each starting on a new cache line.
+class EventArena {
+public:
+  EventArena() {}
+  EventArena(EventArena&&) = default;
+  EventArena& operator=(EventArena&&) = default;
+
+  // Bytes taken by a buffer of 'capacity' events.
+  static size_t BufferSize(size_t capacity);
+  // Allocates 'size' bytes, releasing the previous allocation: buffers
+  // using it must be given new storage.
+  void Reset(size_t size);
+  // Returns 'size' bytes aligned on a cache line, or nullptr if they
+  // don't fit.
+  void* Allocate(size_t size);
+  size_t size() const { return used_ * kLineSize; }
+  size_t capacity() const { return num_lines_ * kLineSize; }
+
+private:
+  static const size_t kLineSize = 64;
+  struct alignas(kLineSize) Line {
+    unsigned char bytes[kLineSize];
+  };
+  std::unique_ptr<Line[]> lines_;
+  size_t num_lines_ = 0;
+  size_t used_ = 0;
+};
+
+// Fixed-capacity list of events produced by a processor over a batch.
+// Memory is allocated once by Reserve(); events added beyond capacity
+// are dropped and counted.
+// Each event is tagged with the index, in the batch given to
+// ProcessorDAG::ProcessBatch, of the input event it derives from. This is
+// what allows merging the outputs of several processors in the same order
+// as if input events had been processed one at a time.
+class EventBuffer {
+public:
+  EventBuffer() {}
+  EventBuffer(EventBuffer&&) = default;
+  EventBuffer& operator=(EventBuffer&&) = default;
+
+  // Allocates space for 'capacity' events. Discards all events.
+  void Reserve(size_t capacity);
+  // Same as above, with space taken from 'arena', which must outlive the
+  // buffer. Returns false, leaving the buffer without space, if it is
+  // full.
+  bool Reserve(size_t capacity, EventArena* arena);
+  // Same as above, with space at 'storage', of at least
+  // EventArena::BufferSize(capacity) bytes. Buffers which are never used
+  // at the same time can share it.
+  void UseStorage(size_t capacity, void* storage);
+
+  void clear() {
+    size_ = 0;
+    dropped_ = 0;
+  }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  size_t capacity() const { return capacity_; }
+  // Number of events dropped since the last clear().
+  size_t dropped() const { return dropped_; }
+
+  const MidiEvent& event(size_t i) const { return events_[i]; }
+  MidiEvent& event(size_t i) { return events_[i]; }
+  uint32_t origin(size_t i) const { return origins_[i]; }
+  const MidiEvent* begin() const { return events_; }
+  const MidiEvent* end() const { return events_ + size_; }
+
+  // Adds an event derived from input event 'origin'.
+  void push_back(const MidiEvent& ev, uint32_t origin) {
+    if (size_ == capacity_) {
+      dropped_++;
+      return;
+    }
+    events_[size_] = ev;
+    origins_[size_] = origin;
+    size_++;
+  }
+  // Returns space for 'count' events derived from 'origin', or nullptr
+  // if they don't fit.
+  MidiEvent* Append(size_t count, uint32_t origin);
+
+  // Sink interface used by EventProcessor::ProcessEvent: events added by
+  // Emit() get the origin set by SetOrigin().
+  void SetOrigin(uint32_t origin) { origin_ = origin; }
+  uint32_t current_origin() const { return origin_; }
+  void Emit(const MidiEvent& ev) { push_back(ev, origin_); }
+  // Emits 'ev' 'delay_ms' milliseconds from now, and at the earliest on
+  // the next call to ProcessorDAG::ProcessTimers(). Scheduled events
+  // reach the children of the processor as if it had generated them at
+  // that point. Events that don't fit in the timer wheel are dropped and
+  // counted. Without a timer wheel, 'ev' is emitted right away.
+  void Schedule(const MidiEvent& ev, uint32_t delay_ms);
+  // Current time in milliseconds, as given to ProcessTimers(). 0 without
+  // a timer wheel.
+  uint64_t now_ms() const;
+  // Timer wheel used by Schedule(), with 'owner' the index of the
+  // processor writing to the buffer. Set by ProcessorDAG.
+  void SetTimers(TimerWheel* timers, uint32_t owner) {
+    timers_ = timers;
+    timer_owner_ = owner;
+  }
+
+private:
+  // Storage used by Reserve(capacity).
+  EventArena storage_;
+  MidiEvent* events_ = nullptr;
+  uint32_t* origins_ = nullptr;
+  size_t size_ = 0;
+  size_t capacity_ = 0;
+  size_t dropped_ = 0;
+  uint32_t origin_ = 0;
+  TimerWheel* timers_ = nullptr;
+  uint32_t timer_owner_ = 0;
+};
+
+#endif
@@ -1,5 +1,6 @@
 /* Midiflume: something like midish but hopefully easier to use. */
 
+#include <algorithm>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -9,12 +10,30 @@
 #include <string>
 #include <sstream>
 #include <memory>
+#include <atomic>
+#include <chrono>
+#include <signal.h>
+#include <thread>
 #include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <getopt.h>
+#include <sys/timerfd.h>
 
 #include <lua5.3/lua.h>
 #include "lua_config.h"
+#include "capture.h"
+#include "config_reloader.h"
 #include "event_processors.h"
 #include "dag.h"
+#include "graph_slot.h"
+#include "metrics.h"
+#include "offline.h"
+#include "port_registry.h"
+#include "realtime.h"
+#include "snapshot.h"
+#include "timer_wheel.h"
+#include "worker_pool.h"
 
 // TODO: move this function elsewhere (in a test e.g.)
 bool GetTestProcessingGraph(snd_seq_t *seq_handle, ProcessorDAG *dag) {
@@ -56,58 +75,384 @@ bool open_seq(snd_seq_t **seq_handle, const char* client_name) {
   return true;
 }
 
-// The main processing loop.
+// Asks the sequencer to only deliver events whose type is in 'types',
+// so that we don't even wake up for events no output depends on, such as
+// clock or active sensing messages when nothing forwards them. Replaces
+// the previous filter.
+bool SetEventFilter(snd_seq_t *seq_handle, const EventTypeSet& types) {
+  if (types.none()) {
+    // An empty filter lets all events through.
+    std::cerr << "No incoming event can reach an output.\n";
+  }
+  snd_seq_client_info_t *info;
+  if (snd_seq_client_info_malloc(&info) < 0) {
+    std::cerr << "Error setting event filter.\n";
+    return false;
+  }
+  bool ok = snd_seq_get_client_info(seq_handle, info) >= 0;
+  if (ok) {
+    snd_seq_client_info_event_filter_clear(info);
+    for (size_t type = 0; type < types.size(); type++) {
+      if (types[type]) {
+        snd_seq_client_info_event_filter_add(info, type);
+      }
+    }
+    ok = snd_seq_set_client_info(seq_handle, info) >= 0;
+  }
+  snd_seq_client_info_free(info);
+  if (!ok) {
+    std::cerr << "Error setting event filter.\n";
+  }
+  return ok;
+}
+
+// Makes all MidiOutput processors of 'dag' use 'output_buffer'.
+void SetOutputBuffer(ProcessorDAG* dag, OutputBuffer* output_buffer) {
+  for (size_t i = 0; i < dag->NumProcessors(); i++) {
+    auto output = dynamic_cast<MidiOutput*>(dag->GetProcessor(i));
+    if (output != nullptr) {
+      output->SetOutputBuffer(output_buffer);
+    }
+  }
+}
+
+// Set by SIGUSR1 to ask for statistics to be printed.
+std::atomic<bool> stats_requested(false);
+
+void RequestStats(int) {
+  stats_requested = true;
+}
+
+// Overflows of the sequencer input buffer, counted by ProcessEvents().
+std::atomic<uint64_t> input_overflows(0);
+
+// Period of the updates of the metrics segment.
+const int kMetricsPeriodMs = 100;
+
+// Updates 'metrics' from the current graph and from 'engine', if not
+// null, every kMetricsPeriodMs. Never returns.
+void PublishMetrics(GraphSlot* graphs, RealtimeEngine* engine,
+                    MetricsWriter* metrics) {
+  while (true) {
+    MetricsSegment* segment = metrics->BeginUpdate();
+    graphs->Enter(GraphSlot::kMetricsReader)->PublishMetrics(segment);
+    graphs->Exit(GraphSlot::kMetricsReader);
+    if (engine != nullptr) {
+      engine->PublishMetrics(&segment->io);
+    } else {
+      SetMetric(&segment->io.input_overflows,
+                input_overflows.load(std::memory_order_relaxed));
+    }
+    metrics->EndUpdate();
+    std::this_thread::sleep_for(std::chrono::milliseconds(kMetricsPeriodMs));
+  }
+}
+
+// Maximum number of events read from the sequencer before sending them
+// through the processing graph.
+const size_t kMaxBatchSize = 256;
+
+// The main processing loop. If 'output_buffer' isn't null, it is
+// drained after each batch. If 'capture' isn't null, incoming events are
+// appended to it. Polled inputs of the graphs built with 'ports' (raw
+// devices, shared memory rings) are read too. 'worker_pool' is only used for stats.
 void ProcessEvents(snd_seq_t *seq_handle,
-                  ProcessorDAG& processing_graph) {
+                  GraphSlot& graphs,
+                  OutputBuffer* output_buffer,
+                  CaptureWriter* capture,
+                  const PortRegistry* ports,
+                  WorkerPool* worker_pool) {
 
   int npfd = snd_seq_poll_descriptors_count(seq_handle, POLLIN);
-  struct pollfd *pfd = (struct pollfd *)alloca(npfd * sizeof(struct pollfd));
+  // Sequencer descriptors, the timer, then polled inputs.
+  std::vector<struct pollfd> pfds(npfd + 1);
+  struct pollfd *pfd = pfds.data();
   snd_seq_poll_descriptors(seq_handle, pfd, npfd, POLLIN);
+  InputPoller polled_inputs(ports);
+  // Wakes up the loop when events scheduled by processors come due.
+  const int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer_fd < 0) {
+    std::cerr << "Cannot create timer, scheduled events will be late: "
+              << strerror(errno) << "\n";
+  }
+  pfd[npfd].fd = timer_fd;
+  pfd[npfd].events = POLLIN;
+
+  std::vector<snd_seq_event_t> batch;
+  batch.reserve(kMaxBatchSize);
+  std::vector<MidiEvent> polled_batch;
+  polled_batch.reserve(kMaxBatchSize);
   
   while (true) {
-    if (poll(pfd, npfd, 100000) > 0) {
+    // Statistics are printed from here rather than from the signal handler,
+    // between two batches.
+    if (stats_requested.exchange(false)) {
+      graphs.Enter(GraphSlot::kStatsReader)->PrintStats(std::cerr);
+      graphs.Exit(GraphSlot::kStatsReader);
+      if (output_buffer != nullptr) {
+        output_buffer->PrintStats(std::cerr);
+      }
+      if (capture != nullptr) {
+        capture->PrintStats(std::cerr);
+      }
+      if (worker_pool != nullptr) {
+        worker_pool->PrintStats(std::cerr);
+      }
+    }
+    // Events scheduled until now, and the time of the next ones.
+    ProcessorDAG* processing_graph = graphs.Enter(GraphSlot::kProcessingReader);
+    processing_graph->ProcessTimers(MonotonicMs());
+    const uint64_t next_timer = processing_graph->NextTimer();
+    graphs.Exit(GraphSlot::kProcessingReader);
+    if (output_buffer != nullptr) {
+      output_buffer->Drain();
+    }
+    if (timer_fd >= 0 && !SetTimerFd(timer_fd, next_timer)) {
+      std::cerr << "Cannot set timer: " << strerror(errno) << "\n";
+    }
+
+    polled_inputs.UpdatePollDescriptors(&pfds, npfd + 1);
+    pfd = pfds.data();
+    const int timeout_ms = polled_inputs.PrepareWait() ? 100000 : 0;
+    if (poll(pfd, pfds.size(), timeout_ms) < 0) {
+      continue;
+    }
+    if (pfd[npfd].revents & POLLIN) {
+      uint64_t expirations;
+      if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        std::cerr << "Cannot read timer: " << strerror(errno) << "\n";
+      }
+    }
+    bool input = false;
+    for (int i = 0; i < npfd; i++) {
+      input = input || (pfd[i].revents & POLLIN);
+    }
+    if (input) {
       do {
-        snd_seq_event_t *ev;
-        snd_seq_event_input(seq_handle, &ev);
-    
-        // Filters out connection events which we don't want to process.
-        if (ev->type >= SND_SEQ_EVENT_CLIENT_START && ev->type < SND_SEQ_EVENT_USR0) {
+        // Drains all events already received into a single batch.
+        batch.clear();
+        do {
+          snd_seq_event_t *ev;
+          const int result = snd_seq_event_input(seq_handle, &ev);
+          if (result < 0) {
+            if (result == -ENOSPC) {
+              // Events were lost before they could be read.
+              IncrementCounter(&input_overflows, 1);
+            }
+            break;
+          }
+          // Filters out connection events which we don't want to process.
+          if (ev->type < SND_SEQ_EVENT_CLIENT_START || ev->type >= SND_SEQ_EVENT_USR0) {
+            batch.push_back(*ev);
+          }
           snd_seq_free_event(ev);
-          continue;
+        } while (batch.size() < kMaxBatchSize
+                 && snd_seq_event_input_pending(seq_handle, 0) > 0);
+        if (capture != nullptr) {
+          const uint64_t time_ns = MonotonicNs();
+          for (const snd_seq_event_t& ev : batch) {
+            capture->Append(ev, time_ns);
+          }
         }
-        if (!processing_graph.ProcessEvent(*ev)) {
-          std::cerr << "Error processing event.\n";
+
+        // The graph may be replaced between two batches. Delays are
+        // counted from now.
+        processing_graph = graphs.Enter(GraphSlot::kProcessingReader);
+        processing_graph->ProcessTimers(MonotonicMs());
+        if (!batch.empty() && !processing_graph->ProcessBatch(batch)) {
+          std::cerr << "Error processing events.\n";
+        }
+        graphs.Exit(GraphSlot::kProcessingReader);
+        if (output_buffer != nullptr) {
+          output_buffer->Drain();
         }
-        snd_seq_free_event(ev);
       } while (snd_seq_event_input_pending(seq_handle, 0) > 0);
     }  
+
+    // Events from polled inputs go through the graph as they are read,
+    // in batches of up to kMaxBatchSize.
+    polled_batch.clear();
+    const auto process_polled_batch = [&]() {
+      if (capture != nullptr) {
+        capture->Append(polled_batch.data(), polled_batch.size(), MonotonicNs());
+      }
+      processing_graph = graphs.Enter(GraphSlot::kProcessingReader);
+      processing_graph->ProcessTimers(MonotonicMs());
+      if (!processing_graph->ProcessBatch(std::span<const MidiEvent>(polled_batch))) {
+        std::cerr << "Error processing events.\n";
+      }
+      graphs.Exit(GraphSlot::kProcessingReader);
+      if (output_buffer != nullptr) {
+        output_buffer->Drain();
+      }
+      polled_batch.clear();
+    };
+    polled_inputs.Read(&pfds, npfd + 1, [&](const MidiEvent& ev) {
+      polled_batch.push_back(ev);
+      if (polled_batch.size() == kMaxBatchSize) {
+        process_polled_batch();
+      }
+    });
+    if (!polled_batch.empty()) {
+      process_polled_batch();
+    }
   }
 }
 
+// Same as ProcessEvents, with the graph run by 'engine' on a real-time
+// thread. This thread only reads and writes events, and prints stats.
+void ProcessEventsRealtime(GraphSlot& graphs,
+                           RealtimeEngine& engine,
+                           OutputBuffer* output_buffer,
+                           CaptureWriter* capture,
+                           WorkerPool* worker_pool) {
+  while (true) {
+    if (stats_requested.exchange(false)) {
+      graphs.Enter(GraphSlot::kStatsReader)->PrintStats(std::cerr);
+      graphs.Exit(GraphSlot::kStatsReader);
+      engine.PrintStats(std::cerr);
+      if (output_buffer != nullptr) {
+        output_buffer->PrintStats(std::cerr);
+      }
+      if (capture != nullptr) {
+        capture->PrintStats(std::cerr);
+      }
+      if (worker_pool != nullptr) {
+        worker_pool->PrintStats(std::cerr);
+      }
+    }
+    engine.Poll(100000);
+  }
+}
+
+// Command-line flags.
+struct Flags {
+  std::string client_name;
+  // Default config file value.
+  // TODO: make that a path under ~/.config/midiflume
+  std::string lua_config_filename = "midiflume.lua";
+  // Collect statistics, printed upon receiving SIGUSR1.
+  bool stats = false;
+  // Also collect hardware counters.
+  bool perf_counters = false;
+  // Publish statistics in shared memory, see MetricsWriter.
+  bool metrics = false;
+  // Run the graph on a real-time thread, see RealtimeEngine.
+  bool realtime = false;
+  RealtimeOptions realtime_options;
+  // Size of the output buffer in events, 0 to send events one by one.
+  size_t output_buffer_size = 0;
+  // Threads running independent parts of the graph, see WorkerPool.
+  size_t worker_threads = 0;
+  // File incoming events are captured to, see CaptureWriter.
+  std::string capture_filename;
+  // Capture replayed instead of reading events from the sequencer, see
+  // ReplayCapture(), and whether to replay it as fast as possible.
+  std::string replay_filename;
+  bool replay_fast = false;
+  // Offline mode: pairs of (input, output) Standard MIDI Files processed
+  // without the sequencer, see ProcessMidiFiles(), on 'offline_jobs'
+  // threads.
+  bool offline = false;
+  std::vector<std::pair<std::string, std::string>> offline_files;
+  size_t offline_jobs = 1;
+  OfflineOptions offline_options;
+  // Snapshot of the graph, used instead of running the config while the
+  // config files don't change, see GraphSnapshot.
+  std::string snapshot_filename;
+};
 
-bool ParseFlags(int argc, char *argv[],
-                std::string* client_name,
-                std::string* lua_config_filename) {
+bool ParseFlags(int argc, char *argv[], Flags* flags) {
   std::string input = "";
 
   // FIXME: make -c mandatory.
   if ( (argc <= 1) || (argv[argc-1] == NULL) || (argv[argc-1][0] == '-') ) {
     // There is NO input...
-    std::cerr << "Usage: midi_flume -n <filename.lua>\n";
+    std::cerr << "Usage: midi_flume [-s] [-H] [-m] [-r] [-C <cpu>] [-P <priority>] "
+              << "[-b <events>] [-t <threads>] [-w <capture file>] "
+              << "[-p <capture file> [-f]] [-S <snapshot>] [-n <client name>] "
+              << "-c <filename.lua>\n"
+              << "       midi_flume -c <filename.lua> --offline [-j <jobs>] "
+              << "[--by-channel] <in.mid> <out.mid> [<in.mid> <out.mid>...]\n";
     return false;
   }
   opterr = 0;
 
+  static const struct option long_options[] = {
+    {"offline", no_argument, nullptr, 'o'},
+    {"by-channel", no_argument, nullptr, 'k'},
+    {nullptr, 0, nullptr, 0},
+  };
   // FIXME: return false in case of unknown option.
   int opt;
-  while ( (opt = getopt(argc, argv, "c:n:")) != -1 ) {
+  while ( (opt = getopt_long(argc, argv, "c:n:sHmrC:P:b:t:w:p:fj:S:", long_options,
+                             nullptr)) != -1 ) {
     switch (opt) {
     case 'n':
-      *client_name = optarg;
+      flags->client_name = optarg;
       break;
     case 'c':
-      *lua_config_filename = optarg;
+      flags->lua_config_filename = optarg;
+      break;
+    case 's':
+      flags->stats = true;
+      break;
+    case 'H':
+      flags->stats = true;
+      flags->perf_counters = true;
+      break;
+    case 'm':
+      flags->stats = true;
+      flags->metrics = true;
+      break;
+    case 'r':
+      flags->realtime = true;
+      break;
+    case 'C':
+      flags->realtime = true;
+      flags->realtime_options.cpu = atoi(optarg);
+      break;
+    case 'P':
+      flags->realtime = true;
+      flags->realtime_options.priority = atoi(optarg);
+      break;
+    case 'b':
+      flags->output_buffer_size = atoi(optarg);
+      break;
+    case 't':
+      flags->worker_threads = atoi(optarg);
+      break;
+    case 'w':
+      flags->capture_filename = optarg;
+      break;
+    case 'p':
+      flags->replay_filename = optarg;
+      break;
+    case 'f':
+      flags->replay_fast = true;
+      break;
+    case 'o':
+      flags->offline = true;
+      break;
+    case 'j':
+      flags->offline_jobs = std::max(atoi(optarg), 1);
       break;
+    case 'k':
+      flags->offline_options.inputs_by_channel = true;
+      break;
+    case 'S':
+      flags->snapshot_filename = optarg;
+      break;
+    }
+  }
+
+  if (flags->offline) {
+    if (optind == argc || (argc - optind) % 2 != 0) {
+      std::cerr << "--offline takes pairs of input and output files.\n";
+      return false;
+    }
+    for (int i = optind; i < argc; i += 2) {
+      flags->offline_files.emplace_back(argv[i], argv[i + 1]);
     }
   }
 
@@ -117,28 +462,42 @@ bool ParseFlags(int argc, char *argv[],
 
 int main(int argc, char *argv[]) {
 
-  // Default config file value.
-  // TODO: make that a path under ~/.config/midiflume
-  std::string lua_config_filename = "midiflume.lua";
-
   // Default client name
   std::string client_name = "midiflume";
   
-  std::string flag_client_name;
-  if (!ParseFlags(argc, argv,
-                  &flag_client_name,
-                  &lua_config_filename)) {
+  Flags flags;
+  if (!ParseFlags(argc, argv, &flags)) {
     return 1;
   }
+  const std::string& flag_client_name = flags.client_name;
+  const std::string& lua_config_filename = flags.lua_config_filename;
 
-  lua_State *L;
-  if (!ReadConfigFile(lua_config_filename, &L)) {
-    return 1;
+  if (flags.offline) {
+    // No sequencer: each file is processed by its own graph.
+    return ProcessMidiFiles(lua_config_filename, flags.offline_files,
+                            flags.offline_jobs, flags.offline_options) ? 0 : 1;
   }
 
+  // With a snapshot up to date, the config isn't run: the graph is built
+  // from the snapshot, and the Lua state stays empty until a reload.
+  lua_State *L;
   std::string config_client_name;
-  if (!GetClientName(L, &config_client_name)) {
-    return 1;
+  std::unique_ptr<GraphSnapshot> snapshot;
+  bool from_snapshot = false;
+  if (!flags.snapshot_filename.empty()) {
+    snapshot = std::make_unique<GraphSnapshot>();
+    from_snapshot = snapshot->Load(flags.snapshot_filename, lua_config_filename);
+  }
+  if (from_snapshot) {
+    L = luaL_newstate();
+    config_client_name = snapshot->client_name();
+  } else {
+    if (!ReadConfigFile(lua_config_filename, &L)) {
+      return 1;
+    }
+    if (!GetClientName(L, &config_client_name)) {
+      return 1;
+    }
   }
 
   // Override the client name but config value first, then flag value.
@@ -160,12 +519,180 @@ int main(int argc, char *argv[]) {
     exit(1);
   }
   
-  ProcessorDAG processing_graph;
-  if (!GetProcessingGraph(L, seq_handle, &processing_graph)) {
-    std::cerr << "Error getting processing graph\n";
+  // SIGHUP is received by the reload thread, it must be blocked before
+  // any thread is started.
+  if (!ConfigReloader::BlockReloadSignal()) {
+    lua_close(L);
+    exit(1);
+  }
+
+  // Ports are kept across config reloads.
+  PortRegistry ports(seq_handle);
+  ports.BeginGeneration();
+  auto processing_graph = std::make_unique<ProcessorDAG>();
+  if (from_snapshot) {
+    if (!snapshot->BuildGraph(seq_handle, processing_graph.get(), &ports)) {
+      std::cerr << "Error building processing graph from snapshot\n";
+      lua_close(L);
+      exit(1);
+    }
+    std::cerr << "Graph loaded from snapshot " << flags.snapshot_filename << "\n";
+  } else {
+    if (snapshot != nullptr) {
+      // Starts over, Load() may have filled it.
+      snapshot = std::make_unique<GraphSnapshot>();
+    }
+    if (!GetProcessingGraph(L, seq_handle, processing_graph.get(), &ports,
+                            snapshot.get())) {
+      std::cerr << "Error getting processing graph\n";
+      lua_close(L);
+      exit(1);
+    }
+    if (snapshot != nullptr) {
+      // Not fatal: the config is run again at the next start.
+      snapshot->SetClientName(config_client_name);
+      snapshot->SetConfigFiles(GetConfigFiles(L, lua_config_filename));
+      snapshot->Save(flags.snapshot_filename);
+    }
+  }
+  ports.CommitGeneration();
+  if (!SetEventFilter(seq_handle, processing_graph->InputEventTypes())) {
     lua_close(L);
     exit(1);
   }
-  ProcessEvents(seq_handle, processing_graph);
-  lua_close(L);
+
+  if (flags.stats) {
+    processing_graph->EnableStats(true);
+  }
+  if (flags.perf_counters && !flags.realtime) {
+    processing_graph->EnablePerfCounters();
+  }
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = RequestStats;
+  sigaction(SIGUSR1, &action, nullptr);
+
+  std::unique_ptr<OutputBuffer> output_buffer;
+  if (flags.output_buffer_size > 0) {
+    output_buffer = std::make_unique<OutputBuffer>(seq_handle);
+    if (!output_buffer->Resize(flags.output_buffer_size)) {
+      lua_close(L);
+      exit(1);
+    }
+  }
+
+  // Started before the engine, whose thread uses it right away.
+  std::unique_ptr<WorkerPool> worker_pool;
+  if (flags.worker_threads > 0) {
+    worker_pool = std::make_unique<WorkerPool>();
+    if (!worker_pool->Start(flags.worker_threads,
+                            flags.realtime ? flags.realtime_options.priority : 0)) {
+      lua_close(L);
+      exit(1);
+    }
+    processing_graph->SetWorkerPool(worker_pool.get());
+  }
+
+  if (!flags.replay_filename.empty()) {
+    // Events come from the capture instead of the sequencer, and the
+    // config isn't reloaded.
+    CaptureReader replay;
+    if (!replay.Open(flags.replay_filename)) {
+      lua_close(L);
+      exit(1);
+    }
+    if (output_buffer != nullptr) {
+      SetOutputBuffer(processing_graph.get(), output_buffer.get());
+    }
+    const bool ok = ReplayCapture(
+        replay, processing_graph.get(), !flags.replay_fast, [&output_buffer]() {
+          if (output_buffer != nullptr) {
+            output_buffer->Drain();
+          }
+        });
+    if (!ok) {
+      std::cerr << "Error replaying " << flags.replay_filename << "\n";
+    }
+    if (flags.stats) {
+      processing_graph->PrintStats(std::cerr);
+    }
+    processing_graph.reset();
+    lua_close(L);
+    return ok ? 0 : 1;
+  }
+
+  std::unique_ptr<CaptureWriter> capture;
+  if (!flags.capture_filename.empty()) {
+    capture = std::make_unique<CaptureWriter>();
+    if (!capture->Open(flags.capture_filename)) {
+      lua_close(L);
+      exit(1);
+    }
+  }
+
+  GraphSlot graphs(processing_graph.get());
+  std::unique_ptr<RealtimeEngine> engine;
+  if (flags.realtime) {
+    // Hardware counters are read by the thread running the graph.
+    flags.realtime_options.perf_counters = flags.perf_counters;
+    engine = std::make_unique<RealtimeEngine>(seq_handle, &graphs,
+                                              flags.realtime_options);
+    // Buffered output is done by this thread, outputs only queue events.
+    engine->SetOutputBuffer(output_buffer.get());
+    engine->SetCapture(capture.get());
+    engine->SetPolledInputs(&ports);
+    if (!engine->Start()) {
+      lua_close(L);
+      exit(1);
+    }
+  } else if (output_buffer != nullptr) {
+    SetOutputBuffer(processing_graph.get(), output_buffer.get());
+  }
+
+  // Read by midiflume-stat.
+  std::unique_ptr<MetricsWriter> metrics;
+  if (flags.metrics) {
+    metrics = std::make_unique<MetricsWriter>();
+    if (!metrics->Open(MetricsSegmentName(client_name))) {
+      lua_close(L);
+      exit(1);
+    }
+    std::thread(PublishMetrics, &graphs, engine.get(), metrics.get()).detach();
+  }
+
+  // Graphs built when the config changes get the same settings as the
+  // first one, except for hardware counters which must be enabled by the
+  // thread running the graph.
+  ConfigReloader::Callbacks callbacks;
+  callbacks.prepare = [&](ProcessorDAG* dag) {
+    dag->EnableStats(flags.stats);
+    dag->SetWorkerPool(worker_pool.get());
+    if (engine != nullptr) {
+      if (!engine->PrepareGraph(dag)) {
+        return false;
+      }
+    } else if (output_buffer != nullptr) {
+      SetOutputBuffer(dag, output_buffer.get());
+    }
+    // Events for both graphs are let through until the switch.
+    return SetEventFilter(seq_handle, graphs.current()->InputEventTypes()
+                          | dag->InputEventTypes());
+  };
+  callbacks.published = [seq_handle](ProcessorDAG* dag) {
+    SetEventFilter(seq_handle, dag->InputEventTypes());
+  };
+  ConfigReloader reloader(lua_config_filename, seq_handle, &ports, &graphs,
+                          callbacks);
+  // The reloader now owns the graph and the Lua state.
+  if (!reloader.Start(std::move(processing_graph), L)) {
+    exit(1);
+  }
+
+  if (engine != nullptr) {
+    ProcessEventsRealtime(graphs, *engine, output_buffer.get(), capture.get(),
+                          worker_pool.get());
+  } else {
+    ProcessEvents(seq_handle, graphs, output_buffer.get(), capture.get(),
+                  &ports, worker_pool.get());
+  }
 }
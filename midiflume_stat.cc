@@ -0,0 +1,79 @@
+/* midiflume-stat: prints the metrics of a running midiflume, published
+   in shared memory with -m (see metrics.h). */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "metrics.h"
+#include "timer_wheel.h"
+
+// Prints 'snapshot' in the same form as ProcessorDAG::PrintStats, with
+// one line per processor.
+void PrintSnapshot(const MetricsSnapshot& snapshot, std::ostream& out) {
+  const uint64_t age_ms = (MonotonicNs() - snapshot.update_time_ns) / 1000000;
+  out << "pid " << snapshot.pid << ", updated " << age_ms << "ms ago\n";
+  const auto& graph = snapshot.graph;
+  out << "graph: batches=" << graph.batches
+      << " events=" << graph.events
+      << " dropped=" << graph.dropped_events
+      << " timer_events=" << graph.timer_events
+      << " max_latency=" << graph.max_latency_ns << "ns"
+      << " dropped_output=" << graph.dropped_output_events << "\n";
+  const auto& io = snapshot.io;
+  out << "input: overflows=" << io.input_overflows
+      << " dropped=" << io.dropped_input_events
+      << " queue=" << io.input_queue_depth
+      << " max_queue=" << io.max_input_queue_depth << "\n";
+  out << "output: queue=" << io.output_queue_depth
+      << " max_queue=" << io.max_output_queue_depth << "\n";
+  for (size_t i = 0; i < snapshot.num_processors; i++) {
+    const auto& processor = snapshot.processors[i];
+    out << processor.name
+        << ": in=" << processor.events_in
+        << " out=" << processor.events_out
+        << " dropped=" << processor.dropped_events
+        << " max_latency=" << processor.max_latency_ns << "ns\n";
+  }
+}
+
+int main(int argc, char *argv[]) {
+  std::string client_name = "midiflume";
+  // Seconds between two snapshots, 0 to print one and exit.
+  int interval = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:i:")) != -1) {
+    switch (opt) {
+    case 'n':
+      client_name = optarg;
+      break;
+    case 'i':
+      interval = atoi(optarg);
+      break;
+    default:
+      std::cerr << "Usage: midiflume-stat [-n <client name>] [-i <seconds>]\n";
+      return 1;
+    }
+  }
+
+  MetricsReader reader;
+  if (!reader.Open(MetricsSegmentName(client_name))) {
+    return 1;
+  }
+  // Too large for the stack.
+  auto snapshot = std::make_unique<MetricsSnapshot>();
+  while (true) {
+    if (!reader.Read(snapshot.get())) {
+      std::cerr << "Cannot read a consistent snapshot\n";
+      return 1;
+    }
+    PrintSnapshot(*snapshot, std::cout);
+    if (interval <= 0) {
+      return 0;
+    }
+    std::cout << std::endl;
+    sleep(interval);
+  }
+}
@@ -0,0 +1,238 @@
+// Offline processing of Standard MIDI Files.
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <lua5.3/lua.h>
+
+#include "event_processors.h"
+#include "lua_config.h"
+#include "offline.h"
+#include "port_registry.h"
+#include "smf.h"
+#include "spsc_ring.h"
+
+// Events generated by a batch, or by timers coming due at once, before
+// they are written to the output file.
+const size_t kOfflineQueueSize = 65536;
+
+// Returns true for meta events copied to the first track of the output:
+// global ones, and the name of the first track.
+static bool IsGlobalMetaEvent(const SmfEvent& ev) {
+  switch (ev.meta_type) {
+  case 0x01:  // Text
+  case 0x02:  // Copyright
+  case 0x06:  // Marker
+  case kSmfMetaTempo:
+  case 0x54:  // SMPTE offset
+  case 0x58:  // Time signature
+  case 0x59:  // Key signature
+    return true;
+  case kSmfMetaTrackName:
+    return ev.track == 0;
+  default:
+    return false;
+  }
+}
+
+bool ProcessMidiFile(const std::string& input_filename,
+                     const std::string& output_filename,
+                     ProcessorDAG* dag, const OfflineOptions& options,
+                     OfflineStats* stats) {
+  SmfReader reader;
+  if (!reader.Open(input_filename)) {
+    return false;
+  }
+
+  // Inputs by port, outputs send their events to 'queue' with their port.
+  std::vector<int> input_ports;
+  std::vector<MidiOutput*> outputs;
+  for (size_t i = 0; i < dag->NumProcessors(); i++) {
+    EventProcessor* processor = dag->GetProcessor(i);
+    if (auto input = dynamic_cast<MidiInput*>(processor)) {
+      input_ports.push_back(input->port_num());
+    } else if (auto output = dynamic_cast<MidiOutput*>(processor)) {
+      outputs.push_back(output);
+    }
+  }
+  if (input_ports.empty()) {
+    std::cerr << "The processing graph has no input.\n";
+    return false;
+  }
+  SmfWriter writer(reader.division());
+  const size_t global_track = writer.AddTrack("");
+  std::vector<int> port_tracks(256, -1);
+  SpscRing<MidiEvent> queue(kOfflineQueueSize);
+  for (MidiOutput* output : outputs) {
+    port_tracks[output->port_num()] = writer.AddTrack(output->name());
+    output->SetOutputQueue(&queue);
+  }
+  // Sysex messages are reassembled per output.
+  std::vector<SeqEventEncoder> encoders(writer.num_tracks());
+
+  OfflineStats file_stats;
+  // Writes events sent to the outputs at 'tick'.
+  auto drain = [&](uint64_t tick) {
+    MidiEvent ev;
+    snd_seq_event_t seq_ev;
+    while (queue.TryPop(&ev)) {
+      const int track = port_tracks[ev.port];
+      if (track < 0 || !encoders[track].Encode(ev, &seq_ev)) {
+        continue;  // Part of a sysex message.
+      }
+      if (writer.AddSeqEvent(track, tick, seq_ev)) {
+        file_stats.output_events++;
+      } else {
+        file_stats.unwritable_events++;
+      }
+    }
+  };
+  // Processes events scheduled up to 'now_ms'.
+  SmfClock clock(reader.division());
+  auto run_timers = [&](uint64_t now_ms) {
+    for (uint64_t next = dag->NextTimer(); next <= now_ms; next = dag->NextTimer()) {
+      if (!dag->ProcessTimers(next)) {
+        return false;
+      }
+      drain(clock.UsToTick(next * 1000));
+    }
+    return true;
+  };
+
+  // Events at the same tick are processed together, as if they had been
+  // received together.
+  std::vector<MidiEvent> batch;
+  uint64_t batch_tick = 0;
+  auto process_batch = [&]() {
+    if (batch.empty()) {
+      return true;
+    }
+    const uint64_t now_ms = clock.TickToUs(batch_tick) / 1000;
+    const bool ok = run_timers(now_ms) && dag->ProcessTimers(now_ms)
+        && dag->ProcessBatch(batch);
+    drain(batch_tick);
+    batch.clear();
+    return ok;
+  };
+
+  bool ok = true;
+  SmfEventDecoder decoder;
+  MidiEvent converted[kMaxSysexChunks];
+  SmfEvent ev;
+  while (ok && reader.Next(&ev)) {
+    if (ev.tick != batch_tick || batch.size() >= kDefaultMaxBatchSize) {
+      ok = process_batch();
+      batch_tick = ev.tick;
+    }
+    if (ev.status == 0xff) {
+      if (ev.meta_type == kSmfMetaTempo && ev.size == 3) {
+        // Events scheduled before the change use the previous tempo.
+        ok = ok && run_timers(clock.TickToUs(ev.tick) / 1000);
+        clock.SetTempo(ev.tick, (ev.data[0] << 16) | (ev.data[1] << 8) | ev.data[2]);
+      }
+      if (IsGlobalMetaEvent(ev)) {
+        writer.AddMeta(global_track, ev.tick, ev.meta_type, ev.data, ev.size);
+      }
+      continue;
+    }
+
+    snd_seq_event_t seq_ev;
+    if (!decoder.Decode(ev, &seq_ev)) {
+      continue;
+    }
+    file_stats.input_events++;
+    size_t input = 0;
+    if (options.inputs_by_channel) {
+      input = ev.status < 0xf0 ? ev.status & 0x0f : 0;
+    } else if (reader.format() != 0) {
+      input = std::max<size_t>(ev.track, 1) - 1;
+    }
+    seq_ev.dest.port = input_ports[std::min(input, input_ports.size() - 1)];
+    const size_t count = NumMidiEvents(seq_ev);
+    FromSeqEvent(seq_ev, converted);
+    batch.insert(batch.end(), converted, converted + count);
+  }
+  ok = ok && process_batch();
+  // Events still scheduled at the end.
+  ok = ok && run_timers(std::numeric_limits<uint64_t>::max() - 1);
+
+  for (MidiOutput* output : outputs) {
+    file_stats.dropped_events += output->dropped_events();
+    output->SetOutputQueue(nullptr);
+  }
+  if (reader.error()) {
+    std::cerr << input_filename << " is corrupted, only processed up to tick "
+              << batch_tick << "\n";
+    ok = false;
+  }
+  if (!ok) {
+    std::cerr << "Error processing " << input_filename << "\n";
+    return false;
+  }
+  if (!writer.Save(output_filename)) {
+    return false;
+  }
+  std::cerr << input_filename << " -> " << output_filename << ": "
+            << file_stats.input_events << " events in, "
+            << file_stats.output_events << " out, "
+            << file_stats.unwritable_events << " unwritable, "
+            << file_stats.dropped_events << " dropped\n";
+  if (stats != nullptr) {
+    *stats = file_stats;
+  }
+  return true;
+}
+
+// Builds a graph from 'config_filename' and processes one file with it.
+static bool ProcessMidiFileWithConfig(const std::string& config_filename,
+                                      const std::string& input_filename,
+                                      const std::string& output_filename,
+                                      const OfflineOptions& options) {
+  lua_State *L;
+  if (!ReadConfigFile(config_filename, &L)) {
+    return false;
+  }
+  // Ports are only numbered, in the order processors are created.
+  PortRegistry ports(nullptr);
+  ports.BeginGeneration();
+  auto dag = std::make_unique<ProcessorDAG>();
+  bool ok = GetProcessingGraph(L, nullptr, dag.get(), &ports);
+  if (!ok) {
+    std::cerr << "Error getting processing graph\n";
+  } else {
+    ports.CommitGeneration();
+    ok = ProcessMidiFile(input_filename, output_filename, dag.get(), options);
+  }
+  // Lua processors use the state until they are destroyed.
+  dag.reset();
+  lua_close(L);
+  return ok;
+}
+
+bool ProcessMidiFiles(const std::string& config_filename,
+                      const std::vector<std::pair<std::string, std::string>>& files,
+                      size_t jobs, const OfflineOptions& options) {
+  std::atomic<size_t> next_file{0};
+  std::atomic<bool> ok{true};
+  auto process_files = [&]() {
+    for (size_t i = next_file++; i < files.size(); i = next_file++) {
+      if (!ProcessMidiFileWithConfig(config_filename, files[i].first,
+                                     files[i].second, options)) {
+        ok = false;
+      }
+    }
+  };
+  // The calling thread is one of the jobs.
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < std::min(jobs, files.size()); i++) {
+    threads.emplace_back(process_files);
+  }
+  process_files();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  return ok;
+}
@@ -0,0 +1,62 @@
+#ifndef _OFFLINE_H
+#define _OFFLINE_H
+// Offline processing of Standard MIDI Files through a processing graph,
+// without a sequencer: events of the input file are sent to the
+// MidiInput processors of the graph, and events reaching MidiOutput
+// processors are written to the output file.
+//
+// The graph clock (ProcessorDAG::ProcessTimers) follows the time of the
+// events in the file, given by its tempo map, so that delays and other
+// time-based processors give the same result as if the file had been
+// played live into midiflume.
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "dag.h"
+
+struct OfflineOptions {
+  // Which MidiInput each event is sent to, inputs being numbered in the
+  // order they were added to the graph, i.e. the order they were declared
+  // in the config (see GetProcessingGraph()). By default, the n-th track of
+  // format 1 files goes to the n-th input (the first track, which usually
+  // only holds the tempo map, going to the first input as well), and all
+  // events of format 0 files go to the first input. With
+  // 'inputs_by_channel', events on channel n go to the n-th input
+  // instead, and other events to the first one. Events for inputs beyond
+  // the last one go to the last one.
+  bool inputs_by_channel = false;
+};
+
+struct OfflineStats {
+  // Events read from the input file, meta events excluded.
+  uint64_t input_events = 0;
+  // Events written to the output file.
+  uint64_t output_events = 0;
+  // Output events without midi equivalent, and events dropped because
+  // too many were generated at once.
+  uint64_t unwritable_events = 0;
+  uint64_t dropped_events = 0;
+};
+
+// Sends the events of 'input_filename' through 'dag', which must be
+// finalized, and writes the output to 'output_filename' as a format 1
+// file: the first track holds the tempo map and other global meta events
+// of the input, followed by one track per MidiOutput. Returns false if a
+// file can't be read or written, or isn't valid. 'stats' may be null.
+bool ProcessMidiFile(const std::string& input_filename,
+                     const std::string& output_filename,
+                     ProcessorDAG* dag, const OfflineOptions& options,
+                     OfflineStats* stats = nullptr);
+
+// Processes each pair of (input, output) files of 'files' with a graph
+// built from 'config_filename', on up to 'jobs' threads. Each file gets
+// its own graph and Lua state, so that files don't affect each other.
+// Returns false if any file failed.
+bool ProcessMidiFiles(const std::string& config_filename,
+                      const std::vector<std::pair<std::string, std::string>>& files,
+                      size_t jobs, const OfflineOptions& options);
+
+#endif
@@ -0,0 +1,204 @@
+// Sequencer ports, raw devices and shared memory rings shared by
+// successive versions of the processing graph.
+
+#include <algorithm>
+#include <iostream>
+
+#include "port_registry.h"
+#include "raw_midi.h"
+#include "shm_ring.h"
+
+void PortRegistry::BeginGeneration() {
+  building_ = committed_ + 1;
+}
+
+int PortRegistry::Acquire(const std::string& name, unsigned int caps) {
+  for (Port& port : ports_) {
+    if (port.generation != building_ && port.name == name && port.caps == caps) {
+      port.generation = building_;
+      return port.port_num;
+    }
+  }
+
+  int port_num;
+  if (seq_handle_ == nullptr) {
+    port_num = next_test_port_++ % 256;
+  } else if ((port_num = snd_seq_create_simple_port(
+                  seq_handle_, name.c_str(), caps,
+                  SND_SEQ_PORT_TYPE_APPLICATION)) < 0) {
+    return port_num;
+  }
+  ports_.push_back({name, caps, port_num, building_, building_});
+  return port_num;
+}
+
+int PortRegistry::FreeInputPort() const {
+  for (int port_num = 255; port_num >= 0; port_num--) {
+    const bool used = std::any_of(ports_.begin(), ports_.end(), [port_num](const Port& port) {
+      return port.port_num == port_num;
+    }) || std::any_of(endpoints_.begin(), endpoints_.end(), [port_num](const Endpoint& endpoint) {
+      return endpoint.input != nullptr && endpoint.input->port() == port_num;
+    });
+    if (!used) {
+      return port_num;
+    }
+  }
+  return -1;
+}
+
+PortRegistry::Endpoint* PortRegistry::ReuseEndpoint(EndpointType type, const std::string& path,
+                                                    bool output) {
+  for (Endpoint& endpoint : endpoints_) {
+    if (endpoint.generation != building_ && endpoint.type == type
+        && endpoint.path == path && endpoint.output == output) {
+      endpoint.generation = building_;
+      return &endpoint;
+    }
+  }
+  return nullptr;
+}
+
+std::shared_ptr<RawMidiDevice> PortRegistry::AcquireRawDevice(const std::string& path,
+                                                              bool output) {
+  Endpoint* reused = ReuseEndpoint(EndpointType::kRawDevice, path, output);
+  if (reused != nullptr) {
+    return std::static_pointer_cast<RawMidiDevice>(reused->object);
+  }
+
+  int port_num = 0;
+  if (!output && (port_num = FreeInputPort()) < 0) {
+    std::cerr << "No port number left for " << path << "\n";
+    return nullptr;
+  }
+  std::shared_ptr<RawMidiDevice> device = RawMidiDevice::Open(path, output, port_num);
+  if (device == nullptr) {
+    return nullptr;
+  }
+  endpoints_.push_back({EndpointType::kRawDevice, path, output, device,
+                        output ? nullptr : device.get(), building_, building_});
+  polled_inputs_changed_ = polled_inputs_changed_ || !output;
+  return device;
+}
+
+std::shared_ptr<ShmRing> PortRegistry::AcquireShmRing(const std::string& name, bool output,
+                                                      size_t capacity) {
+  Endpoint* reused = ReuseEndpoint(EndpointType::kShmRing, name, output);
+  if (reused != nullptr) {
+    return std::static_pointer_cast<ShmRing>(reused->object);
+  }
+
+  int port_num = 0;
+  if (!output && (port_num = FreeInputPort()) < 0) {
+    std::cerr << "No port number left for " << name << "\n";
+    return nullptr;
+  }
+  std::shared_ptr<ShmRing> ring = ShmRing::Create(name, capacity, port_num);
+  if (ring == nullptr) {
+    return nullptr;
+  }
+  endpoints_.push_back({EndpointType::kShmRing, name, output, ring,
+                        output ? nullptr : ring.get(), building_, building_});
+  polled_inputs_changed_ = polled_inputs_changed_ || !output;
+  return ring;
+}
+
+uint64_t PortRegistry::GetPolledInputs(std::vector<std::shared_ptr<PolledInput>>* inputs) const {
+  std::lock_guard<std::mutex> lock(polled_inputs_mutex_);
+  *inputs = polled_inputs_;
+  return polled_inputs_version_.load(std::memory_order_relaxed);
+}
+
+void PortRegistry::PublishPolledInputs() {
+  std::lock_guard<std::mutex> lock(polled_inputs_mutex_);
+  polled_inputs_.clear();
+  for (const Endpoint& endpoint : endpoints_) {
+    if (endpoint.input != nullptr) {
+      // Shares ownership of the device or ring.
+      polled_inputs_.emplace_back(endpoint.object, endpoint.input);
+    }
+  }
+  polled_inputs_version_.fetch_add(1, std::memory_order_release);
+}
+
+void PortRegistry::DeletePort(const Port& port) {
+  if (seq_handle_ != nullptr && snd_seq_delete_simple_port(seq_handle_, port.port_num) < 0) {
+    std::cerr << "Error deleting sequencer port " << port.name << "\n";
+  }
+}
+
+void PortRegistry::CommitGeneration() {
+  auto unused = std::stable_partition(ports_.begin(), ports_.end(), [this](const Port& port) {
+    return port.generation == building_;
+  });
+  for (auto it = unused; it != ports_.end(); ++it) {
+    std::cerr << "Deleting port " << it->port_num << " (" << it->name << ")\n";
+    DeletePort(*it);
+  }
+  ports_.erase(unused, ports_.end());
+
+  // Devices and rings are closed once the loop polling them and the
+  // previous graph let go of them.
+  auto unused_endpoints = std::stable_partition(
+      endpoints_.begin(), endpoints_.end(), [this](const Endpoint& endpoint) {
+        return endpoint.generation == building_;
+      });
+  for (auto it = unused_endpoints; it != endpoints_.end(); ++it) {
+    std::cerr << "Closing " << it->path << "\n";
+    polled_inputs_changed_ = polled_inputs_changed_ || it->input != nullptr;
+  }
+  endpoints_.erase(unused_endpoints, endpoints_.end());
+  if (polled_inputs_changed_) {
+    PublishPolledInputs();
+    polled_inputs_changed_ = false;
+  }
+  committed_ = building_;
+}
+
+void PortRegistry::AbortGeneration() {
+  auto created = std::stable_partition(ports_.begin(), ports_.end(), [this](const Port& port) {
+    return port.created != building_;
+  });
+  for (auto it = created; it != ports_.end(); ++it) {
+    DeletePort(*it);
+  }
+  ports_.erase(created, ports_.end());
+  for (Port& port : ports_) {
+    if (port.generation == building_) {
+      port.generation = committed_;
+    }
+  }
+  endpoints_.erase(std::remove_if(endpoints_.begin(), endpoints_.end(),
+                                  [this](const Endpoint& endpoint) {
+                                    return endpoint.created == building_;
+                                  }),
+                   endpoints_.end());
+  for (Endpoint& endpoint : endpoints_) {
+    if (endpoint.generation == building_) {
+      endpoint.generation = committed_;
+    }
+  }
+  polled_inputs_changed_ = false;
+  building_ = committed_;
+}
+
+// InputPoller
+void InputPoller::UpdatePollDescriptors(std::vector<struct pollfd>* pfds, size_t first) {
+  if (ports_->polled_inputs_version() == version_) {
+    return;
+  }
+  version_ = ports_->GetPolledInputs(&inputs_);
+  ready_.assign(inputs_.size(), false);
+  pfds->resize(first + inputs_.size());
+  for (size_t i = 0; i < inputs_.size(); i++) {
+    (*pfds)[first + i] = {inputs_[i]->poll_fd(), POLLIN, 0};
+  }
+}
+
+bool InputPoller::PrepareWait() {
+  bool wait = true;
+  for (size_t i = 0; i < inputs_.size(); i++) {
+    ready_[i] = !inputs_[i]->PrepareWait();
+    wait = wait && !ready_[i];
+  }
+  return wait;
+}
@@ -0,0 +1,193 @@
+#ifndef _PORT_REGISTRY_H
+#define _PORT_REGISTRY_H
+// Sequencer ports shared by successive versions of the processing graph,
+// so that reloading the config keeps existing ports and their
+// connections.
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <poll.h>
+#include <alsa/asoundlib.h>
+
+#include "midi_event.h"
+
+// Capabilities of the ports created for MidiInput and MidiOutput.
+const unsigned int kInputPortCaps = SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE;
+const unsigned int kOutputPortCaps = SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ;
+
+class RawMidiDevice;
+class ShmRing;
+
+// Source of events read by the poll loop rather than through the
+// sequencer: raw MIDI devices, shared memory rings.
+class PolledInput {
+public:
+  virtual ~PolledInput() {}
+  // Descriptor to poll for POLLIN, negative once the input is closed.
+  virtual int poll_fd() const = 0;
+  // Port number of the events read, as seen by the graph.
+  virtual uint8_t port() const = 0;
+  // Called before waiting for poll_fd(). Returns false if events are
+  // already available, the loop must then not wait.
+  virtual bool PrepareWait() { return true; }
+  // Reads the events available, calling emit(context, ev) for each.
+  // Returns false if the input can't be read anymore.
+  virtual bool ReadEvents(void (*emit)(void* context, const MidiEvent& ev),
+                          void* context) = 0;
+};
+
+// Ports are handed out to the graph being built between BeginGeneration()
+// and CommitGeneration(). A port of the previous graph with the same name
+// and capabilities is reused, otherwise a new one is created. Ports the
+// new graph doesn't use are deleted on commit. Raw MIDI devices (see
+// RawMidiDevice) and shared memory rings (see ShmRing) are shared the
+// same way.
+// Not thread-safe, except for GetPolledInputs(): only one thread must
+// build graphs at a time.
+class PortRegistry {
+public:
+  // Without a sequencer handle ports are only numbered. This is intended
+  // for testing only.
+  explicit PortRegistry(snd_seq_t *seq_handle): seq_handle_(seq_handle) {}
+  PortRegistry(const PortRegistry&) = delete;
+  PortRegistry& operator=(const PortRegistry&) = delete;
+
+  void BeginGeneration();
+  // Returns the port number for a port named 'name' with capabilities
+  // 'caps', or a negative value if the port can't be created.
+  int Acquire(const std::string& name, unsigned int caps);
+  // The new graph replaced the previous one, which must not use its
+  // ports anymore: deletes ports only used by the previous graph.
+  void CommitGeneration();
+  // The new graph won't be used: deletes ports created for it. Ports of
+  // the previous graph are kept.
+  void AbortGeneration();
+
+  // Returns the device at 'path' opened for output or input, reusing the
+  // one of the previous graph if any, or null if it can't be opened.
+  // Inputs get a port number of their own for the events read from them,
+  // counting down from 255 so as not to collide with sequencer ports.
+  std::shared_ptr<RawMidiDevice> AcquireRawDevice(const std::string& path, bool output);
+  // Same for the shared memory ring 'name', created with room for
+  // 'capacity' events. midiflume consumes the events of input rings and
+  // produces those of output rings.
+  std::shared_ptr<ShmRing> AcquireShmRing(const std::string& name, bool output,
+                                          size_t capacity);
+  // Copies the inputs of the committed graph read by polling to 'inputs',
+  // for the thread polling them. Returns the version of the list, which
+  // changes whenever a commit changes it (see polled_inputs_version()).
+  uint64_t GetPolledInputs(std::vector<std::shared_ptr<PolledInput>>* inputs) const;
+  uint64_t polled_inputs_version() const {
+    return polled_inputs_version_.load(std::memory_order_acquire);
+  }
+
+  size_t NumPorts() const { return ports_.size(); }
+  // Number of raw devices and shared memory rings.
+  size_t NumEndpoints() const { return endpoints_.size(); }
+
+private:
+  struct Port {
+    std::string name;
+    unsigned int caps;
+    int port_num;
+    // Last generation the port was acquired by.
+    int generation;
+    // Generation the port was created by.
+    int created;
+  };
+
+  enum class EndpointType { kRawDevice, kShmRing };
+  // A raw device or shared memory ring, with the same generations as
+  // ports.
+  struct Endpoint {
+    EndpointType type;
+    std::string path;
+    bool output;
+    std::shared_ptr<void> object;
+    // Null for outputs.
+    PolledInput* input;
+    int generation;
+    int created;
+  };
+
+  void DeletePort(const Port& port);
+  // Returns the endpoint of the previous graph matching the arguments,
+  // or null.
+  Endpoint* ReuseEndpoint(EndpointType type, const std::string& path, bool output);
+  // Returns a port number for a new input endpoint, -1 if none is left.
+  int FreeInputPort() const;
+  // Publishes the input endpoints for GetPolledInputs().
+  void PublishPolledInputs();
+
+  snd_seq_t *seq_handle_;
+  std::vector<Port> ports_;
+  std::vector<Endpoint> endpoints_;
+  // Whether inputs were opened or closed since the last commit.
+  bool polled_inputs_changed_ = false;
+  // Inputs of the committed graph, guarded by polled_inputs_mutex_.
+  mutable std::mutex polled_inputs_mutex_;
+  std::vector<std::shared_ptr<PolledInput>> polled_inputs_;
+  std::atomic<uint64_t> polled_inputs_version_{0};
+  // Generation of the graph in use, and of the graph being built.
+  int committed_ = 0;
+  int building_ = 0;
+  // Port numbers used without a sequencer handle.
+  int next_test_port_ = 0;
+};
+
+// Reads the polled inputs of the current graph from a poll loop. Their
+// descriptors follow the loop's own in its pollfd array, and are updated
+// whenever a new graph uses other inputs.
+class InputPoller {
+public:
+  explicit InputPoller(const PortRegistry* ports): ports_(ports) {}
+
+  // Replaces the descriptors of 'pfds' from 'first' on with those of the
+  // inputs of the current graph, if they changed.
+  void UpdatePollDescriptors(std::vector<struct pollfd>* pfds, size_t first);
+  // Called before poll(). Returns false if events are already available,
+  // the loop must then not wait.
+  bool PrepareWait();
+  // Reads the inputs whose descriptor is ready in 'pfds' (as updated
+  // above), or which had events in PrepareWait(), calling
+  // emit(const MidiEvent&) for each event. Returns true if any input was
+  // read.
+  template <typename Emit>
+  bool Read(std::vector<struct pollfd>* pfds, size_t first, Emit&& emit);
+
+private:
+  const PortRegistry* ports_;
+  uint64_t version_ = 0;
+  std::vector<std::shared_ptr<PolledInput>> inputs_;
+  // Inputs found with events by PrepareWait().
+  std::vector<bool> ready_;
+};
+
+template <typename Emit>
+bool InputPoller::Read(std::vector<struct pollfd>* pfds, size_t first, Emit&& emit) {
+  using EmitType = std::remove_reference_t<Emit>;
+  const auto call = [](void* context, const MidiEvent& ev) {
+    (*static_cast<EmitType*>(context))(ev);
+  };
+  bool read = false;
+  for (size_t i = 0; i < inputs_.size(); i++) {
+    struct pollfd& pfd = (*pfds)[first + i];
+    if (pfd.fd < 0 || !(ready_[i] || (pfd.revents & (POLLIN | POLLHUP | POLLERR)))) {
+      continue;
+    }
+    ready_[i] = false;
+    read = true;
+    if (!inputs_[i]->ReadEvents(call, &emit)) {
+      // Keeps poll from waking up for it again.
+      pfd.fd = -1;
+    }
+  }
+  return read;
+}
+
+#endif
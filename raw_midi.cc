@@ -0,0 +1,209 @@
+// Raw MIDI 1.0 byte streams.
+
+#include <algorithm>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/stat.h>
+
+#include "raw_midi.h"
+
+// MidiByteParser
+void MidiByteParser::Reset() {
+  status_ = 0;
+  num_data_ = 0;
+  in_sysex_ = false;
+  sysex_size_ = 0;
+}
+
+MidiEvent MidiByteParser::MakeEvent(uint8_t status, uint8_t data0, uint8_t data1) const {
+  MidiEvent ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.type = kMidiStatusTable[status].type;
+  ev.port = port_;
+  if (status < 0xf0) {
+    ev.channel = status & 0x0f;
+  }
+  // Same values as the sequencer gives for these messages.
+  switch (ev.type) {
+  case SND_SEQ_EVENT_NOTEON:
+  case SND_SEQ_EVENT_NOTEOFF:
+  case SND_SEQ_EVENT_KEYPRESS:
+    ev.data.note.note = data0;
+    ev.data.note.velocity = data1;
+    break;
+  case SND_SEQ_EVENT_CONTROLLER:
+    ev.data.control.param = data0;
+    ev.data.control.value = data1;
+    break;
+  case SND_SEQ_EVENT_PGMCHANGE:
+  case SND_SEQ_EVENT_CHANPRESS:
+  case SND_SEQ_EVENT_QFRAME:
+  case SND_SEQ_EVENT_SONGSEL:
+    ev.data.control.value = data0;
+    break;
+  case SND_SEQ_EVENT_PITCHBEND:
+    ev.data.control.value = ((data1 << 7) | data0) - 8192;
+    break;
+  case SND_SEQ_EVENT_SONGPOS:
+    ev.data.control.value = (data1 << 7) | data0;
+    break;
+  }
+  return ev;
+}
+
+// MidiByteEncoder
+size_t MidiByteEncoder::ChannelMessage(uint8_t status, uint8_t data0, uint8_t data1,
+                                       uint8_t num_data, uint8_t* out) {
+  size_t size = 0;
+  if (!use_running_status || status != running_status_) {
+    out[size++] = status;
+    running_status_ = status;
+  }
+  out[size++] = data0 & 0x7f;
+  if (num_data == 2) {
+    out[size++] = data1 & 0x7f;
+  }
+  return size;
+}
+
+size_t MidiByteEncoder::Encode(const MidiEvent& ev, uint8_t* out) {
+  const uint8_t channel = ev.channel & 0x0f;
+  const uint8_t controller = 0xb0 | channel;
+  const uint32_t param = ev.data.control.param;
+  const int32_t value = ev.data.control.value;
+  size_t size = 0;
+  switch (ev.type) {
+  case SND_SEQ_EVENT_NOTEON:
+    return ChannelMessage(0x90 | channel, ev.data.note.note, ev.data.note.velocity, 2, out);
+  case SND_SEQ_EVENT_NOTEOFF:
+    return ChannelMessage(0x80 | channel, ev.data.note.note, ev.data.note.velocity, 2, out);
+  case SND_SEQ_EVENT_KEYPRESS:
+    return ChannelMessage(0xa0 | channel, ev.data.note.note, ev.data.note.velocity, 2, out);
+  case SND_SEQ_EVENT_CONTROLLER:
+    return ChannelMessage(controller, param, value, 2, out);
+  case SND_SEQ_EVENT_PGMCHANGE:
+    return ChannelMessage(0xc0 | channel, value, 0, 1, out);
+  case SND_SEQ_EVENT_CHANPRESS:
+    return ChannelMessage(0xd0 | channel, value, 0, 1, out);
+  case SND_SEQ_EVENT_PITCHBEND: {
+    const int bend = std::clamp(value + 8192, 0, 16383);
+    return ChannelMessage(0xe0 | channel, bend, bend >> 7, 2, out);
+  }
+  case SND_SEQ_EVENT_CONTROL14:
+    // Controllers 0-31 have their LSB in controllers 32-63.
+    if (param >= 32) {
+      return ChannelMessage(controller, param, value, 2, out);
+    }
+    size = ChannelMessage(controller, param, value >> 7, 2, out);
+    return size + ChannelMessage(controller, param + 32, value, 2, out + size);
+  case SND_SEQ_EVENT_NONREGPARAM:
+  case SND_SEQ_EVENT_REGPARAM: {
+    const bool registered = ev.type == SND_SEQ_EVENT_REGPARAM;
+    size = ChannelMessage(controller, registered ? 101 : 99, param >> 7, 2, out);
+    size += ChannelMessage(controller, registered ? 100 : 98, param, 2, out + size);
+    size += ChannelMessage(controller, 6, value >> 7, 2, out + size);
+    return size + ChannelMessage(controller, 38, value, 2, out + size);
+  }
+  case SND_SEQ_EVENT_SYSEX:
+    size = std::min<size_t>(ev.flags & kSysexLengthMask, kSysexChunkSize);
+    memcpy(out, ev.data.sysex, size);
+    running_status_ = 0;
+    return size;
+  case SND_SEQ_EVENT_QFRAME:
+  case SND_SEQ_EVENT_SONGSEL:
+    out[0] = ev.type == SND_SEQ_EVENT_QFRAME ? 0xf1 : 0xf3;
+    out[1] = value & 0x7f;
+    running_status_ = 0;
+    return 2;
+  case SND_SEQ_EVENT_SONGPOS:
+    out[0] = 0xf2;
+    out[1] = value & 0x7f;
+    out[2] = (value >> 7) & 0x7f;
+    running_status_ = 0;
+    return 3;
+  case SND_SEQ_EVENT_TUNE_REQUEST:
+    out[0] = 0xf6;
+    running_status_ = 0;
+    return 1;
+  }
+  // Real-time messages, which leave the running status alone.
+  for (int status = 0xf8; status <= 0xff; status++) {
+    if (kMidiStatusTable[status].type == ev.type) {
+      out[0] = status;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// RawMidiDevice
+RawMidiDevice::~RawMidiDevice() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+std::unique_ptr<RawMidiDevice> RawMidiDevice::Open(const std::string& path, bool output,
+                                                   uint8_t port) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    std::cerr << "Cannot open " << path << ": " << strerror(errno) << "\n";
+    return nullptr;
+  }
+  int flags = O_NONBLOCK | O_CLOEXEC | O_NOCTTY;
+  if (S_ISFIFO(st.st_mode)) {
+    flags |= O_RDWR;
+  } else if (S_ISCHR(st.st_mode)) {
+    flags |= output ? O_WRONLY : O_RDONLY;
+  } else {
+    std::cerr << path << " is not a MIDI device or a FIFO\n";
+    return nullptr;
+  }
+  const int fd = open(path.c_str(), flags);
+  if (fd < 0) {
+    std::cerr << "Cannot open " << path << ": " << strerror(errno) << "\n";
+    return nullptr;
+  }
+  return FromFd(fd, path, output, port);
+}
+
+std::unique_ptr<RawMidiDevice> RawMidiDevice::FromFd(int fd, const std::string& path,
+                                                     bool output, uint8_t port) {
+  return std::unique_ptr<RawMidiDevice>(new RawMidiDevice(fd, path, output, port));
+}
+
+void RawMidiDevice::Fail(const char* operation) {
+  std::cerr << "Error " << operation << " " << path_ << ": "
+            << (errno != 0 ? strerror(errno) : "end of file") << ", closing it\n";
+  close(fd_);
+  fd_ = -1;
+}
+
+void RawMidiDevice::Write(const MidiEvent& ev) {
+  if (write_buffer_.size() - write_size_ < MidiByteEncoder::kMaxEventBytes) {
+    Flush();
+  }
+  write_size_ += encoder_.Encode(ev, write_buffer_.data() + write_size_);
+}
+
+void RawMidiDevice::Flush() {
+  if (write_size_ == 0) {
+    return;
+  }
+  ssize_t written = -1;
+  if (fd_ >= 0) {
+    do {
+      written = write(fd_, write_buffer_.data(), write_size_);
+    } while (written < 0 && errno == EINTR);
+    if (written < 0 && errno != EAGAIN) {
+      Fail("writing");
+    }
+  }
+  const size_t sent = written > 0 ? written : 0;
+  if (sent < write_size_) {
+    dropped_bytes_.fetch_add(write_size_ - sent, std::memory_order_relaxed);
+    // The device may have been left in the middle of a message.
+    encoder_.Reset();
+  }
+  write_size_ = 0;
+}
@@ -0,0 +1,293 @@
+#ifndef _RAW_MIDI_H
+#define _RAW_MIDI_H
+// Raw MIDI 1.0 byte streams, read and written without the sequencer:
+// ALSA rawmidi devices (/dev/snd/midiC*D*), serial MIDI adapters, FIFOs
+// and pipes.
+
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include <poll.h>
+#include <unistd.h>
+#include <alsa/asoundlib.h>
+
+#include "midi_event.h"
+#include "port_registry.h"
+
+// What a status byte starts: the sequencer event type, 0 for bytes which
+// aren't a message (undefined, end of sysex), and the number of data
+// bytes which follow.
+struct MidiStatus {
+  uint8_t type;
+  uint8_t data_bytes;
+};
+
+// Table of all status bytes, indexed by byte. Data bytes (below 0x80)
+// have no entry.
+constexpr std::array<MidiStatus, 256> MakeMidiStatusTable() {
+  std::array<MidiStatus, 256> table{};
+  for (int channel = 0; channel < 16; channel++) {
+    table[0x80 | channel] = {SND_SEQ_EVENT_NOTEOFF, 2};
+    // Note ons with velocity 0 stay note ons, as with the sequencer.
+    table[0x90 | channel] = {SND_SEQ_EVENT_NOTEON, 2};
+    table[0xa0 | channel] = {SND_SEQ_EVENT_KEYPRESS, 2};
+    table[0xb0 | channel] = {SND_SEQ_EVENT_CONTROLLER, 2};
+    table[0xc0 | channel] = {SND_SEQ_EVENT_PGMCHANGE, 1};
+    table[0xd0 | channel] = {SND_SEQ_EVENT_CHANPRESS, 1};
+    table[0xe0 | channel] = {SND_SEQ_EVENT_PITCHBEND, 2};
+  }
+  table[0xf0] = {SND_SEQ_EVENT_SYSEX, 0};
+  table[0xf1] = {SND_SEQ_EVENT_QFRAME, 1};
+  table[0xf2] = {SND_SEQ_EVENT_SONGPOS, 2};
+  table[0xf3] = {SND_SEQ_EVENT_SONGSEL, 1};
+  table[0xf6] = {SND_SEQ_EVENT_TUNE_REQUEST, 0};
+  table[0xf8] = {SND_SEQ_EVENT_CLOCK, 0};
+  table[0xfa] = {SND_SEQ_EVENT_START, 0};
+  table[0xfb] = {SND_SEQ_EVENT_CONTINUE, 0};
+  table[0xfc] = {SND_SEQ_EVENT_STOP, 0};
+  table[0xfe] = {SND_SEQ_EVENT_SENSING, 0};
+  table[0xff] = {SND_SEQ_EVENT_RESET, 0};
+  return table;
+}
+inline constexpr std::array<MidiStatus, 256> kMidiStatusTable = MakeMidiStatusTable();
+
+// Incremental parser of MIDI 1.0 byte streams. Bytes can be given in
+// pieces of any size, messages are completed by later calls. Handles
+// running status, real-time bytes anywhere (including between the data
+// bytes of a message and inside sysex), and sysex messages of any
+// length, emitted in chunks (see MidiEvent) as their bytes arrive. Data
+// bytes without a status are dropped, as are undefined status bytes.
+// Nothing is allocated.
+class MidiByteParser {
+public:
+  // Events get 'port' as their port.
+  explicit MidiByteParser(uint8_t port = 0): port_(port) {}
+
+  // Calls emit(const MidiEvent&) for each event completed by 'bytes'.
+  template <typename Emit>
+  void Parse(const uint8_t* bytes, size_t size, Emit&& emit);
+  // Forgets any partial message and the running status.
+  void Reset();
+
+private:
+  // Returns the event for a message without its sysex bytes.
+  MidiEvent MakeEvent(uint8_t status, uint8_t data0, uint8_t data1) const;
+  template <typename Emit>
+  void AddSysexByte(uint8_t byte, Emit&& emit);
+  template <typename Emit>
+  void EmitSysexChunk(bool last, Emit&& emit);
+
+  const uint8_t port_;
+  // Status of the message being received, kept after it completes for
+  // running status. 0 if none.
+  uint8_t status_ = 0;
+  uint8_t num_data_ = 0;
+  std::array<uint8_t, 2> data_{};
+  bool in_sysex_ = false;
+  // Sysex bytes not emitted yet. A full chunk is only emitted when more
+  // bytes arrive, so that the last one can be flagged.
+  std::array<uint8_t, kSysexChunkSize> sysex_{};
+  uint8_t sysex_size_ = 0;
+  bool sysex_first_ = false;
+};
+
+template <typename Emit>
+void MidiByteParser::Parse(const uint8_t* bytes, size_t size, Emit&& emit) {
+  for (size_t i = 0; i < size; i++) {
+    const uint8_t byte = bytes[i];
+    if (byte >= 0xf8) {
+      // Real-time messages don't interrupt anything.
+      if (kMidiStatusTable[byte].type != 0) {
+        emit(MakeEvent(byte, 0, 0));
+      }
+      continue;
+    }
+    if (byte < 0x80) {
+      if (in_sysex_) {
+        AddSysexByte(byte, emit);
+      } else if (status_ != 0) {
+        data_[num_data_++] = byte;
+        if (num_data_ == kMidiStatusTable[status_].data_bytes) {
+          emit(MakeEvent(status_, data_[0], data_[1]));
+          num_data_ = 0;
+          if (status_ >= 0xf0) {
+            // No running status for system common messages.
+            status_ = 0;
+          }
+        }
+      }
+      continue;
+    }
+
+    // Any other status byte ends a sysex message, as a missing F7.
+    if (in_sysex_) {
+      AddSysexByte(0xf7, emit);
+    }
+    num_data_ = 0;
+    const MidiStatus& status = kMidiStatusTable[byte];
+    if (byte >= 0xf0) {
+      // System common messages cancel the running status.
+      status_ = 0;
+    }
+    if (byte == 0xf0) {
+      in_sysex_ = true;
+      sysex_first_ = true;
+      sysex_size_ = 0;
+      AddSysexByte(byte, emit);
+    } else if (status.type == 0) {
+      // Undefined, or the end of a sysex message.
+    } else if (status.data_bytes == 0) {
+      emit(MakeEvent(byte, 0, 0));
+    } else {
+      status_ = byte;
+    }
+  }
+}
+
+template <typename Emit>
+void MidiByteParser::AddSysexByte(uint8_t byte, Emit&& emit) {
+  if (sysex_size_ == kSysexChunkSize) {
+    EmitSysexChunk(false, emit);
+  }
+  sysex_[sysex_size_++] = byte;
+  if (byte == 0xf7) {
+    EmitSysexChunk(true, emit);
+    in_sysex_ = false;
+  }
+}
+
+template <typename Emit>
+void MidiByteParser::EmitSysexChunk(bool last, Emit&& emit) {
+  if (sysex_size_ == 0) {
+    return;
+  }
+  MidiEvent ev = MakeEvent(0xf0, 0, 0);
+  memcpy(ev.data.sysex, sysex_.data(), sysex_size_);
+  ev.flags = sysex_size_ | (sysex_first_ ? kSysexFirst : 0) | (last ? kSysexLast : 0);
+  emit(static_cast<const MidiEvent&>(ev));
+  sysex_first_ = false;
+  sysex_size_ = 0;
+}
+
+// Converts events to MIDI 1.0 bytes. 14-bit controllers and (N)RPNs are
+// sent as the controllers they stand for. Sysex chunks are written as
+// they are, so messages are sent in pieces as they arrive.
+class MidiByteEncoder {
+public:
+  // Most bytes written for a single event, for an RPN.
+  static const size_t kMaxEventBytes = 12;
+
+  // Writes the bytes of 'ev' to 'out', which must have room for
+  // kMaxEventBytes. Returns their number, 0 for events which don't exist
+  // in MIDI 1.0 streams (notes with a duration, time signatures...).
+  size_t Encode(const MidiEvent& ev, uint8_t* out);
+  // The next message will have its status byte, e.g. after bytes were
+  // lost.
+  void Reset() { running_status_ = 0; }
+
+  // Leaves out repeated status bytes of channel messages.
+  bool use_running_status = true;
+
+private:
+  // Writes a channel message, returns its size.
+  size_t ChannelMessage(uint8_t status, uint8_t data0, uint8_t data1,
+                        uint8_t num_data, uint8_t* out);
+
+  uint8_t running_status_ = 0;
+};
+
+// A raw MIDI device or FIFO, opened non-blocking. Input devices are read
+// by the thread polling inputs, output devices written by the processing
+// graph.
+class RawMidiDevice final: public PolledInput {
+public:
+  RawMidiDevice(const RawMidiDevice&) = delete;
+  RawMidiDevice& operator=(const RawMidiDevice&) = delete;
+  virtual ~RawMidiDevice();
+
+  // Opens 'path', which must be a character device or a FIFO. FIFOs are
+  // opened for reading and writing, so that opening doesn't wait for the
+  // other side and readers don't see an end of file when writers come
+  // and go. Events read get 'port' as their port. Returns null on error.
+  static std::unique_ptr<RawMidiDevice> Open(const std::string& path, bool output,
+                                             uint8_t port);
+  // Same with an already open file descriptor, which the device then
+  // owns. Used for pipes.
+  static std::unique_ptr<RawMidiDevice> FromFd(int fd, const std::string& path,
+                                               bool output, uint8_t port);
+
+  // Reads the bytes available and calls emit(const MidiEvent&) for each
+  // event they complete. Returns false if the device can't be read
+  // anymore, it is then closed.
+  template <typename Emit>
+  bool Read(Emit&& emit);
+
+  // Encodes 'ev' into the output buffer, flushing it first if full.
+  void Write(const MidiEvent& ev);
+  // Writes the output buffer with one system call. What the device can't
+  // take without blocking is dropped and counted.
+  void Flush();
+
+  virtual int poll_fd() const override { return fd_; }
+  virtual uint8_t port() const override { return port_; }
+  virtual bool ReadEvents(void (*emit)(void* context, const MidiEvent& ev),
+                          void* context) override {
+    return Read([emit, context](const MidiEvent& ev) { emit(context, ev); });
+  }
+
+  const std::string& path() const { return path_; }
+  bool output() const { return output_; }
+  uint64_t dropped_bytes() const {
+    return dropped_bytes_.load(std::memory_order_relaxed);
+  }
+
+private:
+  RawMidiDevice(int fd, const std::string& path, bool output, uint8_t port):
+    fd_(fd), path_(path), output_(output), port_(port), parser_(port) {}
+  // Closes the device after an error other than EAGAIN, reported once.
+  void Fail(const char* operation);
+
+  int fd_;
+  const std::string path_;
+  const bool output_;
+  const uint8_t port_;
+  MidiByteParser parser_;
+  MidiByteEncoder encoder_;
+  std::array<uint8_t, 1024> write_buffer_;
+  size_t write_size_ = 0;
+  std::atomic<uint64_t> dropped_bytes_{0};
+};
+
+template <typename Emit>
+bool RawMidiDevice::Read(Emit&& emit) {
+  if (fd_ < 0) {
+    return false;
+  }
+  std::array<uint8_t, 256> bytes;
+  while (true) {
+    const ssize_t size = read(fd_, bytes.data(), bytes.size());
+    if (size > 0) {
+      parser_.Parse(bytes.data(), size, emit);
+      if (static_cast<size_t>(size) < bytes.size()) {
+        return true;
+      }
+    } else if (size < 0 && errno == EINTR) {
+      continue;
+    } else if (size < 0 && errno == EAGAIN) {
+      return true;
+    } else {
+      if (size == 0) {
+        errno = 0;
+      }
+      Fail("reading");
+      return false;
+    }
+  }
+}
+
+#endif
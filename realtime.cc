@@ -0,0 +1,391 @@
+// Real-time execution mode.
+
+#include <cerrno>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "realtime.h"
+#include "timer_wheel.h"
+
+// Amount of stack touched by the processing thread before it starts, so
+// that processing never page faults on the stack.
+const size_t kStackPrefaultSize = 256 * 1024;
+
+RealtimeEngine::RealtimeEngine(snd_seq_t *seq_handle, GraphSlot* graphs,
+                               const RealtimeOptions& options):
+  seq_handle_(seq_handle), graphs_(graphs), options_(options),
+  input_queue_(options.queue_size), output_queue_(options.queue_size) {}
+
+RealtimeEngine::~RealtimeEngine() {
+  Stop();
+  if (input_wakeup_fd_ >= 0) {
+    close(input_wakeup_fd_);
+  }
+  if (output_wakeup_fd_ >= 0) {
+    close(output_wakeup_fd_);
+  }
+  if (timer_fd_ >= 0) {
+    close(timer_fd_);
+  }
+}
+
+// Returns the MidiOutput processors of 'dag'.
+static std::vector<MidiOutput*> GetOutputs(ProcessorDAG* dag) {
+  std::vector<MidiOutput*> outputs;
+  for (size_t i = 0; i < dag->NumProcessors(); i++) {
+    auto output = dynamic_cast<MidiOutput*>(dag->GetProcessor(i));
+    if (output != nullptr) {
+      outputs.push_back(output);
+    }
+  }
+  return outputs;
+}
+
+bool RealtimeEngine::PrepareGraph(ProcessorDAG* dag) {
+  if (!dag->IsFinalized()) {
+    std::cerr << "RealtimeEngine: the graph must be finalized.\n";
+    return false;
+  }
+  dag->Reserve(options_.max_batch_size);
+  for (MidiOutput* output : GetOutputs(dag)) {
+    output->SetOutputQueue(&output_queue_);
+  }
+  return true;
+}
+
+bool RealtimeEngine::Start() {
+  ProcessorDAG* dag = graphs_->current();
+  if (!dag->IsFinalized()) {
+    std::cerr << "RealtimeEngine: the graph must be finalized.\n";
+    return false;
+  }
+
+  // Locks all current and future memory, and keeps malloc from giving
+  // memory back to the kernel or using fresh mappings: memory freed and
+  // reallocated stays locked.
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+    std::cerr << "Cannot lock memory: " << strerror(errno)
+              << " (check RLIMIT_MEMLOCK)\n";
+    return false;
+  }
+  mallopt(M_TRIM_THRESHOLD, -1);
+  mallopt(M_MMAP_MAX, 0);
+
+  // Allocated now that memory is locked, so that it's also prefaulted.
+  PrepareGraph(dag);
+  // Room for a sysex message at the end of a batch.
+  batch_.reserve(options_.max_batch_size + kMaxSysexChunks);
+
+  input_wakeup_fd_ = eventfd(0, EFD_CLOEXEC);
+  output_wakeup_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (input_wakeup_fd_ < 0 || output_wakeup_fd_ < 0) {
+    std::cerr << "Cannot create eventfd: " << strerror(errno) << "\n";
+    return false;
+  }
+  timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer_fd_ < 0) {
+    std::cerr << "Cannot create timer: " << strerror(errno) << "\n";
+    return false;
+  }
+
+  num_seq_pfds_ = snd_seq_poll_descriptors_count(seq_handle_, POLLIN);
+  pfds_.resize(num_seq_pfds_ + 1);
+  snd_seq_poll_descriptors(seq_handle_, pfds_.data(), num_seq_pfds_, POLLIN);
+  pfds_[num_seq_pfds_].fd = output_wakeup_fd_;
+  pfds_[num_seq_pfds_].events = POLLIN;
+
+  std::promise<std::string> setup_error;
+  std::future<std::string> setup_done = setup_error.get_future();
+  stopping_ = false;
+  thread_ = std::thread([this, &setup_error]() {
+    std::string error = SetUpProcessingThread();
+    const bool ok = error.empty();
+    setup_error.set_value(error);
+    if (ok) {
+      ProcessingThread();
+    }
+  });
+  const std::string error = setup_done.get();
+  if (!error.empty()) {
+    std::cerr << error << "\n";
+    thread_.join();
+    Stop();
+    return false;
+  }
+  std::cerr << "Real-time processing started (priority " << options_.priority;
+  if (options_.cpu >= 0) {
+    std::cerr << ", cpu " << options_.cpu;
+  }
+  std::cerr << ")\n";
+  return true;
+}
+
+void PrefaultStack() {
+  char stack[kStackPrefaultSize];
+  memset(stack, 0, sizeof(stack));
+  // Keeps the compiler from optimizing the memset away.
+  asm volatile("" : : "r"(stack) : "memory");
+}
+
+std::string RealtimeEngine::SetUpProcessingThread() {
+  if (options_.cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(options_.cpu, &cpus);
+    const int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (error != 0) {
+      return "Cannot pin processing thread to cpu " + std::to_string(options_.cpu)
+          + ": " + strerror(error);
+    }
+  }
+  // Hardware counters are per thread.
+  if (options_.perf_counters && !graphs_->current()->EnablePerfCounters()) {
+    return "Cannot enable hardware counters on the processing thread";
+  }
+  PrefaultStack();
+
+  struct sched_param param;
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = options_.priority;
+  const int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+  if (error != 0) {
+    return std::string("Cannot set SCHED_FIFO priority ")
+        + std::to_string(options_.priority) + ": " + strerror(error)
+        + " (check RLIMIT_RTPRIO)";
+  }
+  return "";
+}
+
+void RealtimeEngine::Stop() {
+  if (thread_.joinable()) {
+    stopping_ = true;
+    const uint64_t one = 1;
+    if (write(input_wakeup_fd_, &one, sizeof(one)) != sizeof(one)) {
+      std::cerr << "Cannot wake up processing thread: " << strerror(errno) << "\n";
+    }
+    thread_.join();
+  }
+  for (MidiOutput* output : GetOutputs(graphs_->current())) {
+    output->SetOutputQueue(nullptr);
+  }
+  // Events processed but not sent yet.
+  WriteOutput();
+}
+
+// Nothing in here must allocate memory, lock or log.
+void RealtimeEngine::ProcessingThread() {
+  struct pollfd pfds[2];
+  pfds[0] = {input_wakeup_fd_, POLLIN, 0};
+  pfds[1] = {timer_fd_, POLLIN, 0};
+  while (true) {
+    if (poll(pfds, 2, -1) < 0) {
+      if (errno != EINTR) {
+        IncrementCounter(&processing_errors_, 1);
+      }
+      continue;
+    }
+    if (stopping_) {
+      return;
+    }
+    uint64_t value;
+    if ((pfds[0].revents & POLLIN)
+        && read(input_wakeup_fd_, &value, sizeof(value)) < 0 && errno != EINTR) {
+      IncrementCounter(&processing_errors_, 1);
+    }
+    if ((pfds[1].revents & POLLIN)
+        && read(timer_fd_, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+      IncrementCounter(&processing_errors_, 1);
+    }
+    ProcessInputQueue();
+  }
+}
+
+void RealtimeEngine::ProcessInputQueue() {
+  // The I/O thread writes to the eventfd after pushing events, so events
+  // pushed after this loop are processed on the next wake up.
+  bool done = false;
+  UpdateMaximum(&max_input_queue_depth_, input_queue_.Size());
+  while (!done) {
+    batch_.clear();
+    while (true) {
+      const MidiEvent* ev = input_queue_.Front();
+      if (ev == nullptr) {
+        done = true;
+        break;
+      }
+      // Sysex messages are never split between two batches.
+      if (batch_.size() >= options_.max_batch_size && !IsSysexContinuation(*ev)) {
+        break;
+      }
+      batch_.push_back(*ev);
+      input_queue_.Pop();
+    }
+    ProcessorDAG* dag = graphs_->Enter(GraphSlot::kProcessingReader);
+    // Delays are counted from now, see ProcessorDAG::ProcessTimers().
+    if (!dag->ProcessTimers(MonotonicMs())
+        || (!batch_.empty() && !dag->ProcessBatch(batch_))) {
+      IncrementCounter(&processing_errors_, 1);
+    }
+    const uint64_t next_timer = dag->NextTimer();
+    graphs_->Exit(GraphSlot::kProcessingReader);
+    if (done && !SetTimerFd(timer_fd_, next_timer)) {
+      IncrementCounter(&processing_errors_, 1);
+    }
+    if (output_queue_.Size() > 0) {
+      const uint64_t one = 1;
+      if (write(output_wakeup_fd_, &one, sizeof(one)) != sizeof(one)) {
+        IncrementCounter(&processing_errors_, 1);
+      }
+    }
+  }
+}
+
+void RealtimeEngine::Poll(int timeout_ms) {
+  // Polled inputs follow the output wakeup.
+  if (polled_inputs_ != nullptr) {
+    polled_inputs_->UpdatePollDescriptors(&pfds_, num_seq_pfds_ + 1);
+    if (!polled_inputs_->PrepareWait()) {
+      timeout_ms = 0;
+    }
+  }
+  if (poll(pfds_.data(), pfds_.size(), timeout_ms) < 0) {
+    return;
+  }
+  for (int i = 0; i < num_seq_pfds_; i++) {
+    if (pfds_[i].revents & POLLIN) {
+      ReadInput();
+      break;
+    }
+  }
+  if (polled_inputs_ != nullptr) {
+    ReadPolledInputs();
+  }
+  if (pfds_[num_seq_pfds_].revents & POLLIN) {
+    uint64_t value;
+    // Only resets the counter, events are counted by the queue.
+    if (read(output_wakeup_fd_, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+      std::cerr << "Cannot read eventfd: " << strerror(errno) << "\n";
+    }
+    WriteOutput();
+  }
+}
+
+void RealtimeEngine::ReadInput() {
+  bool queued = false;
+  // Events read by a single call are captured as read together.
+  const uint64_t time_ns = capture_ != nullptr ? MonotonicNs() : 0;
+  do {
+    snd_seq_event_t *ev;
+    const int result = snd_seq_event_input(seq_handle_, &ev);
+    if (result < 0) {
+      if (result == -ENOSPC) {
+        // Events were lost before they could be read.
+        IncrementCounter(&input_overflows_, 1);
+      }
+      break;
+    }
+    // Filters out connection events which we don't want to process.
+    if (ev->type < SND_SEQ_EVENT_CLIENT_START || ev->type >= SND_SEQ_EVENT_USR0) {
+      // Converted here, as the data of sysex events is only valid until
+      // the next read.
+      const size_t count = NumMidiEvents(*ev);
+      if (count == 0 || input_queue_.capacity() - input_queue_.Size() < count) {
+        IncrementCounter(&dropped_input_events_, 1);
+      } else {
+        FromSeqEvent(*ev, input_events_.data());
+        for (size_t i = 0; i < count; i++) {
+          input_queue_.TryPush(input_events_[i]);
+        }
+        if (capture_ != nullptr) {
+          capture_->Append(input_events_.data(), count, time_ns);
+        }
+        queued = true;
+      }
+    }
+    snd_seq_free_event(ev);
+  } while (snd_seq_event_input_pending(seq_handle_, 0) > 0);
+
+  if (queued) {
+    const uint64_t one = 1;
+    if (write(input_wakeup_fd_, &one, sizeof(one)) != sizeof(one)) {
+      std::cerr << "Cannot wake up processing thread: " << strerror(errno) << "\n";
+    }
+  }
+}
+
+void RealtimeEngine::ReadPolledInputs() {
+  const uint64_t time_ns = capture_ != nullptr ? MonotonicNs() : 0;
+  bool queued = false;
+  polled_inputs_->Read(&pfds_, num_seq_pfds_ + 1, [&](const MidiEvent& ev) {
+    if (!input_queue_.TryPush(ev)) {
+      IncrementCounter(&dropped_input_events_, 1);
+      return;
+    }
+    if (capture_ != nullptr) {
+      capture_->Append(&ev, 1, time_ns);
+    }
+    queued = true;
+  });
+  if (queued) {
+    const uint64_t one = 1;
+    if (write(input_wakeup_fd_, &one, sizeof(one)) != sizeof(one)) {
+      std::cerr << "Cannot wake up processing thread: " << strerror(errno) << "\n";
+    }
+  }
+}
+
+void RealtimeEngine::WriteOutput() {
+  UpdateMaximum(&max_output_queue_depth_, output_queue_.Size());
+  MidiEvent ev;
+  while (output_queue_.TryPop(&ev)) {
+    snd_seq_event_t seq_ev;
+    if (!encoder_.Encode(ev, &seq_ev)) {
+      continue;  // Part of a sysex message.
+    }
+    snd_seq_ev_set_subs(&seq_ev);
+    snd_seq_ev_set_direct(&seq_ev);
+    snd_seq_ev_set_source(&seq_ev, ev.port);
+    if (output_buffer_ != nullptr) {
+      output_buffer_->Output(&seq_ev);
+    } else {
+      snd_seq_event_output_direct(seq_handle_, &seq_ev);
+    }
+  }
+  if (output_buffer_ != nullptr) {
+    output_buffer_->Drain();
+  }
+}
+
+void RealtimeEngine::PrintStats(std::ostream& out) {
+  uint64_t dropped_output_events = 0;
+  for (const MidiOutput* output : GetOutputs(graphs_->Enter(GraphSlot::kStatsReader))) {
+    dropped_output_events += output->dropped_events();
+  }
+  graphs_->Exit(GraphSlot::kStatsReader);
+  out << "Real-time processing: "
+      << dropped_input_events_.load(std::memory_order_relaxed)
+      << " input events dropped, " << dropped_output_events
+      << " output events dropped, "
+      << processing_errors_.load(std::memory_order_relaxed)
+      << " processing errors\n";
+}
+
+void RealtimeEngine::PublishMetrics(IoMetrics* metrics) {
+  SetMetric(&metrics->input_overflows, input_overflows_.load(std::memory_order_relaxed));
+  SetMetric(&metrics->dropped_input_events,
+            dropped_input_events_.load(std::memory_order_relaxed));
+  SetMetric(&metrics->input_queue_depth, input_queue_.Size());
+  SetMetric(&metrics->max_input_queue_depth,
+            max_input_queue_depth_.load(std::memory_order_relaxed));
+  SetMetric(&metrics->output_queue_depth, output_queue_.Size());
+  SetMetric(&metrics->max_output_queue_depth,
+            max_output_queue_depth_.load(std::memory_order_relaxed));
+}
@@ -0,0 +1,144 @@
+#ifndef _REALTIME_H
+#define _REALTIME_H
+// Real-time execution mode: the processing graph runs on a dedicated
+// SCHED_FIFO thread with locked memory, while the thread owning the
+// sequencer reads and writes events. Events go from one thread to the
+// other through preallocated lock-free queues, converted to MidiEvent
+// by the I/O thread.
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <alsa/asoundlib.h>
+
+#include "capture.h"
+#include "dag.h"
+#include "event_processors.h"
+#include "graph_slot.h"
+#include "metrics.h"
+#include "midi_event.h"
+#include "port_registry.h"
+#include "spsc_ring.h"
+
+struct RealtimeOptions {
+  // Core the processing thread is pinned to, -1 to let the kernel choose.
+  int cpu = -1;
+  // SCHED_FIFO priority of the processing thread.
+  int priority = 70;
+  // Capacity of the input and output queues, in events.
+  size_t queue_size = 4096;
+  // Maximum number of events given at once to ProcessorDAG::ProcessBatch.
+  size_t max_batch_size = 256;
+  // Reads hardware counters on the processing thread, see
+  // ProcessorDAG::EnablePerfCounters().
+  bool perf_counters = false;
+};
+
+class RealtimeEngine {
+public:
+  // The processing thread runs the current graph of 'graphs', which must
+  // outlive the engine. Graphs published there after Start() must first
+  // go through PrepareGraph().
+  RealtimeEngine(snd_seq_t *seq_handle, GraphSlot* graphs,
+                 const RealtimeOptions& options);
+  ~RealtimeEngine();
+  RealtimeEngine(const RealtimeEngine&) = delete;
+  RealtimeEngine& operator=(const RealtimeEngine&) = delete;
+
+  // Sends processed events through 'buffer', drained after each batch of
+  // events taken from the output queue, instead of one write per event.
+  // Call before Start().
+  void SetOutputBuffer(OutputBuffer* buffer) { output_buffer_ = buffer; }
+  // Appends events queued for the processing thread to 'capture', from
+  // the I/O thread. Call before Start().
+  void SetCapture(CaptureWriter* capture) { capture_ = capture; }
+  // Also reads the polled inputs of the graphs built with 'ports' (see
+  // RawMidiInput and ShmInput). Call before Start().
+  void SetPolledInputs(const PortRegistry* ports) {
+    polled_inputs_ = std::make_unique<InputPoller>(ports);
+  }
+
+  // Locks memory, prepares the current graph and starts the processing
+  // thread. Returns false if any of these fails, typically for lack of
+  // permissions (see RLIMIT_RTPRIO and RLIMIT_MEMLOCK).
+  bool Start();
+  // Sizes the buffers of 'dag' for the engine and switches all its
+  // MidiOutput processors to queued mode. 'dag' must be finalized.
+  bool PrepareGraph(ProcessorDAG* dag);
+  // Waits up to 'timeout_ms' for incoming events or processed events,
+  // then forwards them. Must be called in a loop by the thread that
+  // called Start(). Returns early when interrupted by a signal.
+  void Poll(int timeout_ms);
+  // Stops the processing thread and goes back to direct output.
+  void Stop();
+
+  // Prints queue overflows and processing errors. Output queue overflows
+  // are only counted since the last graph change.
+  void PrintStats(std::ostream& out);
+  // Copies sequencer and queue counters to 'metrics', see
+  // MetricsWriter. Can be called from any thread.
+  void PublishMetrics(IoMetrics* metrics);
+
+private:
+  // Body of the processing thread.
+  void ProcessingThread();
+  // Configures the calling thread for real-time processing. Returns an
+  // error message, empty on success.
+  std::string SetUpProcessingThread();
+  // Processes queued events and scheduled events which came due.
+  void ProcessInputQueue();
+
+  // Reads events from the sequencer into the input queue.
+  void ReadInput();
+  // Reads events from polled inputs into the input queue.
+  void ReadPolledInputs();
+  // Sends events from the output queue.
+  void WriteOutput();
+
+  snd_seq_t *seq_handle_;
+  GraphSlot* graphs_;
+  const RealtimeOptions options_;
+  OutputBuffer* output_buffer_ = nullptr;
+  CaptureWriter* capture_ = nullptr;
+  std::unique_ptr<InputPoller> polled_inputs_;
+
+  SpscRing<MidiEvent> input_queue_;
+  SpscRing<MidiEvent> output_queue_;
+  // Conversion of incoming events, used by the I/O thread.
+  std::array<MidiEvent, kMaxSysexChunks> input_events_;
+  // Conversion of outgoing events, used by the I/O thread.
+  SeqEventEncoder encoder_;
+  // Eventfds used to wake up the processing thread when events have been
+  // queued, and the I/O thread when events have been processed.
+  int input_wakeup_fd_ = -1;
+  int output_wakeup_fd_ = -1;
+  // Wakes up the processing thread when events scheduled by processors
+  // come due.
+  int timer_fd_ = -1;
+  // Sequencer descriptors, the output wakeup, then polled inputs.
+  std::vector<struct pollfd> pfds_;
+  // Number of sequencer descriptors at the start of pfds_.
+  int num_seq_pfds_ = 0;
+
+  std::thread thread_;
+  std::atomic<bool> stopping_{false};
+  // Events given to the graph, only used by the processing thread.
+  std::vector<MidiEvent> batch_;
+
+  std::atomic<uint64_t> dropped_input_events_{0};
+  std::atomic<uint64_t> processing_errors_{0};
+  // Overflows of the sequencer input buffer, counted by the I/O thread.
+  std::atomic<uint64_t> input_overflows_{0};
+  // Largest number of events seen in the input queue by the processing
+  // thread, and in the output queue by the I/O thread.
+  std::atomic<uint64_t> max_input_queue_depth_{0};
+  std::atomic<uint64_t> max_output_queue_depth_{0};
+};
+
+#endif
@@ -0,0 +1,303 @@
+// Shared memory rings between processes.
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "shm_ring.h"
+
+// Records start on the cache line after the positions.
+static_assert(sizeof(ShmRingSegment) % 64 == 0, "Records must be cache-line aligned");
+
+// Fills 'addr' with the abstract socket address of ring 'name'. Returns
+// its length, 0 if the name is too long.
+static socklen_t MakeSocketAddress(const std::string& name, struct sockaddr_un* addr) {
+  const std::string path = std::string("midiflume-ring") + name;
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (path.size() + 1 > sizeof(addr->sun_path)) {
+    return 0;
+  }
+  // Abstract: starts with a null byte, not visible in the file system.
+  memcpy(addr->sun_path + 1, path.data(), path.size());
+  return offsetof(struct sockaddr_un, sun_path) + 1 + path.size();
+}
+
+ShmRing::~ShmRing() {
+  if (listen_fd_ >= 0) {
+    // Makes the pending accept() fail.
+    shutdown(listen_fd_, SHUT_RDWR);
+    if (server_.joinable()) {
+      server_.join();
+    }
+    close(listen_fd_);
+  }
+  if (created_) {
+    shm_unlink(name_.c_str());
+  }
+  if (segment_ != nullptr) {
+    munmap(segment_, mapped_size_);
+  }
+  if (wakeup_fd_ >= 0) {
+    close(wakeup_fd_);
+  }
+}
+
+bool ShmRing::Map(int fd, size_t size) {
+  void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  segment_ = static_cast<ShmRingSegment*>(data);
+  records_ = reinterpret_cast<MidiEvent*>(segment_ + 1);
+  mapped_size_ = size;
+  return true;
+}
+
+std::unique_ptr<ShmRing> ShmRing::Create(const std::string& name, size_t capacity,
+                                         uint8_t port) {
+  uint64_t num_records = 1;
+  while (num_records < capacity) {
+    num_records *= 2;
+  }
+  std::unique_ptr<ShmRing> ring(new ShmRing(name, port));
+
+  // The socket is bound first, so that a second process creating the
+  // same ring fails before touching the segment.
+  struct sockaddr_un addr;
+  const socklen_t addr_len = MakeSocketAddress(name, &addr);
+  ring->listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (addr_len == 0 || ring->listen_fd_ < 0
+      || bind(ring->listen_fd_, reinterpret_cast<struct sockaddr*>(&addr), addr_len) != 0
+      || listen(ring->listen_fd_, 8) != 0) {
+    std::cerr << "Cannot create socket for ring " << name << ": "
+              << strerror(errno) << "\n";
+    return nullptr;
+  }
+
+  const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    std::cerr << "Cannot create shared memory " << name << ": "
+              << strerror(errno) << "\n";
+    return nullptr;
+  }
+  ring->created_ = true;
+  const size_t size = sizeof(ShmRingSegment) + num_records * sizeof(MidiEvent);
+  // Zero-filled, which initializes the positions.
+  const bool mapped = ftruncate(fd, size) == 0 && ring->Map(fd, size);
+  close(fd);
+  if (!mapped) {
+    std::cerr << "Cannot map shared memory " << name << ": "
+              << strerror(errno) << "\n";
+    return nullptr;
+  }
+  ShmRingHeader& header = ring->segment_->header;
+  memcpy(header.magic, kShmRingMagic, sizeof(header.magic));
+  header.version = kShmRingVersion;
+  header.record_size = sizeof(MidiEvent);
+  header.capacity = num_records;
+  header.pid = getpid();
+  ring->mask_ = num_records - 1;
+
+  ring->wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (ring->wakeup_fd_ < 0) {
+    std::cerr << "Cannot create eventfd: " << strerror(errno) << "\n";
+    return nullptr;
+  }
+  ring->server_ = std::thread(&ShmRing::ServeWakeupFd, ring.get());
+  return ring;
+}
+
+void ShmRing::ServeWakeupFd() {
+  while (true) {
+    const int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      return;
+    }
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    union {
+      char buffer[CMSG_SPACE(sizeof(int))];
+      struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &wakeup_fd_, sizeof(int));
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != 1) {
+      std::cerr << "Cannot send eventfd of ring " << name_ << ": "
+                << strerror(errno) << "\n";
+    }
+    close(fd);
+  }
+}
+
+std::unique_ptr<ShmRing> ShmRing::Attach(const std::string& name) {
+  std::unique_ptr<ShmRing> ring(new ShmRing(name, 0));
+
+  struct sockaddr_un addr;
+  const socklen_t addr_len = MakeSocketAddress(name, &addr);
+  const int socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (addr_len == 0 || socket_fd < 0
+      || connect(socket_fd, reinterpret_cast<struct sockaddr*>(&addr), addr_len) != 0) {
+    std::cerr << "Cannot connect to ring " << name << ": " << strerror(errno) << "\n";
+    if (socket_fd >= 0) {
+      close(socket_fd);
+    }
+    return nullptr;
+  }
+  char byte;
+  struct iovec iov = {&byte, 1};
+  union {
+    char buffer[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof(control.buffer);
+  const ssize_t received = recvmsg(socket_fd, &msg, MSG_CMSG_CLOEXEC);
+  close(socket_fd);
+  struct cmsghdr* cmsg = received == 1 ? CMSG_FIRSTHDR(&msg) : nullptr;
+  if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+    std::cerr << "Cannot get eventfd of ring " << name << "\n";
+    return nullptr;
+  }
+  memcpy(&ring->wakeup_fd_, CMSG_DATA(cmsg), sizeof(int));
+
+  const int fd = shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0);
+  if (fd < 0) {
+    std::cerr << "Cannot open shared memory " << name << ": "
+              << strerror(errno) << "\n";
+    return nullptr;
+  }
+  struct stat st;
+  const bool mapped = fstat(fd, &st) == 0
+    && static_cast<size_t>(st.st_size) >= sizeof(ShmRingSegment)
+    && ring->Map(fd, st.st_size);
+  close(fd);
+  if (!mapped) {
+    std::cerr << "Cannot map shared memory " << name << "\n";
+    return nullptr;
+  }
+  const ShmRingHeader& header = ring->segment_->header;
+  const uint64_t capacity = header.capacity;
+  if (memcmp(header.magic, kShmRingMagic, sizeof(header.magic)) != 0
+      || header.version != kShmRingVersion || header.record_size != sizeof(MidiEvent)
+      || capacity == 0 || (capacity & (capacity - 1)) != 0
+      || (ring->mapped_size_ - sizeof(ShmRingSegment)) / sizeof(MidiEvent) < capacity) {
+    std::cerr << name << " is not a valid ring\n";
+    return nullptr;
+  }
+  ring->mask_ = capacity - 1;
+  ring->cached_head_ = ring->segment_->head.load(std::memory_order_acquire);
+  ring->cached_tail_ = ring->segment_->tail.load(std::memory_order_acquire);
+  return ring;
+}
+
+bool ShmRing::TryPush(const MidiEvent& ev) {
+  const uint64_t head = segment_->head.load(std::memory_order_relaxed);
+  if (head - cached_tail_ > mask_) {
+    cached_tail_ = segment_->tail.load(std::memory_order_acquire);
+    if (head - cached_tail_ > mask_) {
+      segment_->dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+  }
+  records_[head & mask_] = ev;
+  segment_->head.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+void ShmRing::Wake() {
+  // Orders the pushes before reading the flag, see PrepareWait().
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (segment_->consumer_waiting.load(std::memory_order_relaxed) != 0
+      && segment_->consumer_waiting.exchange(0, std::memory_order_relaxed) != 0) {
+    const uint64_t one = 1;
+    if (write(wakeup_fd_, &one, sizeof(one)) != sizeof(one)) {
+      std::cerr << "Cannot wake up consumer of ring " << name_ << ": "
+                << strerror(errno) << "\n";
+    }
+  }
+}
+
+bool ShmRing::TryPop(MidiEvent* ev) {
+  const uint64_t tail = segment_->tail.load(std::memory_order_relaxed);
+  if (tail == cached_head_) {
+    cached_head_ = segment_->head.load(std::memory_order_acquire);
+    if (tail == cached_head_) {
+      return false;
+    }
+  }
+  *ev = records_[tail & mask_];
+  segment_->tail.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+bool ShmRing::PrepareWait() {
+  segment_->consumer_waiting.store(1, std::memory_order_relaxed);
+  // Either the producer sees the flag, or we see its events.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (segment_->head.load(std::memory_order_relaxed)
+      != segment_->tail.load(std::memory_order_relaxed)) {
+    segment_->consumer_waiting.store(0, std::memory_order_relaxed);
+    return false;
+  }
+  waiting_ = true;
+  return true;
+}
+
+void ShmRing::EndWait() {
+  if (!waiting_) {
+    return;
+  }
+  waiting_ = false;
+  segment_->consumer_waiting.store(0, std::memory_order_relaxed);
+  // Drained even if the flag was still set: a producer may have cleared
+  // it during an earlier wait, and written to the eventfd only after the
+  // consumer read it, which would otherwise wake up every wait.
+  uint64_t value;
+  if (read(wakeup_fd_, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+    std::cerr << "Cannot read eventfd of ring " << name_ << ": "
+              << strerror(errno) << "\n";
+  }
+}
+
+bool ShmRing::ReadEvents(void (*emit)(void* context, const MidiEvent& ev), void* context) {
+  EndWait();
+  // At most one ring's worth, so that a fast producer can't keep the
+  // loop here. What's left is found by the next PrepareWait().
+  MidiEvent ev;
+  for (uint64_t i = 0; i <= mask_ && TryPop(&ev); i++) {
+    ev.port = port_;
+    emit(context, ev);
+  }
+  return true;
+}
+
+size_t ShmRing::Size() const {
+  return segment_->head.load(std::memory_order_acquire)
+      - segment_->tail.load(std::memory_order_acquire);
+}
@@ -0,0 +1,136 @@
+#ifndef _SHM_RING_H
+#define _SHM_RING_H
+// Transport of events between midiflume and other processes on the same
+// host through shared memory, without going through the sequencer.
+//
+// A ring is a named shared memory segment (see shm_open) holding a
+// ShmRingSegment: a lock-free single-producer single-consumer queue of
+// MidiEvent records, 16 bytes each with the layout of midi_event.h. The
+// process creating the ring also creates an eventfd, which the producer
+// writes to when the consumer waits for events. Other processes get it
+// over the abstract unix socket "\0midiflume-ring<name>" when they
+// attach: a single byte, with the descriptor as SCM_RIGHTS.
+//
+// Pushing and popping events are plain memory accesses. The eventfd is
+// only written when the consumer is about to sleep, so that neither side
+// makes system calls while events keep flowing.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "midi_event.h"
+#include "port_registry.h"
+
+const char kShmRingMagic[8] = {'M', 'F', 'R', 'I', 'N', 'G', '\0', '\0'};
+// Incremented whenever ShmRingSegment changes.
+const uint32_t kShmRingVersion = 1;
+// Capacity of rings created for ShmInput and ShmOutput, in events.
+const size_t kDefaultShmRingCapacity = 4096;
+
+struct alignas(64) ShmRingHeader {
+  char magic[8];
+  uint32_t version;
+  // sizeof(MidiEvent).
+  uint32_t record_size;
+  // Number of records, a power of two.
+  uint64_t capacity;
+  // Process which created the ring.
+  uint64_t pid;
+};
+
+struct ShmRingSegment {
+  ShmRingHeader header;
+  // Records pushed so far, written by the producer, and records dropped
+  // because the ring was full.
+  alignas(64) std::atomic<uint64_t> head;
+  std::atomic<uint64_t> dropped;
+  // Records popped so far, written by the consumer, and whether it is
+  // waiting for the eventfd.
+  alignas(64) std::atomic<uint64_t> tail;
+  std::atomic<uint32_t> consumer_waiting;
+  // Followed by 'capacity' records, on the next cache line.
+};
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "Shared memory atomics must be lock-free");
+
+// One end of a ring. Either process can produce or consume, but each
+// ring has a single producer and a single consumer, each used by one
+// thread at a time.
+class ShmRing final: public PolledInput {
+public:
+  virtual ~ShmRing();
+  ShmRing(const ShmRing&) = delete;
+  ShmRing& operator=(const ShmRing&) = delete;
+
+  // Creates the ring 'name', such as "/midiflume-in", with room for
+  // 'capacity' events (rounded up to a power of two), replacing any
+  // previous one of that name. Events popped get 'port' as their port.
+  // The ring is removed when this end is destroyed. Returns null on
+  // error.
+  static std::unique_ptr<ShmRing> Create(const std::string& name, size_t capacity,
+                                         uint8_t port = 0);
+  // Attaches to the ring 'name' created by another process. Returns null
+  // if it doesn't exist or is invalid.
+  static std::unique_ptr<ShmRing> Attach(const std::string& name);
+
+  // Producer side. Returns false, and counts the event as dropped, if
+  // the ring is full.
+  bool TryPush(const MidiEvent& ev);
+  // Wakes up the consumer if it waits. Call after pushing a batch.
+  void Wake();
+
+  // Consumer side. Returns false if the ring is empty.
+  bool TryPop(MidiEvent* ev);
+  // Call before waiting for wakeup_fd(). Returns false if events arrived
+  // in the meantime, and the consumer must not wait.
+  virtual bool PrepareWait() override;
+  // Call once woken up, before popping events.
+  void EndWait();
+
+  // Pops all events, see PolledInput.
+  virtual bool ReadEvents(void (*emit)(void* context, const MidiEvent& ev),
+                          void* context) override;
+  virtual int poll_fd() const override { return wakeup_fd_; }
+  virtual uint8_t port() const override { return port_; }
+
+  const std::string& name() const { return name_; }
+  int wakeup_fd() const { return wakeup_fd_; }
+  size_t capacity() const { return mask_ + 1; }
+  // Number of events in the ring, approximate while the other side runs.
+  size_t Size() const;
+  uint64_t dropped_events() const {
+    return segment_->dropped.load(std::memory_order_relaxed);
+  }
+
+private:
+  ShmRing(const std::string& name, uint8_t port): name_(name), port_(port) {}
+  // Maps the segment from 'fd', of 'size' bytes.
+  bool Map(int fd, size_t size);
+  // Hands the eventfd to attaching processes, until the listening socket
+  // is shut down.
+  void ServeWakeupFd();
+
+  const std::string name_;
+  const uint8_t port_;
+  ShmRingSegment* segment_ = nullptr;
+  MidiEvent* records_ = nullptr;
+  size_t mapped_size_ = 0;
+  uint64_t mask_ = 0;
+  // Copies of the other side's position, read again only when the ring
+  // looks full or empty.
+  uint64_t cached_head_ = 0;
+  uint64_t cached_tail_ = 0;
+  // Set by PrepareWait() until EndWait().
+  bool waiting_ = false;
+  int wakeup_fd_ = -1;
+  // Only for the creator.
+  bool created_ = false;
+  int listen_fd_ = -1;
+  std::thread server_;
+};
+
+#endif
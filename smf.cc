@@ -0,0 +1,512 @@
+// Standard MIDI File reader and writer.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "smf.h"
+
+// Variable-length quantities take at most 4 bytes.
+const uint32_t kMaxVlq = 0x0fffffff;
+
+static uint32_t ReadBigEndian(const uint8_t* data, size_t size) {
+  uint32_t value = 0;
+  for (size_t i = 0; i < size; i++) {
+    value = (value << 8) | data[i];
+  }
+  return value;
+}
+
+static bool ReadVlq(const uint8_t** pos, const uint8_t* end, uint32_t* value) {
+  *value = 0;
+  for (int i = 0; i < 4 && *pos < end; i++) {
+    const uint8_t byte = *(*pos)++;
+    *value = (*value << 7) | (byte & 0x7f);
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+SmfReader::~SmfReader() {
+  if (data_ != nullptr) {
+    munmap(data_, mapped_size_);
+  }
+}
+
+bool SmfReader::Open(const std::string& filename) {
+  const int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    std::cerr << "Cannot open " << filename << ": " << strerror(errno) << "\n";
+    return false;
+  }
+  // Header chunk: "MThd", length, format, number of tracks, division.
+  const size_t kHeaderSize = 14;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < kHeaderSize) {
+    std::cerr << filename << " is not a midi file\n";
+    close(fd);
+    return false;
+  }
+  void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    std::cerr << "Cannot map " << filename << ": " << strerror(errno) << "\n";
+    return false;
+  }
+  data_ = data;
+  mapped_size_ = st.st_size;
+  // Tracks are read once, front to back.
+  madvise(data_, mapped_size_, MADV_SEQUENTIAL);
+
+  const uint8_t* pos = static_cast<const uint8_t*>(data);
+  const uint8_t* end = pos + mapped_size_;
+  const uint32_t header_size = ReadBigEndian(pos + 4, 4);
+  format_ = ReadBigEndian(pos + 8, 2);
+  const size_t num_tracks = ReadBigEndian(pos + 10, 2);
+  division_ = ReadBigEndian(pos + 12, 2);
+  const bool smpte = division_ & 0x8000;
+  if (memcmp(pos, "MThd", 4) != 0 || header_size < 6 || format_ > 2
+      || (!smpte && division_ == 0) || (smpte && (division_ & 0xff) == 0)) {
+    std::cerr << filename << " is not a midi file, or is corrupted\n";
+    return false;
+  }
+
+  // Other chunk types are skipped. The last track may be truncated, in
+  // which case events are read up to the end of the file.
+  pos += std::min<size_t>(8 + header_size, mapped_size_);
+  while (tracks_.size() < num_tracks && end - pos >= 8) {
+    const size_t chunk_size = ReadBigEndian(pos + 4, 4);
+    const uint8_t* chunk = pos + 8;
+    const uint8_t* chunk_end = chunk + std::min<size_t>(chunk_size, end - chunk);
+    if (memcmp(pos, "MTrk", 4) == 0) {
+      tracks_.push_back({chunk, chunk_end, 0, 0});
+    }
+    pos = chunk_end;
+  }
+  if (tracks_.size() < num_tracks) {
+    std::cerr << filename << ": " << num_tracks - tracks_.size()
+              << " missing tracks\n";
+  }
+  for (size_t i = 0; i < tracks_.size(); i++) {
+    if (ReadDelta(&tracks_[i])) {
+      PushTrack(i);
+    }
+  }
+  return true;
+}
+
+bool SmfReader::ReadDelta(Track* track) {
+  if (track->pos == track->end) {
+    // Track without end of track event.
+    return false;
+  }
+  uint32_t delta;
+  if (!ReadVlq(&track->pos, track->end, &delta)) {
+    error_ = true;
+    return false;
+  }
+  track->tick += delta;
+  return true;
+}
+
+bool SmfReader::ReadEvent(Track* track, SmfEvent* ev) {
+  const uint8_t* pos = track->pos;
+  const uint8_t* end = track->end;
+  if (pos == end) {
+    return false;
+  }
+  uint8_t status = *pos;
+  if (status < 0x80) {
+    // Running status: the status byte is the one of the previous event.
+    if (track->running_status == 0) {
+      return false;
+    }
+    status = track->running_status;
+  } else {
+    pos++;
+  }
+  ev->status = status;
+  ev->meta_type = 0;
+
+  if (status < 0xf0) {
+    const uint8_t type = status & 0xf0;
+    const size_t size = type == 0xc0 || type == 0xd0 ? 1 : 2;
+    if (static_cast<size_t>(end - pos) < size) {
+      return false;
+    }
+    track->running_status = status;
+    ev->data = pos;
+    ev->size = size;
+    track->pos = pos + size;
+    return true;
+  }
+
+  // Sysex and meta events cancel running status.
+  track->running_status = 0;
+  if (status == 0xff) {
+    if (pos == end) {
+      return false;
+    }
+    ev->meta_type = *pos++;
+  } else if (status != 0xf0 && status != 0xf7) {
+    return false;
+  }
+  uint32_t size;
+  if (!ReadVlq(&pos, end, &size) || end - pos < size) {
+    return false;
+  }
+  ev->data = pos;
+  ev->size = size;
+  track->pos = pos + size;
+  return true;
+}
+
+void SmfReader::PushTrack(uint16_t track) {
+  queue_.emplace_back(tracks_[track].tick, track);
+  std::push_heap(queue_.begin(), queue_.end(), std::greater<>());
+}
+
+bool SmfReader::Next(SmfEvent* ev) {
+  while (!queue_.empty() && !error_) {
+    std::pop_heap(queue_.begin(), queue_.end(), std::greater<>());
+    const uint16_t index = queue_.back().second;
+    queue_.pop_back();
+    Track& track = tracks_[index];
+    if (!ReadEvent(&track, ev)) {
+      error_ = true;
+      return false;
+    }
+    if (ev->status == 0xff && ev->meta_type == kSmfMetaEndOfTrack) {
+      continue;
+    }
+    ev->tick = track.tick;
+    ev->track = index;
+    if (ReadDelta(&track)) {
+      PushTrack(index);
+    }
+    return true;
+  }
+  return false;
+}
+
+SmfClock::SmfClock(uint16_t division) {
+  smpte_ = division & 0x8000;
+  if (smpte_) {
+    // Frames per second are stored negated, 29 standing for 29.97.
+    const int fps = -static_cast<int8_t>(division >> 8);
+    const uint64_t ticks_per_frame = division & 0xff;
+    us_per_unit_ = fps == 29 ? 1001000000 : 1000000;
+    ticks_per_unit_ = (fps == 29 ? 30000 : fps) * ticks_per_frame;
+  } else {
+    us_per_unit_ = kSmfDefaultTempo;
+    ticks_per_unit_ = division;
+  }
+  ticks_per_unit_ = std::max<uint64_t>(ticks_per_unit_, 1);
+}
+
+void SmfClock::SetTempo(uint64_t tick, uint32_t tempo) {
+  if (smpte_ || tempo == 0 || tick < tick_) {
+    return;
+  }
+  us_ = TickToUs(tick);
+  tick_ = tick;
+  us_per_unit_ = tempo;
+}
+
+uint64_t SmfClock::TickToUs(uint64_t tick) const {
+  if (tick < tick_) {
+    return us_;
+  }
+  return us_ + (tick - tick_) * us_per_unit_ / ticks_per_unit_;
+}
+
+uint64_t SmfClock::UsToTick(uint64_t us) const {
+  if (us < us_) {
+    return tick_;
+  }
+  return tick_ + (us - us_) * ticks_per_unit_ / us_per_unit_;
+}
+
+// Converts a system message, escaped in a 0xf7 sysex event.
+static bool DecodeSystemMessage(const uint8_t* data, size_t size,
+                                snd_seq_event_t* seq_ev) {
+  const int value = size > 1 ? data[1] & 0x7f : 0;
+  switch (data[0]) {
+  case 0xf1: seq_ev->type = SND_SEQ_EVENT_QFRAME; break;
+  case 0xf2:
+    seq_ev->type = SND_SEQ_EVENT_SONGPOS;
+    seq_ev->data.control.value = value | (size > 2 ? (data[2] & 0x7f) << 7 : 0);
+    return true;
+  case 0xf3: seq_ev->type = SND_SEQ_EVENT_SONGSEL; break;
+  case 0xf6: seq_ev->type = SND_SEQ_EVENT_TUNE_REQUEST; break;
+  case 0xf8: seq_ev->type = SND_SEQ_EVENT_CLOCK; break;
+  case 0xf9: seq_ev->type = SND_SEQ_EVENT_TICK; break;
+  case 0xfa: seq_ev->type = SND_SEQ_EVENT_START; break;
+  case 0xfb: seq_ev->type = SND_SEQ_EVENT_CONTINUE; break;
+  case 0xfc: seq_ev->type = SND_SEQ_EVENT_STOP; break;
+  case 0xfe: seq_ev->type = SND_SEQ_EVENT_SENSING; break;
+  case 0xff: seq_ev->type = SND_SEQ_EVENT_RESET; break;
+  default: return false;
+  }
+  seq_ev->data.control.value = value;
+  return true;
+}
+
+bool SmfEventDecoder::Decode(const SmfEvent& ev, snd_seq_event_t* seq_ev) {
+  snd_seq_ev_clear(seq_ev);
+  if (ev.status < 0xf0) {
+    const uint8_t channel = ev.status & 0x0f;
+    const uint8_t data1 = ev.data[0] & 0x7f;
+    const uint8_t data2 = ev.size > 1 ? ev.data[1] & 0x7f : 0;
+    switch (ev.status & 0xf0) {
+    case 0x80: seq_ev->type = SND_SEQ_EVENT_NOTEOFF; break;
+    case 0x90: seq_ev->type = SND_SEQ_EVENT_NOTEON; break;
+    case 0xa0: seq_ev->type = SND_SEQ_EVENT_KEYPRESS; break;
+    case 0xb0: seq_ev->type = SND_SEQ_EVENT_CONTROLLER; break;
+    case 0xc0: seq_ev->type = SND_SEQ_EVENT_PGMCHANGE; break;
+    case 0xd0: seq_ev->type = SND_SEQ_EVENT_CHANPRESS; break;
+    case 0xe0: seq_ev->type = SND_SEQ_EVENT_PITCHBEND; break;
+    }
+    if (ev.status < 0xb0) {
+      seq_ev->data.note.channel = channel;
+      seq_ev->data.note.note = data1;
+      seq_ev->data.note.velocity = data2;
+      return true;
+    }
+    seq_ev->data.control.channel = channel;
+    switch (ev.status & 0xf0) {
+    case 0xb0:
+      seq_ev->data.control.param = data1;
+      seq_ev->data.control.value = data2;
+      break;
+    case 0xe0:
+      seq_ev->data.control.value = ((data2 << 7) | data1) - 8192;
+      break;
+    default:
+      seq_ev->data.control.value = data1;
+      break;
+    }
+    return true;
+  }
+  if (ev.status == 0xff || ev.size == 0) {
+    return false;
+  }
+  if (ev.status == 0xf7 && ev.data[0] > 0xf0 && ev.data[0] != 0xf7) {
+    return DecodeSystemMessage(ev.data, ev.size, seq_ev);
+  }
+  // The sequencer passes complete messages, 0xf0 included. Escaped data
+  // is passed as it is.
+  sysex_.clear();
+  if (ev.status == 0xf0) {
+    sysex_.push_back(0xf0);
+  }
+  sysex_.insert(sysex_.end(), ev.data, ev.data + ev.size);
+  snd_seq_ev_set_sysex(seq_ev, sysex_.size(), sysex_.data());
+  return true;
+}
+
+static void WriteVlq(std::vector<uint8_t>* bytes, uint32_t value) {
+  uint8_t buffer[4];
+  size_t size = 0;
+  do {
+    buffer[size++] = value & 0x7f;
+    value >>= 7;
+  } while (value != 0);
+  while (size > 1) {
+    bytes->push_back(buffer[--size] | 0x80);
+  }
+  bytes->push_back(buffer[0]);
+}
+
+size_t SmfWriter::AddTrack(const std::string& name) {
+  tracks_.emplace_back();
+  const size_t track = tracks_.size() - 1;
+  if (!name.empty()) {
+    AddMeta(track, 0, kSmfMetaTrackName,
+            reinterpret_cast<const uint8_t*>(name.data()), name.size());
+  }
+  return track;
+}
+
+void SmfWriter::AddDelta(Track* track, uint64_t tick) {
+  uint64_t delta = tick > track->tick ? tick - track->tick : 0;
+  // Longer delays are split with empty text events.
+  while (delta > kMaxVlq) {
+    WriteVlq(&track->bytes, kMaxVlq);
+    track->bytes.insert(track->bytes.end(), {0xff, 0x01, 0x00});
+    track->running_status = 0;
+    delta -= kMaxVlq;
+  }
+  WriteVlq(&track->bytes, delta);
+  track->tick = std::max(track->tick, tick);
+}
+
+void SmfWriter::AddMessage(size_t index, uint64_t tick, const uint8_t* data,
+                           size_t size) {
+  Track& track = tracks_[index];
+  AddDelta(&track, tick);
+  if (data[0] == track.running_status) {
+    data++;
+    size--;
+  } else {
+    track.running_status = data[0];
+  }
+  track.bytes.insert(track.bytes.end(), data, data + size);
+}
+
+void SmfWriter::AddSysex(size_t index, uint64_t tick, uint8_t status,
+                         const uint8_t* data, size_t size) {
+  Track& track = tracks_[index];
+  AddDelta(&track, tick);
+  track.running_status = 0;
+  track.bytes.push_back(status);
+  WriteVlq(&track.bytes, size);
+  track.bytes.insert(track.bytes.end(), data, data + size);
+}
+
+void SmfWriter::AddMeta(size_t index, uint64_t tick, uint8_t type,
+                        const uint8_t* data, size_t size) {
+  Track& track = tracks_[index];
+  AddDelta(&track, tick);
+  track.running_status = 0;
+  track.bytes.push_back(0xff);
+  track.bytes.push_back(type);
+  WriteVlq(&track.bytes, size);
+  track.bytes.insert(track.bytes.end(), data, data + size);
+}
+
+bool SmfWriter::AddSeqEvent(size_t track, uint64_t tick, const snd_seq_event_t& ev) {
+  const uint8_t channel = ev.data.control.channel & 0x0f;
+  const uint32_t param = ev.data.control.param;
+  const int value = ev.data.control.value;
+  auto message = [&](uint8_t status, uint8_t data1, uint8_t data2, size_t size) {
+    const uint8_t bytes[3] = {status, static_cast<uint8_t>(data1 & 0x7f),
+                              static_cast<uint8_t>(data2 & 0x7f)};
+    AddMessage(track, tick, bytes, size);
+  };
+  auto controller = [&](uint8_t number, int cc_value) {
+    message(0xb0 | channel, number, cc_value, 3);
+  };
+  auto system = [&](uint8_t status, int data, size_t size) {
+    const uint8_t bytes[3] = {status, static_cast<uint8_t>(data & 0x7f),
+                              static_cast<uint8_t>((data >> 7) & 0x7f)};
+    AddSysex(track, tick, 0xf7, bytes, size);
+  };
+
+  switch (ev.type) {
+  case SND_SEQ_EVENT_NOTEOFF:
+  case SND_SEQ_EVENT_NOTEON:
+  case SND_SEQ_EVENT_KEYPRESS: {
+    const uint8_t status = ev.type == SND_SEQ_EVENT_NOTEOFF ? 0x80
+        : ev.type == SND_SEQ_EVENT_NOTEON ? 0x90 : 0xa0;
+    message(status | (ev.data.note.channel & 0x0f), ev.data.note.note,
+            ev.data.note.velocity, 3);
+    return true;
+  }
+  case SND_SEQ_EVENT_CONTROLLER:
+    controller(param, value);
+    return true;
+  case SND_SEQ_EVENT_PGMCHANGE:
+    message(0xc0 | channel, value, 0, 2);
+    return true;
+  case SND_SEQ_EVENT_CHANPRESS:
+    message(0xd0 | channel, value, 0, 2);
+    return true;
+  case SND_SEQ_EVENT_PITCHBEND: {
+    const int bend = std::clamp(value + 8192, 0, 16383);
+    message(0xe0 | channel, bend, bend >> 7, 3);
+    return true;
+  }
+  case SND_SEQ_EVENT_CONTROL14:
+    // As the sequencer sends them: MSB then LSB for the first 32
+    // controllers, a single 7-bit controller otherwise.
+    if (param < 32) {
+      controller(param, value >> 7);
+      controller(param + 32, value);
+    } else {
+      controller(param, value);
+    }
+    return true;
+  case SND_SEQ_EVENT_NONREGPARAM:
+  case SND_SEQ_EVENT_REGPARAM: {
+    const bool nrpn = ev.type == SND_SEQ_EVENT_NONREGPARAM;
+    controller(nrpn ? 99 : 101, param >> 7);
+    controller(nrpn ? 98 : 100, param);
+    controller(6, value >> 7);
+    controller(38, value);
+    return true;
+  }
+  case SND_SEQ_EVENT_SYSEX: {
+    if (!snd_seq_ev_is_variable(&ev) || ev.data.ext.len == 0) {
+      return false;
+    }
+    const uint8_t* data = static_cast<const uint8_t*>(ev.data.ext.ptr);
+    if (data[0] == 0xf0) {
+      AddSysex(track, tick, 0xf0, data + 1, ev.data.ext.len - 1);
+    } else {
+      AddSysex(track, tick, 0xf7, data, ev.data.ext.len);
+    }
+    return true;
+  }
+  case SND_SEQ_EVENT_QFRAME: system(0xf1, value, 2); return true;
+  case SND_SEQ_EVENT_SONGPOS: system(0xf2, value, 3); return true;
+  case SND_SEQ_EVENT_SONGSEL: system(0xf3, value, 2); return true;
+  case SND_SEQ_EVENT_TUNE_REQUEST: system(0xf6, 0, 1); return true;
+  case SND_SEQ_EVENT_CLOCK: system(0xf8, 0, 1); return true;
+  case SND_SEQ_EVENT_TICK: system(0xf9, 0, 1); return true;
+  case SND_SEQ_EVENT_START: system(0xfa, 0, 1); return true;
+  case SND_SEQ_EVENT_CONTINUE: system(0xfb, 0, 1); return true;
+  case SND_SEQ_EVENT_STOP: system(0xfc, 0, 1); return true;
+  case SND_SEQ_EVENT_SENSING: system(0xfe, 0, 1); return true;
+  case SND_SEQ_EVENT_RESET: system(0xff, 0, 1); return true;
+  default:
+    return false;
+  }
+}
+
+bool SmfWriter::Save(const std::string& filename) {
+  FILE* file = fopen(filename.c_str(), "wb");
+  if (file == nullptr) {
+    std::cerr << "Cannot open " << filename << ": " << strerror(errno) << "\n";
+    return false;
+  }
+  auto write_u32 = [](std::vector<uint8_t>* bytes, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      bytes->push_back(value >> shift);
+    }
+  };
+  std::vector<uint8_t> header = {'M', 'T', 'h', 'd'};
+  write_u32(&header, 6);
+  const size_t num_tracks = tracks_.size();
+  header.insert(header.end(), {0, 1, static_cast<uint8_t>(num_tracks >> 8),
+                               static_cast<uint8_t>(num_tracks),
+                               static_cast<uint8_t>(division_ >> 8),
+                               static_cast<uint8_t>(division_)});
+  bool ok = fwrite(header.data(), header.size(), 1, file) == 1;
+  for (Track& track : tracks_) {
+    // End of track, right after the last event.
+    const uint8_t end_of_track[] = {0, 0xff, kSmfMetaEndOfTrack, 0};
+    std::vector<uint8_t> chunk = {'M', 'T', 'r', 'k'};
+    write_u32(&chunk, track.bytes.size() + sizeof(end_of_track));
+    ok = ok && fwrite(chunk.data(), chunk.size(), 1, file) == 1
+        && (track.bytes.empty()
+            || fwrite(track.bytes.data(), track.bytes.size(), 1, file) == 1)
+        && fwrite(end_of_track, sizeof(end_of_track), 1, file) == 1;
+  }
+  if (fclose(file) != 0) {
+    ok = false;
+  }
+  if (!ok) {
+    std::cerr << "Error writing " << filename << ": " << strerror(errno) << "\n";
+  }
+  return ok;
+}
@@ -0,0 +1,169 @@
+#ifndef _SMF_H
+#define _SMF_H
+// Reading and writing of Standard MIDI Files, for offline processing (see
+// offline.h).
+//
+// SmfReader maps the file in memory and returns the events of all tracks
+// in time order without copying them. SmfWriter buffers the tracks in
+// memory and writes the file in one go.
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <alsa/asoundlib.h>
+
+#include "midi_event.h"
+
+// SMF meta event types used by midiflume.
+const uint8_t kSmfMetaTrackName = 0x03;
+const uint8_t kSmfMetaEndOfTrack = 0x2f;
+const uint8_t kSmfMetaTempo = 0x51;
+
+// Default tempo, in microseconds per quarter note.
+const uint32_t kSmfDefaultTempo = 500000;
+
+// An event of a track. 'data' points into the file, which must stay open.
+struct SmfEvent {
+  // Absolute time in ticks.
+  uint64_t tick;
+  uint16_t track;
+  // Status byte, with running status resolved: 0x80 to 0xef for channel
+  // messages, 0xf0 and 0xf7 for sysex, 0xff for meta events.
+  uint8_t status;
+  // Type of meta events, 0 otherwise.
+  uint8_t meta_type;
+  // Data bytes following the status byte, the meta type or the length:
+  // 1 or 2 for channel messages, the payload otherwise.
+  const uint8_t* data;
+  uint32_t size;
+};
+
+class SmfReader {
+public:
+  SmfReader() {}
+  ~SmfReader();
+  SmfReader(const SmfReader&) = delete;
+  SmfReader& operator=(const SmfReader&) = delete;
+
+  // Maps 'filename' and reads its header. Returns false if the file can't
+  // be read or isn't a Standard MIDI File.
+  bool Open(const std::string& filename);
+
+  uint16_t format() const { return format_; }
+  size_t num_tracks() const { return tracks_.size(); }
+  // Division field of the header: ticks per quarter note, or SMPTE format
+  // and ticks per frame if the top bit is set.
+  uint16_t division() const { return division_; }
+
+  // Reads the next event in time order, events at the same tick in track
+  // order. Returns false at the end of all tracks or on error, see
+  // error().
+  bool Next(SmfEvent* ev);
+  // True if a track is truncated or holds an invalid event. Events before
+  // the problem have been returned.
+  bool error() const { return error_; }
+
+private:
+  struct Track {
+    const uint8_t* pos;
+    const uint8_t* end;
+    uint64_t tick;
+    uint8_t running_status;
+  };
+
+  // Reads the delta time of the next event of 'track' into its tick.
+  // Returns false at the end of the track.
+  bool ReadDelta(Track* track);
+  // Reads the event at the current position of 'track'.
+  bool ReadEvent(Track* track, SmfEvent* ev);
+  // Queue of tracks by time of their next event.
+  void PushTrack(uint16_t track);
+
+  void* data_ = nullptr;
+  size_t mapped_size_ = 0;
+  uint16_t format_ = 0;
+  uint16_t division_ = 0;
+  std::vector<Track> tracks_;
+  // Heap of (tick, track) for tracks with events left.
+  std::vector<std::pair<uint64_t, uint16_t>> queue_;
+  bool error_ = false;
+};
+
+// Conversion between ticks and microseconds, following tempo changes
+// given in time order.
+class SmfClock {
+public:
+  explicit SmfClock(uint16_t division);
+
+  // Tempo in microseconds per quarter note from 'tick' on, which must not
+  // be before the previous change. Ignored with SMPTE divisions.
+  void SetTempo(uint64_t tick, uint32_t tempo);
+  // Conversions, only valid from the last tempo change on.
+  uint64_t TickToUs(uint64_t tick) const;
+  uint64_t UsToTick(uint64_t us) const;
+
+private:
+  // Last tempo change.
+  uint64_t tick_ = 0;
+  uint64_t us_ = 0;
+  // One tick lasts 'us_per_unit_ / ticks_per_unit_' microseconds.
+  uint64_t us_per_unit_;
+  uint64_t ticks_per_unit_;
+  bool smpte_;
+};
+
+// Conversion of SMF events to sequencer events, as the sequencer delivers
+// messages received from a midi device. Sysex data is copied to a buffer
+// owned by the converter, only valid until the next call.
+class SmfEventDecoder {
+public:
+  // Returns false for meta events and messages without sequencer
+  // equivalent.
+  bool Decode(const SmfEvent& ev, snd_seq_event_t* seq_ev);
+
+private:
+  std::vector<uint8_t> sysex_;
+};
+
+class SmfWriter {
+public:
+  // Writes format 1 files, with 'division' as in SmfReader::division().
+  explicit SmfWriter(uint16_t division): division_(division) {}
+
+  // Adds a track and returns its index. 'name' is written as its first
+  // event if not empty.
+  size_t AddTrack(const std::string& name);
+  size_t num_tracks() const { return tracks_.size(); }
+
+  // Appends events at absolute time 'tick'. Events must be added in time
+  // order on each track; earlier ticks are moved to the last one.
+  // Channel message, status byte included.
+  void AddMessage(size_t track, uint64_t tick, const uint8_t* data, size_t size);
+  // Sysex event: 'status' is 0xf0 or 0xf7, 'data' what follows it.
+  void AddSysex(size_t track, uint64_t tick, uint8_t status,
+                const uint8_t* data, size_t size);
+  void AddMeta(size_t track, uint64_t tick, uint8_t type,
+               const uint8_t* data, size_t size);
+  // Converts 'ev', as sent by a MidiOutput, to midi messages. Returns
+  // false if it has no midi equivalent.
+  bool AddSeqEvent(size_t track, uint64_t tick, const snd_seq_event_t& ev);
+
+  // Writes all tracks, ending them at their last event. Returns false on
+  // error.
+  bool Save(const std::string& filename);
+
+private:
+  struct Track {
+    std::vector<uint8_t> bytes;
+    uint64_t tick = 0;
+    uint8_t running_status = 0;
+  };
+  // Writes the delta time of an event at 'tick'.
+  void AddDelta(Track* track, uint64_t tick);
+
+  uint16_t division_;
+  std::vector<Track> tracks_;
+};
+
+#endif
@@ -0,0 +1,320 @@
+// Binary snapshots of processing graphs.
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "event_processors.h"
+#include "lua_util.h"
+#include "snapshot.h"
+
+uint64_t HashBytes(const void* data, size_t size, uint64_t hash) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ bytes[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+// SnapshotWriter
+void SnapshotWriter::WriteU32(uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    data_.push_back(value >> (8 * i));
+  }
+}
+
+void SnapshotWriter::WriteU64(uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    data_.push_back(value >> (8 * i));
+  }
+}
+
+void SnapshotWriter::WriteString(const std::string& value) {
+  WriteU32(value.size());
+  data_.insert(data_.end(), value.begin(), value.end());
+}
+
+void SnapshotWriter::WriteBytes(const std::vector<unsigned char>& value) {
+  WriteU32(value.size());
+  data_.insert(data_.end(), value.begin(), value.end());
+}
+
+// SnapshotReader
+bool SnapshotReader::ReadU8(uint8_t* value) {
+  if (pos_ == end_) {
+    return false;
+  }
+  *value = *pos_++;
+  return true;
+}
+
+bool SnapshotReader::ReadU32(uint32_t* value) {
+  if (end_ - pos_ < 4) {
+    return false;
+  }
+  *value = 0;
+  for (int i = 0; i < 4; i++) {
+    *value |= static_cast<uint32_t>(*pos_++) << (8 * i);
+  }
+  return true;
+}
+
+bool SnapshotReader::ReadU64(uint64_t* value) {
+  if (end_ - pos_ < 8) {
+    return false;
+  }
+  *value = 0;
+  for (int i = 0; i < 8; i++) {
+    *value |= static_cast<uint64_t>(*pos_++) << (8 * i);
+  }
+  return true;
+}
+
+bool SnapshotReader::ReadString(std::string* value) {
+  uint32_t size;
+  if (!ReadU32(&size) || static_cast<size_t>(end_ - pos_) < size) {
+    return false;
+  }
+  value->assign(reinterpret_cast<const char*>(pos_), size);
+  pos_ += size;
+  return true;
+}
+
+bool SnapshotReader::ReadBytes(std::vector<unsigned char>* value) {
+  uint32_t size;
+  if (!ReadU32(&size) || static_cast<size_t>(end_ - pos_) < size) {
+    return false;
+  }
+  value->assign(pos_, pos_ + size);
+  pos_ += size;
+  return true;
+}
+
+// GraphSnapshot
+bool GraphSnapshot::AddProcessor(EventProcessor* processor, const std::string& name) {
+  SnapshotWriter settings;
+  if (!processor->SaveSettings(&settings)) {
+    complete_ = false;
+    return false;
+  }
+  name_to_index_[name] = processors_.size();
+  processors_.push_back({name, settings.data()});
+  return true;
+}
+
+bool GraphSnapshot::AddConnection(const std::string& input, const std::string& output) {
+  const auto input_index = name_to_index_.find(input);
+  const auto output_index = name_to_index_.find(output);
+  if (input_index == name_to_index_.end() || output_index == name_to_index_.end()) {
+    complete_ = false;
+    return false;
+  }
+  connections_.emplace_back(input_index->second, output_index->second);
+  return true;
+}
+
+uint64_t GraphSnapshot::HashConfigFiles() const {
+  uint64_t hash = kFnvOffsetBasis;
+  std::vector<char> buffer(65536);
+  for (const auto& filename: config_files_) {
+    FILE* file = fopen(filename.c_str(), "rb");
+    if (file == nullptr) {
+      return 0;
+    }
+    // Names are hashed too, so that moving content between files counts
+    // as a change.
+    hash = HashBytes(filename.c_str(), filename.size() + 1, hash);
+    size_t size;
+    while ((size = fread(buffer.data(), 1, buffer.size(), file)) > 0) {
+      hash = HashBytes(buffer.data(), size, hash);
+    }
+    const bool failed = ferror(file);
+    fclose(file);
+    if (failed) {
+      return 0;
+    }
+  }
+  return hash;
+}
+
+bool GraphSnapshot::Save(const std::string& filename) {
+  if (!complete_) {
+    std::cerr << "The graph has processors which can't be saved, "
+              << "not writing snapshot " << filename << "\n";
+    return false;
+  }
+  const uint64_t config_hash = HashConfigFiles();
+  if (config_hash == 0) {
+    std::cerr << "Cannot read config files, not writing snapshot "
+              << filename << "\n";
+    return false;
+  }
+  SnapshotWriter out;
+  for (const char c: kSnapshotMagic) {
+    out.WriteU8(c);
+  }
+  out.WriteU64(config_hash);
+  out.WriteString(client_name_);
+  out.WriteU32(config_files_.size());
+  for (const auto& config_file: config_files_) {
+    out.WriteString(config_file);
+  }
+  out.WriteU32(processors_.size());
+  for (const auto& processor: processors_) {
+    out.WriteString(processor.name);
+    out.WriteBytes(processor.settings);
+  }
+  out.WriteU32(connections_.size());
+  for (const auto& connection: connections_) {
+    out.WriteU32(connection.first);
+    out.WriteU32(connection.second);
+  }
+  out.WriteU64(HashBytes(out.data().data(), out.data().size()));
+
+  // Written next to the snapshot then renamed, so that a midiflume
+  // starting at the same time never reads a partial file.
+  const std::string tmp_filename = filename + ".tmp";
+  FILE* file = fopen(tmp_filename.c_str(), "wb");
+  if (file == nullptr) {
+    std::cerr << "Cannot write snapshot " << tmp_filename << ": "
+              << strerror(errno) << "\n";
+    return false;
+  }
+  const bool written = fwrite(out.data().data(), 1, out.data().size(), file)
+    == out.data().size();
+  if (fclose(file) != 0 || !written
+      || rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+    std::cerr << "Cannot write snapshot " << filename << ": "
+              << strerror(errno) << "\n";
+    unlink(tmp_filename.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Parses a snapshot, with the trailing checksum already checked.
+static bool ParseSnapshot(SnapshotReader* in, uint64_t* config_hash,
+                          std::string* client_name,
+                          std::vector<std::string>* config_files,
+                          std::vector<std::pair<std::string, std::vector<uint8_t>>>* processors,
+                          std::vector<std::pair<uint32_t, uint32_t>>* connections) {
+  for (const char c: kSnapshotMagic) {
+    uint8_t byte;
+    if (!in->ReadU8(&byte) || byte != static_cast<uint8_t>(c)) {
+      return false;
+    }
+  }
+  RETURN_IF_FALSE(in->ReadU64(config_hash));
+  RETURN_IF_FALSE(in->ReadString(client_name));
+  uint32_t count;
+  RETURN_IF_FALSE(in->ReadU32(&count));
+  config_files->resize(count);
+  for (auto& config_file: *config_files) {
+    RETURN_IF_FALSE(in->ReadString(&config_file));
+  }
+  RETURN_IF_FALSE(in->ReadU32(&count));
+  processors->resize(count);
+  for (auto& processor: *processors) {
+    RETURN_IF_FALSE(in->ReadString(&processor.first));
+    RETURN_IF_FALSE(in->ReadBytes(&processor.second));
+  }
+  RETURN_IF_FALSE(in->ReadU32(&count));
+  connections->resize(count);
+  for (auto& connection: *connections) {
+    RETURN_IF_FALSE(in->ReadU32(&connection.first));
+    RETURN_IF_FALSE(in->ReadU32(&connection.second));
+    if (connection.first >= processors->size()
+        || connection.second >= processors->size()) {
+      return false;
+    }
+  }
+  return in->AtEnd();
+}
+
+bool GraphSnapshot::Load(const std::string& filename, const std::string& config_filename) {
+  const int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno != ENOENT) {
+      std::cerr << "Cannot open snapshot " << filename << ": "
+                << strerror(errno) << "\n";
+    }
+    return false;
+  }
+  struct stat st;
+  void* data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (data == MAP_FAILED) {
+    std::cerr << "Cannot map snapshot " << filename << "\n";
+    return false;
+  }
+  const size_t size = st.st_size;
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+
+  uint64_t config_hash = 0;
+  std::vector<std::pair<std::string, std::vector<uint8_t>>> processors;
+  bool valid = false;
+  if (size >= sizeof(kSnapshotMagic) + 8) {
+    SnapshotReader checksum(bytes + size - 8, 8);
+    uint64_t expected;
+    valid = checksum.ReadU64(&expected)
+      && HashBytes(bytes, size - 8) == expected;
+  }
+  if (valid) {
+    SnapshotReader in(bytes, size - 8);
+    valid = ParseSnapshot(&in, &config_hash, &client_name_, &config_files_,
+                          &processors, &connections_);
+  }
+  munmap(data, size);
+  if (!valid) {
+    std::cerr << filename << " is not a valid snapshot\n";
+    return false;
+  }
+
+  if (config_files_.empty() || config_files_[0] != config_filename) {
+    std::cerr << "Snapshot " << filename << " is not for "
+              << config_filename << "\n";
+    return false;
+  }
+  if (HashConfigFiles() != config_hash) {
+    std::cerr << "Snapshot " << filename << " is out of date\n";
+    return false;
+  }
+  processors_.clear();
+  for (auto& processor: processors) {
+    processors_.push_back({std::move(processor.first), std::move(processor.second)});
+  }
+  return true;
+}
+
+bool GraphSnapshot::BuildGraph(snd_seq_t *seq_handle, ProcessorDAG *dag,
+                               PortRegistry* ports) {
+  std::vector<size_t> indices;
+  indices.reserve(processors_.size());
+  for (const auto& processor: processors_) {
+    SnapshotReader in(processor.settings.data(), processor.settings.size());
+    auto built = MakeProcessorFromSnapshot(&in, processor.name, seq_handle, ports);
+    if (built == nullptr) {
+      return false;
+    }
+    if (!in.AtEnd()) {
+      std::cerr << "Invalid settings in snapshot for processor "
+                << processor.name << "\n";
+      return false;
+    }
+    indices.push_back(dag->AddProcessor(std::move(built), processor.name));
+  }
+  for (const auto& connection: connections_) {
+    RETURN_IF_FALSE(dag->AddConnection(indices[connection.first],
+                                       indices[connection.second]));
+  }
+  return dag->Finalize();
+}
@@ -0,0 +1,109 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+// Binary snapshots of processing graphs, so that large configs don't
+// need to be run again at each start.
+//
+// A snapshot holds the graph as built from the config, before
+// ProcessorDAG::Finalize(): processors with their settings, in the order
+// they were added, and connections between them by index. It also holds
+// the names of the files the config was read from (the config itself and
+// the Lua modules it loaded, such as mflib.lua) and a hash of their
+// content: a snapshot is only used while these files don't change.
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <alsa/asoundlib.h>
+
+#include "dag.h"
+#include "port_registry.h"
+
+const char kSnapshotMagic[8] = {'M', 'F', 'S', 'N', 'A', 'P', '1', '\0'};
+
+// 64-bit FNV-1a hash of 'size' bytes, continuing from 'hash'.
+const uint64_t kFnvOffsetBasis = 14695981039346656037ull;
+uint64_t HashBytes(const void* data, size_t size, uint64_t hash = kFnvOffsetBasis);
+
+// Serialization of processor settings, see EventProcessor::SaveSettings.
+// Integers are stored little-endian.
+class SnapshotWriter {
+public:
+  void WriteU8(uint8_t value) { data_.push_back(value); }
+  void WriteU32(uint32_t value);
+  void WriteU64(uint64_t value);
+  // Size, then bytes.
+  void WriteString(const std::string& value);
+  void WriteBytes(const std::vector<unsigned char>& value);
+
+  const std::vector<uint8_t>& data() const { return data_; }
+
+private:
+  std::vector<uint8_t> data_;
+};
+
+// Reads values written by SnapshotWriter. All methods return false,
+// leaving the value unset, past the end of the data.
+class SnapshotReader {
+public:
+  SnapshotReader(const uint8_t* data, size_t size): pos_(data), end_(data + size) {}
+
+  bool ReadU8(uint8_t* value);
+  bool ReadU32(uint32_t* value);
+  bool ReadU64(uint64_t* value);
+  bool ReadString(std::string* value);
+  bool ReadBytes(std::vector<unsigned char>* value);
+  bool AtEnd() const { return pos_ == end_; }
+
+private:
+  const uint8_t* pos_;
+  const uint8_t* end_;
+};
+
+class GraphSnapshot {
+public:
+  // Building, along with the graph. Returns false if 'processor' can't
+  // be saved, see EventProcessor::SaveSettings(); the snapshot can then
+  // not be saved.
+  bool AddProcessor(EventProcessor* processor, const std::string& name);
+  bool AddConnection(const std::string& input, const std::string& output);
+  void SetClientName(const std::string& client_name) { client_name_ = client_name; }
+  // Files the config was read from, see GetConfigFiles().
+  void SetConfigFiles(const std::vector<std::string>& filenames) {
+    config_files_ = filenames;
+  }
+  // Writes the snapshot. Returns false on error, or if a processor
+  // couldn't be saved.
+  bool Save(const std::string& filename);
+
+  // Reads a snapshot of the graph of 'config_filename'. Returns false if
+  // the file is missing or invalid, or if the config files changed since
+  // it was saved.
+  bool Load(const std::string& filename, const std::string& config_filename);
+  // Client name set by the config, if any.
+  const std::string& client_name() const { return client_name_; }
+  // Builds and finalizes the graph, as GetProcessingGraph() does from the
+  // config.
+  bool BuildGraph(snd_seq_t *seq_handle, ProcessorDAG *dag,
+                  PortRegistry* ports = nullptr);
+
+private:
+  // Hash of the content of config_files_, 0 if one can't be read.
+  uint64_t HashConfigFiles() const;
+
+  struct Processor {
+    std::string name;
+    // Type and settings, as written by EventProcessor::SaveSettings().
+    std::vector<uint8_t> settings;
+  };
+  std::string client_name_;
+  std::vector<std::string> config_files_;
+  std::vector<Processor> processors_;
+  std::vector<std::pair<uint32_t, uint32_t>> connections_;
+  // Index of processors by name, while building.
+  std::unordered_map<std::string, uint32_t> name_to_index_;
+  bool complete_ = true;
+};
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef _SPSC_RING_H
+#define _SPSC_RING_H
+// Lock-free ring buffer with a single producer and a single consumer.
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+// Fixed-capacity queue of T, with all memory allocated by the
+// constructor. TryPush() must only be called from one thread, and
+// TryPop() from one other thread. Neither of them blocks, allocates or
+// makes system calls, so they can be used from a real-time thread.
+template <typename T>
+class SpscRing {
+public:
+  // 'capacity' is rounded up to a power of two.
+  explicit SpscRing(size_t capacity) {
+    capacity_ = 1;
+    while (capacity_ < capacity) {
+      capacity_ *= 2;
+    }
+    mask_ = capacity_ - 1;
+    // Value-initialized, so that all pages are touched here rather than
+    // on first use.
+    slots_ = std::make_unique<T[]>(capacity_);
+  }
+  SpscRing(const SpscRing&) = delete;
+  SpscRing& operator=(const SpscRing&) = delete;
+
+  // Producer side. Returns false if the ring is full.
+  bool TryPush(const T& value) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head - cached_tail_ == capacity_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head - cached_tail_ == capacity_) {
+        return false;
+      }
+    }
+    slots_[head & mask_] = value;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. Returns false if the ring is empty.
+  bool TryPop(T* value) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == cached_head_) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail == cached_head_) {
+        return false;
+      }
+    }
+    *value = slots_[tail & mask_];
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. Returns the next value without removing it, or
+  // nullptr if the ring is empty. Pop() removes it.
+  const T* Front() {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == cached_head_) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail == cached_head_) {
+        return nullptr;
+      }
+    }
+    return &slots_[tail & mask_];
+  }
+  void Pop() {
+    tail_.store(tail_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+  }
+
+  size_t capacity() const { return capacity_; }
+  // Approximate when called concurrently with TryPush() or TryPop().
+  size_t Size() const {
+    return head_.load(std::memory_order_acquire)
+        - tail_.load(std::memory_order_acquire);
+  }
+
+private:
+  size_t capacity_;
+  size_t mask_;
+  std::unique_ptr<T[]> slots_;
+  // Producer and consumer positions are kept on separate cache lines,
+  // each with the copy of the other position last seen by its thread.
+  alignas(64) std::atomic<size_t> head_{0};
+  size_t cached_tail_ = 0;
+  alignas(64) std::atomic<size_t> tail_{0};
+  size_t cached_head_ = 0;
+};
+
+#endif
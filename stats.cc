@@ -0,0 +1,140 @@
+// Instrumentation of the processing graph.
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+// LatencyHistogram
+size_t LatencyHistogram::BucketIndex(uint64_t value) {
+  if (value < kSubBuckets) {
+    return value;
+  }
+  // Position of the highest bit set, at least kSubBucketBits.
+  const int exponent = 63 - __builtin_clzll(value);
+  const int shift = exponent - kSubBucketBits;
+  return kSubBuckets * (shift + 1) + ((value >> shift) - kSubBuckets);
+}
+
+uint64_t LatencyHistogram::BucketUpperBound(size_t index) {
+  if (index < kSubBuckets) {
+    return index;
+  }
+  const int shift = index / kSubBuckets - 1;
+  const uint64_t sub_bucket = index % kSubBuckets;
+  const uint64_t lower = (kSubBuckets + sub_bucket) << shift;
+  return lower + ((uint64_t(1) << shift) - 1);
+}
+
+void LatencyHistogram::Record(uint64_t value) {
+  IncrementCounter(&buckets_[BucketIndex(value)], 1);
+  IncrementCounter(&count_, 1);
+  IncrementCounter(&sum_, value);
+  if (value > max_.load(std::memory_order_relaxed)) {
+    max_.store(value, std::memory_order_relaxed);
+  }
+}
+
+void LatencyHistogram::Reset() {
+  for (auto& bucket : buckets_) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+  count_.store(0, std::memory_order_relaxed);
+  max_.store(0, std::memory_order_relaxed);
+  sum_.store(0, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::Percentile(double quantile) const {
+  const uint64_t count = Count();
+  if (count == 0) {
+    return 0;
+  }
+  uint64_t rank = static_cast<uint64_t>(std::ceil(quantile * count));
+  if (rank == 0) {
+    rank = 1;
+  }
+
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kNumBuckets; i++) {
+    seen += buckets_[i].load(std::memory_order_relaxed);
+    if (seen >= rank) {
+      return std::min(BucketUpperBound(i), Max());
+    }
+  }
+  // Only reached when reading while values are being recorded.
+  return Max();
+}
+
+void PrintHistogram(const LatencyHistogram& histogram, std::ostream& out) {
+  out << "count=" << histogram.Count()
+      << " p50=" << histogram.Percentile(0.5) << "ns"
+      << " p99=" << histogram.Percentile(0.99) << "ns"
+      << " p999=" << histogram.Percentile(0.999) << "ns"
+      << " max=" << histogram.Max() << "ns";
+}
+
+// PerfCounters
+PerfCounters::~PerfCounters() {
+  for (const int fd : fds_) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+bool PerfCounters::Open() {
+  if (IsOpen()) {
+    return true;
+  }
+  const uint64_t configs[kNumCounters] = {PERF_COUNT_HW_CPU_CYCLES,
+                                          PERF_COUNT_HW_INSTRUCTIONS,
+                                          PERF_COUNT_HW_CACHE_MISSES};
+  for (int i = 0; i < kNumCounters; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = configs[i];
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // The group leader starts disabled, all counters are enabled at once.
+    attr.disabled = (i == 0);
+    // Counts for the calling thread, on any cpu.
+    fds_[i] = syscall(SYS_perf_event_open, &attr, 0, -1, fds_[0], 0);
+    if (fds_[i] < 0) {
+      std::cerr << "Hardware counters not available.\n";
+      for (int& fd : fds_) {
+        if (fd >= 0) {
+          close(fd);
+        }
+        fd = -1;
+      }
+      return false;
+    }
+  }
+  ioctl(fds_[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(fds_[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  return true;
+}
+
+bool PerfCounters::Read(PerfValues* values) {
+  if (!IsOpen()) {
+    return false;
+  }
+  // Layout defined by PERF_FORMAT_GROUP.
+  uint64_t buffer[1 + kNumCounters];
+  if (read(fds_[0], buffer, sizeof(buffer)) != sizeof(buffer)) {
+    return false;
+  }
+  values->cycles = buffer[1];
+  values->instructions = buffer[2];
+  values->cache_misses = buffer[3];
+  return true;
+}
@@ -0,0 +1,117 @@
+#ifndef _STATS_H
+#define _STATS_H
+// Instrumentation of the processing graph: latency histograms, event
+// counts and hardware counters.
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+// Histogram of durations in nanoseconds.
+// Buckets are log-linear: each power of two is split into
+// 2^kSubBucketBits linear buckets, so that any recorded value is known
+// within 1/16th. Values are recorded by a single thread using relaxed
+// atomics, without locking, and can be read from any other thread.
+class LatencyHistogram {
+public:
+  static constexpr int kSubBucketBits = 4;
+  static constexpr size_t kSubBuckets = 1 << kSubBucketBits;
+  static constexpr size_t kNumBuckets = kSubBuckets * (64 - kSubBucketBits + 1);
+
+  LatencyHistogram() { Reset(); }
+
+  // Must only be called from a single thread.
+  void Record(uint64_t value);
+  void Reset();
+
+  uint64_t Count() const { return count_.load(std::memory_order_relaxed); }
+  uint64_t Max() const { return max_.load(std::memory_order_relaxed); }
+  uint64_t Sum() const { return sum_.load(std::memory_order_relaxed); }
+  // Returns an upper bound of the value at 'quantile' (in [0,1]), with
+  // a relative error less than 1/16th.
+  uint64_t Percentile(double quantile) const;
+
+  static size_t BucketIndex(uint64_t value);
+  // Largest value stored in bucket 'index'.
+  static uint64_t BucketUpperBound(size_t index);
+
+private:
+  std::array<std::atomic<uint64_t>, kNumBuckets> buckets_;
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> max_;
+  std::atomic<uint64_t> sum_;
+};
+
+// Adds 'value' to a counter only written by the calling thread.
+inline void IncrementCounter(std::atomic<uint64_t>* counter, uint64_t value) {
+  counter->store(counter->load(std::memory_order_relaxed) + value,
+                 std::memory_order_relaxed);
+}
+
+// Raises a maximum only written by the calling thread to 'value'.
+inline void UpdateMaximum(std::atomic<uint64_t>* maximum, uint64_t value) {
+  if (value > maximum->load(std::memory_order_relaxed)) {
+    maximum->store(value, std::memory_order_relaxed);
+  }
+}
+
+// Counters for a single processor.
+struct ProcessorStats {
+  std::atomic<uint64_t> events_in{0};
+  std::atomic<uint64_t> events_out{0};
+  // Events generated which didn't fit in the output buffer.
+  std::atomic<uint64_t> dropped_events{0};
+  // Time spent in the processor, for each batch.
+  LatencyHistogram latency;
+};
+
+// Hardware counter values, see PerfCounters.
+struct PerfValues {
+  uint64_t cycles = 0;
+  uint64_t instructions = 0;
+  uint64_t cache_misses = 0;
+};
+
+// Counters for the whole graph.
+struct GraphStats {
+  std::atomic<uint64_t> batches{0};
+  std::atomic<uint64_t> events{0};
+  // Events that could not be converted to MidiEvent, or that didn't fit
+  // in a buffer. Always counted, even when stats are disabled.
+  std::atomic<uint64_t> dropped_events{0};
+  // Scheduled events which came due, see ProcessorDAG::ProcessTimers().
+  std::atomic<uint64_t> timer_events{0};
+  // Time spent processing each batch, end to end.
+  LatencyHistogram latency;
+  // Hardware counters, accumulated over all batches.
+  std::atomic<uint64_t> cycles{0};
+  std::atomic<uint64_t> instructions{0};
+  std::atomic<uint64_t> cache_misses{0};
+};
+
+// Hardware counters (cycles, instructions, cache misses) of the calling
+// thread, read through perf_event_open(2).
+class PerfCounters {
+public:
+  PerfCounters() {}
+  ~PerfCounters();
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  // Starts counting for the calling thread. Returns false if counters are
+  // not available (no hardware support, perf_event_paranoid, etc.)
+  bool Open();
+  bool IsOpen() const { return fds_[0] >= 0; }
+  // Reads the values accumulated since Open().
+  bool Read(PerfValues* values);
+
+private:
+  static constexpr int kNumCounters = 3;
+  std::array<int, kNumCounters> fds_ = {-1, -1, -1};
+};
+
+// Prints a one-line summary of 'histogram'.
+void PrintHistogram(const LatencyHistogram& histogram, std::ostream& out);
+
+#endif
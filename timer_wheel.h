@@ -0,0 +1,235 @@
+#ifndef _TIMER_WHEEL_H
+#define _TIMER_WHEEL_H
+// Scheduling of events in the future, used by processors which emit
+// events later (delay, echo, etc.)
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#include "midi_event.h"
+
+// Hierarchical timer wheel holding events due at a given tick, one tick
+// being a millisecond for ProcessorDAG. Adding an event and firing it are
+// O(1), and all memory is allocated by Reserve(), so that thousands of
+// pending events cost nothing until they are due.
+// Level L has 64 slots of 64^L ticks. An event goes to the level of the
+// highest 6-bit digit where its due tick differs from the current tick,
+// and moves down a level each time the current tick reaches the start of
+// its slot. Events due on the same tick fire in the order they were
+// added.
+class TimerWheel {
+public:
+  TimerWheel() {}
+  TimerWheel(TimerWheel&&) = default;
+  TimerWheel& operator=(TimerWheel&&) = default;
+
+  // Allocates room for 'capacity' pending events. Discards all pending
+  // events.
+  void Reserve(size_t capacity) {
+    timers_ = std::make_unique<Timer[]>(capacity);
+    capacity_ = capacity;
+    size_ = 0;
+    free_ = kNone;
+    for (size_t i = capacity; i > 0; i--) {
+      timers_[i - 1].next = free_;
+      free_ = static_cast<uint32_t>(i - 1);
+    }
+    for (auto& level : slots_) {
+      level.fill(Slot());
+    }
+    occupied_.fill(0);
+  }
+  size_t size() const { return size_; }
+  size_t capacity() const { return capacity_; }
+  // Tick given to the last call to Advance().
+  uint64_t now() const { return now_; }
+
+  // Schedules 'ev' for 'owner', 'delay' ticks after now(), and at the
+  // earliest on the next tick. Returns false if the wheel is full.
+  bool Add(uint64_t delay, uint32_t owner, const MidiEvent& ev) {
+    if (free_ == kNone) {
+      return false;
+    }
+    const uint32_t index = free_;
+    Timer& timer = timers_[index];
+    free_ = timer.next;
+    timer.event = ev;
+    timer.owner = owner;
+    timer.due = now_ + delay < next_ ? next_ : now_ + delay;
+    Insert(index);
+    size_++;
+    return true;
+  }
+
+  // Earliest tick at which Advance() may fire events, or the maximum
+  // value if there are none.
+  uint64_t NextTick() const {
+    uint64_t next = std::numeric_limits<uint64_t>::max();
+    if (size_ == 0) {
+      return next;
+    }
+    // The first slot of a higher level can start before the first slot
+    // of a lower one, e.g. on the tick following next_.
+    for (size_t level = 0; level < kLevels; level++) {
+      const unsigned shift = kSlotBits * level;
+      const unsigned position = (next_ >> shift) & kSlotMask;
+      const uint64_t slots = occupied_[level] & (~uint64_t{0} << position);
+      if (slots != 0) {
+        // Start of the block of 64 slots holding next_ at this level.
+        const unsigned block_shift = shift + kSlotBits;
+        const uint64_t block = block_shift >= 64 ? 0 : next_ >> block_shift << block_shift;
+        next = std::min(next, block | static_cast<uint64_t>(__builtin_ctzll(slots)) << shift);
+      }
+    }
+    return next;
+  }
+
+  // Moves the current tick to 'now', calling fire(owner, event) for each
+  // event due by then, in order. Stops early, and returns false, after
+  // firing 'max_events' events; the remaining ones are fired by the next
+  // call.
+  template <typename Fire>
+  bool Advance(uint64_t now, size_t max_events, Fire&& fire) {
+    size_t fired = 0;
+    while (true) {
+      const uint64_t tick = NextTick();
+      if (tick > now) {
+        break;
+      }
+      next_ = tick;
+      now_ = tick;
+      // Events in slots starting at 'tick' move down, from the highest
+      // level so that they reach level 0 in order.
+      for (size_t level = kLevels - 1; level > 0; level--) {
+        const unsigned shift = kSlotBits * level;
+        if ((tick & ((uint64_t{1} << shift) - 1)) == 0) {
+          Cascade(level, (tick >> shift) & kSlotMask);
+        }
+      }
+      Slot& slot = slots_[0][tick & kSlotMask];
+      while (slot.head != kNone) {
+        if (fired == max_events) {
+          return false;
+        }
+        const uint32_t index = slot.head;
+        Timer& timer = timers_[index];
+        slot.head = timer.next;
+        fire(timer.owner, timer.event);
+        fired++;
+        timer.next = free_;
+        free_ = index;
+        size_--;
+      }
+      slot.tail = kNone;
+      occupied_[0] &= ~(uint64_t{1} << (tick & kSlotMask));
+      next_ = tick + 1;
+    }
+    // Nothing is due before 'now', so no slot starts in between.
+    if (now >= next_) {
+      next_ = now + 1;
+    }
+    if (now > now_) {
+      now_ = now;
+    }
+    return true;
+  }
+
+private:
+  static const unsigned kSlotBits = 6;
+  static const uint64_t kSlotMask = 63;
+  // Enough levels for any 64-bit tick.
+  static const size_t kLevels = 11;
+  static const uint32_t kNone = std::numeric_limits<uint32_t>::max();
+
+  struct Timer {
+    MidiEvent event;
+    uint64_t due;
+    uint32_t owner;
+    // Next timer in the same slot, or in the free list.
+    uint32_t next;
+  };
+  // List of timers, in the order they were added.
+  struct Slot {
+    uint32_t head = kNone;
+    uint32_t tail = kNone;
+  };
+
+  // Appends timers_[index] to its slot, relative to next_.
+  void Insert(uint32_t index) {
+    Timer& timer = timers_[index];
+    const uint64_t differing = timer.due ^ next_;
+    const size_t level = differing == 0 ? 0 : (63 - __builtin_clzll(differing)) / kSlotBits;
+    const unsigned slot_index = (timer.due >> (kSlotBits * level)) & kSlotMask;
+    Slot& slot = slots_[level][slot_index];
+    timer.next = kNone;
+    if (slot.tail == kNone) {
+      slot.head = index;
+    } else {
+      timers_[slot.tail].next = index;
+    }
+    slot.tail = index;
+    occupied_[level] |= uint64_t{1} << slot_index;
+  }
+
+  // Moves the timers of a slot to lower levels.
+  void Cascade(size_t level, unsigned slot_index) {
+    Slot& slot = slots_[level][slot_index];
+    uint32_t index = slot.head;
+    slot = Slot();
+    occupied_[level] &= ~(uint64_t{1} << slot_index);
+    while (index != kNone) {
+      const uint32_t next = timers_[index].next;
+      Insert(index);
+      index = next;
+    }
+  }
+
+  std::unique_ptr<Timer[]> timers_;
+  size_t capacity_ = 0;
+  size_t size_ = 0;
+  // Free list of timers.
+  uint32_t free_ = kNone;
+  std::array<std::array<Slot, 64>, kLevels> slots_;
+  // Bitmap of non-empty slots, by level.
+  std::array<uint64_t, kLevels> occupied_{};
+  uint64_t now_ = 0;
+  // First tick which hasn't been processed.
+  uint64_t next_ = 0;
+};
+
+// Current CLOCK_MONOTONIC time in nanoseconds.
+inline uint64_t MonotonicNs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+// Current CLOCK_MONOTONIC time in milliseconds, the clock used for
+// ProcessorDAG::ProcessTimers().
+inline uint64_t MonotonicMs() {
+  return MonotonicNs() / 1000000;
+}
+
+// Arms 'timer_fd', a CLOCK_MONOTONIC timerfd, to expire at 'when_ms' as
+// given by MonotonicMs(), or disarms it if 'when_ms' is the maximum value.
+// Returns false on error.
+inline bool SetTimerFd(int timer_fd, uint64_t when_ms) {
+  struct itimerspec spec = {};
+  if (when_ms != std::numeric_limits<uint64_t>::max()) {
+    spec.it_value.tv_sec = when_ms / 1000;
+    spec.it_value.tv_nsec = (when_ms % 1000) * 1000000;
+    // Zero would disarm the timer.
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+      spec.it_value.tv_nsec = 1;
+    }
+  }
+  return timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr) == 0;
+}
+
+#endif
@@ -0,0 +1,149 @@
+// Threads running independent parts of the processing graph.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "worker_pool.h"
+
+WorkerPool::~WorkerPool() {
+  Stop();
+}
+
+bool WorkerPool::Start(size_t num_threads, int priority) {
+  done_fd_ = eventfd(0, EFD_CLOEXEC);
+  if (done_fd_ < 0) {
+    std::cerr << "Cannot create eventfd: " << strerror(errno) << "\n";
+    return false;
+  }
+  stopping_ = false;
+  // Threads only use their own Worker, which must not move.
+  workers_.resize(num_threads);
+  for (size_t i = 0; i < num_threads; i++) {
+    Worker& worker = workers_[i];
+    worker.wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (worker.wakeup_fd < 0) {
+      std::cerr << "Cannot create eventfd: " << strerror(errno) << "\n";
+      Stop();
+      return false;
+    }
+    worker.thread = std::thread([this, i]() { WorkerThread(i); });
+    if (priority > 0) {
+      struct sched_param param;
+      memset(&param, 0, sizeof(param));
+      param.sched_priority = priority;
+      const int error = pthread_setschedparam(worker.thread.native_handle(),
+                                              SCHED_FIFO, &param);
+      if (error != 0) {
+        std::cerr << "Cannot set SCHED_FIFO priority " << priority
+                  << " on worker threads: " << strerror(error)
+                  << " (check RLIMIT_RTPRIO)\n";
+        Stop();
+        return false;
+      }
+    }
+  }
+  std::cerr << "Started " << num_threads << " worker threads\n";
+  return true;
+}
+
+void WorkerPool::Stop() {
+  stopping_ = true;
+  const uint64_t one = 1;
+  for (Worker& worker : workers_) {
+    if (worker.thread.joinable()) {
+      if (write(worker.wakeup_fd, &one, sizeof(one)) != sizeof(one)) {
+        std::cerr << "Cannot wake up worker thread: " << strerror(errno) << "\n";
+      }
+      worker.thread.join();
+    }
+    if (worker.wakeup_fd >= 0) {
+      close(worker.wakeup_fd);
+    }
+  }
+  workers_.clear();
+  if (done_fd_ >= 0) {
+    close(done_fd_);
+    done_fd_ = -1;
+  }
+}
+
+// Nothing in here must allocate memory, lock or log.
+void WorkerPool::Run(size_t num_tasks, void (*task)(void*, size_t), void* context) {
+  const size_t stride = workers_.size() + 1;
+  // Threads of the pool with at least one task.
+  const size_t num_woken = std::min(workers_.size(), num_tasks > 0 ? num_tasks - 1 : 0);
+  const uint64_t one = 1;
+  size_t first_failed = num_woken;
+  if (num_woken > 0) {
+    task_ = task;
+    context_ = context;
+    pending_threads_.store(num_woken, std::memory_order_relaxed);
+    num_tasks_.store(num_tasks, std::memory_order_release);
+    for (size_t i = 0; i < num_woken; i++) {
+      if (write(workers_[i].wakeup_fd, &one, sizeof(one)) != sizeof(one)) {
+        errors_.fetch_add(1, std::memory_order_relaxed);
+        first_failed = i;
+        break;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < num_tasks; i += stride) {
+    task(context, i);
+  }
+  if (num_woken == 0) {
+    return;
+  }
+  // Tasks of threads which couldn't be woken up are run here.
+  for (size_t worker = first_failed; worker < num_woken; worker++) {
+    for (size_t i = worker + 1; i < num_tasks; i += stride) {
+      task(context, i);
+    }
+    if (pending_threads_.fetch_sub(1, std::memory_order_acq_rel) == 1
+        && write(done_fd_, &one, sizeof(one)) != sizeof(one)) {
+      errors_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  // The last thread to finish always writes to done_fd_, once.
+  uint64_t value;
+  while (read(done_fd_, &value, sizeof(value)) < 0 && errno == EINTR) {
+  }
+  pending_threads_.load(std::memory_order_acquire);
+}
+
+void WorkerPool::WorkerThread(size_t index) {
+  const int wakeup_fd = workers_[index].wakeup_fd;
+  const uint64_t one = 1;
+  while (true) {
+    uint64_t value;
+    if (read(wakeup_fd, &value, sizeof(value)) < 0) {
+      if (errno != EINTR) {
+        errors_.fetch_add(1, std::memory_order_relaxed);
+      }
+      continue;
+    }
+    if (stopping_) {
+      return;
+    }
+    const size_t num_tasks = num_tasks_.load(std::memory_order_acquire);
+    const size_t stride = workers_.size() + 1;
+    for (size_t i = index + 1; i < num_tasks; i += stride) {
+      task_(context_, i);
+    }
+    if (pending_threads_.fetch_sub(1, std::memory_order_acq_rel) == 1
+        && write(done_fd_, &one, sizeof(one)) != sizeof(one)) {
+      errors_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+}
+
+void WorkerPool::PrintStats(std::ostream& out) {
+  out << "Worker pool: " << workers_.size() << " threads, "
+      << errors_.load(std::memory_order_relaxed) << " errors\n";
+}
@@ -0,0 +1,61 @@
+#ifndef _WORKER_POOL_H
+#define _WORKER_POOL_H
+// Threads running parts of a batch of work in parallel with the thread
+// submitting it, used to run independent parts of the processing graph.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+class WorkerPool {
+public:
+  WorkerPool() {}
+  ~WorkerPool();
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  // Starts 'num_threads' threads, which work along with the thread calling
+  // Run(). With a 'priority' above 0, they get this SCHED_FIFO priority.
+  // Returns false if a thread can't be started or configured.
+  bool Start(size_t num_threads, int priority);
+  void Stop();
+  size_t NumThreads() const { return workers_.size(); }
+
+  // Calls task(context, i) for each i in [0, num_tasks) and returns once
+  // all calls returned. Tasks are spread statically: task i runs on the
+  // calling thread if i is a multiple of NumThreads() + 1, and on thread
+  // i % (NumThreads() + 1) - 1 of the pool otherwise. Neither allocates
+  // nor locks, so that it can be called from a real-time thread, but only
+  // one thread may call it at a time.
+  void Run(size_t num_tasks, void (*task)(void*, size_t), void* context);
+
+  // Prints the number of threads and wake up errors.
+  void PrintStats(std::ostream& out);
+
+private:
+  void WorkerThread(size_t index);
+
+  struct Worker {
+    std::thread thread;
+    // Written by Run() when the thread has tasks.
+    int wakeup_fd = -1;
+  };
+  std::vector<Worker> workers_;
+  // Written by the last thread to finish its tasks.
+  int done_fd_ = -1;
+  std::atomic<bool> stopping_{false};
+
+  // Current work, set by Run() before waking up threads.
+  void (*task_)(void*, size_t) = nullptr;
+  void* context_ = nullptr;
+  std::atomic<size_t> num_tasks_{0};
+  // Threads which haven't finished their tasks yet.
+  std::atomic<size_t> pending_threads_{0};
+
+  std::atomic<uint64_t> errors_{0};
+};
+
+#endif